@@ -0,0 +1,290 @@
+/*
+ * atacache.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "atacache.h"
+#include "dev_ata_cmd_set.h"
+#include "utility.h"
+
+const char * atacache_cpp_cvsid = "$Id$"
+                                  ATACACHE_H_CVSID;
+
+// Names of cached commands in text format
+static const struct {
+  smart_command_set command;
+  const char * name;
+} cached_commands[] = {
+  { IDENTIFY,         "identify"   },
+  { PIDENTIFY,        "pidentify"  },
+  { READ_VALUES,      "values"     },
+  { READ_THRESHOLDS,  "thresholds" },
+  { READ_LOG,         "log"        },
+  { STATUS_CHECK,     "status"     },
+  { CHECK_POWER_MODE, "powermode"  },
+};
+
+const unsigned num_cached_commands = sizeof(cached_commands) / sizeof(cached_commands[0]);
+
+static const char * command_name(smart_command_set command)
+{
+  for (unsigned i = 0; i < num_cached_commands; i++) {
+    if (cached_commands[i].command == command)
+      return cached_commands[i].name;
+  }
+  return 0;
+}
+
+// Log address is only relevant for READ LOG
+static inline int cache_key(smart_command_set command, int select)
+{
+  return ((int)command << 8) | (command == READ_LOG ? select & 0xff : 0);
+}
+
+// Size of data returned by command
+static unsigned data_size(smart_command_set command)
+{
+  switch (command) {
+    case STATUS_CHECK:     return 0;
+    case CHECK_POWER_MODE: return 1;
+    default:               return 512;
+  }
+}
+
+ata_data_cache::ata_data_cache()
+: m_time(0)
+{
+}
+
+void ata_data_cache::record(smart_command_set command, int select, const char * data, int retval)
+{
+  if (!command_name(command))
+    return;
+  unsigned size = data_size(command);
+  if (size && !data)
+    return;
+
+  entry & e = m_entries[cache_key(command, select)];
+  e.retval = retval;
+  e.time = time(0);
+  e.data.assign(data, size);
+  if (command != CHECK_POWER_MODE)
+    m_time = e.time;
+}
+
+time_t ata_data_cache::get_time(smart_command_set command, int select) const
+{
+  entry_map::const_iterator it = m_entries.find(cache_key(command, select));
+  return (it != m_entries.end() ? it->second.time : 0);
+}
+
+int ata_data_cache::expire(time_t oldest)
+{
+  int cnt = 0;
+  for (entry_map::iterator it = m_entries.begin(); it != m_entries.end(); ) {
+    smart_command_set command = (smart_command_set)(it->first >> 8);
+    if (   it->second.time < oldest
+        && !(   command == IDENTIFY || command == PIDENTIFY
+             || command == READ_THRESHOLDS)) {
+      m_entries.erase(it++);
+      cnt++;
+    }
+    else
+      ++it;
+  }
+  return cnt;
+}
+
+bool ata_data_cache::lookup(smart_command_set command, int select, char * data, int & retval) const
+{
+  entry_map::const_iterator it = m_entries.find(cache_key(command, select));
+  if (it == m_entries.end())
+    return false;
+  const entry & e = it->second;
+  if (e.data.size() != data_size(command) || (!e.data.empty() && !data))
+    return false;
+  if (!e.data.empty())
+    memcpy(data, e.data.data(), e.data.size());
+  retval = e.retval;
+  return true;
+}
+
+std::string ata_data_cache::format() const
+{
+  static const char hex[] = "0123456789abcdef";
+  std::string text = strprintf("time %" PRId64 "\n", (int64_t)m_time);
+  for (entry_map::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+    const entry & e = it->second;
+    text += strprintf("%s %d %d %" PRId64, command_name((smart_command_set)(it->first >> 8)),
+                      it->first & 0xff, e.retval, (int64_t)e.time);
+    if (!e.data.empty()) {
+      text += ' ';
+      for (unsigned i = 0; i < e.data.size(); i++) {
+        unsigned char b = e.data[i];
+        text += hex[b >> 4]; text += hex[b & 0xf];
+      }
+    }
+    text += '\n';
+  }
+  return text;
+}
+
+static int hexdigit(char c)
+{
+  if ('0' <= c && c <= '9')
+    return c - '0';
+  if ('a' <= c && c <= 'f')
+    return c - 'a' + 10;
+  if ('A' <= c && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool ata_data_cache::parse(const char * text)
+{
+  m_entries.clear();
+  m_time = 0;
+
+  for (const char * line = text; *line; ) {
+    size_t len = strcspn(line, "\n");
+    const char * next = line + len + (line[len] ? 1 : 0);
+    if (len == 0 || (len == 1 && *line == '\r')) {
+      line = next;
+      continue;
+    }
+
+    char name[16+1] = "";
+    int n1 = -1, select = 0, retval = 0, n2 = -1;
+    unsigned long t = 0;
+    if (sscanf(line, "time %lu%n", &t, &n1) == 1 && (unsigned)n1 <= len) {
+      m_time = (time_t)t;
+      line = next;
+      continue;
+    }
+    if (!(   sscanf(line, "%16s %d %d %lu%n", name, &select, &retval, &t, &n2) == 4
+          && (unsigned)n2 <= len))
+      return false;
+
+    smart_command_set command = (smart_command_set)-1;
+    for (unsigned i = 0; i < num_cached_commands; i++) {
+      if (!strcmp(name, cached_commands[i].name)) {
+        command = cached_commands[i].command;
+        break;
+      }
+    }
+    if (command == (smart_command_set)-1)
+      return false;
+
+    const char * hs = line + n2;
+    while (*hs == ' ')
+      hs++;
+    size_t hlen = line + len - hs;
+    if (hlen && hs[hlen-1] == '\r')
+      hlen--;
+    if (hlen != 2 * data_size(command))
+      return false;
+
+    entry & e = m_entries[cache_key(command, select)];
+    e.retval = retval;
+    e.time = (time_t)t;
+    e.data.resize(hlen / 2);
+    for (unsigned i = 0; i < hlen / 2; i++) {
+      int hi = hexdigit(hs[2*i]), lo = hexdigit(hs[2*i+1]);
+      if (hi < 0 || lo < 0)
+        return false;
+      e.data[i] = (char)(hi << 4 | lo);
+    }
+    line = next;
+  }
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Pseudo ATA device serving commands from a copy of a cache
+class cached_ata_device
+: public /*implements*/ ata_device_with_command_set
+{
+public:
+  cached_ata_device(smart_interface * intf, const char * dev_name,
+                    const ata_data_cache & cache);
+
+  virtual bool is_open() const;
+
+  virtual bool open();
+
+  virtual bool close();
+
+protected:
+  virtual int ata_command_interface(smart_command_set command, int select, char * data);
+
+private:
+  ata_data_cache m_cache;
+  bool m_is_open;
+};
+
+cached_ata_device::cached_ata_device(smart_interface * intf, const char * dev_name,
+                                     const ata_data_cache & cache)
+: smart_device(intf, dev_name, "ata", ""),
+  m_cache(cache),
+  m_is_open(false)
+{
+  set_info().info_name = strprintf("%s [smartd cache]", dev_name);
+}
+
+bool cached_ata_device::is_open() const
+{
+  return m_is_open;
+}
+
+bool cached_ata_device::open()
+{
+  m_is_open = true;
+  return true;
+}
+
+bool cached_ata_device::close()
+{
+  m_is_open = false;
+  return true;
+}
+
+int cached_ata_device::ata_command_interface(smart_command_set command, int select, char * data)
+{
+  int retval = -1;
+  if (!m_cache.lookup(command, select, data, retval)) {
+    if (command == READ_LOG)
+      set_err(ENOSYS, "Log 0x%02x not in smartd cache", select & 0xff);
+    else
+      set_err(ENOSYS, "Command not in smartd cache");
+    return -1;
+  }
+  return retval;
+}
+
+} // namespace
+
+ata_device * get_cached_ata_device(smart_interface * intf, const char * dev_name,
+                                   const ata_data_cache & cache)
+{
+  return new cached_ata_device(intf, dev_name, cache);
+}
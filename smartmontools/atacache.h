@@ -0,0 +1,102 @@
+/*
+ * atacache.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ATACACHE_H_
+#define ATACACHE_H_
+
+#define ATACACHE_H_CVSID "$Id$\n"
+
+// Cache of ATA data read by smartd, served to 'smartctl --smartd-cache'.
+//
+// smartd records the results of the SMART and IDENTIFY commands issued
+// by smartcommandhandler() during each check.  The cache is published
+// as text on the local socket of smartd '--metrics=SOCKET'.  smartctl
+// replays the cached results with a pseudo ATA device, so data which
+// smartd read recently is printed without accessing the device.
+//
+// Text format, one line per entry:
+//   time SECONDS                       time of last SMART data read
+//   NAME SELECT RETVAL TIME [HEXDATA]  result of a command
+// NAME is one of identify, pidentify, values, thresholds, log, status
+// or powermode.  SELECT is the log address for 'log', 0 otherwise.
+// TIME is the time the command was issued.  HEXDATA is the data as
+// returned by the device, 512 bytes for data commands and 1 byte
+// (sector count register) for 'powermode'.
+
+#include "atacmds.h"
+
+#include <time.h>
+
+#include <map>
+#include <string>
+
+/// Results of ATA commands, keyed by command and log address.
+class ata_data_cache
+{
+public:
+  ata_data_cache();
+
+  /// Record result of a successful command as issued by
+  /// smartcommandhandler().  Commands which do not return data or
+  /// device state are ignored.
+  void record(smart_command_set command, int select, const char * data, int retval);
+
+  /// Copy cached result of command to DATA and RETVAL.
+  /// Returns false if not cached.
+  bool lookup(smart_command_set command, int select, char * data, int & retval) const;
+
+  /// Return true if nothing is cached.
+  bool empty() const
+    { return m_entries.empty(); }
+
+  /// Return time of last SMART data recorded, 0 if none.
+  /// Results of CHECK POWER MODE do not update this time.
+  time_t get_time() const
+    { return m_time; }
+
+  /// Return time a command was recorded, 0 if not cached.
+  time_t get_time(smart_command_set command, int select) const;
+
+  /// Remove entries recorded before OLDEST.  IDENTIFY data and
+  /// attribute thresholds do not expire.  Returns the number of entries removed.
+  int expire(time_t oldest);
+
+  /// Format as text.
+  std::string format() const;
+
+  /// Replace contents with entries parsed from TEXT.
+  /// Returns false on syntax error.
+  bool parse(const char * text);
+
+private:
+  struct entry
+  {
+    int retval;
+    time_t time;
+    std::string data;
+  };
+
+  typedef std::map<int, entry> entry_map;
+  entry_map m_entries;
+  time_t m_time;
+};
+
+/// Return pseudo-device which serves commands from CACHE.  Commands
+/// which are not cached fail with ENOSYS, the real device is never
+/// accessed.
+ata_device * get_cached_ata_device(smart_interface * intf, const char * dev_name,
+                                   const ata_data_cache & cache);
+
+#endif // ATACACHE_H_
@@ -31,9 +31,14 @@
 
 #include "config.h"
 #include "int64.h"
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "atacmds.h"
 #include "knowndrives.h"  // get_default_attr_defs()
 #include "utility.h"
+#include "atacache.h"
+#include "cmdstats.h"
 #include "dev_ata_cmd_set.h" // for parsed_ata_device
 
 const char * atacmds_cpp_cvsid = "$Id$"
@@ -103,6 +108,108 @@ const char *SelfTestFailureCodeName(unsigned char which){
 #endif
 
 
+#ifdef HAVE_PTHREADS
+// Protects reference counts of ata_vendor_attr_defs, copies
+// are released by other threads.
+static pthread_mutex_t attr_defs_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Scoped lock of attr_defs_mutex, no-op without thread support.
+class attr_defs_lock
+{
+public:
+  attr_defs_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_lock(&attr_defs_mutex);
+#endif
+    }
+
+  ~attr_defs_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_unlock(&attr_defs_mutex);
+#endif
+    }
+
+private:
+  attr_defs_lock(const attr_defs_lock &);
+  void operator=(const attr_defs_lock &);
+};
+
+ata_vendor_attr_defs::shared_defs * ata_vendor_attr_defs::s_empty = 0;
+
+ata_vendor_attr_defs::ata_vendor_attr_defs()
+{
+  attr_defs_lock lock;
+  if (!s_empty)
+    s_empty = new shared_defs;
+  s_empty->refcnt++;
+  m_data = s_empty;
+}
+
+ata_vendor_attr_defs::ata_vendor_attr_defs(const ata_vendor_attr_defs & x)
+: m_data(x.m_data)
+{
+  add_ref(m_data);
+}
+
+ata_vendor_attr_defs::~ata_vendor_attr_defs()
+{
+  release(m_data);
+}
+
+ata_vendor_attr_defs & ata_vendor_attr_defs::operator=(const ata_vendor_attr_defs & x)
+{
+  if (m_data != x.m_data) {
+    add_ref(x.m_data);
+    release(m_data);
+    m_data = x.m_data;
+  }
+  return *this;
+}
+
+ata_vendor_attr_defs::entry & ata_vendor_attr_defs::modify(unsigned char id)
+{
+  // Other threads may change refcnt by copying or releasing the
+  // shared definitions.  If it is 1, no other object can share them.
+  bool shared;
+  {
+    attr_defs_lock lock;
+    shared = (m_data->refcnt > 1);
+  }
+  if (shared)
+    unshare();
+  m_data->modified = true;
+  return m_data->defs[id];
+}
+
+// Make private copy of shared definitions.
+void ata_vendor_attr_defs::unshare()
+{
+  shared_defs * data = new shared_defs(*m_data);
+  data->refcnt = 1;
+  release(m_data);
+  m_data = data;
+}
+
+void ata_vendor_attr_defs::add_ref(shared_defs * data)
+{
+  attr_defs_lock lock;
+  data->refcnt++;
+}
+
+void ata_vendor_attr_defs::release(shared_defs * data)
+{
+  bool last;
+  {
+    attr_defs_lock lock;
+    last = !--data->refcnt;
+  }
+  if (last)
+    delete data;
+}
+
 // Table of raw print format names
 struct format_name_entry
 {
@@ -246,22 +353,24 @@ bool parse_attribute_def(const char * opt, ata_vendor_attr_defs & defs,
     for (i = 0; i < MAX_ATTRIBUTE_NUM; i++) {
       if (defs[i].priority >= priority)
         continue;
+      ata_vendor_attr_defs::entry & e = defs.modify(i);
       if (attrname[0])
-        defs[i].name = attrname;
-      defs[i].priority = priority;
-      defs[i].raw_format = format;
-      defs[i].flags = flags;
-      snprintf(defs[i].byteorder, sizeof(defs[i].byteorder), "%s", byteorder);
+        e.name = attrname;
+      e.priority = priority;
+      e.raw_format = format;
+      e.flags = flags;
+      snprintf(e.byteorder, sizeof(e.byteorder), "%s", byteorder);
     }
   }
   else if (defs[id].priority <= priority) {
     // "id,format[,name]"
+    ata_vendor_attr_defs::entry & e = defs.modify(id);
     if (attrname[0])
-      defs[id].name = attrname;
-    defs[id].raw_format = format;
-    defs[id].priority = priority;
-    defs[id].flags = flags;
-    snprintf(defs[id].byteorder, sizeof(defs[id].byteorder), "%s", byteorder);
+      e.name = attrname;
+    e.raw_format = format;
+    e.priority = priority;
+    e.flags = flags;
+    snprintf(e.byteorder, sizeof(e.byteorder), "%s", byteorder);
   }
 
   return true;
@@ -573,7 +682,7 @@ int smartcommandhandler(ata_device * device, smart_command_set command, int sele
     if (ata_debugmode)
       start_usec = smi()->get_timer_usec();
 
-    bool ok = device->ata_pass_through(in, out);
+    bool ok = timed_ata_pass_through(device, in, out);
 
     if (start_usec >= 0) {
       int64_t duration_usec = smi()->get_timer_usec() - start_usec;
@@ -636,6 +745,10 @@ int smartcommandhandler(ata_device * device, smart_command_set command, int sele
     }
   }
 
+  // Record result for cache served by smartd
+  if (retval >= 0 && device->get_data_recorder())
+    device->get_data_recorder()->record(command, select, data, retval);
+
   // If requested, invalidate serial number before any printing is done
   if ((command == IDENTIFY || command == PIDENTIFY) && !retval && dont_print_serial_number)
     invalidate_serno( reinterpret_cast<ata_identify_device *>(data) );
@@ -814,7 +927,7 @@ bool ata_nodata_command(ata_device * device, unsigned char command,
   if (sector_count >= 0)
     in.in_regs.sector_count = sector_count;
 
-  return device->ata_pass_through(in);
+  return timed_ata_pass_through(device, in);
 }
 
 // Issue SET FEATURES command with optional sector count register value
@@ -827,7 +940,7 @@ bool ata_set_features(ata_device * device, unsigned char features,
   if (sector_count >= 0)
     in.in_regs.sector_count = sector_count;
 
-  return device->ata_pass_through(in);
+  return timed_ata_pass_through(device, in);
 }
 
 // Reads current Device Identity info (512 bytes) into buf.  Returns 0
@@ -1108,6 +1221,24 @@ bool ataReadLogExt(ata_device * device, unsigned char logaddr,
                    unsigned char features, unsigned page,
                    void * data, unsigned nsectors)
 {
+  // Split into smaller reads if larger reads failed before.
+  // Probe again if the limit is too old, e.g. in a long running smartd.
+  unsigned max_sectors = device->get_log_limits().gp_max_sectors;
+  if (max_sectors && nsectors > max_sectors
+      && device->get_log_limits().is_expired(time(0))) {
+    ata_log_limits limits = device->get_log_limits();
+    limits.gp_max_sectors = max_sectors = 0;
+    device->set_log_limits(limits);
+  }
+  if (max_sectors && nsectors > max_sectors) {
+    for (unsigned i = 0; i < nsectors; i += max_sectors) {
+      if (!ataReadLogExt(device, logaddr, features, page + i, (char *)data + 512*i,
+                         (nsectors - i < max_sectors ? nsectors - i : max_sectors)))
+        return false;
+    }
+    return true;
+  }
+
   ata_cmd_in in;
   in.in_regs.command      = ATA_READ_LOG_EXT;
   in.in_regs.features     = features; // log specific
@@ -1115,7 +1246,7 @@ bool ataReadLogExt(ata_device * device, unsigned char logaddr,
   in.in_regs.lba_low      = logaddr;
   in.in_regs.lba_mid_16   = page;
 
-  if (!device->ata_pass_through(in)) { // TODO: Debug output
+  if (!timed_ata_pass_through(device, in)) { // TODO: Debug output
     if (nsectors <= 1) {
       pout("ATA_READ_LOG_EXT (addr=0x%02x:0x%02x, page=%u, n=%u) failed: %s\n",
            logaddr, features, page, nsectors, device->get_errmsg());
@@ -1124,12 +1255,17 @@ bool ataReadLogExt(ata_device * device, unsigned char logaddr,
 
     // Recurse to retry with single sectors,
     // multi-sector reads may not be supported by ioctl.
+    // Remember this if all single sector reads work.
     for (unsigned i = 0; i < nsectors; i++) {
       if (!ataReadLogExt(device, logaddr,
                          features, page + i,
                          (char *)data + 512*i, 1))
         return false;
     }
+    ata_log_limits limits = device->get_log_limits();
+    limits.gp_max_sectors = 1;
+    limits.time = time(0);
+    device->set_log_limits(limits);
   }
 
   return true;
@@ -1147,7 +1283,7 @@ bool ataReadSmartLog(ata_device * device, unsigned char logaddr,
   in.in_regs.lba_mid  = SMART_CYL_LOW;
   in.in_regs.lba_low  = logaddr;
 
-  if (!device->ata_pass_through(in)) { // TODO: Debug output
+  if (!timed_ata_pass_through(device, in)) { // TODO: Debug output
     pout("ATA_SMART_READ_LOG failed: %s\n", device->get_errmsg());
     return false;
   }
@@ -1159,14 +1295,21 @@ bool ataReadSmartLog(ata_device * device, unsigned char logaddr,
 // Reads the SMART or GPL Log Directory (log #0)
 int ataReadLogDirectory(ata_device * device, ata_smart_log_directory * data, bool gpl)
 {
-  if (!gpl) { // SMART Log directory
-    if (smartcommandhandler(device, READ_LOG, 0x00, (char *)data))
-      return -1;
-  }
-  else { // GP Log directory
-    if (!ataReadLogExt(device, 0x00, 0x00, 0, data, 1))
-      return -1;
-  }
+  bool ok;
+  if (!gpl) // SMART Log directory
+    ok = !smartcommandhandler(device, READ_LOG, 0x00, (char *)data);
+  else // GP Log directory
+    ok = ataReadLogExt(device, 0x00, 0x00, 0, data, 1);
+
+  // Remember result, if the directory cannot be read, the device or
+  // the pass-through path likely does not support these log commands
+  ata_log_limits limits = device->get_log_limits();
+  (!gpl ? limits.smart_logdir : limits.gp_logdir) = (ok ? 1 : -1);
+  if (!ok)
+    limits.time = time(0);
+  device->set_log_limits(limits);
+  if (!ok)
+    return -1;
 
   // swap endian order if needed
   if (isbigendian())
@@ -2359,7 +2502,7 @@ int ataGetSetSCTWriteCacheReordering(ata_device * device, bool enable, bool pers
     in.out_needed.sector_count = in.out_needed.lba_low = true;
 
   ata_cmd_out out;
-  if (!device->ata_pass_through(in, out)) {
+  if (!timed_ata_pass_through(device, in, out)) {
     pout("Write SCT (%cet) Feature Control Command failed: %s\n",
       (!set ? 'G' : 'S'), device->get_errmsg());
     return -1;
@@ -2477,7 +2620,7 @@ static int ataGetSetSCTErrorRecoveryControltime(ata_device * device, unsigned ty
     in.out_needed.sector_count = in.out_needed.lba_low = true;
 
   ata_cmd_out out;
-  if (!device->ata_pass_through(in, out)) {
+  if (!timed_ata_pass_through(device, in, out)) {
     pout("Write SCT (%cet) Error Recovery Control Command failed: %s\n",
       (!set ? 'G' : 'S'), device->get_errmsg());
     return -1;
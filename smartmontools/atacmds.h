@@ -691,7 +691,10 @@ enum {
   ATTRFLAG_SSD_ONLY    = 0x10, // DEFAULT setting for SSD only
 };
 
-// Vendor attribute display defs for all attribute ids
+// Vendor attribute display defs for all attribute ids.
+// Copies share the definitions until one of them is modified
+// (copy-on-write), so devices without '-v' options share the
+// presets of their drive database entry.
 class ata_vendor_attr_defs
 {
 public:
@@ -710,14 +713,43 @@ public:
       { byteorder[0] = 0; }
   };
 
-  entry & operator[](unsigned char id)
-    { return m_defs[id]; }
+  ata_vendor_attr_defs();
+
+  ata_vendor_attr_defs(const ata_vendor_attr_defs & x);
+
+  ~ata_vendor_attr_defs();
+
+  ata_vendor_attr_defs & operator=(const ata_vendor_attr_defs & x);
+
+  // Get entry for modification, copies shared definitions first.
+  // Use operator[] for read access, it never copies.
+  entry & modify(unsigned char id);
 
   const entry & operator[](unsigned char id) const
-    { return m_defs[id]; }
+    { return m_data->defs[id]; }
+
+  // Return true if not modified since default construction.
+  bool empty() const
+    { return !m_data->modified; }
 
 private:
-  entry m_defs[256];
+  struct shared_defs
+  {
+    unsigned refcnt; // Number of objects sharing the definitions
+    bool modified;
+    entry defs[256];
+
+    shared_defs()
+      : refcnt(1), modified(false) { }
+  };
+  shared_defs * m_data;
+
+  // Shared definitions of default constructed objects, never freed.
+  static shared_defs * s_empty;
+
+  void unshare();
+  static void add_ref(shared_defs * data);
+  static void release(shared_defs * data);
 };
 
 
@@ -777,9 +809,11 @@ int ataReadErrorLog (ata_device * device, ata_smart_errorlog *data,
 int ataReadSelfTestLog(ata_device * device, ata_smart_selftestlog * data,
                        firmwarebug_defs firmwarebugs);
 int ataReadSelectiveSelfTestLog(ata_device * device, struct ata_selective_self_test_log *data);
+// Result is recorded in device->get_log_limits()
 int ataReadLogDirectory(ata_device * device, ata_smart_log_directory *, bool gpl);
 
-// Read GP Log page(s)
+// Read GP Log page(s), splits reads larger than
+// device->get_log_limits().gp_max_sectors
 bool ataReadLogExt(ata_device * device, unsigned char logaddr,
                    unsigned char features, unsigned page,
                    void * data, unsigned nsectors);
@@ -39,6 +39,7 @@
 #include "smartctl.h"
 #include "utility.h"
 #include "knowndrives.h"
+#include "devcaps.h"
 
 const char * ataprint_cpp_cvsid = "$Id$"
                                   ATAPRINT_H_CVSID;
@@ -52,10 +53,7 @@ static const char * infofound(const char *output) {
 // used to ignore missing capabilities
 static bool is_permissive()
 {
-  if (!failuretest_permissive)
-    return false;
-  failuretest_permissive--;
-  return true;
+  return failuretest_use_permissive();
 }
 
 /* For the given Command Register (CR) and Features Register (FR), attempts
@@ -2376,9 +2374,9 @@ static int ataPrintSCTTempHist(const ata_sct_temperature_history_table * tmh)
     // Print range
     while (n < n2) {
       if (n == n1 || n == n2-1 || n2 <= n1+3) {
-        char date[30];
+        char date[30]; struct tm tmbuf;
         // TODO: Don't print times < boot time
-        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", time_to_tm_local(&tmbuf, t));
         pout(" %3u    %s    %s  %s\n", i, date,
           sct_ptemp(tmh->cb[i], buf1), sct_pbar(tmh->cb[i], buf3));
       }
@@ -2655,6 +2653,17 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
     failuretest(MANDATORY_CMD, returnval|=FAILID);
   }
 
+  // Apply log read limits learned before
+  char caps_model[40+1], caps_serial[20+1], caps_fw[8+1];
+  if (options.caps_cache && retid >= 0) {
+    ata_format_id_string(caps_model, drive.model, sizeof(caps_model)-1);
+    ata_format_id_string(caps_serial, drive.serial_no, sizeof(caps_serial)-1);
+    ata_format_id_string(caps_fw, drive.fw_rev, sizeof(caps_fw)-1);
+    ata_log_limits limits;
+    if (options.caps_cache->lookup_ata(caps_model, caps_serial, caps_fw, limits))
+      device->set_log_limits(limits);
+  }
+
   // If requested, show which presets would be used for this drive and exit.
   if (options.show_presets) {
     show_presets(&drive);
@@ -3166,6 +3175,10 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
   if (need_smart_logdir) {
     if (firmwarebugs.is_set(BUG_NOLOGDIR))
       smartlogdir = fake_logdir(&smartlogdir_buf, options);
+    else if (device->get_log_limits().smart_logdir < 0 && !is_permissive()) {
+      pout("Read SMART Log Directory skipped, failed before (override with '-T permissive' option)\n\n");
+      failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
+    }
     else if (ataReadLogDirectory(device, &smartlogdir_buf, false)) {
       pout("Read SMART Log Directory failed: %s\n\n", device->get_errmsg());
       failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
@@ -3182,6 +3195,10 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
       if (options.gp_logdir)
         pout("General Purpose Log Directory not supported\n\n");
     }
+    else if (device->get_log_limits().gp_logdir < 0 && !is_permissive()) {
+      pout("Read GP Log Directory skipped, failed before (override with '-T permissive' option)\n\n");
+      failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
+    }
     else if (ataReadLogDirectory(device, &gplogdir_buf, true)) {
       pout("Read GP Log Directory failed\n\n");
       failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
@@ -3535,6 +3552,10 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
       pout("Device placed in STANDBY mode\n");
   }
 
+  // Save log read limits, all logs are read
+  if (options.caps_cache && retid >= 0)
+    options.caps_cache->update_ata(caps_model, caps_serial, caps_fw, device->get_log_limits());
+
   // START OF THE TESTING SECTION OF THE CODE.  IF NO TESTING, RETURN
   if (!smart_val_ok || options.smart_selftest_type == -1)
     return returnval;
@@ -3607,7 +3628,8 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
 	t+=timewait*60;
 	pout("Please wait %d minutes for test to complete.\n", (int)timewait);
       }
-      pout("Test will complete after %s\n", ctime(&t));
+      char ctimebuf[CTIMELEN];
+      pout("Test will complete after %s\n", time_to_ctime(ctimebuf, t));
       
       if (   options.smart_selftest_type != SHORT_CAPTIVE_SELF_TEST
           && options.smart_selftest_type != EXTEND_CAPTIVE_SELF_TEST
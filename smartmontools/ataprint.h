@@ -29,6 +29,8 @@
 
 #include <vector>
 
+class device_caps_cache;
+
 // Request to dump a GP or SMART log
 struct ata_log_request
 {
@@ -109,6 +111,8 @@ struct ata_print_options
   bool sct_wcache_reorder_get; // print write cache reordering status
   int sct_wcache_reorder_set; // disable(-1), enable(1) write cache reordering
 
+  device_caps_cache * caps_cache; // Cache of learned log read limits, 0 if none
+
   ata_print_options()
     : drive_info(false),
       identify_word_level(-1), identify_bit_level(-1),
@@ -145,7 +149,8 @@ struct ata_print_options
       set_standby(0), set_standby_now(false),
       get_security(false), set_security_freeze(false),
       get_wcache(false), set_wcache(0),
-      sct_wcache_reorder_get(false), sct_wcache_reorder_set(0)
+      sct_wcache_reorder_get(false), sct_wcache_reorder_set(0),
+      caps_cache(0)
     { }
 };
 
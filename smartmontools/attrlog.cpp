@@ -0,0 +1,579 @@
+/*
+ * attrlog.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> // ftruncate()
+#endif
+#ifdef _WIN32
+#include <io.h> // _chsize()
+#endif
+
+#include "attrlog.h"
+#include "utility.h"
+
+const char * attrlog_cpp_cvsid = "$Id$"
+                                 ATTRLOG_H_CVSID;
+
+// File header: magic, u16 version, u16 header size, u32 reserved
+static const char data_magic[8] = { 'S','M','A','R','T','D','A','H' };
+static const char index_magic[8] = { 'S','M','A','R','T','D','A','I' };
+const unsigned attrlog_version = 1;
+const unsigned file_header_size = 16;
+const unsigned record_header_size = 16;
+const unsigned index_entry_size = 16;
+
+// Limit for payload size, larger records are considered as garbage
+const unsigned max_payload_size = 0x10000;
+
+static void put_varint(std::vector<unsigned char> & buf, uint64_t val)
+{
+  while (val >= 0x80) {
+    buf.push_back((unsigned char)(val | 0x80));
+    val >>= 7;
+  }
+  buf.push_back((unsigned char)val);
+}
+
+static bool get_varint(const unsigned char * & p, const unsigned char * end,
+                       uint64_t & val)
+{
+  val = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    unsigned char b = *p++;
+    val |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static inline uint64_t zigzag_encode(uint64_t delta)
+{
+  return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t zigzag_decode(uint64_t z)
+{
+  return (z >> 1) ^ (uint64_t)(-(int64_t)(z & 1));
+}
+
+static void make_file_header(unsigned char * buf, const char * magic)
+{
+  memset(buf, 0, file_header_size);
+  memcpy(buf, magic, 8);
+  put_le(buf + 8, attrlog_version, 2);
+  put_le(buf + 10, file_header_size, 2);
+}
+
+// Read and check file header, return header size or 0 on error.
+static unsigned read_file_header(FILE * f, const char * magic)
+{
+  unsigned char buf[file_header_size];
+  if (fseek(f, 0, SEEK_SET) || fread(buf, 1, sizeof(buf), f) != sizeof(buf))
+    return 0;
+  if (memcmp(buf, magic, 8) || get_le(buf + 8, 2) != attrlog_version)
+    return 0;
+  unsigned size = (unsigned)get_le(buf + 10, 2);
+  if (size < file_header_size)
+    return 0;
+  return size;
+}
+
+static bool same_tags(const std::vector<attrlog_field> & f1,
+                      const std::vector<attrlog_field> & f2)
+{
+  if (f1.size() != f2.size())
+    return false;
+  for (unsigned i = 0; i < f1.size(); i++) {
+    if (f1[i].tag != f2[i].tag)
+      return false;
+  }
+  return true;
+}
+
+static int64_t get_file_size(FILE * f)
+{
+  if (fseek(f, 0, SEEK_END))
+    return -1;
+  return ftell(f);
+}
+
+static bool truncate_file(FILE * f, int64_t size)
+{
+  fflush(f);
+#ifndef _WIN32
+  return !ftruncate(fileno(f), (off_t)size);
+#else
+  return !_chsize(_fileno(f), (long)size);
+#endif
+}
+
+// Index file access
+
+static std::string get_index_path(const char * path)
+{
+  return std::string(path) + ".idx";
+}
+
+// Return number of index entries, -1 if file header is invalid.
+static int64_t get_index_count(FILE * f)
+{
+  unsigned hsize = read_file_header(f, index_magic);
+  if (!hsize)
+    return -1;
+  int64_t size = get_file_size(f);
+  if (size < hsize)
+    return -1;
+  return (size - hsize) / index_entry_size;
+}
+
+static bool read_index_entry(FILE * f, int64_t i, int64_t & time, int64_t & offset)
+{
+  unsigned char buf[index_entry_size];
+  if (   fseek(f, (long)(file_header_size + i * index_entry_size), SEEK_SET)
+      || fread(buf, 1, sizeof(buf), f) != sizeof(buf))
+    return false;
+  time = (int64_t)get_le(buf, 8);
+  offset = (int64_t)get_le(buf + 8, 8);
+  return true;
+}
+
+// Create empty index file.
+static bool create_index(const char * path)
+{
+  std::string ipath = get_index_path(path);
+  stdio_file f(ipath.c_str(), "wb");
+  unsigned char buf[file_header_size];
+  make_file_header(buf, index_magic);
+  if (!(f && fwrite(buf, 1, sizeof(buf), f) == sizeof(buf) && f.close())) {
+    pout("Cannot create attribute history index \"%s\"\n", ipath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Append key record entry to index file.
+static bool append_index(const char * path, time_t time, int64_t offset)
+{
+  std::string ipath = get_index_path(path);
+  stdio_file f(ipath.c_str(), "r+b");
+  if (!f || get_index_count(f) < 0) {
+    f.close();
+    if (!create_index(path))
+      return false;
+    f.open(ipath.c_str(), "r+b");
+  }
+
+  unsigned char buf[index_entry_size];
+  put_le(buf, (uint64_t)(int64_t)time, 8);
+  put_le(buf + 8, (uint64_t)offset, 8);
+  if (!(   f && !fseek(f, 0, SEEK_END)
+        && fwrite(buf, 1, sizeof(buf), f) == sizeof(buf) && f.close())) {
+    pout("Cannot write attribute history index \"%s\"\n", ipath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// CSV export
+
+std::string attrlog_format_csv(const attrlog_record & rec)
+{
+  static const char * const page_names[3] = {"read", "write", "verify"};
+  static const char * const counter_names[7] = {
+    "corr-by-ecc-fast", "corr-by-ecc-delayed", "corr-by-retry",
+    "total-err-corrected", "corr-algorithm-invocations",
+    "gb-processed", "total-unc-errors"
+  };
+
+  time_t t = rec.time;
+  struct tm * tms = gmtime(&t);
+  std::string line;
+  if (tms)
+    line = strprintf("%d-%02d-%02d %02d:%02d:%02d;",
+                     1900+tms->tm_year, 1+tms->tm_mon, tms->tm_mday,
+                     tms->tm_hour, tms->tm_min, tms->tm_sec);
+  else
+    line = "?;";
+
+  for (unsigned i = 0; i < rec.fields.size(); i++) {
+    unsigned tag = rec.fields[i].tag;
+    uint64_t val = rec.fields[i].value;
+    if (0 < tag && tag <= ATTRLOG_TAG_ATA_MAX)
+      line += strprintf("\t%u;%d;%" PRIu64 ";", tag, (int)(val >> 48),
+                        (uint64_t)(val & 0xffffffffffffULL));
+    else if (ATTRLOG_TAG_SCSI_READ <= tag && tag < ATTRLOG_TAG_SCSI_NONMEDIUM
+             && (tag & 0x0f) < 7) {
+      int k = (tag - ATTRLOG_TAG_SCSI_READ) >> 4, j = tag & 0x0f;
+      if (j == 5)
+        line += strprintf("\t%s-%s;%.3f;", page_names[k], counter_names[j],
+                          (val / 1000000000.0));
+      else
+        line += strprintf("\t%s-%s;%" PRIu64 ";", page_names[k], counter_names[j], val);
+    }
+    else if (tag == ATTRLOG_TAG_SCSI_NONMEDIUM)
+      line += strprintf("\tnon-medium-errors;%" PRIu64 ";", val);
+    else if (tag == ATTRLOG_TAG_TEMPERATURE)
+      line += strprintf("\ttemperature;%d;", (int)val);
+    else
+      line += strprintf("\ttag-0x%04x;%" PRIu64 ";", tag, val);
+  }
+  return line;
+}
+
+// attrlog_reader
+
+attrlog_reader::attrlog_reader()
+: m_file(0),
+  m_offset(0),
+  m_bad(false),
+  m_last_key(false)
+{
+}
+
+attrlog_reader::~attrlog_reader()
+{
+  close();
+}
+
+bool attrlog_reader::open(const char * path)
+{
+  close();
+  m_file = fopen(path, "rb");
+  if (!m_file) {
+    pout("Cannot read attribute history \"%s\": %s\n", path, strerror(errno));
+    return false;
+  }
+  unsigned hsize = read_file_header(m_file, data_magic);
+  if (!hsize) {
+    pout("%s: not an attribute history file\n", path);
+    close();
+    return false;
+  }
+  m_path = path;
+  return seek_offset(hsize);
+}
+
+void attrlog_reader::close()
+{
+  if (m_file) {
+    fclose(m_file);
+    m_file = 0;
+  }
+  m_offset = 0;
+  m_bad = m_last_key = false;
+  m_last.clear();
+}
+
+bool attrlog_reader::seek_offset(int64_t offset)
+{
+  if (!m_file || fseek(m_file, (long)offset, SEEK_SET))
+    return false;
+  m_offset = offset;
+  m_bad = m_last_key = false;
+  m_last.clear();
+  return true;
+}
+
+bool attrlog_reader::seek(time_t t)
+{
+  if (!m_file)
+    return false;
+  int64_t start = read_file_header(m_file, data_magic);
+
+  // Binary search for last key record with time <= t
+  std::string ipath = get_index_path(m_path.c_str());
+  stdio_file f(ipath.c_str(), "rb");
+  int64_t cnt = (f ? get_index_count(f) : -1);
+  if (cnt > 0) {
+    int64_t lo = 0, hi = cnt, time, offset;
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (!read_index_entry(f, mid, time, offset))
+        break;
+      if (time <= (int64_t)t)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0 && read_index_entry(f, lo - 1, time, offset) && offset >= start)
+      start = offset;
+  }
+
+  return seek_offset(start);
+}
+
+bool attrlog_reader::read(attrlog_record & rec)
+{
+  m_bad = false;
+  if (!m_file)
+    return false;
+
+  unsigned char hdr[record_header_size];
+  size_t n = fread(hdr, 1, sizeof(hdr), m_file);
+  if (n != sizeof(hdr)) {
+    m_bad = (n > 0); // Truncated record
+    return false;
+  }
+
+  unsigned char type = hdr[0], checksum = hdr[1];
+  unsigned nfields = (unsigned)get_le(hdr + 2, 2);
+  unsigned size = (unsigned)get_le(hdr + 4, 4);
+  if (   !(type == 'K' || (type == 'D' && nfields == m_last.size()))
+      || size > max_payload_size) {
+    m_bad = true;
+    return false;
+  }
+
+  std::vector<unsigned char> payload(size);
+  if (size && fread(&payload[0], 1, size, m_file) != size) {
+    m_bad = true;
+    return false;
+  }
+  unsigned char sum = 0;
+  for (unsigned i = 0; i < size; i++)
+    sum += payload[i];
+  if (sum != checksum) {
+    m_bad = true;
+    return false;
+  }
+
+  rec.time = (time_t)(int64_t)get_le(hdr + 8, 8);
+  rec.fields.resize(nfields);
+  const unsigned char * p = (size ? &payload[0] : 0), * end = p + size;
+  for (unsigned i = 0; i < nfields; i++) {
+    uint64_t v1, v2;
+    if (type == 'K') {
+      if (!(get_varint(p, end, v1) && v1 <= 0xffff && get_varint(p, end, v2))) {
+        m_bad = true;
+        return false;
+      }
+      rec.fields[i] = attrlog_field((unsigned short)v1, v2);
+    }
+    else {
+      if (!get_varint(p, end, v1)) {
+        m_bad = true;
+        return false;
+      }
+      rec.fields[i] = attrlog_field(m_last[i].tag, m_last[i].value + zigzag_decode(v1));
+    }
+  }
+  if (p != end) {
+    m_bad = true;
+    return false;
+  }
+
+  m_last = rec.fields;
+  m_last_key = (type == 'K');
+  m_offset += record_header_size + size;
+  return true;
+}
+
+// attrlog_writer
+
+attrlog_writer::attrlog_writer()
+: m_loaded(false),
+  m_end(0),
+  m_since_key(0)
+{
+}
+
+// Recover state of last record from existing files.
+bool attrlog_writer::load(const char * path)
+{
+  m_loaded = false;
+  m_end = 0; m_since_key = 0;
+  m_last.clear();
+
+  // Create new files if data file is missing or empty
+  {
+    stdio_file f(path, "rb");
+    if (!f && errno != ENOENT) {
+      pout("Cannot read attribute history \"%s\": %s\n", path, strerror(errno));
+      return false;
+    }
+    if (!f || get_file_size(f) == 0) {
+      f.close();
+      unsigned char buf[file_header_size];
+      make_file_header(buf, data_magic);
+      if (!(   f.open(path, "wb")
+            && fwrite(buf, 1, sizeof(buf), f) == sizeof(buf) && f.close())) {
+        pout("Cannot create attribute history \"%s\"\n", path);
+        return false;
+      }
+      if (!create_index(path))
+        return false;
+      m_end = file_header_size;
+      m_loaded = true;
+      return true;
+    }
+  }
+
+  attrlog_reader reader;
+  if (!reader.open(path))
+    return false;
+
+  // Start at last indexed key record, rebuild index if invalid
+  int64_t last_indexed = -1;
+  {
+    std::string ipath = get_index_path(path);
+    stdio_file f(ipath.c_str(), "rb");
+    int64_t cnt = (f ? get_index_count(f) : -1), time, offset;
+    if (cnt > 0 && read_index_entry(f, cnt - 1, time, offset) && reader.seek_offset(offset)) {
+      attrlog_record rec;
+      if (reader.read(rec) && reader.last_was_key())
+        last_indexed = offset;
+      reader.seek_offset(offset);
+    }
+    if (last_indexed < 0) {
+      f.close();
+      if (cnt != 0)
+        pout("%s: rebuilding attribute history index\n", path);
+      if (!create_index(path))
+        return false;
+      reader.open(path);
+    }
+  }
+
+  // Read remaining records, add missing index entries
+  attrlog_record rec;
+  int64_t offset = reader.get_offset();
+  while (reader.read(rec)) {
+    if (reader.last_was_key()) {
+      if (offset > last_indexed && !append_index(path, rec.time, offset))
+        return false;
+      m_since_key = 0;
+    }
+    else
+      m_since_key++;
+    m_last = rec.fields;
+    offset = reader.get_offset();
+  }
+  bool bad = reader.bad_record();
+  reader.close();
+
+  if (bad) {
+    // Remove incomplete record from interrupted write
+    stdio_file f(path, "r+b");
+    if (!(f && truncate_file(f, offset))) {
+      pout("%s: cannot remove bad record at offset %" PRId64 "\n", path, offset);
+      return false;
+    }
+    pout("%s: removed bad record at offset %" PRId64 "\n", path, offset);
+  }
+
+  m_end = offset;
+  m_loaded = true;
+  return true;
+}
+
+bool attrlog_writer::append(const char * path, const attrlog_record & rec)
+{
+  stdio_file f;
+  for (int retry = 0; ; retry++) {
+    if (!m_loaded && !load(path))
+      return false;
+    if (!f.open(path, "r+b")) {
+      pout("Cannot open attribute history \"%s\": %s\n", path, strerror(errno));
+      m_loaded = false;
+      return false;
+    }
+    if (get_file_size(f) == m_end)
+      break;
+    // File modified or replaced, reload state
+    f.close();
+    m_loaded = false;
+    if (retry)
+      return false;
+  }
+
+  bool key = (   m_since_key + 1 >= ATTRLOG_KEY_INTERVAL
+              || m_end <= file_header_size
+              || !same_tags(m_last, rec.fields));
+
+  std::vector<unsigned char> payload;
+  for (unsigned i = 0; i < rec.fields.size(); i++) {
+    const attrlog_field & fld = rec.fields[i];
+    if (key) {
+      put_varint(payload, fld.tag);
+      put_varint(payload, fld.value);
+    }
+    else
+      put_varint(payload, zigzag_encode(fld.value - m_last[i].value));
+  }
+
+  unsigned char hdr[record_header_size];
+  unsigned char sum = 0;
+  for (unsigned i = 0; i < payload.size(); i++)
+    sum += payload[i];
+  hdr[0] = (key ? 'K' : 'D');
+  hdr[1] = sum;
+  put_le(hdr + 2, rec.fields.size(), 2);
+  put_le(hdr + 4, payload.size(), 4);
+  put_le(hdr + 8, (uint64_t)(int64_t)rec.time, 8);
+
+  if (!(   fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr)
+        && (payload.empty() || fwrite(&payload[0], 1, payload.size(), f) == payload.size())
+        && f.close())) {
+    pout("Cannot write attribute history \"%s\"\n", path);
+    m_loaded = false;
+    return false;
+  }
+
+  // Index entry is written after the record.  If this fails, the
+  // entry is added on next load().
+  int64_t offset = m_end;
+  m_end += sizeof(hdr) + payload.size();
+  m_last = rec.fields;
+  if (key) {
+    m_since_key = 0;
+    if (!append_index(path, rec.time, offset))
+      m_loaded = false;
+  }
+  else
+    m_since_key++;
+  return true;
+}
+
+// Range queries
+
+int attrlog_read_range(const char * path, time_t t1, time_t t2,
+                       void (* func)(const attrlog_record & rec, void * arg),
+                       void * arg)
+{
+  attrlog_reader reader;
+  if (!(reader.open(path) && reader.seek(t1)))
+    return -1;
+
+  int cnt = 0;
+  attrlog_record rec;
+  while (reader.read(rec)) {
+    if (rec.time < t1)
+      continue;
+    if (rec.time > t2)
+      break;
+    func(rec, arg);
+    cnt++;
+  }
+  if (reader.bad_record())
+    pout("%s: bad record at offset %" PRId64 " ignored\n", path, reader.get_offset());
+  return cnt;
+}
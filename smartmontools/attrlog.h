@@ -0,0 +1,164 @@
+/*
+ * attrlog.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ATTRLOG_H_
+#define ATTRLOG_H_
+
+#define ATTRLOG_H_CVSID "$Id$\n"
+
+// Binary attribute history written by smartd '-A PREFIX'.
+//
+// The data file starts with a 16 byte file header followed by records.
+// Each record consists of a fixed 16 byte record header followed by
+// a variable length payload:
+//
+//   u8  type     'K': key record, payload: (varint tag, varint value)...
+//                'D': delta record, payload: (zigzag varint delta)...
+//                     Same tags as previous record, values are
+//                     differences to previous record.
+//   u8  checksum Sum of payload bytes (mod 256)
+//   u16 nfields  Number of fields in record
+//   u32 size     Size of payload in bytes
+//   s64 time     Time of record (time_t)
+//
+// A key record is written if the set of tags has changed, and at least
+// every ATTRLOG_KEY_INTERVAL records.  For each key record, an entry
+// (s64 time, u64 file offset) is appended to the index file PATH.idx.
+// A range query only decodes records starting at the last key record
+// before the start time.  All integers are little endian.
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// Field tags
+enum {
+  // 1-255: ATA attribute ID, value: (normalized value << 48) | raw value
+  ATTRLOG_TAG_ATA_MAX = 0xff,
+  // SCSI error counter pages, +0..6: counter[0..6] of scsiErrorCounter
+  ATTRLOG_TAG_SCSI_READ = 0x100,
+  ATTRLOG_TAG_SCSI_WRITE = 0x110,
+  ATTRLOG_TAG_SCSI_VERIFY = 0x120,
+  ATTRLOG_TAG_SCSI_NONMEDIUM = 0x130,
+  ATTRLOG_TAG_TEMPERATURE = 0x140
+};
+
+// Max number of records between key records
+const unsigned ATTRLOG_KEY_INTERVAL = 64;
+
+struct attrlog_field
+{
+  unsigned short tag;
+  uint64_t value;
+
+  attrlog_field(unsigned short tag_ = 0, uint64_t value_ = 0)
+    : tag(tag_), value(value_) { }
+};
+
+struct attrlog_record
+{
+  time_t time;
+  std::vector<attrlog_field> fields;
+
+  attrlog_record()
+    : time(0) { }
+
+  // Add ATA attribute
+  void add_ata(unsigned char id, unsigned char val, uint64_t raw)
+    { fields.push_back(attrlog_field(id, ((uint64_t)val << 48) | (raw & 0xffffffffffffULL))); }
+
+  // Add other field
+  void add(unsigned short tag, uint64_t value)
+    { fields.push_back(attrlog_field(tag, value)); }
+};
+
+// Format record as a line of the smartd attrlog CSV file.
+std::string attrlog_format_csv(const attrlog_record & rec);
+
+/// Sequential reader for attribute history files.
+class attrlog_reader
+{
+public:
+  attrlog_reader();
+  ~attrlog_reader();
+
+  /// Open data file, check file header.
+  bool open(const char * path);
+
+  void close();
+
+  /// Position at last key record at or before time t.
+  /// Uses the index file if present, otherwise reads from the start.
+  bool seek(time_t t);
+
+  /// Position at record at file offset, must be a key record.
+  bool seek_offset(int64_t offset);
+
+  /// Read next record, return false on end of file or error.
+  bool read(attrlog_record & rec);
+
+  /// Return true if last read() failed due to a bad or truncated record.
+  bool bad_record() const
+    { return m_bad; }
+
+  /// Return file offset of next record.
+  int64_t get_offset() const
+    { return m_offset; }
+
+  /// Return true if last record read was a key record.
+  bool last_was_key() const
+    { return m_last_key; }
+
+private:
+  FILE * m_file;
+  std::string m_path;
+  int64_t m_offset;
+  bool m_bad;
+  bool m_last_key;
+  std::vector<attrlog_field> m_last;
+
+  attrlog_reader(const attrlog_reader &);
+  void operator=(const attrlog_reader &);
+};
+
+/// Appends records to attribute history files.
+/// State of last record is kept in memory, so each append is O(1).
+/// Supports copy & assignment and is compatible with STL containers.
+class attrlog_writer
+{
+public:
+  attrlog_writer();
+
+  /// Append record to data file.  Creates data and index file if
+  /// missing.  Prints error message and returns false on error.
+  bool append(const char * path, const attrlog_record & rec);
+
+private:
+  bool load(const char * path);
+
+  bool m_loaded;              // State below is valid
+  int64_t m_end;              // Expected size of data file
+  unsigned m_since_key;       // Number of records since last key record
+  std::vector<attrlog_field> m_last; // Fields of last record
+};
+
+// Read records with t1 <= time <= t2 and call func(rec, arg) for each.
+// Returns number of records, -1 on error.
+int attrlog_read_range(const char * path, time_t t1, time_t t2,
+                       void (* func)(const attrlog_record & rec, void * arg),
+                       void * arg);
+
+#endif // ATTRLOG_H_
@@ -0,0 +1,188 @@
+/*
+ * cmdstats.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+
+#include "atacmdnames.h"
+#include "atacmds.h"
+#include "cmdstats.h"
+#include "dev_interface.h"
+#include "scsicmds.h"
+#include "utility.h"
+
+const char * cmdstats_cpp_cvsid = "$Id$"
+                                  CMDSTATS_H_CVSID;
+
+const int64_t latency_histogram::bucket_limits[num_buckets - 1] = {
+  100, 250, 500,
+  1000, 2500, 5000,
+  10000, 25000, 50000,
+  100000, 250000, 500000,
+  1000000, 2500000, 5000000
+};
+
+latency_histogram::latency_histogram()
+: count(0), errors(0),
+  sum_usec(0), min_usec(0), max_usec(0)
+{
+  for (int i = 0; i < num_buckets; i++)
+    buckets[i] = 0;
+}
+
+void latency_histogram::add(int64_t usec, bool ok)
+{
+  if (usec < 0)
+    usec = 0;
+  if (!count || usec < min_usec)
+    min_usec = usec;
+  if (!count || usec > max_usec)
+    max_usec = usec;
+  count++;
+  if (!ok)
+    errors++;
+  sum_usec += usec;
+
+  int i;
+  for (i = 0; i < num_buckets - 1 && usec > bucket_limits[i]; i++)
+    ;
+  buckets[i]++;
+}
+
+// Keys of histograms, ATA commands first
+enum {
+  key_ata  = 0x10000,
+  key_scsi = 0x20000
+};
+
+void command_stats::add_ata(unsigned char command, unsigned char features, int64_t usec, bool ok)
+{
+  unsigned key = key_ata | (command << 8) | (command == ATA_SMART_CMD ? features : 0);
+  m_histograms[key].add(usec, ok);
+}
+
+void command_stats::add_scsi(unsigned char opcode, int64_t usec, bool ok)
+{
+  m_histograms[key_scsi | (opcode << 8)].add(usec, ok);
+}
+
+latency_histogram command_stats::get_total() const
+{
+  latency_histogram total;
+  for (histogram_map::const_iterator it = m_histograms.begin(); it != m_histograms.end(); ++it) {
+    const latency_histogram & h = it->second;
+    if (!h.count)
+      continue;
+    if (!total.count || h.min_usec < total.min_usec)
+      total.min_usec = h.min_usec;
+    if (!total.count || h.max_usec > total.max_usec)
+      total.max_usec = h.max_usec;
+    total.count += h.count;
+    total.errors += h.errors;
+    total.sum_usec += h.sum_usec;
+    for (int i = 0; i < latency_histogram::num_buckets; i++)
+      total.buckets[i] += h.buckets[i];
+  }
+  return total;
+}
+
+static std::string format_msec(int64_t usec)
+{
+  return strprintf("%d.%03d", (int)(usec / 1000), (int)(usec % 1000));
+}
+
+// Format non-empty buckets as "LIMIT:COUNT ...", limits in ms
+static std::string format_buckets(const latency_histogram & h)
+{
+  static const char * const labels[latency_histogram::num_buckets] = {
+    "<=0.1", "<=0.25", "<=0.5",
+    "<=1", "<=2.5", "<=5",
+    "<=10", "<=25", "<=50",
+    "<=100", "<=250", "<=500",
+    "<=1000", "<=2500", "<=5000",
+    ">5000"
+  };
+  std::string s;
+  for (int i = 0; i < latency_histogram::num_buckets; i++) {
+    if (!h.buckets[i])
+      continue;
+    if (!s.empty())
+      s += ' ';
+    s += strprintf("%s:%" PRIu64, labels[i], h.buckets[i]);
+  }
+  return s;
+}
+
+static std::string format_line(const char * indent, const char * name, const latency_histogram & h)
+{
+  return strprintf("%s%-32s %8" PRIu64 " %6" PRIu64 " %10s %10s %10s  %s\n", indent, name,
+                   h.count, h.errors, format_msec(h.count ? h.sum_usec / (int64_t)h.count : 0).c_str(),
+                   format_msec(h.min_usec).c_str(), format_msec(h.max_usec).c_str(),
+                   format_buckets(h).c_str());
+}
+
+std::string command_stats::format(const char * indent) const
+{
+  std::string text = strprintf("%s%-32s %8s %6s %10s %10s %10s  %s\n", indent,
+                               "Command", "Count", "Errors", "Avg[ms]", "Min[ms]", "Max[ms]",
+                               "Histogram[ms]");
+  for (histogram_map::const_iterator it = m_histograms.begin(); it != m_histograms.end(); ++it) {
+    unsigned key = it->first;
+    unsigned char op = (key >> 8) & 0xff;
+    std::string name;
+    if (key & key_ata)
+      name = look_up_ata_command(op, key & 0xff);
+    else {
+      const char * s = scsi_get_opcode_name(op);
+      name = (s ? s : strprintf("SCSI opcode 0x%02x", op));
+    }
+    if (name.size() > 32)
+      name.erase(32);
+    text += format_line(indent, name.c_str(), it->second);
+  }
+  if (m_histograms.size() > 1)
+    text += format_line(indent, "Total", get_total());
+  return text;
+}
+
+bool timed_ata_pass_through(ata_device * device, const ata_cmd_in & in, ata_cmd_out & out)
+{
+  command_stats * stats = device->get_command_stats();
+  if (!stats)
+    return device->ata_pass_through(in, out);
+
+  int64_t start = smi()->get_timer_usec();
+  bool ok = device->ata_pass_through(in, out);
+  stats->add_ata(in.in_regs.command, in.in_regs.features, smi()->get_timer_usec() - start, ok);
+  return ok;
+}
+
+bool timed_ata_pass_through(ata_device * device, const ata_cmd_in & in)
+{
+  ata_cmd_out dummy;
+  return timed_ata_pass_through(device, in, dummy);
+}
+
+bool timed_scsi_pass_through(scsi_device * device, scsi_cmnd_io * iop)
+{
+  command_stats * stats = device->get_command_stats();
+  if (!stats)
+    return device->scsi_pass_through(iop);
+
+  int64_t start = smi()->get_timer_usec();
+  bool ok = device->scsi_pass_through(iop);
+  stats->add_scsi(iop->cmnd[0], smi()->get_timer_usec() - start, ok);
+  return ok;
+}
@@ -0,0 +1,99 @@
+/*
+ * cmdstats.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CMDSTATS_H_
+#define CMDSTATS_H_
+
+#define CMDSTATS_H_CVSID "$Id$\n"
+
+// Latency statistics of ATA and SCSI pass through commands.
+//
+// If statistics are set for a device by smart_device::set_command_stats(),
+// the command functions of atacmds.cpp and scsicmds.cpp time each pass
+// through call and add its duration to the histogram of its opcode.
+// SMART subcommands are counted separately.  Commands of a tunnelled
+// device are counted once at the outer device.
+
+#include "int64.h"
+
+#include <map>
+#include <string>
+
+class ata_device;
+class scsi_device;
+struct ata_cmd_in;
+struct ata_cmd_out;
+struct scsi_cmnd_io;
+
+/// Latency histogram with fixed buckets.
+struct latency_histogram
+{
+  enum { num_buckets = 16 };
+
+  /// Upper bounds of the buckets in microseconds, the last bucket is
+  /// unbounded.
+  static const int64_t bucket_limits[num_buckets - 1];
+
+  uint64_t count;               ///< Number of commands
+  uint64_t errors;              ///< Number of failed commands
+  int64_t sum_usec;             ///< Sum of durations
+  int64_t min_usec, max_usec;   ///< Min/Max duration, 0 if no commands
+  uint64_t buckets[num_buckets]; ///< Number of commands per bucket
+
+  latency_histogram();
+
+  /// Add duration of one command.
+  void add(int64_t usec, bool ok);
+};
+
+/// Latency histograms of all commands of one device, by opcode.
+class command_stats
+{
+public:
+  /// Add duration of an ATA command, FEATURES is only used for SMART
+  /// commands.
+  void add_ata(unsigned char command, unsigned char features, int64_t usec, bool ok);
+
+  /// Add duration of a SCSI command.
+  void add_scsi(unsigned char opcode, int64_t usec, bool ok);
+
+  /// Return true if no commands were added.
+  bool empty() const
+    { return m_histograms.empty(); }
+
+  /// Return histogram of all commands.
+  latency_histogram get_total() const;
+
+  /// Format as table with one line per opcode, each line starts with
+  /// INDENT.
+  std::string format(const char * indent) const;
+
+private:
+  typedef std::map<unsigned, latency_histogram> histogram_map;
+  histogram_map m_histograms;
+};
+
+/// Call DEVICE->ata_pass_through() and add its duration to the
+/// statistics of DEVICE, if any.
+bool timed_ata_pass_through(ata_device * device, const ata_cmd_in & in, ata_cmd_out & out);
+
+/// Same without output registers.
+bool timed_ata_pass_through(ata_device * device, const ata_cmd_in & in);
+
+/// Call DEVICE->scsi_pass_through() and add its duration to the
+/// statistics of DEVICE, if any.
+bool timed_scsi_pass_through(scsi_device * device, scsi_cmnd_io * iop);
+
+#endif // CMDSTATS_H_
@@ -41,12 +41,12 @@ const char * dev_interface_cpp_cvsid = "$Id$"
 smart_device::smart_device(smart_interface * intf, const char * dev_name,
     const char * dev_type, const char * req_type)
 : m_intf(intf), m_info(dev_name, dev_type, req_type),
-  m_ata_ptr(0), m_scsi_ptr(0)
+  m_ata_ptr(0), m_scsi_ptr(0), m_command_stats(0)
 {
 }
 
 smart_device::smart_device(do_not_use_in_implementation_classes)
-: m_intf(0), m_ata_ptr(0), m_scsi_ptr(0)
+: m_intf(0), m_ata_ptr(0), m_scsi_ptr(0), m_command_stats(0)
 {
   throw std::logic_error("smart_device: wrong constructor called in implementation class");
 }
@@ -307,6 +307,12 @@ bool smart_interface::disable_system_auto_standby(bool /*disable*/)
   return set_err(ENOSYS);
 }
 
+hotplug_monitor * smart_interface::get_hotplug_monitor(const char * /*source*/)
+{
+  set_err(ENOSYS);
+  return 0;
+}
+
 bool smart_interface::set_err(int no, const char * msg, ...)
 {
   if (!msg)
@@ -33,6 +33,7 @@
 class smart_interface;
 class ata_device;
 class scsi_device;
+class command_stats;
 
 /// Base class for all devices
 class smart_device
@@ -201,6 +202,18 @@ public:
   /// Default implementation does nothing.
   virtual void release(const smart_device * dev);
 
+  ///////////////////////////////////////////////
+  // Command latency statistics
+
+  /// Set statistics which record the duration of each pass through
+  /// command, 0 to stop recording.  See cmdstats.h.
+  void set_command_stats(command_stats * stats)
+    { m_command_stats = stats; }
+
+  /// Get statistics set by set_command_stats(), 0 if none.
+  command_stats * get_command_stats() const
+    { return m_command_stats; }
+
 protected:
   /// Get interface which produced this object.
   smart_interface * smi()
@@ -222,6 +235,8 @@ private:
   friend class scsi_device;
   scsi_device * m_scsi_ptr;
 
+  command_stats * m_command_stats;
+
   // Prevent copy/assigment
   smart_device(const smart_device &);
   void operator=(const smart_device &);
@@ -486,6 +501,33 @@ struct ata_cmd_out
   ata_cmd_out();
 };
 
+class ata_data_cache;
+
+/// Limits of log read commands learned from failed commands,
+/// see ataReadLogExt() and ataReadLogDirectory().
+struct ata_log_limits
+{
+  unsigned gp_max_sectors; ///< Max sectors per READ LOG EXT, 0 if not limited
+  int gp_logdir;           ///< GP Log Directory: 1 read, -1 read failed, 0 unknown
+  int smart_logdir;        ///< SMART Log Directory: 1 read, -1 read failed, 0 unknown
+  time_t time;             ///< Time the last limit was learned, 0 if none
+
+  /// Learned limits are probed again after this number of seconds.
+  static const int max_age = 7 * 24 * 3600;
+
+  ata_log_limits()
+    : gp_max_sectors(0), gp_logdir(0), smart_logdir(0), time(0) { }
+
+  /// Return true if a limit is set.
+  bool is_limited() const
+    { return (gp_max_sectors || gp_logdir < 0 || smart_logdir < 0); }
+
+  /// Return true if limits were learned more than 'max_age' seconds
+  /// before NOW.
+  bool is_expired(time_t now) const
+    { return (time + max_age < now); }
+};
+
 /// ATA device access
 class ata_device
 : virtual public /*extends*/ smart_device
@@ -505,6 +547,23 @@ public:
   /// Default implementation returns false.
   virtual bool ata_identify_is_cached() const;
 
+  /// Set cache which records results of smartcommandhandler(),
+  /// 0 to stop recording.
+  void set_data_recorder(ata_data_cache * recorder)
+    { m_data_recorder = recorder; }
+
+  /// Get cache set by set_data_recorder(), 0 if none.
+  ata_data_cache * get_data_recorder() const
+    { return m_data_recorder; }
+
+  /// Get log read limits learned so far.
+  const ata_log_limits & get_log_limits() const
+    { return m_log_limits; }
+
+  /// Set log read limits, e.g. from capability cache.
+  void set_log_limits(const ata_log_limits & limits)
+    { m_log_limits = limits; }
+
 protected:
   /// Flags for ata_cmd_is_supported().
   enum {
@@ -542,8 +601,13 @@ protected:
 
   /// Default constructor, registers device as ATA.
   ata_device()
-    : smart_device(never_called)
+    : smart_device(never_called),
+      m_data_recorder(0)
     { hide_ata(false); }
+
+private:
+  ata_data_cache * m_data_recorder;
+  ata_log_limits m_log_limits;
 };
 
 
@@ -714,6 +778,18 @@ public:
       return dev;
     }
 
+  void erase(unsigned i)
+    {
+      delete m_list.at(i);
+      m_list.erase(m_list.begin() + i);
+    }
+
+  void replace(unsigned i, smart_device * dev)
+    {
+      delete m_list.at(i);
+      m_list[i] = dev;
+    }
+
 // Implementation
 private:
   std::vector<smart_device *> m_list;
@@ -724,6 +800,33 @@ private:
 };
 
 
+/////////////////////////////////////////////////////////////////////////////
+// hotplug_monitor
+
+/// Source of device add/remove events, used by smartd.
+class hotplug_monitor
+{
+public:
+  /// Device add or remove event.
+  struct event
+  {
+    bool add;             ///< true if device was added, false if removed
+    std::string dev_name; ///< Device name, e.g. "/dev/sdb"
+
+    event()
+      : add(false) { }
+  };
+
+  virtual ~hotplug_monitor() throw()
+    { }
+
+  /// Wait up to 'timeout' seconds for events, append them to 'events'.
+  /// Returns without events if interrupted by a signal.
+  /// Returns false on error, see smi()->get_errmsg().
+  virtual bool wait_events(int timeout, std::vector<event> & events) = 0;
+};
+
+
 /////////////////////////////////////////////////////////////////////////////
 // smart_interface
 
@@ -769,6 +872,11 @@ public:
   /// Default implementation returns false.
   virtual bool disable_system_auto_standby(bool disable);
 
+  /// Return new monitor for device add/remove events from platform
+  /// specific 'source'.  Return 0 on error or if unsupported.
+  /// Default implementation returns 0.
+  virtual hotplug_monitor * get_hotplug_monitor(const char * source);
+
 
   ///////////////////////////////////////////////
   // Last error information
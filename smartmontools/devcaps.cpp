@@ -0,0 +1,382 @@
+/*
+ * devcaps.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> // unlink()
+#endif
+#ifndef _WIN32
+#include <sys/stat.h> // fchmod()
+#else
+#include <io.h> // unlink(), _mktemp()
+#endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "devcaps.h"
+#include "scsicmds.h"
+#include "utility.h"
+
+const char * devcaps_cpp_cvsid = "$Id$"
+                                  DEVCAPS_H_CVSID;
+
+#ifdef HAVE_PTHREADS
+// Protects all caches, smartctl queries several devices in parallel.
+static pthread_mutex_t devcaps_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Scoped lock of devcaps_mutex, no-op without thread support.
+class devcaps_lock
+{
+public:
+  devcaps_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_lock(&devcaps_mutex);
+#endif
+    }
+
+  ~devcaps_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_unlock(&devcaps_mutex);
+#endif
+    }
+
+private:
+  devcaps_lock(const devcaps_lock &);
+  void operator=(const devcaps_lock &);
+};
+
+bool operator==(const scsi_device_caps & c1, const scsi_device_caps & c2)
+{
+  return (   c1.modese_len == c2.modese_len
+          && c1.log_pages == c2.log_pages
+          && c1.vpd_pages == c2.vpd_pages);
+}
+
+// Replace characters which would break the file format.
+static std::string sanitize(const char * s)
+{
+  std::string r = s;
+  for (unsigned i = 0; i < r.size(); i++) {
+    if ((unsigned char)r[i] < ' ' || r[i] == 0x7f)
+      r[i] = '_';
+  }
+  return r;
+}
+
+std::string scsi_format_caps_id(const unsigned char * inqbuf,
+                                const char * serial)
+{
+  if (!*serial)
+    return "";
+  char vendor[8+1], product[16+1];
+  scsi_format_id_string(vendor, inqbuf + 8, 8);
+  scsi_format_id_string(product, inqbuf + 16, 16);
+  return sanitize(strprintf("%s %s %s", vendor, product, serial).c_str());
+}
+
+std::string scsi_format_caps_fw(const unsigned char * inqbuf)
+{
+  char revision[4+1];
+  scsi_format_id_string(revision, inqbuf + 32, 4);
+  return sanitize(revision);
+}
+
+static std::string format_hex(const std::vector<unsigned char> & pages)
+{
+  if (pages.empty())
+    return "-";
+  std::string s;
+  for (unsigned i = 0; i < pages.size(); i++)
+    s += strprintf("%02x", pages[i]);
+  return s;
+}
+
+static bool parse_hex(const std::string & s, std::vector<unsigned char> & pages)
+{
+  pages.clear();
+  if (s == "-")
+    return true;
+  if (s.empty() || (s.size() & 1))
+    return false;
+  for (unsigned i = 0; i < s.size(); i += 2) {
+    unsigned val; char c;
+    if (sscanf(s.substr(i, 2).c_str(), "%2x%c", &val, &c) != 1)
+      return false;
+    pages.push_back((unsigned char)val);
+  }
+  return true;
+}
+
+// Parse decimal number, the whole string must match.
+static bool parse_int(const std::string & s, int & val)
+{
+  int len = -1;
+  return (sscanf(s.c_str(), "%d%n", &val, &len) == 1 && len == (int)s.size());
+}
+
+static bool parse_int(const std::string & s, unsigned & val)
+{
+  int len = -1;
+  return (   !s.empty() && isdigit((unsigned char)s[0])
+          && sscanf(s.c_str(), "%u%n", &val, &len) == 1 && len == (int)s.size());
+}
+
+static bool parse_time(const std::string & s, time_t & val)
+{
+  if (s.empty() || !isdigit((unsigned char)s[0]))
+    return false;
+  char * end = 0;
+  val = (time_t)strtoull(s.c_str(), &end, 10);
+  return !*end;
+}
+
+// Split line into tab separated fields.
+static void split_fields(const char * line, std::vector<std::string> & fields)
+{
+  fields.clear();
+  const char * s = line;
+  for (;;) {
+    int n = strcspn(s, "\t\r\n");
+    fields.push_back(std::string(s, n));
+    if (s[n] != '\t')
+      break;
+    s += n + 1;
+  }
+}
+
+device_caps_cache::device_caps_cache()
+: m_modified(false)
+{
+}
+
+bool device_caps_cache::load(const char * path)
+{
+  stdio_file f(path, "r");
+  if (!f) {
+    if (errno == ENOENT)
+      return true;
+    pout("Cannot read capability cache \"%s\": %s\n", path, strerror(errno));
+    return false;
+  }
+
+  entry_map entries;
+  ata_entry_map ata_entries;
+  int bad = 0;
+  char line[1024];
+  std::vector<std::string> fields;
+  while (fgets(line, sizeof(line), f)) {
+    if (!line[strspn(line, " \t\r\n")] || line[0] == '#')
+      continue;
+    split_fields(line, fields);
+
+    if (fields[0] == "ata") {
+      ata_entry e;
+      if (!(   fields.size() == 7 && !fields[1].empty()
+            && parse_int(fields[3], e.limits.gp_max_sectors)
+            && parse_int(fields[4], e.limits.gp_logdir)
+            && parse_int(fields[5], e.limits.smart_logdir)
+            && parse_time(fields[6], e.limits.time))) {
+        bad++;
+        continue;
+      }
+      e.fw = fields[2];
+      ata_entries[fields[1]] = e;
+      continue;
+    }
+
+    entry e;
+    if (!(   fields.size() == 5 && !fields[0].empty()
+          && parse_int(fields[2], e.caps.modese_len)
+          && parse_hex(fields[3], e.caps.log_pages)
+          && parse_hex(fields[4], e.caps.vpd_pages))) {
+      bad++;
+      continue;
+    }
+    e.fw = fields[1];
+    entries[fields[0]] = e;
+  }
+
+  if (bad)
+    pout("%s: %d invalid line(s) ignored\n", path, bad);
+
+  devcaps_lock lock;
+  m_entries.swap(entries);
+  m_ata_entries.swap(ata_entries);
+  m_modified = false;
+  return true;
+}
+
+bool device_caps_cache::save(const char * path)
+{
+  devcaps_lock lock;
+  if (!m_modified)
+    return true;
+
+  // Create unique temporary file in same directory, other smartctl
+  // or smartd processes may save the same cache concurrently
+  std::string pathtmp = path; pathtmp += ".XXXXXX";
+  std::vector<char> tmpl(pathtmp.begin(), pathtmp.end());
+  tmpl.push_back(0);
+  stdio_file f;
+  bool created = false;
+#ifndef _WIN32
+  int fd = mkstemp(&tmpl[0]);
+  if (fd >= 0) {
+    created = true;
+    fchmod(fd, 0644);
+    FILE * fp = fdopen(fd, "w");
+    if (fp)
+      f.open(fp, true);
+    else
+      close(fd);
+  }
+#else
+  if (_mktemp(&tmpl[0]))
+    f.open(&tmpl[0], "w");
+#endif
+  pathtmp = &tmpl[0];
+  if (!f) {
+    int err = errno;
+    if (created)
+      unlink(pathtmp.c_str());
+    pout("Cannot create capability cache \"%s\": %s\n", pathtmp.c_str(), strerror(err));
+    return false;
+  }
+
+  fprintf(f, "# smartmontools device capability cache\n"
+             "# ID\tFIRMWARE\tMODESE_LEN\tLOG_PAGES\tVPD_PAGES\n");
+  for (entry_map::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    fprintf(f, "%s\t%s\t%d\t%s\t%s\n", it->first.c_str(), it->second.fw.c_str(),
+            it->second.caps.modese_len, format_hex(it->second.caps.log_pages).c_str(),
+            format_hex(it->second.caps.vpd_pages).c_str());
+  if (!m_ata_entries.empty())
+    fprintf(f, "# ata\tID\tFIRMWARE\tGP_MAX_SECTORS\tGP_LOGDIR\tSMART_LOGDIR\tTIME\n");
+  for (ata_entry_map::const_iterator it = m_ata_entries.begin(); it != m_ata_entries.end(); ++it)
+    fprintf(f, "ata\t%s\t%s\t%u\t%d\t%d\t%" PRId64 "\n", it->first.c_str(),
+            it->second.fw.c_str(), it->second.limits.gp_max_sectors,
+            it->second.limits.gp_logdir, it->second.limits.smart_logdir,
+            (int64_t)it->second.limits.time);
+
+  if (!f.close()) {
+    pout("Write error on capability cache \"%s\"\n", pathtmp.c_str());
+    unlink(pathtmp.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  unlink(path); // rename() does not replace existing files
+#endif
+  if (rename(pathtmp.c_str(), path)) {
+    pout("Cannot rename \"%s\" to \"%s\": %s\n", pathtmp.c_str(), path, strerror(errno));
+    unlink(pathtmp.c_str());
+    return false;
+  }
+  m_modified = false;
+  return true;
+}
+
+bool device_caps_cache::lookup(const std::string & id, const std::string & fw,
+                               scsi_device_caps & caps) const
+{
+  if (id.empty())
+    return false;
+  devcaps_lock lock;
+  entry_map::const_iterator it = m_entries.find(id);
+  if (it == m_entries.end() || it->second.fw != fw)
+    return false;
+  caps = it->second.caps;
+  return true;
+}
+
+void device_caps_cache::update(const std::string & id, const std::string & fw,
+                               const scsi_device_caps & caps)
+{
+  if (id.empty())
+    return;
+  devcaps_lock lock;
+  entry_map::const_iterator it = m_entries.find(id);
+  if (it != m_entries.end() && it->second.fw == fw && it->second.caps == caps)
+    return;
+  entry & e = m_entries[id];
+  e.fw = fw;
+  e.caps = caps;
+  m_modified = true;
+}
+
+// Format cache id of ATA device, empty if serial number is empty.
+static std::string format_ata_id(const char * model, const char * serial)
+{
+  if (!*serial)
+    return "";
+  return sanitize(strprintf("%s %s", model, serial).c_str());
+}
+
+bool device_caps_cache::lookup_ata(const char * model, const char * serial, const char * fw,
+                                   ata_log_limits & limits) const
+{
+  std::string id = format_ata_id(model, serial);
+  if (id.empty())
+    return false;
+  devcaps_lock lock;
+  ata_entry_map::const_iterator it = m_ata_entries.find(id);
+  if (it == m_ata_entries.end() || it->second.fw != sanitize(fw))
+    return false;
+  // Probe again if limits are too old
+  if (it->second.limits.is_expired(time(0)))
+    return false;
+  limits = it->second.limits;
+  return true;
+}
+
+void device_caps_cache::update_ata(const char * model, const char * serial, const char * fw,
+                                   const ata_log_limits & limits)
+{
+  std::string id = format_ata_id(model, serial);
+  if (id.empty())
+    return;
+  std::string fwstr = sanitize(fw);
+  devcaps_lock lock;
+  ata_entry_map::iterator it = m_ata_entries.find(id);
+  if (!limits.is_limited()) {
+    // Keep only devices with limits, remove entry if limits were
+    // probed again and no longer apply
+    if (it != m_ata_entries.end() && it->second.fw == fwstr) {
+      m_ata_entries.erase(it);
+      m_modified = true;
+    }
+    return;
+  }
+  if (   it != m_ata_entries.end()
+      && it->second.fw == fwstr
+      && it->second.limits.gp_max_sectors == limits.gp_max_sectors
+      && it->second.limits.gp_logdir == limits.gp_logdir
+      && it->second.limits.smart_logdir == limits.smart_logdir
+      && it->second.limits.time == limits.time)
+    return;
+  ata_entry & e = m_ata_entries[id];
+  e.fw = fwstr;
+  e.limits = limits;
+  m_modified = true;
+}
@@ -0,0 +1,139 @@
+/*
+ * devcaps.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DEVCAPS_H_
+#define DEVCAPS_H_
+
+#define DEVCAPS_H_CVSID "$Id$\n"
+
+// Cache of device capabilities used by smartctl and smartd
+// '--capcache=FILE'.  Keeps the capabilities of SCSI devices which
+// require discovery commands and the log read limits of ATA devices.
+//
+// SCSI devices use one line per device:
+//
+//   ID <TAB> FIRMWARE <TAB> MODESE_LEN <TAB> LOG_PAGES <TAB> VPD_PAGES
+//
+// ID is "VENDOR PRODUCT SERIAL" from the standard INQUIRY and the Unit
+// Serial Number VPD page, FIRMWARE is the INQUIRY product revision.
+// LOG_PAGES and VPD_PAGES are the responses of the Supported Log Pages
+// log page and Supported VPD Pages VPD page as hex strings ("-" if
+// empty).  An entry is ignored if the firmware revision has changed.
+// Mode pages are not cached because they contain current settings.
+// The Supported VPD Pages and Unit Serial Number VPD pages are still
+// read on each run to build and check the ID.
+//
+// ATA devices use lines starting with the keyword "ata":
+//
+//   ata <TAB> ID <TAB> FIRMWARE <TAB> GP_MAX_SECTORS <TAB> GP_LOGDIR <TAB> SMART_LOGDIR
+//
+// ID is "MODEL SERIAL" and FIRMWARE the firmware revision from IDENTIFY
+// DEVICE.  The other fields are the members of struct ata_log_limits.
+
+#include "dev_interface.h" // ata_log_limits
+
+#include <map>
+#include <string>
+#include <vector>
+
+/// Capabilities of a SCSI device which require discovery commands.
+struct scsi_device_caps
+{
+  std::vector<unsigned char> log_pages; ///< Supported log pages
+  std::vector<unsigned char> vpd_pages; ///< Supported VPD pages
+  int modese_len; ///< Working MODE SENSE length (6 or 10), 0 if unknown
+
+  scsi_device_caps()
+    : modese_len(0) { }
+};
+
+bool operator==(const scsi_device_caps & c1, const scsi_device_caps & c2);
+
+inline bool operator!=(const scsi_device_caps & c1, const scsi_device_caps & c2)
+  { return !(c1 == c2); }
+
+/// Format cache id from standard INQUIRY response (at least 36 bytes)
+/// and serial number.  Returns empty string if serial number is empty.
+std::string scsi_format_caps_id(const unsigned char * inqbuf,
+                                const char * serial);
+
+/// Format firmware revision from standard INQUIRY response.
+std::string scsi_format_caps_fw(const unsigned char * inqbuf);
+
+/// Capability cache of SCSI and ATA devices, all lookup and update
+/// functions are thread safe.
+class device_caps_cache
+{
+public:
+  device_caps_cache();
+
+  /// Read cache file.  A missing file is not an error.
+  /// Prints error message and returns false on error.
+  bool load(const char * path);
+
+  /// Write cache file if modified.  Writes to a unique
+  /// temporary file PATH.XXXXXX first and renames it.
+  /// Prints error message and returns false on error.
+  bool save(const char * path);
+
+  /// Get capabilities of device with id and firmware.
+  /// Returns false if unknown or firmware has changed.
+  bool lookup(const std::string & id, const std::string & fw,
+              scsi_device_caps & caps) const;
+
+  /// Add or replace entry.
+  void update(const std::string & id, const std::string & fw,
+              const scsi_device_caps & caps);
+
+  /// Get log read limits of ATA device with MODEL, SERIAL and FIRMWARE.
+  /// Returns false if unknown, serial number is empty or firmware has
+  /// changed.
+  bool lookup_ata(const char * model, const char * serial, const char * fw,
+                  ata_log_limits & limits) const;
+
+  /// Add or replace ATA entry.  A new entry is only added if a
+  /// limit was learned.
+  void update_ata(const char * model, const char * serial, const char * fw,
+                  const ata_log_limits & limits);
+
+  /// Return true if entries were added or replaced since load().
+  bool is_modified() const
+    { return m_modified; }
+
+private:
+  struct entry
+  {
+    std::string fw;
+    scsi_device_caps caps;
+  };
+
+  typedef std::map<std::string, entry> entry_map;
+  entry_map m_entries;
+
+  struct ata_entry
+  {
+    std::string fw;
+    ata_log_limits limits;
+  };
+
+  typedef std::map<std::string, ata_entry> ata_entry_map;
+  ata_entry_map m_ata_entries;
+  bool m_modified;
+
+  device_caps_cache(const device_caps_cache &);
+  void operator=(const device_caps_cache &);
+};
+
+#endif // DEVCAPS_H_
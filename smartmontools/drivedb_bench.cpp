@@ -0,0 +1,253 @@
+/*
+ * drivedb_bench.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Micro-benchmark for drive database lookups.
+// Compares the indexed lookup_drive() with a linear search which
+// compiles each regular expression on demand (the old implementation).
+// With '-c', checks the pre-parsed builtin tables generated by
+// drivedb_gen against the builtin database instead.
+// Not installed, run 'make drivedb-bench' or 'make check'.
+
+#include "config.h"
+#include "int64.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "atacmds.h"
+#include "knowndrives.h"
+#include "utility.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const char * drivedb_bench_cpp_cvsid = "$Id$"
+  KNOWNDRIVES_H_CVSID;
+
+void pout(const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  fflush(stdout);
+}
+
+void checksumwarning(const char * /*string*/)
+{
+}
+
+// Same table as the builtin table in knowndrives.cpp.
+static const drive_settings bench_knowndrives[] = {
+#include "drivedb.h"
+};
+
+static const unsigned bench_knowndrives_size =
+  sizeof(bench_knowndrives) / sizeof(bench_knowndrives[0]);
+
+// Linear search, compiles each regular expression on demand.
+static const drive_settings * lookup_drive_linear(const char * model,
+                                                  const char * firmware)
+{
+  for (unsigned i = 0; i < bench_knowndrives_size; i++) {
+    const drive_settings & dbentry = bench_knowndrives[i];
+    if (   !strcmp(dbentry.modelfamily, "DEFAULT")
+        || str_starts_with(dbentry.modelfamily, "USB:"))
+      continue;
+
+    regular_expression regex;
+    if (!(   regex.compile(dbentry.modelregexp, REG_EXTENDED)
+          && regex.full_match(model)))
+      continue;
+    if (!(   !*dbentry.firmwareregexp
+          || (   regex.compile(dbentry.firmwareregexp, REG_EXTENDED)
+              && regex.full_match(firmware))))
+      continue;
+    return &dbentry;
+  }
+  return 0;
+}
+
+// Default corpus, includes model strings not found in the database.
+static const char * const default_corpus[][2] = {
+  { "ST3000DM001-1CH166", "CC24" },
+  { "ST2000DL003-9VT166", "CC32" },
+  { "ST31000528AS", "CC38" },
+  { "ST9500325AS", "0001SDM1" },
+  { "ST4000VN000-1H4168", "SC43" },
+  { "WDC WD20EARS-00MVWB0", "51.0AB51" },
+  { "WDC WD10EZEX-00BN5A0", "01.01A01" },
+  { "WDC WD40EFRX-68WT0N0", "80.00A80" },
+  { "WDC WD5000AAKX-001CA0", "15.01H15" },
+  { "WDC WD3200BEVT-22A23T0", "01.01A01" },
+  { "HGST HUS724040ALA640", "MFAOA8B0" },
+  { "Hitachi HDS722020ALA330", "JKAOA3EA" },
+  { "Hitachi HTS545050B9A300", "PB4OC60F" },
+  { "TOSHIBA DT01ACA300", "MX6OABB0" },
+  { "TOSHIBA MQ01ABD100", "AX1P3D" },
+  { "SAMSUNG HD204UI", "1AQ10001" },
+  { "SAMSUNG HD103SJ", "1AJ10001" },
+  { "Samsung SSD 850 EVO 250GB", "EMT01B6Q" },
+  { "Samsung SSD 840 PRO Series", "DXM05B0Q" },
+  { "INTEL SSDSC2BB480G4", "D2010370" },
+  { "INTEL SSDSA2CW120G3", "4PC10362" },
+  { "Crucial_CT256MX100SSD1", "MU01" },
+  { "Crucial_CT512M550SSD1", "MU01" },
+  { "M4-CT128M4SSD2", "0309" },
+  { "KINGSTON SV300S37A120G", "505ABBF0" },
+  { "OCZ-VERTEX3", "2.15" },
+  { "OCZ-VECTOR150", "1.2" },
+  { "SanDisk SDSSDHP128G", "X2316RL" },
+  { "SanDisk SD6SB1M128G1022I", "X231600" },
+  { "Corsair Force GT", "5.02" },
+  { "MAXTOR STM3500320AS", "MX15" },
+  { "Maxtor 6L250S0", "BANC1G10" },
+  { "FUJITSU MHV2080AH", "00860028" },
+  { "IC25N040ATCS05-0", "CA4OA71A" },
+  { "APPLE SSD SM128E", "CXM09A1Q" },
+  { "Unknown Vendor XYZ-1000", "1.0" },
+  { "QEMU HARDDISK", "2.5+" },
+  { "VBOX HARDDISK", "1.0" },
+  { "", "" }
+};
+
+// Read corpus from file, one "MODEL[<TAB>FIRMWARE]" per line.
+static bool read_corpus(const char * path,
+                        std::vector<std::string> & models,
+                        std::vector<std::string> & firmwares)
+{
+  stdio_file f(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    char * tab = strchr(line, '\t');
+    if (tab)
+      *tab++ = 0;
+    models.push_back(line);
+    firmwares.push_back(tab ? tab : "");
+  }
+  return true;
+}
+
+// Run lookups in rounds for at least 1s, return microseconds per lookup.
+static double time_lookups(
+  const drive_settings * (*lookup)(const char *, const char *),
+  const std::vector<std::string> & models,
+  const std::vector<std::string> & firmwares,
+  unsigned & rounds)
+{
+  clock_t start = clock(), elapsed;
+  rounds = 0;
+  do {
+    for (unsigned i = 0; i < models.size(); i++)
+      lookup(models[i].c_str(), firmwares[i].c_str());
+    rounds++;
+    elapsed = clock() - start;
+  } while (elapsed < CLOCKS_PER_SEC);
+
+  return (1000000.0 * elapsed / CLOCKS_PER_SEC) / ((double)rounds * models.size());
+}
+
+int main(int argc, char ** argv)
+{
+  if (!(2 <= argc && argc <= 3)) {
+    printf("Usage: %s DRIVEDB [CORPUS]\n"
+           "       %s -c\n\n"
+           "DRIVEDB must be the drivedb.h file used to build this program.\n"
+           "CORPUS contains one \"MODEL[<TAB>FIRMWARE]\" per line.\n"
+           "-c checks the generated builtin tables for every entry.\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  try {
+    if (!strcmp(argv[1], "-c")) {
+      // Generated presets and prefixes must match parsed ones
+      int errcnt = check_builtin_drive_tables();
+      if (errcnt < 0) {
+        printf("Builtin tables: not generated, check skipped\n");
+        return 0;
+      }
+      printf("Builtin tables: %u entries, %d mismatches\n", bench_knowndrives_size, errcnt);
+      return (errcnt ? 1 : 0);
+    }
+
+    // Same entries as builtin table but read from file
+    if (!read_drive_database(argv[1]))
+      return 1;
+    if (!init_drive_database(false))
+      return 1;
+
+    std::vector<std::string> models, firmwares;
+    if (argc == 3) {
+      if (!read_corpus(argv[2], models, firmwares))
+        return 1;
+    }
+    else {
+      for (unsigned i = 0; *default_corpus[i][0]; i++) {
+        models.push_back(default_corpus[i][0]);
+        firmwares.push_back(default_corpus[i][1]);
+      }
+    }
+    if (models.empty()) {
+      printf("%s: empty corpus\n", argv[2]);
+      return 1;
+    }
+
+    // Both lookups must return the same entry
+    int errcnt = 0, found = 0;
+    for (unsigned i = 0; i < models.size(); i++) {
+      const drive_settings * e1 = lookup_drive_linear(models[i].c_str(), firmwares[i].c_str());
+      const drive_settings * e2 = lookup_drive(models[i].c_str(), firmwares[i].c_str());
+      if (e1)
+        found++;
+      if (   !e1 != !e2
+          || (e1 && (   strcmp(e1->modelfamily, e2->modelfamily)
+                     || strcmp(e1->modelregexp, e2->modelregexp)))) {
+        printf("Mismatch for \"%s\", \"%s\": \"%s\" != \"%s\"\n",
+               models[i].c_str(), firmwares[i].c_str(),
+               (e1 ? e1->modelfamily : "(none)"), (e2 ? e2->modelfamily : "(none)"));
+        errcnt++;
+      }
+    }
+
+    printf("%s: %u entries, corpus: %u models, %d found\n",
+           argv[1], bench_knowndrives_size, (unsigned)models.size(), found);
+    if (errcnt) {
+      printf("%d mismatches\n", errcnt);
+      return 1;
+    }
+
+    unsigned rounds1, rounds2;
+    double t1 = time_lookups(lookup_drive_linear, models, firmwares, rounds1);
+    double t2 = time_lookups(lookup_drive, models, firmwares, rounds2);
+    printf("Linear search:  %10.3f us/lookup (%u rounds)\n", t1, rounds1);
+    printf("Indexed lookup: %10.3f us/lookup (%u rounds)\n", t2, rounds2);
+    if (t2 > 0)
+      printf("Speedup: %.1fx\n", t1 / t2);
+  }
+  catch (const std::exception & ex) {
+    printf("Exception: %s\n", ex.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * drivedb_gen.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Generator of the pre-parsed builtin drive database.
+// Writes the presets and model regexp prefixes of all entries of
+// drivedb.h as C++ tables to stdout.  The output 'drivedb_gen.h' is
+// included by drivedb_tables.cpp, so no presets are parsed at startup.
+// Run by 'make', not installed.
+
+#include "config.h"
+#include "int64.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "atacmds.h"
+#include "knowndrives.h"
+#include "utility.h"
+
+#include <stdexcept>
+
+const char * drivedb_gen_cpp_cvsid = "$Id$"
+  KNOWNDRIVES_H_CVSID;
+
+// Messages go to stderr, stdout is the generated file.
+void pout(const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+void checksumwarning(const char * /*string*/)
+{
+}
+
+// Replaces drivedb_tables.cpp, the builtin database is parsed
+const builtin_drive_info builtin_drive_infos[1] = { { { 0, 0, 0, 0 }, 0, 0 } };
+const unsigned builtin_drive_infos_size = 0;
+
+int main(int argc, char ** argv)
+{
+  if (argc != 1) {
+    fprintf(stderr, "Usage: %s > drivedb_gen.h\n", argv[0]);
+    return 1;
+  }
+
+  try {
+    if (!write_builtin_drive_tables(stdout) || fflush(stdout)) {
+      fprintf(stderr, "%s: cannot write tables\n", argv[0]);
+      return 1;
+    }
+  }
+  catch (const std::exception & ex) {
+    fprintf(stderr, "Exception: %s\n", ex.what());
+    return 1;
+  }
+
+  return 0;
+}
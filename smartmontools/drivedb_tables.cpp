@@ -0,0 +1,35 @@
+/*
+ * drivedb_tables.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Pre-parsed builtin drive database.  The tables are generated from
+// drivedb.h by drivedb_gen at build time.  Kept separate from
+// knowndrives.cpp which is also linked into drivedb_gen.
+
+#include "config.h"
+#include "int64.h"
+#include <stdio.h>
+#include "atacmds.h"
+#include "knowndrives.h"
+
+const char * drivedb_tables_cpp_cvsid = "$Id$"
+  KNOWNDRIVES_H_CVSID;
+
+#ifdef HAVE_DRIVEDB_GEN_H
+#include "drivedb_gen.h"
+#else
+// Not generated, builtin database is parsed at startup
+const builtin_drive_info builtin_drive_infos[1] = { { { 0, 0, 0, 0 }, 0, 0 } };
+const unsigned builtin_drive_infos_size = 0;
+#endif
@@ -23,13 +23,24 @@
 #include "knowndrives.h"
 #include "utility.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #ifdef _WIN32
 #include <io.h> // access()
 #endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
+#include <algorithm>
+#include <map>
 #include <stdexcept>
 
 const char * knowndrives_cpp_cvsid = "$Id$"
@@ -53,9 +64,39 @@ const drive_settings builtin_knowndrives[] = {
 const unsigned builtin_knowndrives_size =
   sizeof(builtin_knowndrives) / sizeof(builtin_knowndrives[0]);
 
+// Read-only memory mapping of a file.  Without mmap() support, the
+// file is read into memory.
+class mapped_file
+{
+public:
+  mapped_file()
+    : m_data(0), m_size(0) { }
+
+  ~mapped_file();
+
+  /// Map file at PATH, return false on error.
+  bool open(const char * path);
+
+  const char * data() const
+    { return m_data; }
+
+  size_t size() const
+    { return m_size; }
+
+private:
+  char * m_data;
+  size_t m_size;
+
+  mapped_file(const mapped_file &);
+  void operator=(const mapped_file &);
+};
+
 /// Drive database class. Stores custom entries read from file.
 /// Provides transparent access to concatenation of custom and
 /// default table.
+/// Regular expressions are compiled on first use and kept until the
+/// database changes.  ATA and USB entries are indexed by the literal
+/// prefixes of their model regular expressions.
 class drive_database
 {
 public:
@@ -77,25 +118,101 @@ public:
   /// Append new custom entry.
   void push_back(const drive_settings & src);
 
-  /// Append builtin table.
-  void append(const drive_settings * builtin_tab, unsigned builtin_size)
-    { m_builtin_tab = builtin_tab; m_builtin_size = builtin_size; }
+  /// Append custom entries of a compiled image.  The strings and
+  /// presets are used in place, FILE is deleted with the database.
+  void append_image(mapped_file * file, const std::vector<drive_settings> & entries,
+                    const std::vector<drive_presets> & presets);
+
+  /// Get pre-parsed presets of entry i, 0 if not available.
+  const drive_presets * get_presets(unsigned i) const;
+
+  /// Append builtin table.  If BUILTIN_INFO is specified, the
+  /// generated presets and prefixes are used instead of parsing.
+  void append(const drive_settings * builtin_tab, unsigned builtin_size,
+              const builtin_drive_info * builtin_info = 0)
+    { m_builtin_tab = builtin_tab; m_builtin_size = builtin_size;
+      m_builtin_info = builtin_info; invalidate_index(); }
+
+  /// Return true if MODEL fully matches the model regexp of entry i.
+  bool match_model(unsigned i, const char * model);
+
+  /// Return true if FIRMWARE fully matches the firmware regexp of entry i.
+  /// An empty firmware regexp matches always.
+  bool match_firmware(unsigned i, const char * firmware);
+
+  /// Search ATA entries (no DEFAULT or USB entries).
+  /// Returns index of first entry matching MODEL and FIRMWARE, -1 if none.
+  int find_ata_entry(const char * model, const char * firmware);
+
+  /// Search USB entries.  Sets CANDIDATES to the indices of all entries
+  /// whose model regexp may match USB_ID "0xVVVV:0xPPPP", in table order.
+  void find_usb_entries(const char * usb_id, std::vector<unsigned> & candidates);
+
+  /// Build model prefix index.  Called on first search if necessary.
+  void build_index();
+
+  /// Get presets of ATA entry i as applied to default constructed
+  /// definitions.  Parsed on first use, copies share the definitions.
+  /// Returns false on syntax error.
+  bool get_preset_defs(unsigned i, ata_vendor_attr_defs & defs,
+                       firmwarebug_defs & firmwarebugs);
 
 private:
   const drive_settings * m_builtin_tab;
   unsigned m_builtin_size;
+  const builtin_drive_info * m_builtin_info;
 
   std::vector<drive_settings> m_custom_tab;
+  std::vector<drive_presets> m_custom_presets;
   std::vector<char *> m_custom_strings;
+  std::vector<mapped_file *> m_images;
 
   const char * copy_string(const char * str);
 
+  // Compiled regular expressions of one entry.
+  struct entry_regex {
+    regular_expression model, firmware;
+    signed char model_state, firmware_state; // 0: not compiled, 1: ok, -1: error
+    entry_regex() : model_state(0), firmware_state(0) { }
+  };
+  std::vector<entry_regex> m_regex;
+
+  // Memoized presets of one entry.
+  struct entry_preset_defs {
+    ata_vendor_attr_defs defs;
+    firmwarebug_defs firmwarebugs;
+    signed char state; // 0: not parsed, 1: ok, -1: error
+    entry_preset_defs() : state(0) { }
+  };
+  std::vector<entry_preset_defs> m_preset_defs;
+
+  // Prefix index of ATA entries.  The key is the first (up to)
+  // prefix_key_len chars of each prefix, the value is the list of
+  // entry indices in table order.
+  enum { prefix_key_len = 4 };
+  typedef std::map<std::string, std::vector<unsigned> > prefix_map;
+  prefix_map m_prefix_index;
+  std::vector<unsigned> m_no_prefix; // Entries without a literal prefix
+  std::vector< std::vector<std::string> > m_prefixes; // Prefixes of each entry
+
+  // Index of USB entries.  The key is the full "0xVVVV:0xPPPP" ID
+  // (usb_id_len chars) or the "0xVVVV:" vendor part (usb_vendor_len
+  // chars) of each prefix.
+  enum { usb_id_len = 13, usb_vendor_len = 7 };
+  prefix_map m_usb_index;
+  std::vector<unsigned> m_usb_no_prefix; // USB entries without vendor prefix
+  bool m_index_valid;
+
+  entry_regex & get_regex(unsigned i);
+  void invalidate_index();
+
   drive_database(const drive_database &);
   void operator=(const drive_database &);
 };
 
 drive_database::drive_database()
-: m_builtin_tab(0), m_builtin_size(0)
+: m_builtin_tab(0), m_builtin_size(0), m_builtin_info(0),
+  m_index_valid(false)
 {
 }
 
@@ -103,6 +220,8 @@ drive_database::~drive_database()
 {
   for (unsigned i = 0; i < m_custom_strings.size(); i++)
     delete [] m_custom_strings[i];
+  for (unsigned i = 0; i < m_images.size(); i++)
+    delete m_images[i];
 }
 
 const drive_settings & drive_database::operator[](unsigned i)
@@ -120,6 +239,33 @@ void drive_database::push_back(const drive_settings & src)
   dest.warningmsg     = copy_string(src.warningmsg);
   dest.presets        = copy_string(src.presets);
   m_custom_tab.push_back(dest);
+  m_custom_presets.push_back(drive_presets());
+  invalidate_index();
+}
+
+void drive_database::append_image(mapped_file * file, const std::vector<drive_settings> & entries,
+                                  const std::vector<drive_presets> & presets)
+{
+  try {
+    m_images.push_back(file);
+  }
+  catch (...) {
+    delete file; throw;
+  }
+  m_custom_tab.insert(m_custom_tab.end(), entries.begin(), entries.end());
+  m_custom_presets.insert(m_custom_presets.end(), presets.begin(), presets.end());
+  invalidate_index();
+}
+
+const drive_presets * drive_database::get_presets(unsigned i) const
+{
+  if (i < m_custom_presets.size()) {
+    if (m_custom_presets[i].pool)
+      return &m_custom_presets[i];
+  }
+  else if (m_builtin_info && i - m_custom_presets.size() < m_builtin_size)
+    return &m_builtin_info[i - m_custom_presets.size()].presets;
+  return 0;
 }
 
 const char * drive_database::copy_string(const char * src)
@@ -136,7 +282,6 @@ const char * drive_database::copy_string(const char * src)
   return dest;
 }
 
-
 /// The drive database.
 static drive_database knowndrives;
 
@@ -175,46 +320,442 @@ static bool compile(regular_expression & regex, const char *pattern)
   return true;
 }
 
-// Compile & match a regular expression.
-static bool match(const char * pattern, const char * str)
+// Literal prefix of a regular expression.  'complete' is set if the
+// (sub)expression consists of this string only.
+struct regex_prefix
 {
-  regular_expression regex;
-  if (!compile(regex, pattern))
-    return false;
-  return regex.full_match(str);
+  std::string str;
+  bool complete;
+
+  explicit regex_prefix(const std::string & s = "", bool c = true)
+    : str(s), complete(c) { }
+};
+
+typedef std::vector<regex_prefix> regex_prefix_list;
+
+// Max number of alternative prefixes per expression.
+const unsigned max_regex_prefixes = 64;
+
+// Skip bracket expression "[...]", return pointer behind it.
+static const char * skip_bracket_expr(const char * p, const char * end)
+{
+  p++;
+  if (p < end && *p == '^')
+    p++;
+  if (p < end && *p == ']')
+    p++;
+  while (p < end && *p != ']') {
+    if (*p == '[' && p + 1 < end && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+      // Skip "[:class:]", "[.coll.]", "[=equiv=]"
+      char c = p[1];
+      for (p += 2; p + 1 < end && !(p[0] == c && p[1] == ']'); p++) ;
+      p += 2;
+      continue;
+    }
+    p++;
+  }
+  return (p < end ? p + 1 : end);
 }
 
-// Searches knowndrives[] for a drive with the given model number and firmware
-// string.  If either the drive's model or firmware strings are not set by the
-// manufacturer then values of NULL may be used.  Returns the entry of the
-// first match in knowndrives[] or 0 if no match if found.
-static const drive_settings * lookup_drive(const char * model, const char * firmware)
+// Find closing parenthesis, return 0 if missing.
+static const char * find_closing_paren(const char * p, const char * end)
 {
-  if (!model)
-    model = "";
-  if (!firmware)
-    firmware = "";
+  int depth = 0;
+  while (p < end) {
+    switch (*p) {
+      case '\\': p += 2; continue;
+      case '[': p = skip_bracket_expr(p, end); continue;
+      case '(': depth++; break;
+      case ')':
+        if (!--depth)
+          return p;
+        break;
+    }
+    p++;
+  }
+  return 0;
+}
 
-  for (unsigned i = 0; i < knowndrives.size(); i++) {
-    // Skip DEFAULT and USB entries
-    if (get_dbentry_type(&knowndrives[i]) != DBENTRY_ATA)
+// Replace list by its longest common prefix.
+static void merge_regex_prefixes(regex_prefix_list & prefixes)
+{
+  if (prefixes.empty())
+    return;
+  std::string common = prefixes[0].str;
+  for (unsigned i = 1; i < prefixes.size(); i++) {
+    const std::string & s = prefixes[i].str;
+    unsigned n = 0;
+    while (n < common.size() && n < s.size() && common[n] == s[n])
+      n++;
+    common.erase(n);
+  }
+  prefixes.assign(1, regex_prefix(common, false));
+}
+
+static void get_alt_regex_prefixes(const char * p, const char * end,
+                                   regex_prefix_list & prefixes);
+
+// Get literal prefixes of a concatenation of atoms.
+static void get_seq_regex_prefixes(const char * p, const char * end,
+                                   regex_prefix_list & prefixes)
+{
+  prefixes.assign(1, regex_prefix());
+  if (p < end && *p == '^')
+    p++;
+
+  while (p < end) {
+    bool any_complete = false;
+    for (unsigned i = 0; i < prefixes.size() && !any_complete; i++)
+      any_complete = prefixes[i].complete;
+    if (!any_complete)
+      break;
+
+    // Get prefixes of next atom
+    regex_prefix_list atom;
+    if (*p == '(') {
+      const char * q = find_closing_paren(p, end);
+      if (!q)
+        break;
+      get_alt_regex_prefixes(p + 1, q, atom);
+      p = q + 1;
+    }
+    else if (*p == '\\') {
+      // Only escaped special chars are literals, "\<", "\w", ... are not
+      if (!(p + 1 < end && strchr(".[\\()*+?{|^$", p[1])))
+        break;
+      atom.push_back(regex_prefix(std::string(1, p[1])));
+      p += 2;
+    }
+    else if (!strchr(".[)*+?{|^$", *p)) {
+      atom.push_back(regex_prefix(std::string(1, *p)));
+      p++;
+    }
+    else
+      break;
+
+    // Check for repetition
+    bool stop = false;
+    if (p < end) {
+      if (*p == '?') {
+        atom.push_back(regex_prefix());
+        p++;
+      }
+      else if (*p == '*' || *p == '{')
+        break;
+      else if (*p == '+') {
+        for (unsigned i = 0; i < atom.size(); i++)
+          atom[i].complete = false;
+        stop = true;
+      }
+    }
+
+    // Append atom to complete prefixes
+    regex_prefix_list next;
+    for (unsigned i = 0; i < prefixes.size(); i++) {
+      if (!prefixes[i].complete) {
+        next.push_back(prefixes[i]);
+        continue;
+      }
+      for (unsigned j = 0; j < atom.size(); j++)
+        next.push_back(regex_prefix(prefixes[i].str + atom[j].str, atom[j].complete));
+    }
+    prefixes.swap(next);
+
+    if (prefixes.size() > max_regex_prefixes) {
+      merge_regex_prefixes(prefixes);
+      return;
+    }
+    if (stop)
+      return;
+  }
+
+  if (p < end) {
+    for (unsigned i = 0; i < prefixes.size(); i++)
+      prefixes[i].complete = false;
+  }
+}
+
+// Get literal prefixes of alternatives "A|B|...".
+static void get_alt_regex_prefixes(const char * p, const char * end,
+                                   regex_prefix_list & prefixes)
+{
+  std::vector<regex_prefix_list> branches;
+  unsigned cnt = 0;
+  int depth = 0;
+  for (const char * q = p, * start = p; ; ) {
+    if (q >= end || (*q == '|' && !depth)) {
+      branches.push_back(regex_prefix_list());
+      get_seq_regex_prefixes(start, (q < end ? q : end), branches.back());
+      cnt += branches.back().size();
+      if (q >= end)
+        break;
+      start = ++q;
       continue;
+    }
+    switch (*q) {
+      case '\\': q += 2; continue;
+      case '[': q = skip_bracket_expr(q, end); continue;
+      case '(': depth++; break;
+      case ')': depth--; break;
+    }
+    q++;
+  }
+
+  // Too many alternatives: Use common prefix of each branch
+  bool merge_all = (branches.size() > max_regex_prefixes);
+  if (cnt > max_regex_prefixes && !merge_all) {
+    for (unsigned i = 0; i < branches.size(); i++)
+      merge_regex_prefixes(branches[i]);
+  }
 
-    // Check whether model matches the regular expression in knowndrives[i].
-    if (!match(knowndrives[i].modelregexp, model))
+  prefixes.clear();
+  for (unsigned i = 0; i < branches.size(); i++)
+    prefixes.insert(prefixes.end(), branches[i].begin(), branches[i].end());
+  if (merge_all)
+    merge_regex_prefixes(prefixes);
+}
+
+// Get literal prefixes of extended regular expression PATTERN.
+// Any string fully matching PATTERN starts with one of these prefixes.
+// Returns an empty prefix if no literal prefix is known.
+static void get_regex_prefixes(const char * pattern, std::vector<std::string> & prefixes)
+{
+  regex_prefix_list list;
+  get_alt_regex_prefixes(pattern, pattern + strlen(pattern), list);
+  prefixes.clear();
+  for (unsigned i = 0; i < list.size(); i++)
+    prefixes.push_back(list[i].str);
+  std::sort(prefixes.begin(), prefixes.end());
+  prefixes.erase(std::unique(prefixes.begin(), prefixes.end()), prefixes.end());
+}
+
+void drive_database::invalidate_index()
+{
+  m_regex.clear();
+  m_preset_defs.clear();
+  m_prefix_index.clear();
+  m_no_prefix.clear();
+  m_prefixes.clear();
+  m_usb_index.clear();
+  m_usb_no_prefix.clear();
+  m_index_valid = false;
+}
+
+// Get (possibly not yet compiled) regular expressions of entry i.
+drive_database::entry_regex & drive_database::get_regex(unsigned i)
+{
+  if (m_regex.size() != size())
+    m_regex.resize(size());
+  return m_regex[i];
+}
+
+bool drive_database::match_model(unsigned i, const char * model)
+{
+  entry_regex & re = get_regex(i);
+  if (!re.model_state)
+    re.model_state = (compile(re.model, (*this)[i].modelregexp) ? 1 : -1);
+  return (re.model_state > 0 && re.model.full_match(model));
+}
+
+bool drive_database::match_firmware(unsigned i, const char * firmware)
+{
+  const char * pattern = (*this)[i].firmwareregexp;
+  if (!*pattern)
+    return true;
+  entry_regex & re = get_regex(i);
+  if (!re.firmware_state)
+    re.firmware_state = (compile(re.firmware, pattern) ? 1 : -1);
+  return (re.firmware_state > 0 && re.firmware.full_match(firmware));
+}
+
+void drive_database::build_index()
+{
+  invalidate_index();
+  m_prefixes.resize(size());
+
+  for (unsigned i = 0; i < size(); i++) {
+    const drive_settings & dbentry = (*this)[i];
+    dbentry_type type = get_dbentry_type(&dbentry);
+    if (type == DBENTRY_ATA_DEFAULT)
+      continue;
+
+    std::vector<std::string> & prefixes = m_prefixes[i];
+    if (m_builtin_info && i >= custom_size()) {
+      // Use prefixes generated at build time
+      const builtin_drive_info & info = m_builtin_info[i - custom_size()];
+      prefixes.assign(info.prefixes, info.prefixes + info.num_prefixes);
+    }
+    else
+      get_regex_prefixes(dbentry.modelregexp, prefixes);
+    if (prefixes.empty() || prefixes[0].empty()) {
+      // Sorted, so an empty prefix would be first
+      prefixes.clear();
+      (type == DBENTRY_USB ? m_usb_no_prefix : m_no_prefix).push_back(i);
+      continue;
+    }
+
+    if (type == DBENTRY_USB) {
+      // Index by full ID or by vendor, entries with shorter
+      // prefixes are always candidates
+      bool indexed = true;
+      for (unsigned j = 0; j < prefixes.size() && indexed; j++)
+        indexed = (prefixes[j].size() >= usb_vendor_len);
+      if (!indexed) {
+        m_usb_no_prefix.push_back(i);
+        continue;
+      }
+      for (unsigned j = 0; j < prefixes.size(); j++) {
+        unsigned len = (prefixes[j].size() >= usb_id_len ? usb_id_len : usb_vendor_len);
+        std::vector<unsigned> & list = m_usb_index[prefixes[j].substr(0, len)];
+        if (list.empty() || list.back() != i)
+          list.push_back(i);
+      }
+      continue;
+    }
+
+    for (unsigned j = 0; j < prefixes.size(); j++) {
+      std::vector<unsigned> & list = m_prefix_index[prefixes[j].substr(0, prefix_key_len)];
+      if (list.empty() || list.back() != i)
+        list.push_back(i);
+    }
+  }
+
+  m_index_valid = true;
+}
+
+int drive_database::find_ata_entry(const char * model, const char * firmware)
+{
+  if (!m_index_valid)
+    build_index();
+
+  // Candidate lists: entries without prefix and entries with
+  // a prefix key matching the start of the model string.
+  const std::vector<unsigned> * lists[1 + prefix_key_len];
+  unsigned pos[1 + prefix_key_len];
+  int num_lists = 0;
+  lists[num_lists] = &m_no_prefix; pos[num_lists++] = 0;
+
+  std::string key;
+  for (int k = 0; k < prefix_key_len && model[k]; k++) {
+    key += model[k];
+    prefix_map::const_iterator it = m_prefix_index.find(key);
+    if (it != m_prefix_index.end()) {
+      lists[num_lists] = &it->second; pos[num_lists++] = 0;
+    }
+  }
+
+  // Merge candidate lists to check entries in table order
+  for (;;) {
+    unsigned i = ~0U;
+    for (int l = 0; l < num_lists; l++) {
+      if (pos[l] < lists[l]->size() && (*lists[l])[pos[l]] < i)
+        i = (*lists[l])[pos[l]];
+    }
+    if (i == ~0U)
+      return -1;
+    for (int l = 0; l < num_lists; l++) {
+      if (pos[l] < lists[l]->size() && (*lists[l])[pos[l]] == i)
+        pos[l]++;
+    }
+
+    // Check full prefix first
+    const std::vector<std::string> & prefixes = m_prefixes[i];
+    if (!prefixes.empty()) {
+      unsigned j;
+      for (j = 0; j < prefixes.size(); j++) {
+        if (str_starts_with(model, prefixes[j].c_str()))
+          break;
+      }
+      if (j >= prefixes.size())
+        continue;
+    }
+
+    // Check whether model matches the regular expression of the entry.
+    if (!match_model(i, model))
       continue;
 
     // Model matches, now check firmware. "" matches always.
-    if (!(  !*knowndrives[i].firmwareregexp
-          || match(knowndrives[i].firmwareregexp, firmware)))
+    if (!match_firmware(i, firmware))
       continue;
 
-    // Found
-    return &knowndrives[i];
+    return i;
   }
+}
 
-  // Not found
-  return 0;
+void drive_database::find_usb_entries(const char * usb_id, std::vector<unsigned> & candidates)
+{
+  if (!m_index_valid)
+    build_index();
+
+  // Entries without vendor prefix and entries indexed by full ID or vendor
+  candidates = m_usb_no_prefix;
+  std::string id(usb_id);
+  for (int k = 0; k < 2; k++) {
+    prefix_map::const_iterator it = m_usb_index.find(id.substr(0, (!k ? usb_id_len : usb_vendor_len)));
+    if (it != m_usb_index.end())
+      candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  // Remove entries without a matching full prefix
+  unsigned n = 0;
+  for (unsigned c = 0; c < candidates.size(); c++) {
+    const std::vector<std::string> & prefixes = m_prefixes[candidates[c]];
+    bool match = prefixes.empty();
+    for (unsigned j = 0; j < prefixes.size() && !match; j++)
+      match = str_starts_with(usb_id, prefixes[j].c_str());
+    if (match)
+      candidates[n++] = candidates[c];
+  }
+  candidates.resize(n);
+}
+
+#ifdef HAVE_PTHREADS
+// Protects lazy compilation of regular expressions and index,
+// smartctl queries several devices in parallel.
+static pthread_mutex_t knowndrives_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Scoped lock of knowndrives_mutex, no-op without thread support.
+class knowndrives_lock
+{
+public:
+  knowndrives_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_lock(&knowndrives_mutex);
+#endif
+    }
+
+  ~knowndrives_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_unlock(&knowndrives_mutex);
+#endif
+    }
+
+private:
+  knowndrives_lock(const knowndrives_lock &);
+  void operator=(const knowndrives_lock &);
+};
+
+// Searches knowndrives[] for a drive with the given model number and firmware
+// string.  If either the drive's model or firmware strings are not set by the
+// manufacturer then values of NULL may be used.  Returns the entry of the
+// first match in knowndrives[] or 0 if no match if found.
+const drive_settings * lookup_drive(const char * model, const char * firmware)
+{
+  if (!model)
+    model = "";
+  if (!firmware)
+    firmware = "";
+
+  knowndrives_lock lock;
+  int i = knowndrives.find_ata_entry(model, firmware);
+  if (i < 0)
+    return 0;
+  return &knowndrives[i];
 }
 
 
@@ -275,6 +816,94 @@ static inline bool parse_usb_type(const char * presets, std::string & type)
   return parse_db_presets(presets, 0, 0, &type);
 }
 
+// Apply pre-parsed presets with PRIORITY, same as parse_db_presets().
+static void apply_presets(const drive_presets & presets, ata_vendor_def_prior priority,
+                          ata_vendor_attr_defs & defs, firmwarebug_defs & firmwarebugs)
+{
+  for (unsigned i = 0; i < presets.num_attrs; i++) {
+    const drive_attr_preset & ap = presets.attrs[i];
+    if (defs[ap.id].priority > priority)
+      continue;
+    ata_vendor_attr_defs::entry & e = defs.modify(ap.id);
+    if (ap.name)
+      e.name = presets.pool + ap.name;
+    e.raw_format = (ata_attr_raw_format)ap.raw_format;
+    e.priority = priority;
+    e.flags = ap.flags;
+    memcpy(e.byteorder, ap.byteorder, sizeof(e.byteorder));
+  }
+
+  // Don't set if user specified '-F none'.
+  if (presets.firmwarebugs && !firmwarebugs.is_set(BUG_NONE)) {
+    for (int b = BUG_NONE; b <= BUG_XERRORLBA; b++) {
+      if (presets.firmwarebugs & (1 << b))
+        firmwarebugs.set((firmwarebug_t)b);
+    }
+  }
+}
+
+// Get bit mask of firmwarebug_t.
+static unsigned get_firmwarebug_mask(const firmwarebug_defs & bugs)
+{
+  unsigned mask = 0;
+  for (int b = BUG_NONE; b <= BUG_XERRORLBA; b++) {
+    if (bugs.is_set((firmwarebug_t)b))
+      mask |= (1 << b);
+  }
+  return mask;
+}
+
+bool drive_database::get_preset_defs(unsigned i, ata_vendor_attr_defs & defs,
+                                     firmwarebug_defs & firmwarebugs)
+{
+  if (m_preset_defs.size() != size())
+    m_preset_defs.resize(size());
+  entry_preset_defs & pd = m_preset_defs[i];
+  if (!pd.state) {
+    const drive_presets * presets = get_presets(i);
+    if (presets) {
+      apply_presets(*presets, PRIOR_DATABASE, pd.defs, pd.firmwarebugs);
+      pd.state = 1;
+    }
+    else
+      pd.state = (parse_presets((*this)[i].presets, pd.defs, pd.firmwarebugs) ? 1 : -1);
+  }
+  defs = pd.defs;
+  firmwarebugs = pd.firmwarebugs;
+  return (pd.state > 0);
+}
+
+// Parse '-v' and '-F' options of a DEFAULT or ATA entry for
+// pre-parsing.  Attributes not changed by the presets keep the
+// default entry.  Return false on error.
+static bool preparse_presets(const drive_settings & dbentry, ata_vendor_attr_defs & defs,
+                             unsigned & firmwarebugs)
+{
+  firmwarebug_defs bugs;
+  switch (get_dbentry_type(&dbentry)) {
+    case DBENTRY_ATA_DEFAULT:
+      if (!parse_default_presets(dbentry.presets, defs))
+        return false;
+      break;
+    case DBENTRY_ATA:
+      if (!parse_presets(dbentry.presets, defs, bugs))
+        return false;
+      break;
+    default:
+      break;
+  }
+
+  firmwarebugs = get_firmwarebug_mask(bugs);
+  return true;
+}
+
+// Return true if attribute definition differs from default.
+static inline bool is_preset_attr(const ata_vendor_attr_defs::entry & e)
+{
+  return (   e.priority != PRIOR_DEFAULT || !e.name.empty()
+          || e.raw_format != RAWFMT_DEFAULT || e.flags || e.byteorder[0]);
+}
+
 // Parse "USB: [DEVICE] ; [BRIDGE]" string
 static void parse_usb_names(const char * names, usb_dev_info & info)
 {
@@ -300,16 +929,16 @@ int lookup_usb_device(int vendor_id, int product_id, int bcd_device,
   else
     bcd_dev_str[0] = 0;
 
+  knowndrives_lock lock;
+  std::vector<unsigned> candidates;
+  knowndrives.find_usb_entries(usb_id_str, candidates);
   int found = 0;
-  for (unsigned i = 0; i < knowndrives.size(); i++) {
+  for (unsigned c = 0; c < candidates.size(); c++) {
+    unsigned i = candidates[c];
     const drive_settings & dbentry = knowndrives[i];
 
-    // Skip drive entries
-    if (get_dbentry_type(&dbentry) != DBENTRY_USB)
-      continue;
-
     // Check whether USB vendor:product ID matches
-    if (!match(dbentry.modelregexp, usb_id_str))
+    if (!knowndrives.match_model(i, usb_id_str))
       continue;
 
     // Parse '-d type'
@@ -321,7 +950,7 @@ int lookup_usb_device(int vendor_id, int product_id, int bcd_device,
     // If two entries with same vendor:product ID have different
     // types, use bcd_device (if provided by OS) to select entry.
     if (  *dbentry.firmwareregexp && *bcd_dev_str
-        && match(dbentry.firmwareregexp, bcd_dev_str)) {
+        && knowndrives.match_firmware(i, bcd_dev_str)) {
       // Exact match including bcd_device
       info = d; found = 1;
       break;
@@ -498,11 +1127,10 @@ int showmatchingpresets(const char *model, const char *firmware)
   const char * firmwaremsg = (firmware ? firmware : "(any)");
 
   for (unsigned i = 0; i < knowndrives.size(); i++) {
-    if (!match(knowndrives[i].modelregexp, model))
+    if (!knowndrives.match_model(i, model))
+      continue;
+    if (firmware && !knowndrives.match_firmware(i, firmware))
       continue;
-    if (   firmware && *knowndrives[i].firmwareregexp
-        && !match(knowndrives[i].firmwareregexp, firmware))
-        continue;
     // Found
     if (++cnt == 1)
       pout("Drive found in smartmontools Database.  Drive identity strings:\n"
@@ -569,11 +1197,27 @@ const drive_settings * lookup_drive_apply_presets(
   ata_format_id_string(firmware, drive->fw_rev, sizeof(firmware)-1);
 
   // Look up the drive in knowndrives[].
-  const drive_settings * dbentry = lookup_drive(model, firmware);
-  if (!dbentry)
+  knowndrives_lock lock;
+  int i = knowndrives.find_ata_entry(model, firmware);
+  if (i < 0)
     return 0;
+  const drive_settings * dbentry = &knowndrives[i];
 
-  if (*dbentry->presets) {
+  const drive_presets * presets = knowndrives.get_presets(i);
+  if (defs.empty()) {
+    // No '-v' options, share memoized presets of entry
+    firmwarebug_defs bugs;
+    if (!knowndrives.get_preset_defs(i, defs, bugs))
+      pout("Syntax error in preset option string \"%s\"\n", dbentry->presets);
+    // Don't set if user specified '-F none'.
+    if (!firmwarebugs.is_set(BUG_NONE))
+      firmwarebugs.set(bugs);
+  }
+  else if (presets) {
+    // Apply pre-parsed presets from compiled image or builtin tables
+    apply_presets(*presets, PRIOR_DATABASE, defs, firmwarebugs);
+  }
+  else if (*dbentry->presets) {
     // Apply presets
     if (!parse_presets(dbentry->presets, defs, firmwarebugs))
       pout("Syntax error in preset option string \"%s\"\n", dbentry->presets);
@@ -852,9 +1496,332 @@ static bool parse_drive_database(parse_ptr src, drive_database & db, const char
   return ok;
 }
 
+
+/////////////////////////////////////////////////////////////////////////////
+// Compiled drive database images
+
+// A database file PATH may be compiled into an image PATH.bin by
+// 'smartctl --drivedb-compile'.  The image contains a string pool, the
+// table of entries with offsets into the pool and the pre-parsed
+// presets of each entry.  It is mapped into memory and used in place
+// if the size and modification time (or the hash) of the text file
+// still match the values recorded in the image.  The image is specific
+// to the byte order of the host and to the version of the format.
+
+#define DRIVEDB_IMAGE_MAGIC "SMARTDDB"
+
+// Increase if the format or the meaning of pre-parsed values
+// (ata_attr_raw_format, ATTRFLAG_*, firmwarebug_t) changes.
+const uint32_t DRIVEDB_IMAGE_VERSION = 1;
+
+// Layout: header, entries, attribute presets, string pool.
+struct drivedb_image_header
+{
+  char magic[8];                // DRIVEDB_IMAGE_MAGIC
+  uint32_t version;             // DRIVEDB_IMAGE_VERSION
+  uint32_t byte_order;          // 0x01020304 in byte order of host
+  uint64_t source_size;         // Size of text file
+  int64_t source_mtime;         // Modification time of text file
+  uint64_t source_hash;         // FNV-1a hash of text file
+  uint32_t num_entries;
+  uint32_t num_attrs;
+  uint32_t pool_size;           // Starts with empty string, ends with null char
+  uint32_t reserved;
+};
+
+struct drivedb_image_entry
+{
+  uint32_t strings[5];          // Offsets of drive_settings strings in pool
+  uint32_t first_attr;          // Index of first attribute preset
+  uint32_t num_attrs;           // Number of attribute presets
+  uint32_t firmwarebugs;        // Bit mask of firmwarebug_t
+};
+
+mapped_file::~mapped_file()
+{
+  if (!m_data)
+    return;
+#ifdef HAVE_MMAP
+  munmap(m_data, m_size);
+#else
+  delete [] m_data;
+#endif
+}
+
+bool mapped_file::open(const char * path)
+{
+#ifdef HAVE_MMAP
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void * p = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size > 0)
+    p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  m_data = (char *)p;
+  m_size = st.st_size;
+#else
+  stdio_file f(path, "rb");
+  if (!f)
+    return false;
+  struct stat st;
+  if (fstat(fileno(f), &st) || st.st_size <= 0)
+    return false;
+  char * p = new char[st.st_size];
+  if (fread(p, 1, st.st_size, f) != (size_t)st.st_size) {
+    delete [] p;
+    return false;
+  }
+  m_data = p;
+  m_size = st.st_size;
+#endif
+  return true;
+}
+
+// Get FNV-1a hash of file, return false on error.
+static bool get_file_hash(const char * path, uint64_t & hash)
+{
+  stdio_file f(path, "rb");
+  if (!f)
+    return false;
+  hash = 0xcbf29ce484222325ULL;
+  char buf[8192];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (size_t i = 0; i < n; i++)
+      hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+  }
+  return !ferror(f);
+}
+
+// Get path of compiled image of database file PATH.
+std::string get_drivedb_image_path(const char * path)
+{
+  return std::string(path) + ".bin";
+}
+
+// Read compiled image of database file PATH if it is up to date.
+// Returns false if no image is available, the caller then parses
+// the text file.
+static bool read_drive_database_image(const char * path)
+{
+  struct stat st;
+  if (stat(path, &st))
+    return false;
+  std::string img_path = get_drivedb_image_path(path);
+  mapped_file * img = new mapped_file;
+  if (!img->open(img_path.c_str())) {
+    delete img;
+    return false;
+  }
+
+  // Check header and sizes
+  const char * data = img->data();
+  size_t size = img->size();
+  const drivedb_image_header * hdr = (const drivedb_image_header *)data;
+  size_t entries_offset = sizeof(drivedb_image_header);
+  size_t attrs_offset = 0, pool_offset = 0;
+  bool ok = false;
+  if (   size >= sizeof(drivedb_image_header)
+      && !memcmp(hdr->magic, DRIVEDB_IMAGE_MAGIC, sizeof(hdr->magic))
+      && hdr->version == DRIVEDB_IMAGE_VERSION
+      && hdr->byte_order == 0x01020304) {
+    attrs_offset = entries_offset + (uint64_t)hdr->num_entries * sizeof(drivedb_image_entry);
+    pool_offset = attrs_offset + (uint64_t)hdr->num_attrs * sizeof(drive_attr_preset);
+    ok = (   hdr->pool_size > 0 && pool_offset + hdr->pool_size == size
+          && !data[pool_offset] && !data[size - 1]);
+  }
+
+  if (!ok) {
+    pout("%s: invalid drive database image, ignored\n", img_path.c_str());
+    delete img;
+    return false;
+  }
+
+  // Check whether text file is unchanged.  The mtime is not sufficient
+  // if the file was modified in the same second the image was written.
+  struct stat img_st;
+  if (!(   hdr->source_size == (uint64_t)st.st_size
+        && hdr->source_mtime == (int64_t)st.st_mtime
+        && !stat(img_path.c_str(), &img_st) && st.st_mtime < img_st.st_mtime)) {
+    uint64_t hash;
+    if (!(   hdr->source_size == (uint64_t)st.st_size
+          && get_file_hash(path, hash) && hdr->source_hash == hash)) {
+      pout("%s: drive database image is outdated, ignored\n", img_path.c_str());
+      delete img;
+      return false;
+    }
+  }
+
+  // Check offsets and build entry table pointing into the pool
+  const drivedb_image_entry * img_entries = (const drivedb_image_entry *)(data + entries_offset);
+  const drive_attr_preset * img_attrs = (const drive_attr_preset *)(data + attrs_offset);
+  const char * pool = data + pool_offset;
+  std::vector<drive_settings> entries(hdr->num_entries);
+  std::vector<drive_presets> presets(hdr->num_entries);
+  for (unsigned i = 0; i < hdr->num_entries && ok; i++) {
+    const drivedb_image_entry & ie = img_entries[i];
+    for (int j = 0; j < 5; j++) {
+      if (ie.strings[j] >= hdr->pool_size)
+        ok = false;
+    }
+    if (!(ie.first_attr <= hdr->num_attrs && ie.num_attrs <= hdr->num_attrs - ie.first_attr))
+      ok = false;
+    if (!ok)
+      break;
+    drive_settings & e = entries[i];
+    e.modelfamily    = pool + ie.strings[0];
+    e.modelregexp    = pool + ie.strings[1];
+    e.firmwareregexp = pool + ie.strings[2];
+    e.warningmsg     = pool + ie.strings[3];
+    e.presets        = pool + ie.strings[4];
+    drive_presets & p = presets[i];
+    p.pool = pool;
+    p.attrs = img_attrs + ie.first_attr;
+    p.num_attrs = ie.num_attrs;
+    p.firmwarebugs = ie.firmwarebugs;
+  }
+  for (unsigned i = 0; i < hdr->num_attrs && ok; i++) {
+    const drive_attr_preset & ap = img_attrs[i];
+    if (!(   ap.name < hdr->pool_size && ap.raw_format <= RAWFMT_TEMP10X
+          && memchr(ap.byteorder, 0, sizeof(ap.byteorder))))
+      ok = false;
+  }
+  if (!ok) {
+    pout("%s: invalid drive database image, ignored\n", img_path.c_str());
+    delete img;
+    return false;
+  }
+
+  knowndrives.append_image(img, entries, presets);
+  return true;
+}
+
+typedef std::map<std::string, uint32_t> pool_index_map;
+
+// Add string to pool unless already present, return offset.
+static uint32_t add_pool_string(std::string & pool, pool_index_map & index, const char * str)
+{
+  if (!*str)
+    return 0;
+  pool_index_map::const_iterator it = index.find(str);
+  if (it != index.end())
+    return it->second;
+  uint32_t offset = pool.size();
+  index[str] = offset;
+  pool.append(str, strlen(str) + 1);
+  return offset;
+}
+
+// Append attribute definitions set by presets to ATTRS.
+static void add_attr_presets(const ata_vendor_attr_defs & defs, std::string & pool,
+                             pool_index_map & pool_index, std::vector<drive_attr_preset> & attrs)
+{
+  for (int id = 0; id < MAX_ATTRIBUTE_NUM; id++) {
+    const ata_vendor_attr_defs::entry & e = defs[id];
+    if (!is_preset_attr(e))
+      continue;
+    drive_attr_preset ap;
+    memset(&ap, 0, sizeof(ap));
+    ap.id = id;
+    ap.raw_format = e.raw_format;
+    ap.flags = e.flags;
+    memcpy(ap.byteorder, e.byteorder, sizeof(ap.byteorder));
+    ap.name = add_pool_string(pool, pool_index, e.name.c_str());
+    attrs.push_back(ap);
+  }
+}
+
+// Write image of database DB read from file PATH.
+static bool write_drive_database_image(const char * path, const struct stat & st,
+                                       uint64_t hash, drive_database & db)
+{
+  std::string pool(1, '\0');
+  pool_index_map pool_index;
+  std::vector<drivedb_image_entry> entries(db.size());
+  std::vector<drive_attr_preset> attrs;
+
+  for (unsigned i = 0; i < db.size(); i++) {
+    const drive_settings & dbentry = db[i];
+    const char * strings[5] = { dbentry.modelfamily, dbentry.modelregexp,
+      dbentry.firmwareregexp, dbentry.warningmsg, dbentry.presets };
+
+    // Pre-parse presets
+    ata_vendor_attr_defs defs;
+    unsigned firmwarebugs = 0;
+    if (!preparse_presets(dbentry, defs, firmwarebugs)) {
+      pout("%s: Syntax error in preset option string \"%s\"\n", path, dbentry.presets);
+      return false;
+    }
+
+    drivedb_image_entry & ie = entries[i];
+    ie.first_attr = attrs.size();
+    ie.firmwarebugs = firmwarebugs;
+    add_attr_presets(defs, pool, pool_index, attrs);
+    ie.num_attrs = attrs.size() - ie.first_attr;
+
+    // Add strings to pool, share duplicates
+    for (int j = 0; j < 5; j++)
+      ie.strings[j] = add_pool_string(pool, pool_index, strings[j]);
+  }
+
+  drivedb_image_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DRIVEDB_IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.version = DRIVEDB_IMAGE_VERSION;
+  hdr.byte_order = 0x01020304;
+  hdr.source_size = st.st_size;
+  hdr.source_mtime = st.st_mtime;
+  hdr.source_hash = hash;
+  hdr.num_entries = entries.size();
+  hdr.num_attrs = attrs.size();
+  hdr.pool_size = pool.size();
+
+  // Write to temporary file, then replace image
+  std::string img_path = get_drivedb_image_path(path);
+  std::string tmp_path = img_path + ".new";
+  {
+    stdio_file f(tmp_path.c_str(), "wb");
+    if (!f) {
+      pout("%s: cannot create drive database image: %s\n", tmp_path.c_str(), strerror(errno));
+      return false;
+    }
+    bool ok = (   fwrite(&hdr, sizeof(hdr), 1, f) == 1
+               && (entries.empty() || fwrite(&entries[0], sizeof(entries[0]), entries.size(), f) == entries.size())
+               && (attrs.empty() || fwrite(&attrs[0], sizeof(attrs[0]), attrs.size(), f) == attrs.size())
+               && fwrite(pool.data(), 1, pool.size(), f) == pool.size());
+    if (!f.close() || !ok) {
+      pout("%s: write error\n", tmp_path.c_str());
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+#ifdef _WIN32
+  unlink(img_path.c_str()); // rename() does not replace
+#endif
+  if (rename(tmp_path.c_str(), img_path.c_str())) {
+    pout("%s: cannot rename to %s: %s\n", tmp_path.c_str(), img_path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  pout("%s: %u entries compiled to %s\n", path, db.size(), img_path.c_str());
+  return true;
+}
+
+// Paths of drive database files read so far, for '--drivedb-compile'
+static std::vector<std::string> drivedb_paths_read;
+
 // Read drive database from file.
 bool read_drive_database(const char * path)
 {
+  drivedb_paths_read.push_back(path);
+  if (read_drive_database_image(path))
+    return true;
+
   stdio_file f(path, "r"
 #ifdef __CYGWIN__ // Allow files with '\r\n'.
                       "t"
@@ -868,6 +1835,35 @@ bool read_drive_database(const char * path)
   return parse_drive_database(parse_ptr(f), knowndrives, path);
 }
 
+// Compile drive database file PATH into an image.
+static bool compile_drive_database(const char * path)
+{
+  struct stat st; uint64_t hash;
+  if (stat(path, &st) || !get_file_hash(path, hash)) {
+    pout("%s: cannot open drive database file\n", path);
+    return false;
+  }
+
+  drive_database db;
+  {
+    stdio_file f(path, "r"
+#ifdef __CYGWIN__ // Allow files with '\r\n'.
+                        "t"
+#endif
+                           );
+    if (!f) {
+      pout("%s: cannot open drive database file\n", path);
+      return false;
+    }
+    if (!parse_drive_database(parse_ptr(f), db, path)) {
+      pout("%s: not compiled due to errors\n", path);
+      return false;
+    }
+  }
+
+  return write_drive_database_image(path, st, hash, db);
+}
+
 // Get path for additional database file
 const char * get_drivedb_path_add()
 {
@@ -914,13 +1910,222 @@ static bool read_default_drive_databases()
   else
 #endif
   {
-    // Append builtin table.
-    knowndrives.append(builtin_knowndrives, builtin_knowndrives_size);
+    // Append builtin table, use generated tables if up to date.
+    const builtin_drive_info * builtin_info = 0;
+    if (builtin_drive_infos_size == builtin_knowndrives_size)
+      builtin_info = builtin_drive_infos;
+    knowndrives.append(builtin_knowndrives, builtin_knowndrives_size, builtin_info);
+  }
+
+  return true;
+}
+
+// Compile drive database files into images.
+bool compile_drive_databases(bool use_default_db)
+{
+  std::vector<std::string> paths = drivedb_paths_read;
+  if (use_default_db) {
+    const char * db1 = get_drivedb_path_add();
+    if (!access(db1, 0))
+      paths.push_back(db1);
+#ifdef SMARTMONTOOLS_DRIVEDBDIR
+    const char * db2 = get_drivedb_path_default();
+    if (!access(db2, 0))
+      paths.push_back(db2);
+#endif
+  }
+  if (paths.empty()) {
+    pout("No drive database file found, builtin database is not compiled\n");
+    return false;
+  }
+
+  bool ok = true;
+  for (unsigned i = 0; i < paths.size(); i++) {
+    if (std::find(paths.begin(), paths.begin() + i, paths[i]) != paths.begin() + i)
+      continue; // Duplicate
+    if (!compile_drive_database(paths[i].c_str()))
+      ok = false;
+  }
+  return ok;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Tables of pre-parsed builtin database generated at build time
+
+// Generated data of one builtin entry, indices into tables.
+struct builtin_gen_entry
+{
+  unsigned first_attr, num_attrs;
+  unsigned firmwarebugs;
+  unsigned first_prefix, num_prefixes;
+};
+
+// Write STR as C string literal, optionally with explicit NUL.
+static void write_c_string(FILE * f, const char * str, bool nul)
+{
+  putc('"', f);
+  for (const char * p = str; *p; p++) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\' || c == '?') // '?': No trigraphs
+      fprintf(f, "\\%c", c);
+    else if (' ' <= c && c <= '~')
+      putc(c, f);
+    else
+      fprintf(f, "\\%03o", c);
+  }
+  if (nul)
+    fputs("\\0", f);
+  putc('"', f);
+}
+
+// Write pre-parsed builtin tables as C++ source.
+bool write_builtin_drive_tables(FILE * f)
+{
+  std::string pool(1, '\0');
+  pool_index_map pool_index;
+  std::vector<drive_attr_preset> attrs;
+  std::vector<std::string> prefixes;
+  std::vector<builtin_gen_entry> entries(builtin_knowndrives_size);
+
+  for (unsigned i = 0; i < builtin_knowndrives_size; i++) {
+    const drive_settings & dbentry = builtin_knowndrives[i];
+    builtin_gen_entry & ge = entries[i];
+
+    // Pre-parse presets
+    ata_vendor_attr_defs defs;
+    if (!preparse_presets(dbentry, defs, ge.firmwarebugs)) {
+      pout("Syntax error in preset option string \"%s\"\n", dbentry.presets);
+      return false;
+    }
+    ge.first_attr = attrs.size();
+    add_attr_presets(defs, pool, pool_index, attrs);
+    ge.num_attrs = attrs.size() - ge.first_attr;
+
+    // Get literal prefixes of model regexp for the index
+    ge.first_prefix = prefixes.size();
+    if (get_dbentry_type(&dbentry) != DBENTRY_ATA_DEFAULT) {
+      std::vector<std::string> p;
+      get_regex_prefixes(dbentry.modelregexp, p);
+      if (!(p.empty() || p[0].empty()))
+        prefixes.insert(prefixes.end(), p.begin(), p.end());
+    }
+    ge.num_prefixes = prefixes.size() - ge.first_prefix;
   }
 
+  fprintf(f, "// Generated from drivedb.h by drivedb_gen, do not edit.\n\n");
+
+  fprintf(f, "static const char builtin_drivedb_pool[] =");
+  for (size_t pos = 0; pos < pool.size(); pos += strlen(pool.c_str() + pos) + 1) {
+    fputs("\n  ", f);
+    write_c_string(f, pool.c_str() + pos, true);
+  }
+  fprintf(f, ";\n\n");
+
+  fprintf(f, "static const drive_attr_preset builtin_attr_presets[] = {\n");
+  for (unsigned i = 0; i < attrs.size(); i++) {
+    const drive_attr_preset & ap = attrs[i];
+    fprintf(f, "  { %u, 0x%x, %u, %u, ", ap.name, ap.flags, ap.id, ap.raw_format);
+    write_c_string(f, ap.byteorder, false);
+    fprintf(f, ", 0 },\n");
+  }
+  fprintf(f, "  { 0, 0, 0, 0, \"\", 0 } // End\n};\n\n");
+
+  fprintf(f, "static const char * const builtin_prefixes[] = {\n");
+  for (unsigned i = 0; i < prefixes.size(); i++) {
+    fputs("  ", f);
+    write_c_string(f, prefixes[i].c_str(), false);
+    fputs(",\n", f);
+  }
+  fprintf(f, "  0 // End\n};\n\n");
+
+  fprintf(f, "const builtin_drive_info builtin_drive_infos[] = {\n");
+  for (unsigned i = 0; i < entries.size(); i++) {
+    const builtin_gen_entry & ge = entries[i];
+    fprintf(f, "  { { builtin_drivedb_pool, builtin_attr_presets + %u, %u, 0x%x },"
+               " builtin_prefixes + %u, %u }, // %u\n",
+            ge.first_attr, ge.num_attrs, ge.firmwarebugs,
+            ge.first_prefix, ge.num_prefixes, i);
+  }
+  fprintf(f, "};\n\n");
+
+  fprintf(f, "const unsigned builtin_drive_infos_size = %u;\n",
+          (unsigned)entries.size());
+  return !ferror(f);
+}
+
+// Return true if attribute definitions are equal.
+static bool equal_attr_defs(const ata_vendor_attr_defs & defs1,
+                            const ata_vendor_attr_defs & defs2)
+{
+  for (int id = 0; id < MAX_ATTRIBUTE_NUM; id++) {
+    const ata_vendor_attr_defs::entry & e1 = defs1[id], & e2 = defs2[id];
+    if (!(   e1.name == e2.name && e1.priority == e2.priority
+          && e1.raw_format == e2.raw_format && e1.flags == e2.flags
+          && !strcmp(e1.byteorder, e2.byteorder)))
+      return false;
+  }
   return true;
 }
 
+// Compare generated tables with the parsed builtin table.
+int check_builtin_drive_tables()
+{
+  if (!builtin_drive_infos_size)
+    return -1;
+  if (builtin_drive_infos_size != builtin_knowndrives_size) {
+    pout("Generated builtin drive database tables are out of date (%u entries, %u expected)\n",
+         builtin_drive_infos_size, builtin_knowndrives_size);
+    return 1;
+  }
+
+  int errcnt = 0;
+  for (unsigned i = 0; i < builtin_knowndrives_size; i++) {
+    const drive_settings & dbentry = builtin_knowndrives[i];
+    const builtin_drive_info & info = builtin_drive_infos[i];
+    dbentry_type type = get_dbentry_type(&dbentry);
+
+    // Presets applied from tables must be the same as parsed
+    if (type != DBENTRY_USB) {
+      ata_vendor_attr_defs defs1, defs2;
+      firmwarebug_defs bugs1, bugs2;
+      if (type == DBENTRY_ATA_DEFAULT) {
+        parse_default_presets(dbentry.presets, defs1);
+        apply_presets(info.presets, PRIOR_DEFAULT, defs2, bugs2);
+      }
+      else {
+        parse_presets(dbentry.presets, defs1, bugs1);
+        apply_presets(info.presets, PRIOR_DATABASE, defs2, bugs2);
+      }
+      if (!(   equal_attr_defs(defs1, defs2)
+            && get_firmwarebug_mask(bugs1) == get_firmwarebug_mask(bugs2))) {
+        pout("Entry %u (%s): generated presets differ from \"%s\"\n",
+             i, dbentry.modelfamily, dbentry.presets);
+        errcnt++;
+      }
+    }
+
+    // Prefixes must be the same, then lookups via index are the same
+    std::vector<std::string> prefixes;
+    if (type != DBENTRY_ATA_DEFAULT) {
+      get_regex_prefixes(dbentry.modelregexp, prefixes);
+      if (!prefixes.empty() && prefixes[0].empty())
+        prefixes.clear();
+    }
+    bool ok = (prefixes.size() == info.num_prefixes);
+    for (unsigned j = 0; ok && j < prefixes.size(); j++)
+      ok = (prefixes[j] == info.prefixes[j]);
+    if (!ok) {
+      pout("Entry %u (%s): generated model prefixes differ from \"%s\"\n",
+           i, dbentry.modelfamily, dbentry.modelregexp);
+      errcnt++;
+    }
+  }
+  return errcnt;
+}
+
+
 static ata_vendor_attr_defs default_attr_defs;
 
 // Initialize default_attr_defs.
@@ -932,6 +2137,14 @@ static bool init_default_attr_defs()
     if (get_dbentry_type(&knowndrives[i]) != DBENTRY_ATA_DEFAULT)
       continue;
     entry = &knowndrives[i];
+
+    const drive_presets * presets = knowndrives.get_presets(i);
+    if (presets) {
+      // Use pre-parsed presets from compiled image or builtin tables
+      firmwarebug_defs unused;
+      apply_presets(*presets, PRIOR_DEFAULT, default_attr_defs, unused);
+      return true;
+    }
     break;
   }
 
@@ -964,7 +2177,11 @@ bool init_drive_database(bool use_default_db)
   if (use_default_db && !read_default_drive_databases())
     return false;
 
-  return init_default_attr_defs();
+  if (!init_default_attr_defs())
+    return false;
+
+  knowndrives.build_index();
+  return true;
 }
 
 // Get vendor attribute options from default db entry.
@@ -30,6 +30,44 @@ struct drive_settings {
   const char * presets;
 };
 
+// Pre-parsed '-v' option of a preset string.  Layout is part of the
+// compiled database image format, see drivedb_image_header in
+// knowndrives.cpp.
+struct drive_attr_preset
+{
+  uint32_t name;                // Offset of attribute name in string pool, 0 to keep name
+  uint32_t flags;               // ATTRFLAG_*
+  unsigned char id;             // Attribute ID
+  unsigned char raw_format;     // ata_attr_raw_format
+  char byteorder[8+1];          // Byte order string, see ata_vendor_attr_defs::entry
+  char reserved;
+};
+
+// Pre-parsed preset string of a database entry.
+// Value-initialized 'drive_presets()' is not pre-parsed.
+struct drive_presets
+{
+  const char * pool;            // String pool, 0 if not pre-parsed
+  const drive_attr_preset * attrs;
+  unsigned num_attrs;
+  unsigned firmwarebugs;        // Bit mask of firmwarebug_t
+};
+
+// Pre-parsed presets and model regexp prefixes of a builtin entry,
+// generated from drivedb.h at build time by drivedb_gen,
+// see write_builtin_drive_tables().
+struct builtin_drive_info
+{
+  drive_presets presets;
+  const char * const * prefixes; // Literal prefixes of model regexp
+  unsigned num_prefixes;         // 0 if none or DEFAULT entry
+};
+
+// Generated tables (drivedb_tables.cpp), one entry per builtin entry.
+// The size is 0 if the tables were not generated.
+extern const builtin_drive_info builtin_drive_infos[];
+extern const unsigned builtin_drive_infos_size;
+
 // info returned by lookup_usb_device()
 struct usb_dev_info
 {
@@ -53,6 +91,10 @@ int showallpresets();
 // Returns # matching entries.
 int showmatchingpresets(const char *model, const char *firmware);
 
+// Searches drive database for ATA drive with model and firmware string.
+// Returns pointer to first matching entry or nullptr if none found.
+const drive_settings * lookup_drive(const char * model, const char * firmware);
+
 // Searches drive database and sets preset vendor attribute
 // options in defs and firmwarebugs.
 // Values that have already been set will not be changed.
@@ -69,9 +111,26 @@ const char * get_drivedb_path_add();
 const char * get_drivedb_path_default();
 #endif
 
-// Read drive database from file.
+// Read drive database from file, or from its compiled image if the
+// file is unchanged since the image was written.
 bool read_drive_database(const char * path);
 
+// Get path of compiled image of database file PATH.
+std::string get_drivedb_image_path(const char * path);
+
+// Compile drive database files read so far and, if USE_DEFAULT_DB,
+// those from standard places into images.  Returns false on error.
+bool compile_drive_databases(bool use_default_db);
+
+// Compare tables of pre-parsed builtin database generated at build
+// time with the builtin database.  Returns #errors, -1 if the tables
+// were not generated.
+int check_builtin_drive_tables();
+
+// Write tables of pre-parsed builtin database as C++ source,
+// used by drivedb_gen.  Returns false on error.
+bool write_builtin_drive_tables(FILE * f);
+
 // Init default db entry and optionally read drive databases from standard places.
 bool init_drive_database(bool use_default_db);
 
@@ -0,0 +1,480 @@
+/*
+ * localsock.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "localsock.h"
+#include "utility.h"
+
+const char * localsock_cpp_cvsid = "$Id$"
+                                   LOCALSOCK_H_CVSID;
+
+#ifndef _WIN32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Max length of a request line
+const unsigned max_request_len = 1024;
+
+// Max number of HTTP header lines
+const int max_header_lines = 100;
+
+// Total time for reading the request and writing the response of one
+// client connection (milliseconds)
+const int client_timeout_ms = 2000;
+
+static bool set_sockaddr(const char * path, sockaddr_un & addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  return true;
+}
+
+static void set_timeouts(int fd, int timeout)
+{
+  struct timeval tv;
+  tv.tv_sec = timeout; tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Connect to socket at PATH, return fd or -1 on error.
+static int connect_socket(const char * path)
+{
+  sockaddr_un addr;
+  if (!set_sockaddr(path, addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (const sockaddr *)&addr, sizeof(addr))) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static bool write_all(int fd, const char * buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += n; size -= n;
+  }
+  return true;
+}
+
+bool local_socket_query(const char * path, const char * request,
+                        std::string & response, int timeout)
+{
+  response.clear();
+  int fd = connect_socket(path);
+  if (fd < 0)
+    return false;
+  set_timeouts(fd, timeout);
+
+  std::string req = request; req += '\n';
+  bool ok = write_all(fd, req.data(), req.size());
+  if (ok)
+    shutdown(fd, SHUT_WR);
+
+  while (ok) {
+    char buf[4096];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        errno = ETIMEDOUT;
+      ok = false;
+    }
+    else if (n == 0)
+      break;
+    else
+      response.append(buf, n);
+  }
+
+  int err = errno;
+  close(fd);
+  errno = err;
+  return ok;
+}
+
+#ifdef HAVE_PTHREADS
+
+struct local_socket_data
+{
+  std::string path;
+  std::string default_request;
+  int fd; // Listening socket
+  int wakeup[2]; // Pipe to stop the thread
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  local_socket_server::response_map responses; // protected by mutex
+};
+
+// Client connection of the server thread.  All reads and writes share a
+// single deadline, so a slow client cannot block the server for long.
+class client_connection
+{
+public:
+  explicit client_connection(int fd);
+
+  /// Read next line without trailing CR/LF.  Returns false on error,
+  /// end of data or timeout, LINE then contains the partial line.
+  bool read_line(std::string & line);
+
+  /// Write all data, return false on error or timeout.
+  bool write_all(const std::string & data);
+
+private:
+  int m_fd;
+  struct timeval m_deadline;
+  std::string m_buf; // Received but not yet returned data
+
+  // Wait for EVENTS until deadline, return false on timeout or error.
+  bool wait(short events);
+};
+
+client_connection::client_connection(int fd)
+: m_fd(fd)
+{
+  gettimeofday(&m_deadline, 0);
+  m_deadline.tv_sec += client_timeout_ms / 1000;
+  m_deadline.tv_usec += (client_timeout_ms % 1000) * 1000;
+  if (m_deadline.tv_usec >= 1000000) {
+    m_deadline.tv_sec++; m_deadline.tv_usec -= 1000000;
+  }
+}
+
+bool client_connection::wait(short events)
+{
+  for (;;) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    long ms = (long)(m_deadline.tv_sec - now.tv_sec) * 1000
+            + (m_deadline.tv_usec - now.tv_usec) / 1000;
+    if (ms <= 0)
+      return false;
+    struct pollfd pfd;
+    pfd.fd = m_fd; pfd.events = events; pfd.revents = 0;
+    int rc = poll(&pfd, 1, (int)ms);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    return (rc > 0);
+  }
+}
+
+bool client_connection::read_line(std::string & line)
+{
+  bool ok = true;
+  std::string::size_type end;
+  while ((end = m_buf.find('\n')) == std::string::npos) {
+    if (m_buf.size() >= max_request_len) {
+      end = max_request_len;
+      break;
+    }
+    if (!wait(POLLIN)) {
+      ok = false; // Timeout
+      break;
+    }
+    char buf[max_request_len];
+    ssize_t n = recv(m_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+      continue;
+    if (n <= 0) {
+      ok = false; // Error or end of data
+      break;
+    }
+    m_buf.append(buf, n);
+  }
+
+  if (end == std::string::npos) {
+    line = m_buf.substr(0, max_request_len);
+    m_buf.clear();
+  }
+  else {
+    line = m_buf.substr(0, end);
+    m_buf.erase(0, (end < m_buf.size() && m_buf[end] == '\n' ? end + 1 : end));
+  }
+  if (!line.empty() && line[line.size()-1] == '\r')
+    line.erase(line.size()-1);
+  return ok;
+}
+
+bool client_connection::write_all(const std::string & data)
+{
+  const char * buf = data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    ssize_t n = send(m_fd, buf, size, MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait(POLLOUT))
+        continue;
+      return false;
+    }
+    buf += n; size -= n;
+  }
+  return true;
+}
+
+static void serve_client(local_socket_data & data, int fd)
+{
+  client_connection conn(fd);
+  // A timeout or end of data terminates the request, an empty request
+  // returns the default response
+  std::string request;
+  conn.read_line(request);
+
+  // "GET /REQUEST[?...] HTTP/1.x"
+  bool http = false;
+  if (str_starts_with(request, "GET ")) {
+    std::string::size_type end = request.find_first_of(" ?", 4);
+    request = request.substr(4, (end != std::string::npos ? end - 4 : end));
+    if (str_starts_with(request, "/"))
+      request.erase(0, 1);
+    http = true;
+
+    // Skip header lines, closing with unread data would reset connection
+    for (int i = 0; i < max_header_lines; i++) {
+      std::string line;
+      if (!conn.read_line(line) || line.empty())
+        break;
+    }
+  }
+  if (request.empty())
+    request = data.default_request;
+
+  std::string response;
+  bool found;
+  pthread_mutex_lock(&data.mutex);
+  local_socket_server::response_map::const_iterator it = data.responses.find(request);
+  found = (it != data.responses.end());
+  if (found)
+    response = it->second;
+  pthread_mutex_unlock(&data.mutex);
+
+  if (http) {
+    response = strprintf("HTTP/1.0 %s\r\n"
+                         "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                         "Content-Length: %u\r\n"
+                         "\r\n",
+                         (found ? "200 OK" : "404 Not Found"),
+                         (unsigned)response.size()) + response;
+  }
+  conn.write_all(response);
+}
+
+extern "C" void * local_socket_thread(void * arg)
+{
+  local_socket_data & data = *(local_socket_data *)arg;
+  for (;;) {
+    struct pollfd fds[2];
+    fds[0].fd = data.fd;        fds[0].events = POLLIN; fds[0].revents = 0;
+    fds[1].fd = data.wakeup[0]; fds[1].events = POLLIN; fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break; // stop()
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    int fd = accept(data.fd, 0, 0);
+    if (fd < 0)
+      continue;
+    serve_client(data, fd);
+    close(fd);
+  }
+  return 0;
+}
+
+local_socket_server::local_socket_server()
+: m_data(0)
+{
+}
+
+local_socket_server::~local_socket_server()
+{
+  stop();
+}
+
+bool local_socket_server::start(const char * path, const char * default_request)
+{
+  stop();
+
+  // Replace socket file left by a process which is no longer running
+  struct stat st;
+  if (!lstat(path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      pout("%s: exists and is not a socket\n", path);
+      return false;
+    }
+    int fd = connect_socket(path);
+    if (fd >= 0) {
+      close(fd);
+      pout("%s: socket is in use by another process\n", path);
+      return false;
+    }
+    unlink(path);
+  }
+
+  sockaddr_un addr;
+  int fd = -1;
+  if (   !set_sockaddr(path, addr)
+      || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+      || bind(fd, (const sockaddr *)&addr, sizeof(addr))
+      || listen(fd, 16)) {
+    pout("%s: cannot create socket: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  local_socket_data * data = new local_socket_data;
+  data->path = path;
+  data->default_request = default_request;
+  data->fd = fd;
+  if (pipe(data->wakeup)) {
+    pout("%s: cannot create pipe: %s\n", path, strerror(errno));
+    close(fd); unlink(path);
+    delete data;
+    return false;
+  }
+  fcntl(data->wakeup[0], F_SETFD, FD_CLOEXEC);
+  fcntl(data->wakeup[1], F_SETFD, FD_CLOEXEC);
+  pthread_mutex_init(&data->mutex, 0);
+
+  // Signals should be handled by the main thread only
+  sigset_t allsigs, oldsigs;
+  sigfillset(&allsigs);
+  pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+  int err = pthread_create(&data->thread, 0, local_socket_thread, data);
+  pthread_sigmask(SIG_SETMASK, &oldsigs, 0);
+
+  if (err) {
+    pout("%s: cannot create thread: %s\n", path, strerror(err));
+    pthread_mutex_destroy(&data->mutex);
+    close(data->wakeup[0]); close(data->wakeup[1]);
+    close(fd); unlink(path);
+    delete data;
+    return false;
+  }
+
+  m_data = data;
+  return true;
+}
+
+void local_socket_server::stop()
+{
+  if (!m_data)
+    return;
+  local_socket_data * data = m_data;
+  m_data = 0;
+
+  if (write(data->wakeup[1], "x", 1) == 1)
+    pthread_join(data->thread, 0);
+  pthread_mutex_destroy(&data->mutex);
+  close(data->wakeup[0]); close(data->wakeup[1]);
+  close(data->fd);
+  unlink(data->path.c_str());
+  delete data;
+}
+
+void local_socket_server::set_responses(response_map & responses)
+{
+  if (!m_data)
+    return;
+  pthread_mutex_lock(&m_data->mutex);
+  m_data->responses.swap(responses);
+  pthread_mutex_unlock(&m_data->mutex);
+}
+
+#endif // HAVE_PTHREADS
+
+#else // _WIN32
+
+bool local_socket_query(const char * /*path*/, const char * /*request*/,
+                        std::string & response, int /*timeout*/)
+{
+  response.clear();
+  errno = ENOSYS;
+  return false;
+}
+
+#endif // _WIN32
+
+#if defined(_WIN32) || !defined(HAVE_PTHREADS)
+
+local_socket_server::local_socket_server()
+: m_data(0)
+{
+}
+
+local_socket_server::~local_socket_server()
+{
+}
+
+bool local_socket_server::start(const char * path, const char * /*default_request*/)
+{
+  pout("%s: local socket server not supported on this platform\n", path);
+  return false;
+}
+
+void local_socket_server::stop()
+{
+}
+
+void local_socket_server::set_responses(response_map & /*responses*/)
+{
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * localsock.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOCALSOCK_H_
+#define LOCALSOCK_H_
+
+#define LOCALSOCK_H_CVSID "$Id$\n"
+
+// Local (UNIX domain) stream socket used by smartd to publish the
+// data of its last device checks.
+//
+// A request is a single line of text, the response is the text
+// registered for this request by set_responses().  An empty request
+// (client sends nothing or closes its write side) returns the default
+// response.  An HTTP "GET /REQUEST" is also accepted and answered with
+// an HTTP/1.0 header, so the socket can be scraped directly by HTTP
+// clients which support UNIX sockets.
+//
+// Responses are prepared by the owner of the server, the server thread
+// never calls back.  Therefore requests never access devices.  Unknown
+// requests return an empty response.
+
+#include <map>
+#include <string>
+
+struct local_socket_data;
+
+/// Server on a local socket.  Requests are served in a separate
+/// thread, so POSIX threads support is required.
+class local_socket_server
+{
+public:
+  local_socket_server();
+  ~local_socket_server();
+
+  typedef std::map<std::string, std::string> response_map;
+
+  /// Create socket at PATH and start server thread.  Empty requests
+  /// return the response of DEFAULT_REQUEST.  A stale socket file is
+  /// replaced.  Prints error message and returns false on error.
+  bool start(const char * path, const char * default_request);
+
+  /// Stop server thread and remove socket.
+  void stop();
+
+  /// Return true if server is running.
+  bool is_running() const
+    { return !!m_data; }
+
+  /// Replace all responses, RESPONSES is swapped with the old ones.
+  /// Thread safe.
+  void set_responses(response_map & responses);
+
+private:
+  local_socket_data * m_data;
+
+  local_socket_server(const local_socket_server &);
+  void operator=(const local_socket_server &);
+};
+
+/// Send REQUEST to server at PATH and read the response, wait at most
+/// TIMEOUT seconds.  Sets errno and returns false on error.
+bool local_socket_query(const char * path, const char * request,
+                        std::string & response, int timeout);
+
+#endif // LOCALSOCK_H_
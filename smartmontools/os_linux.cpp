@@ -58,7 +58,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <glob.h>
+#include <linux/netlink.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_ioctl.h>
@@ -66,6 +68,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
@@ -93,6 +97,8 @@
 #include "dev_ata_cmd_set.h"
 #include "dev_areca.h"
 
+#include <map>
+
 #ifndef ENOTSUP
 #define ENOTSUP ENOSYS
 #endif
@@ -2642,6 +2648,260 @@ static bool get_usb_id(const char * name, unsigned short & vendor_id,
   return true;
 }
 
+// USB bridge IDs of "sdX" devices, 'usb' is false for other disks
+struct usb_id_info
+{
+  bool usb;
+  unsigned short vendor_id, product_id, version;
+
+  usb_id_info()
+    : usb(false), vendor_id(0), product_id(0), version(0) { }
+};
+
+typedef std::map<std::string, usb_id_info> usb_id_map;
+
+// Get absolute path of symlink "DIR/NAME" in /sys, "" on error
+static std::string read_sysfs_link(const std::string & dir, const char * name)
+{
+  char link[1024];
+  int n = readlink((dir + '/' + name).c_str(), link, sizeof(link) - 1);
+  if (n <= 0)
+    return "";
+  link[n] = 0;
+
+  // Remove "." and ".." from "DIR/LINK"
+  std::string path = (link[0] == '/' ? "" : dir);
+  for (const char * p = link; *p; ) {
+    size_t len = strcspn(p, "/");
+    if (len == 2 && !strncmp(p, "..", 2)) {
+      size_t i = path.rfind('/');
+      path.erase(i != std::string::npos ? i : 0);
+    }
+    else if (len && !(len == 1 && *p == '.'))
+      path.append("/").append(p, len);
+    p += len + (p[len] ? 1 : 0);
+  }
+  return path;
+}
+
+// Get USB bridge IDs of all "sdX" devices in one pass through /sys.
+// The IDs are read from the USB device directory which is the closest
+// parent of the disk's device directory, same as get_usb_id() above.
+// Disks without a readable /sys/block symlink (e.g. old kernels with
+// CONFIG_SYSFS_DEPRECATED) are not added.
+static void get_usb_ids(usb_id_map & ids)
+{
+  ids.clear();
+
+  // Get device directories of USB devices, skip interfaces "B-P:C.I"
+  std::map<std::string, int> usb_dirs; // 1: IDs read, -1: no IDs, 0: not yet read
+  usb_id_map usb_dir_ids;
+  DIR * dp = opendir("/sys/bus/usb/devices");
+  if (!dp)
+    return;
+  const struct dirent * ep;
+  while ((ep = readdir(dp))) {
+    if (ep->d_name[0] == '.' || strchr(ep->d_name, ':'))
+      continue;
+    std::string dir = read_sysfs_link("/sys/bus/usb/devices", ep->d_name);
+    if (!dir.empty())
+      usb_dirs[dir] = 0;
+  }
+  closedir(dp);
+
+  // Search parents of each disk device directory
+  dp = opendir("/sys/block");
+  if (!dp)
+    return;
+  while ((ep = readdir(dp))) {
+    if (strncmp(ep->d_name, "sd", 2))
+      continue;
+    std::string dir = read_sysfs_link("/sys/block", ep->d_name);
+    if (dir.empty())
+      continue;
+    ids[ep->d_name] = usb_id_info(); // Not USB unless found below
+    for (int cnt = 0; cnt < 10; cnt++) {
+      size_t i = dir.rfind('/');
+      if (i == std::string::npos)
+        break;
+      dir.erase(i);
+      if (dir == "/sys/devices")
+        break;
+      std::map<std::string, int>::iterator it = usb_dirs.find(dir);
+      if (it == usb_dirs.end())
+        continue;
+
+      // Read IDs once per USB device
+      usb_id_info & id = usb_dir_ids[dir];
+      if (!it->second) {
+        it->second = (   read_id(dir + "/idVendor", id.vendor_id)
+                      && read_id(dir + "/idProduct", id.product_id)
+                      && read_id(dir + "/bcdDevice", id.version)    ? 1 : -1);
+        id.usb = true;
+      }
+      if (it->second > 0)
+        ids[ep->d_name] = id;
+      break;
+    }
+  }
+  closedir(dp);
+}
+
+// Get USB bridge ID for "sdX" from IDS.  Returns 1 if found, 0 if not
+// a USB device, -1 if not in IDS.
+static int find_usb_id(const usb_id_map & ids, const char * name, unsigned short & vendor_id,
+                       unsigned short & product_id, unsigned short & version)
+{
+  usb_id_map::const_iterator it = ids.find(name);
+  if (it == ids.end())
+    return -1;
+  if (!it->second.usb)
+    return 0;
+  vendor_id = it->second.vendor_id;
+  product_id = it->second.product_id;
+  version = it->second.version;
+
+  if (scsi_debugmode > 1)
+    pout("USB ID = 0x%04x:0x%04x (0x%03x)\n", vendor_id, product_id, version);
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+/// Hotplug events
+
+// Reads kernel uevents from a netlink socket.  For testing, events may
+// be read from a FIFO instead.  The FIFO format is the output of
+// 'udevadm monitor --kernel --property': One "KEY=VALUE" line per
+// property, events separated by empty lines, other lines are ignored.
+class linux_hotplug_monitor
+: public /*implements*/ hotplug_monitor
+{
+public:
+  linux_hotplug_monitor(int fd, bool netlink)
+    : m_fd(fd), m_netlink(netlink) { }
+
+  virtual ~linux_hotplug_monitor() throw()
+    { ::close(m_fd); }
+
+  virtual bool wait_events(int timeout, std::vector<event> & events);
+
+private:
+  int m_fd;               ///< Netlink socket or FIFO
+  bool m_netlink;         ///< true if netlink socket
+  std::string m_line;     ///< Incomplete line from FIFO
+  std::vector<std::string> m_props; ///< Properties of incomplete event from FIFO
+
+  bool read_netlink(std::vector<event> & events);
+  bool read_fifo(std::vector<event> & events);
+  static void add_event(const std::vector<std::string> & props,
+                        std::vector<event> & events);
+};
+
+bool linux_hotplug_monitor::wait_events(int timeout, std::vector<event> & events)
+{
+  fd_set rfds; FD_ZERO(&rfds); FD_SET(m_fd, &rfds);
+  struct timeval tv; tv.tv_sec = (timeout > 0 ? timeout : 0); tv.tv_usec = 0;
+  int rc = select(m_fd + 1, &rfds, 0, 0, &tv);
+  if (rc < 0) {
+    if (errno == EINTR)
+      return true;
+    return smi()->set_err(errno, "select(): %s", strerror(errno));
+  }
+  if (!rc)
+    return true;
+  return (m_netlink ? read_netlink(events) : read_fifo(events));
+}
+
+bool linux_hotplug_monitor::read_netlink(std::vector<event> & events)
+{
+  for (;;) {
+    char buf[8192];
+    struct sockaddr_nl addr; socklen_t addrlen = sizeof(addr);
+    int n = recvfrom(m_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+                     (struct sockaddr *)&addr, &addrlen);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return true;
+      if (errno == ENOBUFS) {
+        // Receive buffer overflow, events are lost
+        pout("Netlink receive buffer overflow, hotplug events lost\n");
+        continue;
+      }
+      return smi()->set_err(errno, "recvfrom(): %s", strerror(errno));
+    }
+    // Accept messages from kernel only
+    if (!(addrlen == sizeof(addr) && addr.nl_pid == 0))
+      continue;
+
+    // "ACTION@DEVPATH\0KEY=VALUE\0...KEY=VALUE\0"
+    buf[n] = 0;
+    std::vector<std::string> props;
+    for (int i = strlen(buf) + 1; i < n; i += strlen(buf + i) + 1)
+      props.push_back(buf + i);
+    add_event(props, events);
+  }
+}
+
+bool linux_hotplug_monitor::read_fifo(std::vector<event> & events)
+{
+  char buf[1024];
+  int n = read(m_fd, buf, sizeof(buf));
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return true;
+    return smi()->set_err(errno, "read(): %s", strerror(errno));
+  }
+  for (int i = 0; i < n; i++) {
+    if (buf[i] != '\n') {
+      m_line += buf[i];
+      continue;
+    }
+    if (m_line.empty()) {
+      add_event(m_props, events);
+      m_props.clear();
+    }
+    else if (m_line.find('=') != std::string::npos)
+      m_props.push_back(m_line);
+    m_line.clear();
+  }
+  return true;
+}
+
+// Append event if properties describe add/remove of a disk found by
+// DEVICESCAN.
+void linux_hotplug_monitor::add_event(const std::vector<std::string> & props,
+                                      std::vector<event> & events)
+{
+  std::string action, subsystem, devtype, devname;
+  for (unsigned i = 0; i < props.size(); i++) {
+    const std::string & p = props[i];
+    if (str_starts_with(p, "ACTION="))
+      action = p.substr(7);
+    else if (str_starts_with(p, "SUBSYSTEM="))
+      subsystem = p.substr(10);
+    else if (str_starts_with(p, "DEVTYPE="))
+      devtype = p.substr(8);
+    else if (str_starts_with(p, "DEVNAME="))
+      devname = p.substr(8);
+  }
+  if (!(   (action == "add" || action == "remove")
+        && subsystem == "block" && devtype == "disk"))
+    return;
+
+  // Same names as in scan_smart_devices() below
+  if (str_starts_with(devname, "/dev/"))
+    devname.erase(0, 5);
+  if (!(   !fnmatch("hd[a-t]", devname.c_str(), 0)
+        || !fnmatch("sd[a-z]", devname.c_str(), 0)
+        || !fnmatch("sd[a-c][a-z]", devname.c_str(), 0)))
+    return;
+
+  event ev;
+  ev.add = (action == "add");
+  ev.dev_name = "/dev/" + devname;
+  events.push_back(ev);
+}
+
 //////////////////////////////////////////////////////////////////////
 /// Linux interface
 
@@ -2649,6 +2909,9 @@ class linux_smart_interface
 : public /*implements*/ smart_interface
 {
 public:
+  linux_smart_interface()
+    : m_usb_ids_valid(false) { }
+
   virtual std::string get_os_version_str();
 
   virtual std::string get_app_examples(const char * appname);
@@ -2656,6 +2919,8 @@ public:
   virtual bool scan_smart_devices(smart_device_list & devlist, const char * type,
     const char * pattern = 0);
 
+  virtual hotplug_monitor * get_hotplug_monitor(const char * source);
+
 protected:
   virtual ata_device * get_ata_device(const char * name, const char * type);
 
@@ -2675,6 +2940,9 @@ private:
   int megasas_dcmd_cmd(int bus_no, uint32_t opcode, void *buf,
     size_t bufsize, uint8_t *mbox, size_t mboxlen, uint8_t *statusp);
   int megasas_pd_add_list(int bus_no, smart_device_list & devlist);
+
+  usb_id_map m_usb_ids; ///< USB IDs of "sdX" devices, valid during scan
+  bool m_usb_ids_valid;
 };
 
 std::string linux_smart_interface::get_os_version_str()
@@ -2866,9 +3134,16 @@ bool linux_smart_interface::scan_smart_devices(smart_device_list & devlist,
     get_dev_list(devlist, "/dev/hd[a-t]", true, false, type, false);
   if (scan_scsi) {
     bool autodetect = !*type; // Try USB autodetection if no type specifed
+    if (autodetect) {
+      // Resolve USB IDs of all devices at once
+      get_usb_ids(m_usb_ids);
+      m_usb_ids_valid = true;
+    }
     get_dev_list(devlist, "/dev/sd[a-z]", false, true, type, autodetect);
     // Support up to 104 devices
     get_dev_list(devlist, "/dev/sd[a-c][a-z]", false, true, type, autodetect);
+    m_usb_ids_valid = false;
+    m_usb_ids.clear();
     // get device list from the megaraid device
     get_dev_megasas(devlist);
   }
@@ -2882,6 +3157,39 @@ bool linux_smart_interface::scan_smart_devices(smart_device_list & devlist,
   return get_dev_list(devlist, "/dev/discs/disc*", scan_ata, scan_scsi, type, false);
 }
 
+hotplug_monitor * linux_smart_interface::get_hotplug_monitor(const char * source)
+{
+  if (!strcmp(source, "kernel")) {
+    // Kernel uevents, sent before udev rules are processed
+    int fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+      set_err(errno, "socket(NETLINK_KOBJECT_UEVENT): %s", strerror(errno));
+      return 0;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      set_err(errno, "bind(NETLINK_KOBJECT_UEVENT): %s", strerror(errno));
+      ::close(fd);
+      return 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return new linux_hotplug_monitor(fd, true);
+  }
+
+  // FIFO with simulated events, opened read/write to avoid EOF if no
+  // writer is connected
+  int fd = open(source, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    set_err(errno, "%s: %s", source, strerror(errno));
+    return 0;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return new linux_hotplug_monitor(fd, false);
+}
+
 ata_device * linux_smart_interface::get_ata_device(const char * name, const char * type)
 {
   return new linux_ata_device(this, name, type);
@@ -3042,7 +3350,11 @@ smart_device * linux_smart_interface::autodetect_smart_device(const char * name)
 
     // Try to detect possible USB->(S)ATA bridge
     unsigned short vendor_id = 0, product_id = 0, version = 0;
-    if (get_usb_id(test_name, vendor_id, product_id, version)) {
+    int usb = (m_usb_ids_valid ? find_usb_id(m_usb_ids, test_name, vendor_id, product_id, version)
+                               : -1);
+    if (usb < 0) // Not scanned or not found in scan
+      usb = get_usb_id(test_name, vendor_id, product_id, version);
+    if (usb > 0) {
       const char * usbtype = get_usb_dev_type_by_id(vendor_id, product_id, version);
       if (!usbtype)
         return 0;
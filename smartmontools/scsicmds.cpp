@@ -44,6 +44,7 @@
 #include "int64.h"
 #include "scsicmds.h"
 #include "atacmds.h" // FIXME: for smart_command_set only
+#include "cmdstats.h"
 #include "dev_interface.h"
 #include "utility.h"
 
@@ -53,8 +54,6 @@ const char *scsicmds_c_cvsid="$Id$"
 // Print SCSI debug messages?
 unsigned char scsi_debugmode = 0;
 
-supported_vpd_pages * supported_vpd_pages_p = NULL;
-
 
 supported_vpd_pages::supported_vpd_pages(scsi_device * device) : num_valid(0)
 {
@@ -70,6 +69,17 @@ supported_vpd_pages::supported_vpd_pages(scsi_device * device) : num_valid(0)
     }
 }
 
+supported_vpd_pages::supported_vpd_pages(const unsigned char * page_list,
+                                         int num) : num_valid(0)
+{
+    if (num > (int)sizeof(pages))
+        num = sizeof(pages);
+    if (num > 0) {
+        memcpy(pages, page_list, num);
+        num_valid = num;
+    }
+}
+
 bool
 supported_vpd_pages::is_supported(int vpd_page_num) const
 {
@@ -480,7 +490,7 @@ scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
         io_hdr.max_sense_len = sizeof(sense);
         io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!timed_scsi_pass_through(device, &io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         int res;
@@ -516,7 +526,7 @@ scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     int status = scsiSimpleSenseFilter(&sinfo);
@@ -530,6 +540,126 @@ scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
     return 0;
 }
 
+scsi_log_batch::scsi_log_batch()
+: m_commands(0), m_usec(0),
+  m_total_fetches(0), m_total_commands(0), m_total_usec(0)
+{
+}
+
+void
+scsi_log_batch::add_page(int pagenum, int max_len)
+{
+    if (is_planned(pagenum))
+        return;
+    page_info pi;
+    pi.pagenum = pagenum;
+    pi.max_len = max_len;
+    pi.resp_len = 0;
+    pi.offset = (int)m_arena.size();
+    pi.err = -1;
+    m_pages.push_back(pi);
+    m_arena.resize(pi.offset + max_len);
+}
+
+bool
+scsi_log_batch::is_planned(int pagenum) const
+{
+    return !!find_page(pagenum);
+}
+
+void
+scsi_log_batch::clear()
+{
+    m_pages.clear();
+    m_arena.clear();
+}
+
+const scsi_log_batch::page_info *
+scsi_log_batch::find_page(int pagenum) const
+{
+    for (unsigned i = 0; i < m_pages.size(); i++) {
+        if (m_pages[i].pagenum == pagenum)
+            return &m_pages[i];
+    }
+    return 0;
+}
+
+/* Fetch one page.  Uses the known response length if the page has
+ * been fetched before, otherwise fetches the page header first to get
+ * the length.  Same length rules as scsiLogSense(). */
+int
+scsi_log_batch::fetch_page(scsi_device * device, page_info & pi)
+{
+    UINT8 * pBuf = &m_arena[pi.offset];
+    int err;
+
+    if (pi.resp_len > 0) {
+        m_commands++;
+        if ((err = scsiLogSense(device, pi.pagenum, 0, pBuf, pi.max_len,
+                                pi.resp_len)))
+            return err;
+        /* Done unless the page has grown */
+        int len = (pBuf[2] << 8) + pBuf[3] + 4;
+        if ((len <= pi.resp_len) || (pi.resp_len >= pi.max_len))
+            return 0;
+        pi.resp_len = 0;
+    }
+
+    m_commands++;
+    if ((err = scsiLogSense(device, pi.pagenum, 0, pBuf, pi.max_len, 4)))
+        return err;
+    int len = (pBuf[2] << 8) + pBuf[3] + 4;
+    if (4 == len)   /* some IBM tape drives don't like double fetch */
+        len = 252;
+    if (len % 2)    /* some SCSI HBA don't like "odd" length transfers */
+        len += 1;
+    if (len > pi.max_len)
+        len = pi.max_len;
+
+    m_commands++;
+    if ((err = scsiLogSense(device, pi.pagenum, 0, pBuf, pi.max_len, len)))
+        return err;
+    pi.resp_len = len;
+    return 0;
+}
+
+int
+scsi_log_batch::fetch(scsi_device * device)
+{
+    int64_t start = smi()->get_timer_usec();
+    int num_ok = 0;
+
+    m_commands = 0;
+    for (unsigned i = 0; i < m_pages.size(); i++) {
+        page_info & pi = m_pages[i];
+        memset(&m_arena[pi.offset], 0, pi.max_len);
+        if (0 == (pi.err = fetch_page(device, pi)))
+            num_ok++;
+    }
+
+    m_usec = (start >= 0 ? smi()->get_timer_usec() - start : 0);
+    m_total_fetches++;
+    m_total_commands += m_commands;
+    m_total_usec += m_usec;
+    return num_ok;
+}
+
+unsigned char *
+scsi_log_batch::get_page(int pagenum)
+{
+    const page_info * pi = find_page(pagenum);
+    if (!pi || pi->err)
+        return 0;
+    return &m_arena[pi->offset];
+}
+
+int
+scsi_log_batch::get_error(int pagenum) const
+{
+    const page_info * pi = find_page(pagenum);
+    return (pi ? pi->err : -1);
+}
+
 /* Sends a LOG SELECT command. Can be used to set log page values
  * or reset one log page (or all of them) to its defaults (typically zero).
  * Returns 0 if ok, 1 if NOT READY, 2 if command not supported, * 3 if
@@ -561,7 +691,7 @@ scsiLogSelect(scsi_device * device, int pcr, int sp, int pc, int pagenum,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -597,12 +727,12 @@ scsiModeSense(scsi_device * device, int pagenum, int subpagenum, int pc,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     int status = scsiSimpleSenseFilter(&sinfo);
     if (SIMPLE_ERR_TRY_AGAIN == status) {
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!timed_scsi_pass_through(device, &io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         status = scsiSimpleSenseFilter(&sinfo);
@@ -658,7 +788,7 @@ scsiModeSelect(scsi_device * device, int sp, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -693,12 +823,12 @@ scsiModeSense10(scsi_device * device, int pagenum, int subpagenum, int pc,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     int status = scsiSimpleSenseFilter(&sinfo);
     if (SIMPLE_ERR_TRY_AGAIN == status) {
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!timed_scsi_pass_through(device, &io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         status = scsiSimpleSenseFilter(&sinfo);
@@ -755,7 +885,7 @@ scsiModeSelect10(scsi_device * device, int sp, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -788,7 +918,7 @@ scsiStdInquiry(scsi_device * device, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -807,12 +937,6 @@ scsiInquiryVpd(scsi_device * device, int vpd_page, UINT8 *pBuf, int bufLen)
     UINT8 sense[32];
     int res;
 
-    /* Assume SCSI_VPD_SUPPORTED_VPD_PAGES is first VPD page fetched */
-    if ((SCSI_VPD_SUPPORTED_VPD_PAGES != vpd_page) &&
-        supported_vpd_pages_p &&
-        (! supported_vpd_pages_p->is_supported(vpd_page)))
-        return 3;
-
     if ((bufLen < 0) || (bufLen > 1023))
         return -EINVAL;
 try_again:
@@ -834,7 +958,7 @@ try_again:
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     if ((SCSI_STATUS_CHECK_CONDITION == io_hdr.scsi_status) &&
@@ -881,7 +1005,7 @@ scsiRequestSense(scsi_device * device, struct scsi_sense_disect * sense_info)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     if (sense_info) {
         UINT8 resp_code = buff[0] & 0x7f;
@@ -969,7 +1093,7 @@ scsiSendDiagnostic(scsi_device * device, int functioncode, UINT8 *pBuf,
     /* worst case is an extended foreground self test on a big disk */
     io_hdr.timeout = SCSI_TIMEOUT_SELF_TEST;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -995,7 +1119,7 @@ _testunitready(scsi_device * device, struct scsi_sense_disect * sinfo)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, sinfo);
     return 0;
@@ -1052,7 +1176,7 @@ scsiReadDefect10(scsi_device * device, int req_plist, int req_glist,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     /* Look for "(Primary|Grown) defect list not found" */
@@ -1096,7 +1220,7 @@ scsiReadDefect12(scsi_device * device, int req_plist, int req_glist,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     /* Look for "(Primary|Grown) defect list not found" */
@@ -1132,7 +1256,7 @@ scsiReadCapacity10(scsi_device * device, unsigned int * last_lbap,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     res = scsiSimpleSenseFilter(&sinfo);
@@ -1175,7 +1299,7 @@ scsiReadCapacity16(scsi_device * device, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!timed_scsi_pass_through(device, &io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -1476,6 +1600,33 @@ scsiGetTemp(scsi_device * device, UINT8 *currenttemp, UINT8 *triptemp)
     return 0;
 }
 
+/* Decode informational exception log page.  Temperature is taken from
+ * the page if the device has no temperature log page.  Returns 0 if ok,
+ * else error number. */
+static int
+scsiDecodeIEPage(const UINT8 * tBuf, int hasTempLogPage,
+                 struct scsi_sense_disect * sinfo, UINT8 *currenttemp,
+                 UINT8 *triptemp)
+{
+    // pull out page size from response, don't forget to add 4
+    unsigned short pagesize = (unsigned short) ((tBuf[2] << 8) | tBuf[3]) + 4;
+    if ((pagesize < 4) || tBuf[4] || tBuf[5]) {
+        pout("Log Sense failed, IE page, bad parameter code or length\n");
+        return SIMPLE_ERR_BAD_PARAM;
+    }
+    if (tBuf[7] > 1) {
+        sinfo->asc = tBuf[8];
+        sinfo->ascq = tBuf[9];
+        if (! hasTempLogPage) {
+            if (tBuf[7] > 2)
+                *currenttemp = tBuf[10];
+            if (tBuf[7] > 3)        /* IBM extension in SMART (IE) lpage */
+                *triptemp = tBuf[11];
+        }
+    }
+    return 0;
+}
+
 /* Read informational exception log page or Request Sense response.
  * Fetching asc/ascq code potentially flagging an exception or warning.
  * Returns 0 if ok, else error number. A current temperature of 255
@@ -1502,22 +1653,9 @@ scsiCheckIE(scsi_device * device, int hasIELogPage, int hasTempLogPage,
             pout("Log Sense failed, IE page [%s]\n", scsiErrString(err));
             return err;
         }
-        // pull out page size from response, don't forget to add 4
-        unsigned short pagesize = (unsigned short) ((tBuf[2] << 8) | tBuf[3]) + 4;
-        if ((pagesize < 4) || tBuf[4] || tBuf[5]) {
-            pout("Log Sense failed, IE page, bad parameter code or length\n");
-            return SIMPLE_ERR_BAD_PARAM;
-        }
-        if (tBuf[7] > 1) {
-            sense_info.asc = tBuf[8];
-            sense_info.ascq = tBuf[9];
-            if (! hasTempLogPage) {
-                if (tBuf[7] > 2)
-                    *currenttemp = tBuf[10];
-                if (tBuf[7] > 3)        /* IBM extension in SMART (IE) lpage */
-                    *triptemp = tBuf[11];
-            }
-        }
+        if ((err = scsiDecodeIEPage(tBuf, hasTempLogPage, &sense_info,
+                                    currenttemp, triptemp)))
+            return err;
     }
     if (0 == sense_info.asc) {
         /* ties in with MRIE field of 6 in IEC mode page (0x1c) */
@@ -1537,6 +1675,53 @@ scsiCheckIE(scsi_device * device, int hasIELogPage, int hasTempLogPage,
     return 0;
 }
 
+/* Like scsiCheckIE() but uses the IE and temperature log pages from the
+ * last fetch of batch.  The pages are used if planned. */
+int
+scsiCheckIE(scsi_device * device, scsi_log_batch & batch, UINT8 *asc,
+            UINT8 *ascq, UINT8 *currenttemp, UINT8 *triptemp)
+{
+    struct scsi_sense_disect sense_info;
+    int err;
+    int hasTempLogPage = batch.is_planned(TEMPERATURE_LPAGE);
+
+    *asc = 0;
+    *ascq = 0;
+    *currenttemp = 0;
+    *triptemp = 0;
+    memset(&sense_info, 0, sizeof(sense_info));
+    if (batch.is_planned(IE_LPAGE)) {
+        const UINT8 * tBuf = batch.get_page(IE_LPAGE);
+        if (! tBuf) {
+            err = batch.get_error(IE_LPAGE);
+            pout("Log Sense failed, IE page [%s]\n", scsiErrString(err));
+            return err;
+        }
+        if ((err = scsiDecodeIEPage(tBuf, hasTempLogPage, &sense_info,
+                                    currenttemp, triptemp)))
+            return err;
+    }
+    if (0 == sense_info.asc) {
+        /* ties in with MRIE field of 6 in IEC mode page (0x1c) */
+        if ((err = scsiRequestSense(device, &sense_info))) {
+            pout("Request Sense failed, [%s]\n", scsiErrString(err));
+            return err;
+        }
+    }
+    *asc = sense_info.asc;
+    *ascq = sense_info.ascq;
+    if (hasTempLogPage) {
+        const UINT8 * tBuf = batch.get_page(TEMPERATURE_LPAGE);
+        if (tBuf) {
+            *currenttemp = tBuf[9];
+            *triptemp = tBuf[15];
+        } else
+            pout("Log Sense for temperature failed [%s]\n",
+                 scsiErrString(batch.get_error(TEMPERATURE_LPAGE)));
+    }
+    return 0;
+}
+
 // The first character (W, C, I) tells the severity
 static const char * TapeAlertsMessageTable[]= {
     " ",
@@ -2035,6 +2220,13 @@ static char spare_buff[128];
 
 const char *
 scsiGetIEString(UINT8 asc, UINT8 ascq)
+{
+    return scsiGetIEString(asc, ascq, spare_buff, sizeof(spare_buff));
+}
+
+/* Reentrant version, message for unknown ascq is formatted into buff */
+const char *
+scsiGetIEString(UINT8 asc, UINT8 ascq, char * buff, int buff_len)
 {
     const char * rp;
 
@@ -2047,17 +2239,17 @@ scsiGetIEString(UINT8 asc, UINT8 ascq)
             if (strlen(rp) > 0)
                 return rp;
         }
-        snprintf(spare_buff, sizeof(spare_buff),
+        snprintf(buff, buff_len,
                  "FAILURE PREDICTION THRESHOLD EXCEEDED: ascq=0x%x", ascq);
-        return spare_buff;
+        return buff;
     } else if (SCSI_ASC_WARNING == asc) {
         if (ascq < (sizeof(strs_for_asc_b) / sizeof(strs_for_asc_b[0]))) {
             rp = strs_for_asc_b[ascq];
             if (strlen(rp) > 0)
                 return rp;
         }
-        snprintf(spare_buff, sizeof(spare_buff), "WARNING: ascq=0x%x", ascq);
-        return spare_buff;
+        snprintf(buff, buff_len, "WARNING: ascq=0x%x", ascq);
+        return buff;
     }
     return NULL;        /* not a IE additional sense code */
 }
@@ -2293,8 +2485,7 @@ scsiDecodeNonMediumErrPage(unsigned char *resp,
 int
 scsiCountFailedSelfTests(scsi_device * fd, int noisy)
 {
-    int num, k, err, fails, fail_hour;
-    UINT8 * ucp;
+    int err;
     unsigned char resp[LOG_RESP_SELF_TEST_LEN];
 
     if ((err = scsiLogSense(fd, SELFTEST_RESULTS_LPAGE, 0, resp,
@@ -2303,6 +2494,17 @@ scsiCountFailedSelfTests(scsi_device * fd, int noisy)
             pout("scsiCountSelfTests Failed [%s]\n", scsiErrString(err));
         return -1;
     }
+    return scsiCountFailedSelfTests(resp, noisy);
+}
+
+/* Same as above for an already fetched self-test results log page
+   (at least LOG_RESP_SELF_TEST_LEN bytes). */
+int
+scsiCountFailedSelfTests(const unsigned char * resp, int noisy)
+{
+    int num, k, fails, fail_hour;
+    const UINT8 * ucp;
+
     if ((resp[0] & 0x3f) != SELFTEST_RESULTS_LPAGE) {
         if (noisy)
             pout("Self-test Log Sense Failed, page mismatch\n");
@@ -2401,18 +2603,21 @@ scsiFetchControlGLTSD(scsi_device * device, int modese_len, int current)
 /* Returns a negative value on error, 0 if unknown and 1 if SSD,
  * otherwise the positive returned value is the speed in rpm. First checks
  * the Block Device Characteristics VPD page and if that fails it tries the
- * RIGID_DISK_DRIVE_GEOMETRY_PAGE mode page. */
+ * RIGID_DISK_DRIVE_GEOMETRY_PAGE mode page. The VPD page is skipped if
+ * not in VPD_PAGES (if non-NULL). */
 
 int
 scsiGetRPM(scsi_device * device, int modese_len, int * form_factorp,
-           int * haw_zbcp)
+           int * haw_zbcp, const supported_vpd_pages * vpd_pages)
 {
     int err, offset;
     UINT8 buff[64];
     int pc = MPAGE_CONTROL_DEFAULT;
 
     memset(buff, 0, sizeof(buff));
-    if ((0 == scsiInquiryVpd(device, SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS,
+    if ((! vpd_pages ||
+         vpd_pages->is_supported(SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS)) &&
+        (0 == scsiInquiryVpd(device, SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS,
                              buff, sizeof(buff))) &&
         (((buff[2] << 8) + buff[3]) > 2)) {
         int speed = (buff[4] << 8) + buff[5];
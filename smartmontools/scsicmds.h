@@ -36,6 +36,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
 /* #define SCSI_DEBUG 1 */ /* Comment out to disable command debugging */
 
 /* Following conditional defines just in case OS already has them defined.
@@ -321,6 +323,8 @@ class supported_vpd_pages
 {
 public:
     explicit supported_vpd_pages(scsi_device * device);
+    /* Set from a previously fetched list, e.g. from a capability cache */
+    supported_vpd_pages(const unsigned char * page_list, int num);
     ~supported_vpd_pages() { num_valid = 0; }
 
     bool is_supported(int vpd_page_num) const;
@@ -328,12 +332,63 @@ public:
     /* Returns 0 or less for VPD pages not supported or error */
     int num_pages() const { return num_valid; }
 
+    /* Supported VPD page numbers, num_pages() entries */
+    const unsigned char * get_pages() const { return pages; }
+
 private:
     int num_valid;      /* 0 or less for invalid */
     unsigned char pages[256];
 };
 
-extern supported_vpd_pages * supported_vpd_pages_p;
+// Set of log pages fetched back to back into one buffer arena.  The
+// response length of each page is learned on the first fetch, later
+// fetches issue a single LOG SENSE per page instead of the twin fetch
+// (length, then data) of scsiLogSense().  Keep the object per device.
+class scsi_log_batch
+{
+public:
+    scsi_log_batch();
+
+    /* Add page to plan, max_len is the maximal response length */
+    void add_page(int pagenum, int max_len = 252);
+    bool is_planned(int pagenum) const;
+    int num_planned() const { return (int)m_pages.size(); }
+    void clear();
+
+    /* Fetch all planned pages, returns number of pages fetched ok */
+    int fetch(scsi_device * device);
+
+    /* Response of page from last fetch(), NULL if failed or not planned */
+    unsigned char * get_page(int pagenum);
+    /* Error of page from last fetch(), 0 if ok, -1 if not planned */
+    int get_error(int pagenum) const;
+
+    /* Statistics of last fetch() and of all fetches */
+    unsigned get_commands() const { return m_commands; }
+    int64_t get_usec() const { return m_usec; }
+    unsigned get_total_fetches() const { return m_total_fetches; }
+    uint64_t get_total_commands() const { return m_total_commands; }
+    int64_t get_total_usec() const { return m_total_usec; }
+
+private:
+    struct page_info {
+        int pagenum;
+        int max_len;
+        int resp_len;   /* 0 if not yet known */
+        int offset;     /* in m_arena */
+        int err;        /* of last fetch */
+    };
+    std::vector<page_info> m_pages;
+    std::vector<unsigned char> m_arena;
+    unsigned m_commands;
+    int64_t m_usec;
+    unsigned m_total_fetches;
+    uint64_t m_total_commands;
+    int64_t m_total_usec;
+
+    int fetch_page(scsi_device * device, page_info & pi);
+    const page_info * find_page(int pagenum) const;
+};
 
 
 // Print SCSI debug messages?
@@ -397,6 +452,8 @@ int scsiReadCapacity16(scsi_device * device, UINT8 *pBuf, int bufLen);
 /* SMART specific commands */
 int scsiCheckIE(scsi_device * device, int hasIELogPage, int hasTempLogPage, UINT8 *asc,
                 UINT8 *ascq, UINT8 *currenttemp, UINT8 *triptemp);
+int scsiCheckIE(scsi_device * device, scsi_log_batch & batch, UINT8 *asc,
+                UINT8 *ascq, UINT8 *currenttemp, UINT8 *triptemp);
 
 int scsiFetchIECmpage(scsi_device * device, struct scsi_iec_mode_page *iecp,
                       int modese_len);
@@ -411,12 +468,13 @@ void scsiDecodeNonMediumErrPage(unsigned char * resp,
 int scsiFetchExtendedSelfTestTime(scsi_device * device, int * durationSec,
                                   int modese_len);
 int scsiCountFailedSelfTests(scsi_device * device, int noisy);
+int scsiCountFailedSelfTests(const unsigned char * resp, int noisy);
 int scsiSelfTestInProgress(scsi_device * device, int * inProgress);
 int scsiFetchControlGLTSD(scsi_device * device, int modese_len, int current);
 int scsiSetControlGLTSD(scsi_device * device, int enabled, int modese_len);
 int scsiFetchTransportProtocol(scsi_device * device, int modese_len);
 int scsiGetRPM(scsi_device * device, int modese_len, int * form_factorp,
-               int * haw_zbcp);
+               int * haw_zbcp, const supported_vpd_pages * vpd_pages);
 int scsiGetSetCache(scsi_device * device,  int modese_len, short int * wce,
                     short int * rcd);
 uint64_t scsiGetSize(scsi_device * device, unsigned int * lb_sizep,
@@ -425,6 +483,7 @@ int scsiGetProtPBInfo(scsi_device * device, unsigned char * rc16_12_31p);
 
 /* T10 Standard IE Additional Sense Code strings taken from t10.org */
 const char* scsiGetIEString(UINT8 asc, UINT8 ascq);
+const char* scsiGetIEString(UINT8 asc, UINT8 ascq, char * buff, int buff_len);
 int scsiGetTemp(scsi_device * device, UINT8 *currenttemp, UINT8 *triptemp);
 
 
@@ -44,97 +44,96 @@ const char * scsiprint_c_cvsid = "$Id$"
                                  SCSIPRINT_H_CVSID;
 
 
-UINT8 gBuf[GBUF_SIZE];
 #define LOG_RESP_LEN 252
 #define LOG_RESP_LONG_LEN ((62 * 256) + 252)
 #define LOG_RESP_TAPE_ALERT_LEN 0x144
 
-/* Log pages supported */
-static int gSmartLPage = 0;     /* Informational Exceptions log page */
-static int gTempLPage = 0;
-static int gSelfTestLPage = 0;
-static int gStartStopLPage = 0;
-static int gReadECounterLPage = 0;
-static int gWriteECounterLPage = 0;
-static int gVerifyECounterLPage = 0;
-static int gNonMediumELPage = 0;
-static int gLastNErrorLPage = 0;
-static int gBackgroundResultsLPage = 0;
-static int gProtocolSpecificLPage = 0;
-static int gTapeAlertsLPage = 0;
-static int gSSMediaLPage = 0;
-
-/* Vendor specific log pages */
-static int gSeagateCacheLPage = 0;
-static int gSeagateFactoryLPage = 0;
+scsi_print_context::scsi_print_context()
+  : buf(new UINT8[GBUF_SIZE]),
+    smartLPage(0), tempLPage(0), selfTestLPage(0), startStopLPage(0),
+    readECounterLPage(0), writeECounterLPage(0), verifyECounterLPage(0),
+    nonMediumELPage(0), lastNErrorLPage(0), backgroundResultsLPage(0),
+    protocolSpecificLPage(0), tapeAlertsLPage(0), sSMediaLPage(0),
+    seagateCacheLPage(0), seagateFactoryLPage(0),
+    iecMPage(1), // N.B. assume it until we know otherwise
+    modese_len(0),
+    vpd_pages(0),
+    log_pages_checked(false), log_pages_valid(false),
+    caps_cache(0),
+    caps_cached(false)
+{
+    memset(buf, 0, GBUF_SIZE);
+}
 
-/* Mode pages supported */
-static int gIecMPage = 1;     /* N.B. assume it until we know otherwise */
+scsi_print_context::~scsi_print_context()
+{
+    delete vpd_pages;
+    delete [] buf;
+}
 
-/* Remember last successful mode sense/select command */
-static int modese_len = 0;
+// Like scsiInquiryVpd() but skips VPD pages not supported by device.
+static int
+scsiInquiryVpdCtx(scsi_device * device, scsi_print_context & ctx,
+                  int vpd_page, UINT8 * pBuf, int bufLen)
+{
+    if (ctx.vpd_pages && !ctx.vpd_pages->is_supported(vpd_page))
+        return 3;
+    return scsiInquiryVpd(device, vpd_page, pBuf, bufLen);
+}
 
 
+// Set log page flags from list of supported log pages
 static void
-scsiGetSupportedLogPages(scsi_device * device)
+scsiSetSupportedLogPages(scsi_print_context & ctx, const UINT8 * pages,
+                         int num)
 {
-    int i, err;
-
-    if ((err = scsiLogSense(device, SUPPORTED_LPAGES, 0, gBuf,
-                            LOG_RESP_LEN, 0))) {
-        if (scsi_debugmode > 0)
-            pout("Log Sense for supported pages failed [%s]\n",
-                 scsiErrString(err));
-        return;
-    }
-
-    for (i = 4; i < gBuf[3] + LOGPAGEHDRSIZE; i++) {
-        switch (gBuf[i])
+    for (int i = 0; i < num; i++) {
+        switch (pages[i])
         {
             case READ_ERROR_COUNTER_LPAGE:
-                gReadECounterLPage = 1;
+                ctx.readECounterLPage = 1;
                 break;
             case WRITE_ERROR_COUNTER_LPAGE:
-                gWriteECounterLPage = 1;
+                ctx.writeECounterLPage = 1;
                 break;
             case VERIFY_ERROR_COUNTER_LPAGE:
-                gVerifyECounterLPage = 1;
+                ctx.verifyECounterLPage = 1;
                 break;
             case LAST_N_ERROR_LPAGE:
-                gLastNErrorLPage = 1;
+                ctx.lastNErrorLPage = 1;
                 break;
             case NON_MEDIUM_ERROR_LPAGE:
-                gNonMediumELPage = 1;
+                ctx.nonMediumELPage = 1;
                 break;
             case TEMPERATURE_LPAGE:
-                gTempLPage = 1;
+                ctx.tempLPage = 1;
                 break;
             case STARTSTOP_CYCLE_COUNTER_LPAGE:
-                gStartStopLPage = 1;
+                ctx.startStopLPage = 1;
                 break;
             case SELFTEST_RESULTS_LPAGE:
-                gSelfTestLPage = 1;
+                ctx.selfTestLPage = 1;
                 break;
             case IE_LPAGE:
-                gSmartLPage = 1;
+                ctx.smartLPage = 1;
                 break;
             case BACKGROUND_RESULTS_LPAGE:
-                gBackgroundResultsLPage = 1;
+                ctx.backgroundResultsLPage = 1;
                 break;
             case PROTOCOL_SPECIFIC_LPAGE:
-                gProtocolSpecificLPage = 1;
+                ctx.protocolSpecificLPage = 1;
                 break;
             case TAPE_ALERTS_LPAGE:
-                gTapeAlertsLPage = 1;
+                ctx.tapeAlertsLPage = 1;
                 break;
             case SS_MEDIA_LPAGE:
-                gSSMediaLPage = 1;
+                ctx.sSMediaLPage = 1;
                 break;
             case SEAGATE_CACHE_LPAGE:
-                gSeagateCacheLPage = 1;
+                ctx.seagateCacheLPage = 1;
                 break;
             case SEAGATE_FACTORY_LPAGE:
-                gSeagateFactoryLPage = 1;
+                ctx.seagateFactoryLPage = 1;
                 break;
             default:
                 break;
@@ -142,35 +141,127 @@ scsiGetSupportedLogPages(scsi_device * device)
     }
 }
 
+static void
+scsiGetSupportedLogPages(scsi_device * device, scsi_print_context & ctx)
+{
+    int err;
+
+    if (ctx.log_pages_checked)  // already known, maybe from cache
+        return;
+    ctx.log_pages_checked = true;
+
+    if ((err = scsiLogSense(device, SUPPORTED_LPAGES, 0, ctx.buf,
+                            LOG_RESP_LEN, 0))) {
+        if (scsi_debugmode > 0)
+            pout("Log Sense for supported pages failed [%s]\n",
+                 scsiErrString(err));
+        return;
+    }
+
+    ctx.log_pages.assign(ctx.buf + LOGPAGEHDRSIZE,
+                         ctx.buf + LOGPAGEHDRSIZE + ctx.buf[3]);
+    ctx.log_pages_valid = true;
+    scsiSetSupportedLogPages(ctx, ctx.buf + LOGPAGEHDRSIZE, ctx.buf[3]);
+}
+
+// Read device id from standard INQUIRY response in ctx.buf and Unit
+// Serial Number VPD page and look up capabilities in cache.  The
+// supported VPD pages in ctx.vpd_pages are always read from the device
+// because the serial number is needed first.  A cache entry with other
+// VPD pages is stale.
+static void
+scsiLookupCaps(scsi_device * device, scsi_print_context & ctx)
+{
+    UINT8 inq[36], b[252];
+    char serial[64+1];
+
+    memcpy(inq, ctx.buf, sizeof(inq));
+    serial[0] = '\0';
+    if (0 == scsiInquiryVpdCtx(device, ctx, SCSI_VPD_UNIT_SERIAL_NUMBER, b,
+                               sizeof(b))) {
+        int len = b[3];
+        if (len > (int)sizeof(b) - 4)
+            len = sizeof(b) - 4;
+        scsi_format_id_string(serial, &b[4], len);
+    }
+    ctx.caps_id = scsi_format_caps_id(inq, serial);
+    ctx.caps_fw = scsi_format_caps_fw(inq);
+
+    scsi_device_caps caps;
+    if (!ctx.caps_cache->lookup(ctx.caps_id, ctx.caps_fw, caps)) {
+        if (scsi_debugmode > 0)
+            pout("Capabilities of device [%s] not cached\n",
+                 ctx.caps_id.c_str());
+        return;
+    }
+    int num = ctx.vpd_pages->num_pages();
+    if (caps.vpd_pages != std::vector<UINT8>(ctx.vpd_pages->get_pages(),
+                          ctx.vpd_pages->get_pages() + (num > 0 ? num : 0))) {
+        if (scsi_debugmode > 0)
+            pout("Capabilities of device [%s] changed\n",
+                 ctx.caps_id.c_str());
+        return;
+    }
+
+    ctx.log_pages = caps.log_pages;
+    ctx.log_pages_checked = ctx.log_pages_valid = true;
+    if (!caps.log_pages.empty())
+        scsiSetSupportedLogPages(ctx, &caps.log_pages[0],
+                                 caps.log_pages.size());
+    if (caps.modese_len)
+        ctx.modese_len = caps.modese_len;
+    ctx.caps_cached = true;
+}
+
+// Add capabilities of device to cache if new or changed.
+static void
+scsiUpdateCaps(scsi_device * device, scsi_print_context & ctx)
+{
+    // Complete the information if not already done
+    scsiGetSupportedLogPages(device, ctx);
+    if (!(ctx.log_pages_valid && ctx.vpd_pages))
+        return;
+
+    scsi_device_caps caps;
+    caps.log_pages = ctx.log_pages;
+    int num = ctx.vpd_pages->num_pages();
+    if (num > 0)
+        caps.vpd_pages.assign(ctx.vpd_pages->get_pages(),
+                              ctx.vpd_pages->get_pages() + num);
+    caps.modese_len = ctx.modese_len;
+    ctx.caps_cache->update(ctx.caps_id, ctx.caps_fw, caps);
+}
+
 /* Returns 0 if ok, -1 if can't check IE, -2 if can check and bad
    (or at least something to report). */
 static int
-scsiGetSmartData(scsi_device * device, bool attribs)
+scsiGetSmartData(scsi_device * device, scsi_print_context & ctx, bool attribs)
 {
     UINT8 asc;
     UINT8 ascq;
     UINT8 currenttemp = 0;
     UINT8 triptemp = 0;
     const char * cp;
+    char iebuf[128];
     int err = 0;
     print_on();
-    if (scsiCheckIE(device, gSmartLPage, gTempLPage, &asc, &ascq,
+    if (scsiCheckIE(device, ctx.smartLPage, ctx.tempLPage, &asc, &ascq,
                     &currenttemp, &triptemp)) {
         /* error message already announced */
         print_off();
         return -1;
     }
     print_off();
-    cp = scsiGetIEString(asc, ascq);
+    cp = scsiGetIEString(asc, ascq, iebuf, sizeof(iebuf));
     if (cp) {
         err = -2;
         print_on();
         pout("SMART Health Status: %s [asc=%x, ascq=%x]\n", cp, asc, ascq);
         print_off();
-    } else if (gIecMPage)
+    } else if (ctx.iecMPage)
         pout("SMART Health Status: OK\n");
 
-    if (attribs && !gTempLPage) {
+    if (attribs && !ctx.tempLPage) {
         if (currenttemp) {
             if (255 != currenttemp)
                 pout("Current Drive Temperature:     %d C\n", currenttemp);
@@ -190,7 +281,7 @@ scsiGetSmartData(scsi_device * device, bool attribs)
 static const char * const severities = "CWI";
 
 static int
-scsiGetTapeAlertsData(scsi_device * device, int peripheral_type)
+scsiGetTapeAlertsData(scsi_device * device, scsi_print_context & ctx, int peripheral_type)
 {
     unsigned short pagelength;
     unsigned short parametercode;
@@ -200,24 +291,24 @@ scsiGetTapeAlertsData(scsi_device * device, int peripheral_type)
     int failures = 0;
 
     print_on();
-    if ((err = scsiLogSense(device, TAPE_ALERTS_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, TAPE_ALERTS_LPAGE, 0, ctx.buf,
                         LOG_RESP_TAPE_ALERT_LEN, LOG_RESP_TAPE_ALERT_LEN))) {
         pout("scsiGetTapesAlertData Failed [%s]\n", scsiErrString(err));
         print_off();
         return -1;
     }
-    if (gBuf[0] != 0x2e) {
+    if (ctx.buf[0] != 0x2e) {
         pout("TapeAlerts Log Sense Failed\n");
         print_off();
         return -1;
     }
-    pagelength = (unsigned short) gBuf[2] << 8 | gBuf[3];
+    pagelength = (unsigned short) ctx.buf[2] << 8 | ctx.buf[3];
 
     for (s=severities; *s; s++) {
         for (i = 4; i < pagelength; i += 5) {
-            parametercode = (unsigned short) gBuf[i] << 8 | gBuf[i+1];
+            parametercode = (unsigned short) ctx.buf[i] << 8 | ctx.buf[i+1];
 
-            if (gBuf[i + 4]) {
+            if (ctx.buf[i + 4]) {
                 ts = SCSI_PT_MEDIUM_CHANGER == peripheral_type ?
                     scsiTapeAlertsChangerDevice(parametercode) :
                     scsiTapeAlertsTapeDevice(parametercode);
@@ -240,26 +331,26 @@ scsiGetTapeAlertsData(scsi_device * device, int peripheral_type)
 }
 
 static void
-scsiGetStartStopData(scsi_device * device)
+scsiGetStartStopData(scsi_device * device, scsi_print_context & ctx)
 {
     int err, len, k, extra;
     unsigned char * ucp;
 
-    if ((err = scsiLogSense(device, STARTSTOP_CYCLE_COUNTER_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, STARTSTOP_CYCLE_COUNTER_LPAGE, 0, ctx.buf,
                             LOG_RESP_LEN, 0))) {
         print_on();
         pout("scsiGetStartStopData Failed [%s]\n", scsiErrString(err));
         print_off();
         return;
     }
-    if ((gBuf[0] & 0x3f) != STARTSTOP_CYCLE_COUNTER_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != STARTSTOP_CYCLE_COUNTER_LPAGE) {
         print_on();
         pout("StartStop Log Sense Failed, page mismatch\n");
         print_off();
         return;
     }
-    len = ((gBuf[2] << 8) | gBuf[3]);
-    ucp = gBuf + 4;
+    len = ((ctx.buf[2] << 8) | ctx.buf[3]);
+    ucp = ctx.buf + 4;
     for (k = len; k > 0; k -= extra, ucp += extra) {
         if (k < 3) {
             print_on();
@@ -317,18 +408,18 @@ scsiGetStartStopData(scsi_device * device)
 }
 
 static void
-scsiPrintGrownDefectListLen(scsi_device * device)
+scsiPrintGrownDefectListLen(scsi_device * device, scsi_print_context & ctx)
 {
     int err, dl_format, got_rd12;
     unsigned int dl_len, div;
 
-    memset(gBuf, 0, 8);
+    memset(ctx.buf, 0, 8);
     if ((err = scsiReadDefect12(device, 0 /* req_plist */, 1 /* req_glist */,
                                 4 /* format: bytes from index */,
-                                0 /* addr desc index */, gBuf, 8))) {
+                                0 /* addr desc index */, ctx.buf, 8))) {
         if (2 == err) { /* command not supported */
             if ((err = scsiReadDefect10(device, 0 /* req_plist */, 1 /* req_glist */,
-                                        4 /* format: bytes from index */, gBuf, 4))) {
+                                        4 /* format: bytes from index */, ctx.buf, 4))) {
                 if (scsi_debugmode > 0) {
                     print_on();
                     pout("Read defect list (10) Failed: %s\n", scsiErrString(err));
@@ -351,24 +442,24 @@ scsiPrintGrownDefectListLen(scsi_device * device)
         got_rd12 = 1;
 
     if (got_rd12) {
-        int generation = (gBuf[2] << 8) + gBuf[3];
+        int generation = (ctx.buf[2] << 8) + ctx.buf[3];
         if ((generation > 1) && (scsi_debugmode > 0)) {
             print_on();
             pout("Read defect list (12): generation=%d\n", generation);
             print_off();
         }
-        dl_len = (gBuf[4] << 24) + (gBuf[5] << 16) + (gBuf[6] << 8) + gBuf[7];
+        dl_len = (ctx.buf[4] << 24) + (ctx.buf[5] << 16) + (ctx.buf[6] << 8) + ctx.buf[7];
     } else {
-        dl_len = (gBuf[2] << 8) + gBuf[3];
+        dl_len = (ctx.buf[2] << 8) + ctx.buf[3];
     }
-    if (0x8 != (gBuf[1] & 0x18)) {
+    if (0x8 != (ctx.buf[1] & 0x18)) {
         print_on();
         pout("Read defect list: asked for grown list but didn't get it\n");
         print_off();
         return;
     }
     div = 0;
-    dl_format = (gBuf[1] & 0x7);
+    dl_format = (ctx.buf[1] & 0x7);
     switch (dl_format) {
         case 0:     /* short block */
             div = 4;
@@ -401,28 +492,28 @@ scsiPrintGrownDefectListLen(scsi_device * device)
 }
 
 static void
-scsiPrintSeagateCacheLPage(scsi_device * device)
+scsiPrintSeagateCacheLPage(scsi_device * device, scsi_print_context & ctx)
 {
     int num, pl, pc, err, len;
     unsigned char * ucp;
     uint64_t ull;
 
-    if ((err = scsiLogSense(device, SEAGATE_CACHE_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, SEAGATE_CACHE_LPAGE, 0, ctx.buf,
                             LOG_RESP_LEN, 0))) {
         print_on();
         pout("Seagate Cache Log Sense Failed: %s\n", scsiErrString(err));
         print_off();
         return;
     }
-    if ((gBuf[0] & 0x3f) != SEAGATE_CACHE_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != SEAGATE_CACHE_LPAGE) {
         print_on();
         pout("Seagate Cache Log Sense Failed, page mismatch\n");
         print_off();
         return;
     }
-    len = ((gBuf[2] << 8) | gBuf[3]) + 4;
+    len = ((ctx.buf[2] << 8) | ctx.buf[3]) + 4;
     num = len - 4;
-    ucp = &gBuf[0] + 4;
+    ucp = &ctx.buf[0] + 4;
     while (num > 3) {
         pc = (ucp[0] << 8) | ucp[1];
         pl = ucp[3] + 4;
@@ -443,7 +534,7 @@ scsiPrintSeagateCacheLPage(scsi_device * device)
     }
     pout("Vendor (Seagate) cache information\n");
     num = len - 4;
-    ucp = &gBuf[0] + 4;
+    ucp = &ctx.buf[0] + 4;
     while (num > 3) {
         pc = (ucp[0] << 8) | ucp[1];
         pl = ucp[3] + 4;
@@ -477,28 +568,28 @@ scsiPrintSeagateCacheLPage(scsi_device * device)
 }
 
 static void
-scsiPrintSeagateFactoryLPage(scsi_device * device)
+scsiPrintSeagateFactoryLPage(scsi_device * device, scsi_print_context & ctx)
 {
     int num, pl, pc, len, err, good, bad;
     unsigned char * ucp;
     uint64_t ull;
 
-    if ((err = scsiLogSense(device, SEAGATE_FACTORY_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, SEAGATE_FACTORY_LPAGE, 0, ctx.buf,
                             LOG_RESP_LEN, 0))) {
         print_on();
         pout("scsiPrintSeagateFactoryLPage Failed [%s]\n", scsiErrString(err));
         print_off();
         return;
     }
-    if ((gBuf[0] & 0x3f) != SEAGATE_FACTORY_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != SEAGATE_FACTORY_LPAGE) {
         print_on();
         pout("Seagate/Hitachi Factory Log Sense Failed, page mismatch\n");
         print_off();
         return;
     }
-    len = ((gBuf[2] << 8) | gBuf[3]) + 4;
+    len = ((ctx.buf[2] << 8) | ctx.buf[3]) + 4;
     num = len - 4;
-    ucp = &gBuf[0] + 4;
+    ucp = &ctx.buf[0] + 4;
     good = 0;
     bad = 0;
     while (num > 3) {
@@ -526,7 +617,7 @@ scsiPrintSeagateFactoryLPage(scsi_device * device)
     }
     pout("Vendor (Seagate/Hitachi) factory information\n");
     num = len - 4;
-    ucp = &gBuf[0] + 4;
+    ucp = &ctx.buf[0] + 4;
     while (num > 3) {
         pc = (ucp[0] << 8) | ucp[1];
         pl = ucp[3] + 4;
@@ -572,25 +663,43 @@ scsiPrintSeagateFactoryLPage(scsi_device * device)
 }
 
 static void
-scsiPrintErrorCounterLog(scsi_device * device)
+scsiPrintErrorCounterLog(scsi_device * device, scsi_print_context & ctx)
 {
     struct scsiErrorCounter errCounterArr[3];
     struct scsiErrorCounter * ecp;
     int found[3] = {0, 0, 0};
+    UINT8 * resp;
+
+    // Read all pages back to back
+    scsi_log_batch lp;
+    if (ctx.readECounterLPage)
+        lp.add_page(READ_ERROR_COUNTER_LPAGE, LOG_RESP_LEN);
+    if (ctx.writeECounterLPage)
+        lp.add_page(WRITE_ERROR_COUNTER_LPAGE, LOG_RESP_LEN);
+    if (ctx.verifyECounterLPage)
+        lp.add_page(VERIFY_ERROR_COUNTER_LPAGE, LOG_RESP_LEN);
+    if (ctx.nonMediumELPage)
+        lp.add_page(NON_MEDIUM_ERROR_LPAGE, LOG_RESP_LEN);
+    if (ctx.lastNErrorLPage)
+        lp.add_page(LAST_N_ERROR_LPAGE, LOG_RESP_LONG_LEN);
+    if (lp.num_planned() > 0) {
+        int num_ok = lp.fetch(device);
+        if (scsi_debugmode > 0)
+            pout("Read %d of %d error counter log pages, %u commands, "
+                 "%d.%03d ms\n", num_ok, lp.num_planned(), lp.get_commands(),
+                 (int)(lp.get_usec() / 1000), (int)(lp.get_usec() % 1000));
+    }
 
-    if (gReadECounterLPage && (0 == scsiLogSense(device,
-                READ_ERROR_COUNTER_LPAGE, 0, gBuf, LOG_RESP_LEN, 0))) {
-        scsiDecodeErrCounterPage(gBuf, &errCounterArr[0]);
+    if ((resp = lp.get_page(READ_ERROR_COUNTER_LPAGE))) {
+        scsiDecodeErrCounterPage(resp, &errCounterArr[0]);
         found[0] = 1;
     }
-    if (gWriteECounterLPage && (0 == scsiLogSense(device,
-                WRITE_ERROR_COUNTER_LPAGE, 0, gBuf, LOG_RESP_LEN, 0))) {
-        scsiDecodeErrCounterPage(gBuf, &errCounterArr[1]);
+    if ((resp = lp.get_page(WRITE_ERROR_COUNTER_LPAGE))) {
+        scsiDecodeErrCounterPage(resp, &errCounterArr[1]);
         found[1] = 1;
     }
-    if (gVerifyECounterLPage && (0 == scsiLogSense(device,
-                VERIFY_ERROR_COUNTER_LPAGE, 0, gBuf, LOG_RESP_LEN, 0))) {
-        scsiDecodeErrCounterPage(gBuf, &errCounterArr[2]);
+    if ((resp = lp.get_page(VERIFY_ERROR_COUNTER_LPAGE))) {
+        scsiDecodeErrCounterPage(resp, &errCounterArr[2]);
         ecp = &errCounterArr[2];
         for (int k = 0; k < 7; ++k) {
             if (ecp->gotPC[k] && ecp->counter[k]) {
@@ -621,10 +730,9 @@ scsiPrintErrorCounterLog(scsi_device * device)
     }
     else
         pout("Error Counter logging not supported\n");
-    if (gNonMediumELPage && (0 == scsiLogSense(device,
-                NON_MEDIUM_ERROR_LPAGE, 0, gBuf, LOG_RESP_LEN, 0))) {
+    if ((resp = lp.get_page(NON_MEDIUM_ERROR_LPAGE))) {
         struct scsiNonMediumError nme;
-        scsiDecodeNonMediumErrPage(gBuf, &nme);
+        scsiDecodeNonMediumErrPage(resp, &nme);
         if (nme.gotPC0)
             pout("\nNon-medium error count: %8" PRIu64 "\n", nme.counterPC0);
         if (nme.gotTFE_H)
@@ -634,13 +742,12 @@ scsiPrintErrorCounterLog(scsi_device * device)
             pout("Positioning error count [Hitachi]: %8" PRIu64 "\n",
                  nme.counterPE_H);
     }
-    if (gLastNErrorLPage && (0 == scsiLogSense(device,
-                LAST_N_ERROR_LPAGE, 0, gBuf, LOG_RESP_LONG_LEN, 0))) {
-        int num = (gBuf[2] << 8) + gBuf[3] + 4;
+    if ((resp = lp.get_page(LAST_N_ERROR_LPAGE))) {
+        int num = (resp[2] << 8) + resp[3] + 4;
         int truncated = (num > LOG_RESP_LONG_LEN) ? num : 0;
         if (truncated)
             num = LOG_RESP_LONG_LEN;
-        unsigned char * ucp = gBuf + 4;
+        unsigned char * ucp = resp + 4;
         num -= 4;
         if (num < 4)
             pout("\nNo error events logged\n");
@@ -713,7 +820,7 @@ static const char * self_test_result[] = {
 // 20 self tests fail (result code 3 to 7 inclusive) then FAILLOG and/or
 // FAILSMART is returned.
 static int
-scsiPrintSelfTest(scsi_device * device)
+scsiPrintSelfTest(scsi_device * device, scsi_print_context & ctx)
 {
     int num, k, err, durationSec;
     int noheader = 1;
@@ -730,21 +837,21 @@ scsiPrintSelfTest(scsi_device * device)
              100 - ((sense_info.progress * 100) / 65535));
     }
 
-    if ((err = scsiLogSense(device, SELFTEST_RESULTS_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, SELFTEST_RESULTS_LPAGE, 0, ctx.buf,
                             LOG_RESP_SELF_TEST_LEN, 0))) {
         print_on();
         pout("scsiPrintSelfTest Failed [%s]\n", scsiErrString(err));
         print_off();
         return FAILSMART;
     }
-    if ((gBuf[0] & 0x3f) != SELFTEST_RESULTS_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != SELFTEST_RESULTS_LPAGE) {
         print_on();
         pout("Self-test Log Sense Failed, page mismatch\n");
         print_off();
         return FAILSMART;
     }
     // compute page length
-    num = (gBuf[2] << 8) + gBuf[3];
+    num = (ctx.buf[2] << 8) + ctx.buf[3];
     // Log sense page length 0x190 bytes
     if (num != 0x190) {
         print_on();
@@ -753,7 +860,7 @@ scsiPrintSelfTest(scsi_device * device)
         return FAILSMART;
     }
     // loop through the twenty possible entries
-    for (k = 0, ucp = gBuf + 4; k < 20; ++k, ucp += 20 ) {
+    for (k = 0, ucp = ctx.buf + 4; k < 20; ++k, ucp += 20 ) {
         int i;
 
         // timestamp in power-on hours (or zero if test in progress)
@@ -860,7 +967,7 @@ scsiPrintSelfTest(scsi_device * device)
         pout("No self-tests have been logged\n");
     else
     if ((0 == scsiFetchExtendedSelfTestTime(device, &durationSec,
-                        modese_len)) && (durationSec > 0)) {
+                        ctx.modese_len)) && (durationSec > 0)) {
         pout("\nLong (extended) Self Test duration: %d seconds "
              "[%.1f minutes]\n", durationSec, durationSec / 60.0);
     }
@@ -897,7 +1004,7 @@ static const char * reassign_status[] = {
 // and up to 2048 events (although would hope to have less). May set
 // FAILLOG if serious errors detected (in the future).
 static int
-scsiPrintBackgroundResults(scsi_device * device)
+scsiPrintBackgroundResults(scsi_device * device, scsi_print_context & ctx)
 {
     int num, j, m, err, truncated;
     int noheader = 1;
@@ -905,21 +1012,21 @@ scsiPrintBackgroundResults(scsi_device * device)
     int retval = 0;
     UINT8 * ucp;
 
-    if ((err = scsiLogSense(device, BACKGROUND_RESULTS_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, BACKGROUND_RESULTS_LPAGE, 0, ctx.buf,
                             LOG_RESP_LONG_LEN, 0))) {
         print_on();
         pout("scsiPrintBackgroundResults Failed [%s]\n", scsiErrString(err));
         print_off();
         return FAILSMART;
     }
-    if ((gBuf[0] & 0x3f) != BACKGROUND_RESULTS_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != BACKGROUND_RESULTS_LPAGE) {
         print_on();
         pout("Background scan results Log Sense Failed, page mismatch\n");
         print_off();
         return FAILSMART;
     }
     // compute page length
-    num = (gBuf[2] << 8) + gBuf[3] + 4;
+    num = (ctx.buf[2] << 8) + ctx.buf[3] + 4;
     if (num < 20) {
         print_on();
         pout("Background scan results Log Sense length is %d, no scan "
@@ -930,7 +1037,7 @@ scsiPrintBackgroundResults(scsi_device * device)
     truncated = (num > LOG_RESP_LONG_LEN) ? num : 0;
     if (truncated)
         num = LOG_RESP_LONG_LEN;
-    ucp = gBuf + 4;
+    ucp = ctx.buf + 4;
     num -= 4;
     while (num > 3) {
         int pc = (ucp[0] << 8) | ucp[1];
@@ -1006,27 +1113,27 @@ scsiPrintBackgroundResults(scsi_device * device)
 // and up to 2048 events (although would hope to have less). May set
 // FAILLOG if serious errors detected (in the future).
 static int
-scsiPrintSSMedia(scsi_device * device)
+scsiPrintSSMedia(scsi_device * device, scsi_print_context & ctx)
 {
     int num, err, truncated;
     int retval = 0;
     UINT8 * ucp;
 
-    if ((err = scsiLogSense(device, SS_MEDIA_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, SS_MEDIA_LPAGE, 0, ctx.buf,
                             LOG_RESP_LONG_LEN, 0))) {
         print_on();
         pout("scsiPrintSSMedia Failed [%s]\n", scsiErrString(err));
         print_off();
         return FAILSMART;
     }
-    if ((gBuf[0] & 0x3f) != SS_MEDIA_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != SS_MEDIA_LPAGE) {
         print_on();
         pout("Solid state media Log Sense Failed, page mismatch\n");
         print_off();
         return FAILSMART;
     }
     // compute page length
-    num = (gBuf[2] << 8) + gBuf[3] + 4;
+    num = (ctx.buf[2] << 8) + ctx.buf[3] + 4;
     if (num < 12) {
         print_on();
         pout("Solid state media Log Sense length is %d, too short\n", num);
@@ -1036,7 +1143,7 @@ scsiPrintSSMedia(scsi_device * device)
     truncated = (num > LOG_RESP_LONG_LEN) ? num : 0;
     if (truncated)
         num = LOG_RESP_LONG_LEN;
-    ucp = gBuf + 4;
+    ucp = ctx.buf + 4;
     num -= 4;
     while (num > 3) {
         int pc = (ucp[0] << 8) | ucp[1];
@@ -1351,26 +1458,26 @@ show_protocol_specific_page(unsigned char * resp, int len)
 // See Serial Attached SCSI (SPL-3) (e.g. revision 6g) the Protocol Specific
 // log page [0x18]. Returns 0 if ok else FAIL* bitmask.
 static int
-scsiPrintSasPhy(scsi_device * device, int reset)
+scsiPrintSasPhy(scsi_device * device, scsi_print_context & ctx, int reset)
 {
     int num, err;
 
-    if ((err = scsiLogSense(device, PROTOCOL_SPECIFIC_LPAGE, 0, gBuf,
+    if ((err = scsiLogSense(device, PROTOCOL_SPECIFIC_LPAGE, 0, ctx.buf,
                             LOG_RESP_LONG_LEN, 0))) {
         print_on();
         pout("scsiPrintSasPhy Log Sense Failed [%s]\n\n", scsiErrString(err));
         print_off();
         return FAILSMART;
     }
-    if ((gBuf[0] & 0x3f) != PROTOCOL_SPECIFIC_LPAGE) {
+    if ((ctx.buf[0] & 0x3f) != PROTOCOL_SPECIFIC_LPAGE) {
         print_on();
         pout("Protocol specific Log Sense Failed, page mismatch\n\n");
         print_off();
         return FAILSMART;
     }
     // compute page length
-    num = (gBuf[2] << 8) + gBuf[3];
-    if (1 != show_protocol_specific_page(gBuf, num + 4)) {
+    num = (ctx.buf[2] << 8) + ctx.buf[3];
+    if (1 != show_protocol_specific_page(ctx.buf, num + 4)) {
         print_on();
         pout("Only support protocol specific log page on SAS devices\n\n");
         print_off();
@@ -1446,7 +1553,7 @@ static const char * transport_proto_arr[] = {
 
 /* Returns 0 on success, 1 on general error and 2 for early, clean exit */
 static int
-scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
+scsiGetDriveInfo(scsi_device * device, scsi_print_context & ctx, UINT8 * peripheral_type, bool all)
 {
     char timedatetz[DATEANDEPOCHLEN];
     struct scsi_iec_mode_page iec;
@@ -1458,16 +1565,16 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
     int haw_zbc = 0;
     int protect = 0;
 
-    memset(gBuf, 0, 96);
+    memset(ctx.buf, 0, 96);
     req_len = 36;
-    if ((err = scsiStdInquiry(device, gBuf, req_len))) {
+    if ((err = scsiStdInquiry(device, ctx.buf, req_len))) {
         print_on();
         pout("Standard Inquiry (36 bytes) failed [%s]\n", scsiErrString(err));
         pout("Retrying with a 64 byte Standard Inquiry\n");
         print_off();
         /* Marvell controllers fail on a 36 bytes StdInquiry, but 64 suffices */
         req_len = 64;
-        if ((err = scsiStdInquiry(device, gBuf, req_len))) {
+        if ((err = scsiStdInquiry(device, ctx.buf, req_len))) {
             print_on();
             pout("Standard Inquiry (64 bytes) failed [%s]\n",
                  scsiErrString(err));
@@ -1475,9 +1582,9 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
             return 1;
         }
     }
-    avail_len = gBuf[4] + 5;
+    avail_len = ctx.buf[4] + 5;
     len = (avail_len < req_len) ? avail_len : req_len;
-    peri_dt = gBuf[0] & 0x1f;
+    peri_dt = ctx.buf[0] & 0x1f;
     *peripheral_type = peri_dt;
 
     if (len < 36) {
@@ -1488,18 +1595,18 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
     }
     // Upper bits of version bytes were used in older standards
     // Only interested in SPC-4 (0x6) and SPC-5 (assumed to be 0x7)
-    scsi_version = gBuf[2] & 0x7;
+    scsi_version = ctx.buf[2] & 0x7;
 
-    if (all && (0 != strncmp((char *)&gBuf[8], "ATA", 3))) {
+    if (all && (0 != strncmp((char *)&ctx.buf[8], "ATA", 3))) {
         char vendor[8+1], product[16+1], revision[4+1];
-        scsi_format_id_string(vendor, (const unsigned char *)&gBuf[8], 8);
-        scsi_format_id_string(product, (const unsigned char *)&gBuf[16], 16);
-        scsi_format_id_string(revision, (const unsigned char *)&gBuf[32], 4);
+        scsi_format_id_string(vendor, (const unsigned char *)&ctx.buf[8], 8);
+        scsi_format_id_string(product, (const unsigned char *)&ctx.buf[16], 16);
+        scsi_format_id_string(revision, (const unsigned char *)&ctx.buf[32], 4);
 
         pout("=== START OF INFORMATION SECTION ===\n");
         pout("Vendor:               %.8s\n", vendor);
         pout("Product:              %.16s\n", product);
-        if (gBuf[32] >= ' ')
+        if (ctx.buf[32] >= ' ')
             pout("Revision:             %.4s\n", revision);
         if (scsi_version == 0x6)
             pout("Compliance:           SPC-4\n");
@@ -1508,15 +1615,17 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
     }
 
     if (!*device->get_req_type()/*no type requested*/ &&
-               (0 == strncmp((char *)&gBuf[8], "ATA", 3))) {
+               (0 == strncmp((char *)&ctx.buf[8], "ATA", 3))) {
         pout("\nProbable ATA device behind a SAT layer\n"
              "Try an additional '-d ata' or '-d sat' argument.\n");
         return 2;
     }
+    if (ctx.caps_cache)
+        scsiLookupCaps(device, ctx);
     if (! all)
         return 0;
 
-    protect = gBuf[5] & 0x1;    /* from and including SPC-3 */
+    protect = ctx.buf[5] & 0x1;    /* from and including SPC-3 */
 
     if (! is_tape) {    /* only do this for disks */
         unsigned int lb_size = 0;
@@ -1577,7 +1686,7 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
                 lbprz = !! (rc16_12[2] & 0x40);
             }
         }
-        if (0 == scsiInquiryVpd(device, SCSI_VPD_LOGICAL_BLOCK_PROVISIONING,
+        if (0 == scsiInquiryVpdCtx(device, ctx, SCSI_VPD_LOGICAL_BLOCK_PROVISIONING,
                                 lb_prov_resp, sizeof(lb_prov_resp))) {
             int prov_type = lb_prov_resp[6] & 0x7;
 
@@ -1602,7 +1711,8 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
         } else if (1 == lbpme)
             pout("Logical block provisioning enabled, LBPRZ=%d\n", lbprz);
 
-        int rpm = scsiGetRPM(device, modese_len, &form_factor, &haw_zbc);
+        int rpm = scsiGetRPM(device, ctx.modese_len, &form_factor, &haw_zbc,
+                             ctx.vpd_pages);
         if (rpm >= 0) {
             if (0 == rpm)
                 ;       // Not reported
@@ -1642,24 +1752,24 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
 
     /* Do this here to try and detect badly conforming devices (some USB
        keys) that will lock up on a InquiryVpd or log sense or ... */
-    if ((iec_err = scsiFetchIECmpage(device, &iec, modese_len))) {
+    if ((iec_err = scsiFetchIECmpage(device, &iec, ctx.modese_len))) {
         if (SIMPLE_ERR_BAD_RESP == iec_err) {
             pout(">> Terminate command early due to bad response to IEC "
                  "mode page\n");
             print_off();
-            gIecMPage = 0;
+            ctx.iecMPage = 0;
             return 1;
         }
     } else
-        modese_len = iec.modese_len;
+        ctx.modese_len = iec.modese_len;
 
     if (! dont_print_serial_number) {
-        if (0 == (err = scsiInquiryVpd(device, SCSI_VPD_DEVICE_IDENTIFICATION,
-                                       gBuf, 252))) {
+        if (0 == (err = scsiInquiryVpdCtx(device, ctx, SCSI_VPD_DEVICE_IDENTIFICATION,
+                                       ctx.buf, 252))) {
             char s[256];
 
-            len = gBuf[3];
-            scsi_decode_lu_dev_id(gBuf + 4, len, s, sizeof(s), &transport);
+            len = ctx.buf[3];
+            scsi_decode_lu_dev_id(ctx.buf + 4, len, s, sizeof(s), &transport);
             if (strlen(s) > 0)
                 pout("Logical Unit id:      %s\n", s);
         } else if (scsi_debugmode > 0) {
@@ -1670,13 +1780,13 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
                 pout("Vital Product Data (VPD) INQUIRY failed [%d]\n", err);
             print_off();
         }
-        if (0 == (err = scsiInquiryVpd(device, SCSI_VPD_UNIT_SERIAL_NUMBER,
-                                       gBuf, 252))) {
+        if (0 == (err = scsiInquiryVpdCtx(device, ctx, SCSI_VPD_UNIT_SERIAL_NUMBER,
+                                       ctx.buf, 252))) {
             char serial[256];
-            len = gBuf[3];
+            len = ctx.buf[3];
 
-            gBuf[4 + len] = '\0';
-            scsi_format_id_string(serial, &gBuf[4], len);
+            ctx.buf[4 + len] = '\0';
+            scsi_format_id_string(serial, &ctx.buf[4], len);
             pout("Serial number:        %s\n", serial);
         } else if (scsi_debugmode > 0) {
             print_on();
@@ -1697,7 +1807,7 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
 
     // See if transport protocol is known
     if (transport < 0)
-        transport = scsiFetchTransportProtocol(device, modese_len);
+        transport = scsiFetchTransportProtocol(device, ctx.modese_len);
     if ((transport >= 0) && (transport <= 0xf))
         pout("Transport protocol:   %s\n", transport_proto_arr[transport]);
 
@@ -1742,7 +1852,7 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
                 pout(" [%s]\n", scsiErrString(iec_err));
             print_off();
         }
-        gIecMPage = 0;
+        ctx.iecMPage = 0;
         return 0;
     }
 
@@ -1757,19 +1867,19 @@ scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool all)
 }
 
 static int
-scsiSmartEnable(scsi_device * device)
+scsiSmartEnable(scsi_device * device, scsi_print_context & ctx)
 {
     struct scsi_iec_mode_page iec;
     int err;
 
-    if ((err = scsiFetchIECmpage(device, &iec, modese_len))) {
+    if ((err = scsiFetchIECmpage(device, &iec, ctx.modese_len))) {
         print_on();
         pout("unable to fetch IEC (SMART) mode page [%s]\n",
              scsiErrString(err));
         print_off();
         return 1;
     } else
-        modese_len = iec.modese_len;
+        ctx.modese_len = iec.modese_len;
 
     if ((err = scsiSetExceptionControlAndWarning(device, 1, &iec))) {
         print_on();
@@ -1779,12 +1889,12 @@ scsiSmartEnable(scsi_device * device)
         return 1;
     }
     /* Need to refetch 'iec' since could be modified by previous call */
-    if ((err = scsiFetchIECmpage(device, &iec, modese_len))) {
+    if ((err = scsiFetchIECmpage(device, &iec, ctx.modese_len))) {
         pout("unable to fetch IEC (SMART) mode page [%s]\n",
              scsiErrString(err));
         return 1;
     } else
-        modese_len = iec.modese_len;
+        ctx.modese_len = iec.modese_len;
 
     pout("Informational Exceptions (SMART) %s\n",
          scsi_IsExceptionControlEnabled(&iec) ? "enabled" : "disabled");
@@ -1794,19 +1904,19 @@ scsiSmartEnable(scsi_device * device)
 }
 
 static int
-scsiSmartDisable(scsi_device * device)
+scsiSmartDisable(scsi_device * device, scsi_print_context & ctx)
 {
     struct scsi_iec_mode_page iec;
     int err;
 
-    if ((err = scsiFetchIECmpage(device, &iec, modese_len))) {
+    if ((err = scsiFetchIECmpage(device, &iec, ctx.modese_len))) {
         print_on();
         pout("unable to fetch IEC (SMART) mode page [%s]\n",
              scsiErrString(err));
         print_off();
         return 1;
     } else
-        modese_len = iec.modese_len;
+        ctx.modese_len = iec.modese_len;
 
     if ((err = scsiSetExceptionControlAndWarning(device, 0, &iec))) {
         print_on();
@@ -1816,12 +1926,12 @@ scsiSmartDisable(scsi_device * device)
         return 1;
     }
     /* Need to refetch 'iec' since could be modified by previous call */
-    if ((err = scsiFetchIECmpage(device, &iec, modese_len))) {
+    if ((err = scsiFetchIECmpage(device, &iec, ctx.modese_len))) {
         pout("unable to fetch IEC (SMART) mode page [%s]\n",
              scsiErrString(err));
         return 1;
     } else
-        modese_len = iec.modese_len;
+        ctx.modese_len = iec.modese_len;
 
     pout("Informational Exceptions (SMART) %s\n",
          scsi_IsExceptionControlEnabled(&iec) ? "enabled" : "disabled");
@@ -1854,6 +1964,15 @@ scsiPrintTemp(scsi_device * device)
 /* Main entry point used by smartctl command. Return 0 for success */
 int
 scsiPrintMain(scsi_device * device, const scsi_print_options & options)
+{
+    scsi_print_context ctx;
+    return scsiPrintMain(device, options, ctx);
+}
+
+/* Body of scsiPrintMain() */
+static int
+scsiPrintDevice(scsi_device * device, const scsi_print_options & options,
+                scsi_print_context & ctx)
 {
     int checkedSupportedLogPages = 0;
     UINT8 peripheral_type = 0;
@@ -1863,13 +1982,14 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
 
     bool any_output = options.drive_info;
 
-    if (supported_vpd_pages_p) {
-        delete supported_vpd_pages_p;
-        supported_vpd_pages_p = NULL;
-    }
-    supported_vpd_pages_p = new supported_vpd_pages(device);
+    delete ctx.vpd_pages;
+    ctx.vpd_pages = 0;
+    ctx.log_pages_checked = ctx.log_pages_valid = false;
+    ctx.caps_id.clear(); ctx.caps_fw.clear();
+    ctx.caps_cached = false;
+    ctx.vpd_pages = new supported_vpd_pages(device);
 
-    res = scsiGetDriveInfo(device, &peripheral_type, options.drive_info);
+    res = scsiGetDriveInfo(device, ctx, &peripheral_type, options.drive_info);
     if (res) {
         if (2 == res)
             return 0;
@@ -1882,7 +2002,7 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
   short int wce = -1, rcd = -1;
   if (options.get_rcd || options.get_wce) {
     if (SCSI_PT_DIRECT_ACCESS == peripheral_type)
-       res = scsiGetSetCache(device, modese_len, &wce, &rcd);
+       res = scsiGetSetCache(device, ctx.modese_len, &wce, &rcd);
     else
        res = -1; // fetch for disks only
     any_output = true;
@@ -1908,19 +2028,19 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
     pout("=== START OF ENABLE/DISABLE COMMANDS SECTION ===\n");
 
     if (options.smart_enable) {
-        if (scsiSmartEnable(device))
+        if (scsiSmartEnable(device, ctx))
             failuretest(MANDATORY_CMD, returnval |= FAILSMART);
         any_output = true;
     }
 
     if (options.smart_disable) {
-        if (scsiSmartDisable(device))
+        if (scsiSmartDisable(device, ctx))
             failuretest(MANDATORY_CMD,returnval |= FAILSMART);
         any_output = true;
     }
 
     if (options.smart_auto_save_enable) {
-      if (scsiSetControlGLTSD(device, 0, modese_len)) {
+      if (scsiSetControlGLTSD(device, 0, ctx.modese_len)) {
         pout("Enable autosave (clear GLTSD bit) failed\n");
         failuretest(OPTIONAL_CMD,returnval |= FAILSMART);
       }
@@ -1934,7 +2054,7 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
     if (options.set_wce && SCSI_PT_DIRECT_ACCESS == peripheral_type) {
       short int enable = wce = (options.set_wce > 0);
       rcd = -1;
-      if (scsiGetSetCache(device, modese_len, &wce, &rcd)) {
+      if (scsiGetSetCache(device, ctx.modese_len, &wce, &rcd)) {
           pout("Write cache %sable failed: %s\n", (enable ? "en" : "dis"),
                device->get_errmsg());
           failuretest(OPTIONAL_CMD,returnval |= FAILSMART);
@@ -1949,7 +2069,7 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
       short int enable =  (options.set_rcd > 0);
       rcd = !enable;
       wce = -1;
-      if (scsiGetSetCache(device, modese_len, &wce, &rcd)) {
+      if (scsiGetSetCache(device, ctx.modese_len, &wce, &rcd)) {
           pout("Read cache %sable failed: %s\n", (enable ? "en" : "dis"),
                 device->get_errmsg());
           failuretest(OPTIONAL_CMD,returnval |= FAILSMART);
@@ -1960,7 +2080,7 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
     }
 
     if (options.smart_auto_save_disable) {
-      if (scsiSetControlGLTSD(device, 1, modese_len)) {
+      if (scsiSetControlGLTSD(device, 1, ctx.modese_len)) {
         pout("Disable autosave (set GLTSD bit) failed\n");
         failuretest(OPTIONAL_CMD,returnval |= FAILSMART);
       }
@@ -1982,20 +2102,20 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
     pout("=== START OF READ SMART DATA SECTION ===\n");
 
     if (options.smart_check_status) {
-        scsiGetSupportedLogPages(device);
+        scsiGetSupportedLogPages(device, ctx);
         checkedSupportedLogPages = 1;
         if ((SCSI_PT_SEQUENTIAL_ACCESS == peripheral_type) ||
             (SCSI_PT_MEDIUM_CHANGER == peripheral_type)) { /* tape device */
-            if (gTapeAlertsLPage) {
+            if (ctx.tapeAlertsLPage) {
                 if (options.drive_info)
                     pout("TapeAlert Supported\n");
-                if (-1 == scsiGetTapeAlertsData(device, peripheral_type))
+                if (-1 == scsiGetTapeAlertsData(device, ctx, peripheral_type))
                     failuretest(OPTIONAL_CMD, returnval |= FAILSMART);
             }
             else
                 pout("TapeAlert Not Supported\n");
         } else { /* disk, cd/dvd, enclosure, etc */
-            if ((res = scsiGetSmartData(device, options.smart_vendor_attrib))) {
+            if ((res = scsiGetSmartData(device, ctx, options.smart_vendor_attrib))) {
                 if (-2 == res)
                     returnval |= FAILSTATUS;
                 else
@@ -2007,46 +2127,46 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
 
     if (options.smart_ss_media_log) {
         if (! checkedSupportedLogPages)
-            scsiGetSupportedLogPages(device);
+            scsiGetSupportedLogPages(device, ctx);
         res = 0;
-        if (gSSMediaLPage)
-            res = scsiPrintSSMedia(device);
+        if (ctx.sSMediaLPage)
+            res = scsiPrintSSMedia(device, ctx);
         if (0 != res)
             failuretest(OPTIONAL_CMD, returnval|=res);
         any_output = true;
     }
     if (options.smart_vendor_attrib) {
         if (! checkedSupportedLogPages)
-            scsiGetSupportedLogPages(device);
-        if (gTempLPage) {
+            scsiGetSupportedLogPages(device, ctx);
+        if (ctx.tempLPage) {
             scsiPrintTemp(device);
         }
-        if (gStartStopLPage)
-            scsiGetStartStopData(device);
+        if (ctx.startStopLPage)
+            scsiGetStartStopData(device, ctx);
         if (SCSI_PT_DIRECT_ACCESS == peripheral_type) {
-            scsiPrintGrownDefectListLen(device);
-            if (gSeagateCacheLPage)
-                scsiPrintSeagateCacheLPage(device);
-            if (gSeagateFactoryLPage)
-                scsiPrintSeagateFactoryLPage(device);
+            scsiPrintGrownDefectListLen(device, ctx);
+            if (ctx.seagateCacheLPage)
+                scsiPrintSeagateCacheLPage(device, ctx);
+            if (ctx.seagateFactoryLPage)
+                scsiPrintSeagateFactoryLPage(device, ctx);
         }
         any_output = true;
     }
     if (options.smart_error_log) {
         if (! checkedSupportedLogPages)
-            scsiGetSupportedLogPages(device);
-        scsiPrintErrorCounterLog(device);
-        if (1 == scsiFetchControlGLTSD(device, modese_len, 1))
+            scsiGetSupportedLogPages(device, ctx);
+        scsiPrintErrorCounterLog(device, ctx);
+        if (1 == scsiFetchControlGLTSD(device, ctx.modese_len, 1))
             pout("\n[GLTSD (Global Logging Target Save Disable) set. "
                  "Enable Save with '-S on']\n");
         any_output = true;
     }
     if (options.smart_selftest_log) {
         if (! checkedSupportedLogPages)
-            scsiGetSupportedLogPages(device);
+            scsiGetSupportedLogPages(device, ctx);
         res = 0;
-        if (gSelfTestLPage)
-            res = scsiPrintSelfTest(device);
+        if (ctx.selfTestLPage)
+            res = scsiPrintSelfTest(device, ctx);
         else {
             pout("Device does not support Self Test logging\n");
             failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
@@ -2057,10 +2177,10 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
     }
     if (options.smart_background_log) {
         if (! checkedSupportedLogPages)
-            scsiGetSupportedLogPages(device);
+            scsiGetSupportedLogPages(device, ctx);
         res = 0;
-        if (gBackgroundResultsLPage)
-            res = scsiPrintBackgroundResults(device);
+        if (ctx.backgroundResultsLPage)
+            res = scsiPrintBackgroundResults(device, ctx);
         else {
             pout("Device does not support Background scan results logging\n");
             failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
@@ -2111,13 +2231,14 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
             return returnval | FAILSMART;
         pout("Extended Background Self Test has begun\n");
         if ((0 == scsiFetchExtendedSelfTestTime(device, &durationSec,
-                        modese_len)) && (durationSec > 0)) {
+                        ctx.modese_len)) && (durationSec > 0)) {
             time_t t = time(NULL);
 
             t += durationSec;
             pout("Please wait %d minutes for test to complete.\n",
                  durationSec / 60);
-            pout("Estimated completion time: %s\n", ctime(&t));
+            char ctimebuf[CTIMELEN];
+            pout("Estimated completion time: %s\n", time_to_ctime(ctimebuf, t));
         }
         pout("Use smartctl -X to abort test\n");
         any_output = true;
@@ -2133,8 +2254,8 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
         pout("Self Test returned without error\n");
         any_output = true;
     }
-    if (options.sasphy && gProtocolSpecificLPage) {
-        if (scsiPrintSasPhy(device, options.sasphy_reset))
+    if (options.sasphy && ctx.protocolSpecificLPage) {
+        if (scsiPrintSasPhy(device, ctx, options.sasphy_reset))
             return returnval | FAILSMART;
         any_output = true;
     }
@@ -2145,3 +2266,14 @@ scsiPrintMain(scsi_device * device, const scsi_print_options & options)
 
     return returnval;
 }
+
+/* Reentrant version, state of device is kept in ctx */
+int
+scsiPrintMain(scsi_device * device, const scsi_print_options & options,
+              scsi_print_context & ctx)
+{
+    int returnval = scsiPrintDevice(device, options, ctx);
+    if (ctx.caps_cache && !ctx.caps_id.empty())
+        scsiUpdateCaps(device, ctx);
+    return returnval;
+}
@@ -31,6 +31,8 @@
 
 #define SCSIPRINT_H_CVSID "$Id$\n"
 
+#include "devcaps.h"
+
 // Options for scsiPrintMain
 struct scsi_print_options
 {
@@ -77,6 +79,66 @@ struct scsi_print_options
     { }
 };
 
+class supported_vpd_pages;
+
+// Per-device state of scsiPrintMain(): response buffer and supported
+// log, mode and VPD pages.  scsiPrintMain() may be called concurrently
+// for different devices if each call uses its own context.
+struct scsi_print_context
+{
+  unsigned char * buf;          // Response buffer (64KiB)
+
+  // Log pages supported
+  int smartLPage;               // Informational Exceptions log page
+  int tempLPage;
+  int selfTestLPage;
+  int startStopLPage;
+  int readECounterLPage;
+  int writeECounterLPage;
+  int verifyECounterLPage;
+  int nonMediumELPage;
+  int lastNErrorLPage;
+  int backgroundResultsLPage;
+  int protocolSpecificLPage;
+  int tapeAlertsLPage;
+  int sSMediaLPage;
+
+  // Vendor specific log pages
+  int seagateCacheLPage;
+  int seagateFactoryLPage;
+
+  // Mode pages supported
+  int iecMPage;
+
+  // Remember last successful mode sense/select command
+  int modese_len;
+
+  // VPD pages supported, set by scsiPrintMain()
+  supported_vpd_pages * vpd_pages;
+
+  // Supported log pages, valid if log_pages_checked and log_pages_valid
+  bool log_pages_checked;
+  bool log_pages_valid;
+  std::vector<unsigned char> log_pages;
+
+  // Capability cache, may be set by caller.  If set, scsiPrintMain()
+  // uses cached VPD, log and mode page information instead of
+  // discovery commands and adds new or changed devices to the cache.
+  device_caps_cache * caps_cache;
+  std::string caps_id, caps_fw; // Cache id of device, empty if unknown
+  bool caps_cached;             // Capabilities were read from cache
+
+  scsi_print_context();
+  ~scsi_print_context();
+
+private:
+  scsi_print_context(const scsi_print_context &);
+  void operator=(const scsi_print_context &);
+};
+
 int scsiPrintMain(scsi_device * device, const scsi_print_options & options);
 
+int scsiPrintMain(scsi_device * device, const scsi_print_options & options,
+                  scsi_print_context & ctx);
+
 #endif
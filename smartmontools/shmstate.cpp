@@ -0,0 +1,354 @@
+/*
+ * shmstate.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_SHM_OPEN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "shmstate.h"
+#include "utility.h"
+
+const char * shmstate_cpp_cvsid = "$Id$"
+                                  SHMSTATE_H_CVSID;
+
+// The layout is part of the interface
+typedef char assert_sizeof_shm_state_header[sizeof(shm_state_header) == 64 ? 1 : -1];
+typedef char assert_sizeof_shm_state_attr[sizeof(shm_state_attr) == 16 ? 1 : -1];
+typedef char assert_sizeof_shm_state_slot[sizeof(shm_state_slot) == 768 ? 1 : -1];
+
+#ifdef HAVE_SHM_OPEN
+
+// Retries of a reader until the writer finished an update
+const int max_read_retries = 10000;
+
+// Slots are allocated in multiples of this
+const unsigned slot_alloc_unit = 16;
+
+// Order memory accesses of the sequence lock
+static inline void memory_barrier()
+{
+#ifdef __GNUC__
+  __sync_synchronize();
+#endif
+}
+
+// Begin and end update of data protected by SEQ
+static inline void begin_write(volatile uint32_t & seq)
+{
+  seq = seq + 1;
+  memory_barrier();
+}
+
+static inline void end_write(volatile uint32_t & seq)
+{
+  memory_barrier();
+  seq = seq + 1;
+}
+
+// Copy SIZE bytes of data protected by SEQ at start of SRC
+static bool read_consistent(const volatile uint32_t & seq, const void * src,
+                            void * dest, size_t size)
+{
+  for (int i = 0; i < max_read_retries; i++) {
+    uint32_t s1 = seq;
+    if (s1 & 1)
+      continue;
+    memory_barrier();
+    memcpy(dest, src, size);
+    memory_barrier();
+    if (seq == s1)
+      return true;
+  }
+  errno = EAGAIN;
+  return false;
+}
+
+static size_t segment_size(unsigned num_slots)
+{
+  return sizeof(shm_state_header) + num_slots * sizeof(shm_state_slot);
+}
+
+shm_state_writer::shm_state_writer()
+: m_hdr(0), m_size(0)
+{
+}
+
+shm_state_writer::~shm_state_writer()
+{
+  close();
+}
+
+bool shm_state_writer::open(const char * name, unsigned num_devices)
+{
+  close();
+
+  unsigned num_slots = (num_devices + slot_alloc_unit) / slot_alloc_unit * slot_alloc_unit;
+  size_t size = segment_size(num_slots);
+
+  // Replace segment left by a previous process
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (fd < 0) {
+    pout("%s: cannot create shared memory segment: %s\n", name, strerror(errno));
+    return false;
+  }
+  void * p = MAP_FAILED;
+  if (!ftruncate(fd, size))
+    p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    pout("%s: cannot map shared memory segment: %s\n", name, strerror(errno));
+    ::close(fd);
+    shm_unlink(name);
+    return false;
+  }
+  ::close(fd);
+
+  // New segment is zero filled
+  shm_state_header * hdr = (shm_state_header *)p;
+  hdr->version = SHM_STATE_VERSION;
+  hdr->header_size = sizeof(shm_state_header);
+  hdr->slot_size = sizeof(shm_state_slot);
+  hdr->num_slots = num_slots;
+  hdr->pid = getpid();
+  memory_barrier();
+  // Readers check magic last
+  memcpy(hdr->magic, SHM_STATE_MAGIC, sizeof(hdr->magic));
+
+  m_name = name;
+  m_hdr = hdr;
+  m_size = size;
+  return true;
+}
+
+void shm_state_writer::close()
+{
+  if (!m_hdr)
+    return;
+  begin_write(m_hdr->seq);
+  m_hdr->closed = 1;
+  end_write(m_hdr->seq);
+  munmap((void *)m_hdr, m_size);
+  shm_unlink(m_name.c_str());
+  m_hdr = 0; m_size = 0;
+}
+
+shm_state_slot * shm_state_writer::get_slot(unsigned i) const
+{
+  if (!(m_hdr && i < m_hdr->num_slots))
+    return 0;
+  return (shm_state_slot *)((char *)m_hdr + sizeof(shm_state_header)) + i;
+}
+
+bool shm_state_writer::set_num_devices(unsigned num_devices)
+{
+  if (!m_hdr)
+    return false;
+
+  if (num_devices > m_hdr->num_slots) {
+    uint64_t generation = m_hdr->generation;
+    std::string name = m_name;
+    if (!open(name.c_str(), num_devices))
+      return false;
+    m_hdr->generation = generation;
+  }
+
+  begin_write(m_hdr->seq);
+  m_hdr->num_devices = num_devices;
+  m_hdr->generation++;
+  end_write(m_hdr->seq);
+
+  shm_state_slot empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.smart_status = -1;
+  for (unsigned i = 0; i < m_hdr->num_slots; i++)
+    update_slot(i, empty);
+  return true;
+}
+
+void shm_state_writer::update_slot(unsigned i, const shm_state_slot & data)
+{
+  shm_state_slot * slot = get_slot(i);
+  if (!slot)
+    return;
+  begin_write(slot->seq);
+  memcpy((char *)slot + sizeof(slot->seq), (const char *)&data + sizeof(data.seq),
+         sizeof(data) - sizeof(data.seq));
+  end_write(slot->seq);
+}
+
+void shm_state_writer::update_header(int64_t update_time)
+{
+  if (!m_hdr)
+    return;
+  begin_write(m_hdr->seq);
+  m_hdr->update_time = update_time;
+  m_hdr->pid = getpid();
+  end_write(m_hdr->seq);
+}
+
+shm_state_reader::shm_state_reader()
+: m_hdr(0), m_size(0)
+{
+}
+
+shm_state_reader::~shm_state_reader()
+{
+  close();
+}
+
+bool shm_state_reader::open(const char * name)
+{
+  close();
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  int err = 0;
+  if (fstat(fd, &st))
+    err = errno;
+  else if (st.st_size < (off_t)sizeof(shm_state_header))
+    err = EPROTO;
+  if (err) {
+    ::close(fd);
+    errno = err;
+    return false;
+  }
+  void * p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  err = errno;
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    errno = err;
+    return false;
+  }
+
+  const shm_state_header * hdr = (const shm_state_header *)p;
+  if (!(   !memcmp(hdr->magic, SHM_STATE_MAGIC, sizeof(hdr->magic))
+        && hdr->version == SHM_STATE_VERSION
+        && hdr->header_size >= sizeof(shm_state_header)
+        && hdr->slot_size >= sizeof(shm_state_slot)
+        && hdr->header_size + (uint64_t)hdr->num_slots * hdr->slot_size <= (uint64_t)st.st_size)) {
+    munmap(p, st.st_size);
+    errno = EPROTO;
+    return false;
+  }
+
+  m_hdr = hdr;
+  m_size = st.st_size;
+  return true;
+}
+
+void shm_state_reader::close()
+{
+  if (!m_hdr)
+    return;
+  munmap((void *)m_hdr, m_size);
+  m_hdr = 0; m_size = 0;
+}
+
+bool shm_state_reader::read_header(shm_state_header & hdr) const
+{
+  if (!m_hdr) {
+    errno = EBADF;
+    return false;
+  }
+  return read_consistent(m_hdr->seq, m_hdr, &hdr, sizeof(hdr));
+}
+
+bool shm_state_reader::read_slot(unsigned i, shm_state_slot & slot) const
+{
+  if (!(m_hdr && i < m_hdr->num_slots)) {
+    errno = EINVAL;
+    return false;
+  }
+  const shm_state_slot * src = (const shm_state_slot *)
+    ((const char *)m_hdr + m_hdr->header_size + (size_t)i * m_hdr->slot_size);
+  return read_consistent(src->seq, src, &slot, sizeof(slot));
+}
+
+#else // HAVE_SHM_OPEN
+
+shm_state_writer::shm_state_writer()
+: m_hdr(0), m_size(0)
+{
+}
+
+shm_state_writer::~shm_state_writer()
+{
+}
+
+bool shm_state_writer::open(const char * name, unsigned /*num_devices*/)
+{
+  pout("%s: shared memory not supported on this platform\n", name);
+  return false;
+}
+
+void shm_state_writer::close()
+{
+}
+
+bool shm_state_writer::set_num_devices(unsigned /*num_devices*/)
+{
+  return false;
+}
+
+void shm_state_writer::update_slot(unsigned /*i*/, const shm_state_slot & /*data*/)
+{
+}
+
+void shm_state_writer::update_header(int64_t /*update_time*/)
+{
+}
+
+shm_state_reader::shm_state_reader()
+: m_hdr(0), m_size(0)
+{
+}
+
+shm_state_reader::~shm_state_reader()
+{
+}
+
+bool shm_state_reader::open(const char * /*name*/)
+{
+  errno = ENOSYS;
+  return false;
+}
+
+void shm_state_reader::close()
+{
+}
+
+bool shm_state_reader::read_header(shm_state_header & /*hdr*/) const
+{
+  errno = ENOSYS;
+  return false;
+}
+
+bool shm_state_reader::read_slot(unsigned /*i*/, shm_state_slot & /*slot*/) const
+{
+  errno = ENOSYS;
+  return false;
+}
+
+#endif // HAVE_SHM_OPEN
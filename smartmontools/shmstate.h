@@ -0,0 +1,181 @@
+/*
+ * shmstate.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SHMSTATE_H_
+#define SHMSTATE_H_
+
+#define SHMSTATE_H_CVSID "$Id$\n"
+
+// Table of device states published by smartd '--statetable=NAME' in a
+// POSIX shared memory segment.
+//
+// The segment starts with a shm_state_header followed by 'num_slots'
+// slots of 'slot_size' bytes.  Slot i holds the state of device i
+// after its last check.  The header and each slot are protected by a
+// sequence lock: The writer increments 'seq' to an odd value before and
+// to an even value after an update.  A reader copies the data and
+// retries if 'seq' was odd or has changed meanwhile.  So readers need
+// no syscalls after mmap() and never block smartd.
+//
+// Incompatible layout changes increase SHM_STATE_VERSION.  New fields
+// are added at the end of the slot, readers must use 'slot_size'.  If
+// smartd needs more slots or exits, 'closed' is set and the segment is
+// unlinked.  Readers should then open the segment again by name.
+
+#include <string>
+
+#define SHM_STATE_MAGIC "SMARTDST"
+#define SHM_STATE_VERSION 1
+#define SHM_STATE_MAX_ATTRS 30
+
+/// Header of table, 64 bytes.
+struct shm_state_header
+{
+  char magic[8];              ///< SHM_STATE_MAGIC
+  uint32_t version;           ///< SHM_STATE_VERSION
+  uint32_t header_size;       ///< Size of header
+  uint32_t slot_size;         ///< Size of each slot
+  uint32_t num_slots;         ///< Number of slots in segment
+  volatile uint32_t seq;      ///< Sequence lock of the fields below
+  uint32_t num_devices;       ///< Number of slots in use
+  uint32_t closed;            ///< Nonzero if no longer updated
+  uint32_t pid;               ///< Process id of smartd
+  int64_t update_time;        ///< Time of last check cycle
+  uint64_t generation;        ///< Increased when the device list changes
+  char reserved[8];
+};
+
+/// Flags of shm_state_slot.
+enum {
+  SHM_STATE_ATA           = 0x0001, ///< ATA device
+  SHM_STATE_SCSI          = 0x0002, ///< SCSI device
+  SHM_STATE_CHECK_FAILED  = 0x0004, ///< Last check could not open device
+  SHM_STATE_SELFTEST_LOG  = 0x0008, ///< 'self_test_errors' is valid
+  SHM_STATE_ATA_ERROR_LOG = 0x0010, ///< 'ata_errors' is valid
+  SHM_STATE_ATA_VALUES    = 0x0020, ///< Attributes and self-test status are valid
+  SHM_STATE_SCSI_READ     = 0x0100, ///< SCSI read error counters are valid
+  SHM_STATE_SCSI_WRITE    = 0x0200, ///< SCSI write error counters are valid
+  SHM_STATE_SCSI_VERIFY   = 0x0400, ///< SCSI verify error counters are valid
+  SHM_STATE_SCSI_NONMEDIUM= 0x0800  ///< 'scsi_nonmedium' is valid
+};
+
+/// ATA SMART attribute, 16 bytes.
+struct shm_state_attr
+{
+  uint8_t id, value, worst, threshold;
+  uint32_t reserved;
+  uint64_t raw;               ///< Raw value as interpreted by smartd
+};
+
+/// State of one device, 768 bytes.
+struct shm_state_slot
+{
+  volatile uint32_t seq;      ///< Sequence lock of the fields below
+  uint32_t flags;             ///< SHM_STATE_* flags
+  char device[64];            ///< Device name, null terminated
+  char type[16];              ///< Device type, null terminated
+  int64_t last_check;         ///< Start time of last check, 0 if none
+  int64_t check_usec;         ///< Duration of last check in microseconds
+  int8_t smart_status;        ///< SMART health: 0=passed, 1=failed, -1=unknown
+  uint8_t temperature;        ///< Last temperature, 0 if unknown
+  uint8_t temp_min, temp_max; ///< Min/Max temperature, 0 if unknown
+  uint8_t self_test_exec_status; ///< ATA self-test execution status byte
+  uint8_t num_attrs;          ///< Number of entries in 'attrs'
+  uint16_t power_skip_count;  ///< Checks skipped due to power mode
+  uint32_t self_test_errors;  ///< Errors in self-test log
+  uint32_t ata_errors;        ///< Errors in ATA error log
+  uint64_t num_checks;        ///< Number of checks since registration
+  shm_state_attr attrs[SHM_STATE_MAX_ATTRS]; ///< ATA SMART attributes
+  uint64_t scsi_corrected[3]; ///< SCSI read/write/verify errors corrected
+  uint64_t scsi_uncorrected[3]; ///< SCSI read/write/verify errors uncorrected
+  uint64_t scsi_bytes[3];     ///< SCSI read/write/verify bytes processed
+  uint64_t scsi_nonmedium;    ///< SCSI non-medium error count
+  char reserved[80];
+};
+
+/// Writer of the table, used by smartd.  Each slot must be updated
+/// by one thread at a time, the header by one thread only.
+class shm_state_writer
+{
+public:
+  shm_state_writer();
+  ~shm_state_writer();
+
+  /// Create segment NAME with room for at least NUM_DEVICES.  An
+  /// existing segment is replaced.  Prints error message and returns
+  /// false on error.
+  bool open(const char * name, unsigned num_devices);
+
+  /// Mark segment as closed and unlink it.
+  void close();
+
+  bool is_open() const
+    { return !!m_hdr; }
+
+  /// Set number of devices, clear all slots, increase generation.
+  /// Creates a new segment if there are not enough slots.
+  /// Prints error message and returns false on error.
+  bool set_num_devices(unsigned num_devices);
+
+  /// Copy DATA to slot I, DATA.seq is ignored.
+  void update_slot(unsigned i, const shm_state_slot & data);
+
+  /// Set update time and process id.
+  void update_header(int64_t update_time);
+
+private:
+  std::string m_name;
+  shm_state_header * m_hdr;
+  size_t m_size;
+
+  shm_state_slot * get_slot(unsigned i) const;
+
+  shm_state_writer(const shm_state_writer &);
+  void operator=(const shm_state_writer &);
+};
+
+/// Reader of the table.
+class shm_state_reader
+{
+public:
+  shm_state_reader();
+  ~shm_state_reader();
+
+  /// Map segment NAME read-only.  Sets errno and returns false on
+  /// error, errno is EPROTO if magic or version does not match.
+  bool open(const char * name);
+
+  void close();
+
+  bool is_open() const
+    { return !!m_hdr; }
+
+  /// Copy consistent header.  Returns false if writer did not finish
+  /// an update in time.
+  bool read_header(shm_state_header & hdr) const;
+
+  /// Copy consistent slot I.  Returns false if I is out of range or
+  /// writer did not finish an update in time.
+  bool read_slot(unsigned i, shm_state_slot & slot) const;
+
+private:
+  const shm_state_header * m_hdr;
+  size_t m_size;
+
+  shm_state_reader(const shm_state_reader &);
+  void operator=(const shm_state_reader &);
+};
+
+#endif // SHMSTATE_H_
@@ -28,7 +28,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <stdexcept>
+#include <limits>
+#include <string>
+#include <vector>
 #include <getopt.h>
 
 #include "config.h"
@@ -37,15 +41,22 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #if defined(__FreeBSD__)
 #include <sys/param.h>
 #endif
 
 #include "int64.h"
+#include "atacache.h"
 #include "atacmds.h"
+#include "attrlog.h"
 #include "dev_interface.h"
 #include "ataprint.h"
 #include "knowndrives.h"
+#include "localsock.h"
 #include "scsicmds.h"
 #include "scsiprint.h"
 #include "smartctl.h"
@@ -58,6 +69,67 @@ const char * smartctl_cpp_cvsid = "$Id$"
 bool printing_is_switchable = false;
 bool printing_is_off = false;
 
+// Device from command line or --device-list, see query_devices().
+struct device_query
+{
+  std::string name, type;  // Name and '-d TYPE', type may be empty
+  int status;              // Exit status of device
+  bool done;               // Query finished, protected by mutex
+
+  // Per device copies of globals
+  bool printing_is_off;
+  unsigned char failuretest_permissive;
+
+  bool capture;            // Collect output in 'output', see pout()
+  std::string output;
+
+  device_query()
+    : status(0), done(false),
+      printing_is_off(false), failuretest_permissive(0),
+      capture(false)
+    { }
+};
+
+#ifdef HAVE_PTHREADS
+// Device queried by current thread, 0 if only one device is queried.
+static pthread_key_t device_query_key;
+static bool device_query_key_created = false;
+
+static device_query * get_device_query()
+{
+  if (!device_query_key_created)
+    return 0;
+  return (device_query *)pthread_getspecific(device_query_key);
+}
+
+static void set_device_query(device_query * query)
+{
+  if (device_query_key_created)
+    pthread_setspecific(device_query_key, query);
+}
+#else
+static device_query * current_device_query = 0;
+
+static device_query * get_device_query()
+{
+  return current_device_query;
+}
+
+static void set_device_query(device_query * query)
+{
+  current_device_query = query;
+}
+#endif
+
+void set_printing_is_off(bool off)
+{
+  device_query * query = get_device_query();
+  if (query)
+    query->printing_is_off = off;
+  else
+    printing_is_off = off;
+}
+
 static void printslogan()
 {
   pout("%s\n", format_version_info("smartctl").c_str());
@@ -74,7 +146,7 @@ static std::string getvalidarglist(int opt);
 /*  void prints help information for command syntax */
 static void Usage()
 {
-  printf("Usage: smartctl [options] device\n\n");
+  printf("Usage: smartctl [options] device [device ...]\n\n");
   printf(
 "============================================ SHOW INFORMATION OPTIONS =====\n\n"
 "  -h, --help, --usage\n"
@@ -95,6 +167,14 @@ static void Usage()
 "         Scan for devices\n\n"
 "  --scan-open\n"
 "         Scan for devices and try to open each device\n\n"
+"  --attrlog=FILE[,START[-END]]\n"
+"         Print smartd attribute history FILE in CSV format\n\n"
+"  --device-list=FILE\n"
+"         Query devices listed in FILE ('-' for stdin, '--scan' format)\n\n"
+"  --capcache=FILE\n"
+"         Read and update SCSI capability and ATA log limit cache FILE\n\n"
+"  --smartd-cache=SOCKET[,MAXAGE]\n"
+"         Use ATA data cached by 'smartd -M SOCKET' if at most MAXAGE seconds old\n\n"
   );
   printf(
 "================================== SMARTCTL RUN-TIME BEHAVIOR OPTIONS =====\n\n"
@@ -109,7 +189,9 @@ static void Usage()
 "  -r TYPE, --report=TYPE\n"
 "         Report transactions (see man page)\n\n"
 "  -n MODE, --nocheck=MODE                                             (ATA)\n"
-"         No check if: never, sleep, standby, idle (see man page)\n\n",
+"         No check if: never, sleep, standby, idle (see man page)\n\n"
+"  -j N, --jobs=N\n"
+"         Query up to N devices in parallel\n\n",
   getvalidarglist('d').c_str()); // TODO: Use this function also for other options ?
   printf(
 "============================== DEVICE FEATURE ENABLE/DISABLE COMMANDS =====\n\n"
@@ -163,6 +245,8 @@ static void Usage()
 #endif
   printf(
          "]\n\n"
+"  --drivedb-compile                                                   (ATA)\n"
+"        Compile drive database file(s) into image(s) FILE.bin and exit\n\n"
 "============================================ DEVICE SELF-TEST OPTIONS =====\n\n"
 "  -t TEST, --test=TEST\n"
 "        Run test. TEST: offline, short, long, conveyance, force, vendor,N,\n"
@@ -178,7 +262,8 @@ static void Usage()
 }
 
 // Values for  --long only options, see parse_options()
-enum { opt_identify = 1000, opt_scan, opt_scan_open, opt_set, opt_smart };
+enum { opt_identify = 1000, opt_scan, opt_scan_open, opt_set, opt_smart, opt_attrlog,
+       opt_device_list, opt_capcache, opt_smartd_cache, opt_drivedb_compile };
 
 /* Returns a string containing a formatted list of the valid arguments
    to the option opt or empty on failure. Note 'v' case different */
@@ -227,6 +312,16 @@ static std::string getvalidarglist(int opt)
     return getvalidarglist(opt_smart)+", "+getvalidarglist(opt_set);
   case opt_identify:
     return "n, wn, w, v, wv, wb";
+  case opt_attrlog:
+    return "FILE[,START[-END]], START and END in seconds since 1970-01-01 UTC";
+  case 'j':
+    return "N, 1 <= N <= 64";
+  case opt_device_list:
+    return "FILE, lines in '--scan' output format, '-' for stdin";
+  case opt_capcache:
+    return "FILE";
+  case opt_smartd_cache:
+    return "SOCKET[,MAXAGE], MAXAGE in seconds, default 3600";
   case 'v':
   default:
     return "";
@@ -261,14 +356,30 @@ static checksum_err_mode_t checksum_err_mode = CHECKSUM_ERR_WARN;
 
 static void scan_devices(const char * type, bool with_open, char ** argv);
 
+static int export_attrlog(const char * path, time_t t1, time_t t2);
+
+static bool read_device_list(const char * path, const char * type,
+                             std::vector<device_query> & queries);
+
+// Max number of devices queried in parallel, set by '-j N'
+static int max_jobs = 8;
+
+// Device capability cache, set by '--capcache=FILE'
+static const char * capcache_path = 0;
+static device_caps_cache caps_cache;
+
+// smartd metrics socket and max age of cached ATA data in seconds,
+// set by '--smartd-cache=SOCKET[,MAXAGE]'
+static std::string smartd_cache_socket;
+static int smartd_cache_max_age = 3600;
 
 /*      Takes command options and sets features to be run */    
 static const char * parse_options(int argc, char** argv,
   ata_print_options & ataopts, scsi_print_options & scsiopts,
-  bool & print_type_only)
+  bool & print_type_only, std::vector<device_query> & queries)
 {
   // Please update getvalidarglist() if you edit shortopts
-  const char *shortopts = "h?Vq:d:T:b:r:s:o:S:HcAl:iaxv:P:t:CXF:n:B:f:g:";
+  const char *shortopts = "h?Vq:d:T:b:r:s:o:S:HcAl:iaxv:P:t:CXF:n:B:f:g:j:";
   // Please update getvalidarglist() if you edit longopts
   struct option longopts[] = {
     { "help",            no_argument,       0, 'h' },
@@ -305,6 +416,12 @@ static const char * parse_options(int argc, char** argv,
     { "set",             required_argument, 0, opt_set },
     { "scan",            no_argument,       0, opt_scan      },
     { "scan-open",       no_argument,       0, opt_scan_open },
+    { "attrlog",         required_argument, 0, opt_attrlog },
+    { "jobs",            required_argument, 0, 'j' },
+    { "device-list",     required_argument, 0, opt_device_list },
+    { "capcache",        required_argument, 0, opt_capcache },
+    { "smartd-cache",    required_argument, 0, opt_smartd_cache },
+    { "drivedb-compile", no_argument,       0, opt_drivedb_compile },
     { 0,                 0,                 0, 0   }
   };
 
@@ -316,6 +433,10 @@ static const char * parse_options(int argc, char** argv,
   bool use_default_db = true; // set false on '-B FILE'
   bool output_format_set = false; // set true on '-f FORMAT'
   int scan = 0; // set by --scan, --scan-open
+  bool drivedb_compile = false; // set by --drivedb-compile
+  std::string attrlog_path; // set by --attrlog
+  const char * device_list = 0; // set by --device-list
+  time_t attrlog_start = 0, attrlog_end = 0;
   bool badarg = false, captive = false;
   int testcnt = 0; // number of self-tests requested
 
@@ -942,6 +1063,72 @@ static const char * parse_options(int argc, char** argv,
       scan = optchar;
       break;
 
+    case 'j':
+      {
+        char * end = 0;
+        long n = strtol(optarg, &end, 10);
+        if (!(end != optarg && !*end && 1 <= n && n <= 64))
+          badarg = true;
+        else
+          max_jobs = (int)n;
+      }
+      break;
+
+    case opt_device_list:
+      device_list = optarg;
+      break;
+
+    case opt_capcache:
+      capcache_path = optarg;
+      break;
+
+    case opt_smartd_cache:
+      {
+        // SOCKET[,MAXAGE]
+        smartd_cache_socket = optarg;
+        size_t i = smartd_cache_socket.rfind(',');
+        if (i != std::string::npos) {
+          const char * age = smartd_cache_socket.c_str() + i + 1;
+          char * end = 0;
+          long n = strtol(age, &end, 10);
+          if (!(end != age && !*end && 0 <= n && n <= 365L*24*3600))
+            badarg = true;
+          else
+            smartd_cache_max_age = (int)n;
+          smartd_cache_socket.erase(i);
+        }
+        if (smartd_cache_socket.empty())
+          badarg = true;
+      }
+      break;
+
+    case opt_drivedb_compile:
+      drivedb_compile = true;
+      break;
+
+    case opt_attrlog:
+      {
+        // FILE[,START[-END]]
+        attrlog_path = optarg;
+        attrlog_start = 0; attrlog_end = std::numeric_limits<time_t>::max();
+        size_t i = attrlog_path.rfind(',');
+        if (i != std::string::npos) {
+          const char * range = attrlog_path.c_str() + i + 1;
+          unsigned long t1 = 0, t2 = 0;
+          int n1 = -1, n2 = -1, len = (int)strlen(range);
+          if (   sscanf(range, "%lu%n-%lu%n", &t1, &n1, &t2, &n2) >= 1
+              && (n1 == len || n2 == len)                              ) {
+            attrlog_start = (time_t)t1;
+            if (n2 == len)
+              attrlog_end = (time_t)t2;
+            attrlog_path.erase(i);
+          }
+        }
+        if (attrlog_path.empty() || attrlog_end < attrlog_start)
+          badarg = true;
+      }
+      break;
+
     case '?':
     default:
       printing_is_off = false;
@@ -988,6 +1175,9 @@ static const char * parse_options(int argc, char** argv,
       char optstr[] = { (char)optchar, 0 };
       pout("=======> INVALID ARGUMENT TO -%s: %s\n",
         (optchar == opt_identify ? "-identify" :
+         optchar == opt_attrlog ? "-attrlog" :
+         optchar == opt_device_list ? "-device-list" :
+         optchar == opt_smartd_cache ? "-smartd-cache" :
          optchar == opt_set ? "-set" :
          optchar == opt_smart ? "-smart" : optstr), optarg);
       printvalidarglistmessage(optchar);
@@ -1007,6 +1197,14 @@ static const char * parse_options(int argc, char** argv,
     EXIT(0);
   }
 
+  // Special handling of --drivedb-compile
+  if (drivedb_compile)
+    EXIT(compile_drive_databases(use_default_db) ? 0 : FAILCMD);
+
+  // Special handling of --attrlog
+  if (!attrlog_path.empty())
+    EXIT(export_attrlog(attrlog_path.c_str(), attrlog_start, attrlog_end));
+
   // At this point we have processed all command-line options.  If the
   // print output is switchable, then start with the print output
   // turned off
@@ -1059,23 +1257,36 @@ static const char * parse_options(int argc, char** argv,
 
   // From here on, normal operations...
   printslogan();
-  
+
+  // Devices from command line, then from --device-list
+  for (int i = optind; i < argc; i++) {
+    queries.push_back(device_query());
+    queries.back().name = argv[i];
+    if (type)
+      queries.back().type = type;
+  }
+  if (device_list && !read_device_list(device_list, type, queries))
+    EXIT(FAILCMD);
+
   // Warn if the user has provided no device name
-  if (argc-optind<1){
-    pout("ERROR: smartctl requires a device name as the final command-line argument.\n\n");
+  if (queries.empty()) {
+    if (device_list)
+      pout("ERROR: no devices found in device list \"%s\".\n\n", device_list);
+    else
+      pout("ERROR: smartctl requires a device name as the final command-line argument.\n\n");
     UsageSummary();
     EXIT(FAILCMD);
   }
-  
-  // Warn if the user has provided more than one device name
-  if (argc-optind>1){
-    int i;
-    pout("ERROR: smartctl takes ONE device name as the final command-line argument.\n");
-    pout("You have provided %d device names:\n",argc-optind);
-    for (i=0; i<argc-optind; i++)
-      pout("%s\n",argv[optind+i]);
-    UsageSummary();
-    EXIT(FAILCMD);
+
+  // Device "-" reads from stdin, allow only as single device
+  if (queries.size() > 1) {
+    for (unsigned i = 0; i < queries.size(); i++) {
+      if (queries[i].name == "-") {
+        pout("ERROR: device name \"-\" is not allowed in conjunction with other devices.\n");
+        UsageSummary();
+        EXIT(FAILCMD);
+      }
+    }
   }
 
   // Read or init drive database
@@ -1097,7 +1308,15 @@ void pout(const char *fmt, ...){
   
   // initialize variable argument list 
   va_start(ap,fmt);
-  if (printing_is_off) {
+  device_query * query = get_device_query();
+  if (query ? query->printing_is_off : printing_is_off) {
+    va_end(ap);
+    return;
+  }
+
+  // collect output of device queried in parallel
+  if (query && query->capture) {
+    query->output += vstrprintf(fmt, ap);
     va_end(ap);
     return;
   }
@@ -1113,6 +1332,18 @@ void pout(const char *fmt, ...){
 bool failuretest_conservative = false;
 unsigned char failuretest_permissive = 0;
 
+// Decrement '-T permissive' count of current device, return false if zero.
+bool failuretest_use_permissive()
+{
+  device_query * query = get_device_query();
+  unsigned char & permissive = (query ? query->failuretest_permissive
+                                      : failuretest_permissive);
+  if (!permissive)
+    return false;
+  permissive--;
+  return true;
+}
+
 // Compares failure type to policy in effect, and either exits or
 // simply returns to the calling routine.
 // Used in ataprint.cpp and scsiprint.cpp.
@@ -1128,7 +1359,7 @@ void failuretest(failure_type type, int returnvalue)
 
   // If this is an error in a "mandatory" SMART command
   if (type == MANDATORY_CMD) {
-    if (failuretest_permissive--)
+    if (failuretest_use_permissive())
       return;
     pout("A mandatory SMART command failed: exiting. To continue, add one or more '-T permissive' options.\n");
     EXIT(returnvalue);
@@ -1214,38 +1445,146 @@ void scan_devices(const char * type, bool with_open, char ** argv)
   }
 }
 
-// Main program without exception handling
-static int main_worker(int argc, char **argv)
+static void print_attrlog_record(const attrlog_record & rec, void * /*arg*/)
 {
-  // Throw if runtime environment does not match compile time test.
-  check_config();
+  pout("%s\n", attrlog_format_csv(rec).c_str());
+}
 
-  // Initialize interface
-  smart_interface::init();
-  if (!smi())
-    return 1;
+// Attribute history export
+// smartctl --attrlog=FILE[,START[-END]]
+int export_attrlog(const char * path, time_t t1, time_t t2)
+{
+  if (attrlog_read_range(path, t1, t2, print_attrlog_record, 0) < 0)
+    return FAILCMD;
+  return 0;
+}
 
-  // Parse input arguments
+// Read list of devices, one "NAME [-d TYPE] [...] [# comment]" per line.
+// This is the output format of '--scan' and '--scan-open'.
+// Devices without '-d TYPE' use TYPE from command line.
+bool read_device_list(const char * path, const char * type,
+                      std::vector<device_query> & queries)
+{
+  stdio_file f;
+  if (!strcmp(path, "-"))
+    f.open(stdin);
+  else if (!f.open(path, "r")) {
+    pout("%s: cannot open device list: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "#\r\n")] = 0;
+    const char * sep = " \t";
+    char * name = strtok(line, sep);
+    if (!name)
+      continue;
+    queries.push_back(device_query());
+    device_query & q = queries.back();
+    q.name = name;
+    if (type)
+      q.type = type;
+    // Ignore other options, e.g. smartd directives
+    for (char * tok; (tok = strtok(0, sep)); ) {
+      if (!strcmp(tok, "-d") && (tok = strtok(0, sep))) {
+        if (!strcmp(tok, "auto"))
+          q.type.clear();
+        else
+          q.type = tok;
+      }
+    }
+  }
+  return true;
+}
+
+// Options of query_device()
+struct query_options
+{
   ata_print_options ataopts;
   scsi_print_options scsiopts;
-  bool print_type_only = false;
-  const char * type = parse_options(argc, argv, ataopts, scsiopts, print_type_only);
+  bool print_type_only;
+
+  query_options()
+    : print_type_only(false)
+    { }
+};
+
+// Get pseudo-device serving ATA data cached by smartd.  Prints the
+// reason and returns 0 if the device must be accessed instead.
+static ata_device * get_smartd_cache_device(const char * name, const char * type)
+{
+  std::string request = strprintf("cache %s", name);
+  if (type)
+    request += strprintf(" %s", type);
+  std::string response;
+  if (!local_socket_query(smartd_cache_socket.c_str(), request.c_str(), response, 10)) {
+    pout("%s: smartd cache not available: %s, reading device\n",
+         smartd_cache_socket.c_str(), strerror(errno));
+    return 0;
+  }
+
+  ata_data_cache cache;
+  if (!(cache.parse(response.c_str()) && !cache.empty())) {
+    pout("%s: no ATA data in smartd cache, reading device\n", name);
+    return 0;
+  }
+  long age = (long)(time(0) - cache.get_time());
+  if (age < 0)
+    age = 0;
+  if (age > smartd_cache_max_age) {
+    pout("%s: smartd cache is %ld seconds old, reading device\n", name, age);
+    return 0;
+  }
 
-  const char * name = argv[argc-1];
+  // Data read only at registration may be older
+  int expired = cache.expire(time(0) - smartd_cache_max_age);
+  if (expired)
+    pout("%s: %d entries of smartd cache are older than %d seconds, ignored\n",
+         name, expired, smartd_cache_max_age);
+
+  pout("%s: Using ATA data read by smartd %ld seconds ago, device is not accessed\n", name, age);
+  return get_cached_ata_device(smi(), name, cache);
+}
+
+// Return true if any option changes device settings or starts a
+// command, the smartd cache cannot be used then.
+static bool ata_options_modify_device(const ata_print_options & o)
+{
+  return (   o.smart_disable || o.smart_enable
+          || o.smart_auto_offl_disable || o.smart_auto_offl_enable
+          || o.smart_auto_save_disable || o.smart_auto_save_enable
+          || o.smart_selftest_type != -1
+          || o.sct_erc_set || o.sct_temp_int || o.sataphy_reset
+          || o.set_aam || o.set_apm || o.set_lookahead || o.set_standby
+          || o.set_standby_now || o.set_security_freeze || o.set_wcache
+          || o.sct_wcache_reorder_set);
+}
 
+// Get device of appropriate type, print error message on failure.
+static smart_device * get_device(const char * name, const char * type,
+                                 const query_options & opts)
+{
   smart_device_auto_ptr dev;
   if (!strcmp(name,"-")) {
     // Parse "smartctl -r ataioctl,2 ..." output from stdin
-    if (type || print_type_only) {
+    if (type || opts.print_type_only) {
       pout("-d option is not allowed in conjunction with device name \"-\".\n");
       UsageSummary();
-      return FAILCMD;
+      return 0;
     }
     dev = get_parsed_ata_device(smi(), name);
   }
-  else
+  else {
+    // Use ATA data cached by smartd if recent enough and
+    // the device is only read
+    if (   !smartd_cache_socket.empty() && !opts.print_type_only
+        && !ata_options_modify_device(opts.ataopts))
+      dev = get_smartd_cache_device(name, type);
     // get device of appropriate type
-    dev = smi()->get_smart_device(name, type);
+    if (!dev)
+      dev = smi()->get_smart_device(name, type);
+  }
 
   if (!dev) {
     pout("%s: %s\n", name, smi()->get_errmsg());
@@ -1254,14 +1593,21 @@ static int main_worker(int argc, char **argv)
     else
       pout("Please specify device type with the -d option.\n");
     UsageSummary();
-    return FAILCMD;
+    return 0;
   }
 
-  if (print_type_only)
+  if (opts.print_type_only)
     // Report result of first autodetection
     pout("%s: Device of type '%s' [%s] detected\n",
          dev->get_info_name(), dev->get_dev_type(), get_protocol_info(dev.get()));
 
+  return dev.release();
+}
+
+// Open device and call appropriate ATA or SCSI routine.
+static int query_device(smart_device_auto_ptr & dev, const char * type,
+                        const query_options & opts)
+{
   // Open device
   {
     // Save old info
@@ -1271,7 +1617,7 @@ static int main_worker(int argc, char **argv)
     dev.replace( dev->autodetect_open() );
 
     // Report if type has changed
-    if ((type || print_type_only) && oldinfo.dev_type != dev->get_dev_type())
+    if ((type || opts.print_type_only) && oldinfo.dev_type != dev->get_dev_type())
       pout("%s: Device open changed type from '%s' to '%s'\n",
         dev->get_info_name(), oldinfo.dev_type.c_str(), dev->get_dev_type());
   }
@@ -1282,13 +1628,17 @@ static int main_worker(int argc, char **argv)
 
   // now call appropriate ATA or SCSI routine
   int retval = 0;
-  if (print_type_only)
+  if (opts.print_type_only)
     pout("%s: Device of type '%s' [%s] opened\n",
          dev->get_info_name(), dev->get_dev_type(), get_protocol_info(dev.get()));
   else if (dev->is_ata())
-    retval = ataPrintMain(dev->to_ata(), ataopts);
-  else if (dev->is_scsi())
-    retval = scsiPrintMain(dev->to_scsi(), scsiopts);
+    retval = ataPrintMain(dev->to_ata(), opts.ataopts);
+  else if (dev->is_scsi()) {
+    scsi_print_context ctx;
+    if (capcache_path)
+      ctx.caps_cache = &caps_cache;
+    retval = scsiPrintMain(dev->to_scsi(), opts.scsiopts, ctx);
+  }
   else
     // we should never fall into this branch!
     pout("%s: Neither ATA nor SCSI device\n", dev->get_info_name());
@@ -1297,6 +1647,284 @@ static int main_worker(int argc, char **argv)
   return retval;
 }
 
+// Query device of a device_query, set its status.
+static void run_device_query(device_query & q, smart_device_auto_ptr & dev,
+                             const query_options & opts)
+{
+  try {
+    q.status = query_device(dev, (!q.type.empty() ? q.type.c_str() : 0), opts);
+  }
+  catch (int ex) {
+    // EXIT(status) arrives here
+    q.status = ex;
+  }
+  catch (const std::bad_alloc & /*ex*/) {
+    pout("Smartctl: Out of memory\n");
+    q.status = FAILCMD;
+  }
+  catch (const std::exception & ex) {
+    pout("Smartctl: Exception: %s\n", ex.what());
+    q.status = FAILCMD;
+  }
+  catch (...) {
+    pout("Smartctl: Unknown exception\n");
+    q.status = FAILCMD;
+  }
+  dev.reset();
+}
+
+// Print delimiter lines and output of device.
+static void print_device_query(const device_query & q, bool start)
+{
+  if (start) {
+    printf("=== START OF DEVICE %s%s%s ===\n", q.name.c_str(),
+           (!q.type.empty() ? " -d " : ""), q.type.c_str());
+    fflush(stdout);
+    return;
+  }
+  fputs(q.output.c_str(), stdout);
+  printf("=== END OF DEVICE %s, exit status %d ===\n\n", q.name.c_str(), q.status);
+  fflush(stdout);
+}
+
+#ifdef HAVE_PTHREADS
+
+// Shared data of the worker threads of query_devices_parallel().
+struct parallel_query_info
+{
+  std::vector<device_query> * queries;
+  std::vector<smart_device *> * devices;
+  const query_options * opts;
+
+  // Device indices grouped by device name, each group is queried serially
+  std::vector< std::vector<unsigned> > groups;
+  unsigned next_group; // Next group to query, protected by mutex
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; // Signaled if a query is done
+};
+
+extern "C" void * parallel_query_worker(void * arg)
+{
+  parallel_query_info & info = *(parallel_query_info *)arg;
+  for (;;) {
+    pthread_mutex_lock(&info.mutex);
+    bool stop = (info.next_group >= info.groups.size());
+    unsigned g = info.next_group++;
+    pthread_mutex_unlock(&info.mutex);
+    if (stop)
+      break;
+
+    const std::vector<unsigned> & group = info.groups[g];
+    for (unsigned j = 0; j < group.size(); j++) {
+      unsigned i = group[j];
+      device_query & q = info.queries->at(i);
+      smart_device_auto_ptr dev((*info.devices)[i]);
+      (*info.devices)[i] = 0;
+
+      set_device_query(&q);
+      run_device_query(q, dev, *info.opts);
+      set_device_query(0);
+
+      pthread_mutex_lock(&info.mutex);
+      q.done = true;
+      pthread_cond_signal(&info.cond);
+      pthread_mutex_unlock(&info.mutex);
+    }
+  }
+  return 0;
+}
+
+// Query devices in up to max_jobs worker threads.  Devices with the
+// same device name (e.g. the ports of a RAID controller) are queried
+// serially in the same thread.  The output is printed in device order
+// as soon as all previous devices are done.
+// Returns false if threads could not be created.
+static bool query_devices_parallel(std::vector<device_query> & queries,
+                                   std::vector<smart_device *> & devices,
+                                   const query_options & opts)
+{
+  parallel_query_info info;
+  info.queries = &queries; info.devices = &devices; info.opts = &opts;
+  info.next_group = 0;
+
+  // Group devices by device name, keep order of first device
+  std::vector<std::string> group_names;
+  for (unsigned i = 0; i < queries.size(); i++) {
+    if (!devices[i])
+      continue;
+    std::string name = devices[i]->get_dev_name();
+    unsigned g;
+    for (g = 0; g < group_names.size() && group_names[g] != name; g++) ;
+    if (g >= group_names.size()) {
+      group_names.push_back(name);
+      info.groups.push_back(std::vector<unsigned>());
+    }
+    info.groups[g].push_back(i);
+  }
+
+  unsigned num_threads = info.groups.size();
+  if (num_threads > (unsigned)max_jobs)
+    num_threads = max_jobs;
+  if (num_threads < 2)
+    return false;
+
+  for (unsigned i = 0; i < queries.size(); i++) {
+    if (devices[i])
+      queries[i].capture = true;
+  }
+  pthread_mutex_init(&info.mutex, 0);
+  pthread_cond_init(&info.cond, 0);
+
+  std::vector<pthread_t> threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, parallel_query_worker, &info))
+      break;
+    threads.push_back(thread);
+  }
+
+  if (threads.empty()) {
+    pthread_cond_destroy(&info.cond);
+    pthread_mutex_destroy(&info.mutex);
+    for (unsigned i = 0; i < queries.size(); i++)
+      queries[i].capture = false;
+    return false;
+  }
+
+  // Print output in device order
+  for (unsigned i = 0; i < queries.size(); i++) {
+    device_query & q = queries[i];
+    print_device_query(q, true);
+    if (q.capture) {
+      pthread_mutex_lock(&info.mutex);
+      while (!q.done)
+        pthread_cond_wait(&info.cond, &info.mutex);
+      pthread_mutex_unlock(&info.mutex);
+    }
+    print_device_query(q, false);
+  }
+
+  for (unsigned t = 0; t < threads.size(); t++)
+    pthread_join(threads[t], 0);
+  pthread_cond_destroy(&info.cond);
+  pthread_mutex_destroy(&info.mutex);
+  return true;
+}
+
+#endif // HAVE_PTHREADS
+
+// Query several devices, print delimited output in device order.
+// Returns bitwise OR of the exit status of all devices.
+static int query_devices(std::vector<device_query> & queries,
+                         const query_options & opts)
+{
+  // Per device copies of globals set by options
+  for (unsigned i = 0; i < queries.size(); i++) {
+    queries[i].printing_is_off = printing_is_off;
+    queries[i].failuretest_permissive = failuretest_permissive;
+  }
+
+#ifdef HAVE_PTHREADS
+  if (!device_query_key_created) {
+    if (pthread_key_create(&device_query_key, 0))
+      throw std::runtime_error("pthread_key_create() failed");
+    device_query_key_created = true;
+  }
+#endif
+
+  // Get device objects in main thread, smart_interface is not reentrant.
+  // Error messages are collected as output of the device.
+  std::vector<smart_device *> devices(queries.size(), (smart_device *)0);
+  try {
+    for (unsigned i = 0; i < queries.size(); i++) {
+      device_query & q = queries[i];
+      q.capture = true;
+      set_device_query(&q);
+      devices[i] = get_device(q.name.c_str(), (!q.type.empty() ? q.type.c_str() : 0), opts);
+      set_device_query(0);
+      q.capture = false;
+      if (!devices[i])
+        q.status = FAILCMD;
+    }
+
+    bool done = false;
+#ifdef HAVE_PTHREADS
+    if (max_jobs > 1)
+      done = query_devices_parallel(queries, devices, opts);
+#endif
+
+    if (!done) {
+      for (unsigned i = 0; i < queries.size(); i++) {
+        device_query & q = queries[i];
+        print_device_query(q, true);
+        fputs(q.output.c_str(), stdout);
+        q.output.clear();
+        if (devices[i]) {
+          smart_device_auto_ptr dev(devices[i]);
+          devices[i] = 0;
+          set_device_query(&q);
+          run_device_query(q, dev, opts);
+          set_device_query(0);
+        }
+        print_device_query(q, false);
+      }
+    }
+  }
+  catch (...) {
+    set_device_query(0);
+    for (unsigned i = 0; i < devices.size(); i++)
+      delete devices[i];
+    throw;
+  }
+
+  int status = 0;
+  for (unsigned i = 0; i < queries.size(); i++)
+    status |= queries[i].status;
+  return status;
+}
+
+// Main program without exception handling
+static int main_worker(int argc, char **argv)
+{
+  // Throw if runtime environment does not match compile time test.
+  check_config();
+
+  // Initialize interface
+  smart_interface::init();
+  if (!smi())
+    return 1;
+
+  // Parse input arguments
+  query_options opts;
+  std::vector<device_query> queries;
+  parse_options(argc, argv, opts.ataopts, opts.scsiopts, opts.print_type_only, queries);
+
+  // Errors are not fatal, devices are queried then
+  if (capcache_path) {
+    caps_cache.load(capcache_path);
+    // Learn ATA log read limits only from real devices
+    if (smartd_cache_socket.empty())
+      opts.ataopts.caps_cache = &caps_cache;
+  }
+
+  int status;
+  if (queries.size() > 1)
+    status = query_devices(queries, opts);
+  else {
+    const char * name = queries[0].name.c_str();
+    const char * type = (!queries[0].type.empty() ? queries[0].type.c_str() : 0);
+
+    smart_device_auto_ptr dev( get_device(name, type, opts) );
+    if (!dev)
+      return FAILCMD;
+
+    status = query_device(dev, type, opts);
+  }
+
+  if (capcache_path)
+    caps_cache.save(capcache_path);
+  return status;
+}
 
 // Main program
 int main(int argc, char **argv)
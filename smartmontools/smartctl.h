@@ -79,20 +79,28 @@ extern unsigned char failuretest_permissive;
 // simply returns to the calling routine.
 void failuretest(failure_type type, int returnvalue);
 
+// Decrements '-T permissive' count of current device.
+// Returns false if count is already zero.
+bool failuretest_use_permissive();
+
 // Globals to control printing
 extern bool printing_is_switchable;
 extern bool printing_is_off;
 
+// Set printing_is_off of current device.  If several devices are
+// queried in parallel, each device has its own copy.
+void set_printing_is_off(bool off);
+
 // Printing control functions
 inline void print_on()
 {
   if (printing_is_switchable)
-    printing_is_off = false;
+    set_printing_is_off(false);
 }
 inline void print_off()
 {
   if (printing_is_switchable)
-    printing_is_off = true;
+    set_printing_is_off(true);
 }
 
 #endif
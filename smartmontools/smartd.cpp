@@ -43,9 +43,15 @@
 #include <string>
 #include <vector>
 #include <algorithm> // std::replace()
+#include <functional> // std::greater
+#include <deque>
+#include <map>
+#include <queue>
+#include <set>
 
 // conditionally included files
 #ifndef _WIN32
+#include <poll.h>
 #include <sys/wait.h>
 #endif
 #ifdef HAVE_UNISTD_H
@@ -61,7 +67,7 @@
 typedef unsigned short mode_t;
 typedef int pid_t;
 #endif
-#include <io.h> // umask()
+#include <io.h> // umask(), _commit()
 #include <process.h> // getpid()
 #endif // _WIN32
 
@@ -73,11 +79,22 @@ typedef int pid_t;
 #include <cap-ng.h>
 #endif // LIBCAP_NG
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 // locally included files
+#include "atacache.h"
 #include "atacmds.h"
+#include "attrlog.h"
+#include "cmdstats.h"
 #include "dev_interface.h"
 #include "knowndrives.h"
+#include "localsock.h"
+#include "devcaps.h"
 #include "scsicmds.h"
+#include "shmstate.h"
+#include "testsched.h"
 #include "utility.h"
 
 // This is for solaris, where signal() resets the handler to SIG_DFL
@@ -143,6 +160,34 @@ static std::string state_path_prefix
 #endif
                                     ;
 
+// command-line: path of state database file, empty if none.
+static std::string state_db_path;
+
+// command-line: path of device capability cache, empty if none.
+static std::string capcache_path;
+
+// Device capability cache, read at startup, written after registration.
+static device_caps_cache caps_cache;
+
+// command-line: source of hotplug events, empty if none.
+static std::string hotplug_source;
+
+// command-line: path of command profile file, empty if none.
+static std::string profile_path;
+
+#ifdef HAVE_PTHREADS
+// command-line: path of metrics socket, empty if none.
+static std::string metrics_socket_path;
+#endif
+
+#ifdef HAVE_SHM_OPEN
+// command-line: name of shared memory state table, empty if none.
+static std::string state_table_name;
+#endif
+
+// Shared memory state table, opened after fork
+static shm_state_writer state_table;
+
 // command-line: path prefix of attribute log file, empty if no logs.
 static std::string attrlog_path_prefix
 #ifdef SMARTMONTOOLS_ATTRIBUTELOG
@@ -176,16 +221,25 @@ static bool do_fork=true;
 static bool enable_capabilities = false;
 #endif
 
+#ifdef HAVE_PTHREADS
+// command-line: max number of devices checked in parallel
+static int max_jobs = 1;
+
+// command-line: max number of warning scripts run in background
+// (0: wait for each script), timeout and coalescing delay in seconds
+// (0: no coalescing)
+static int warn_jobs = 4, warn_timeout = 120, warn_delay = 0;
+#endif
+
 // TODO: This smartctl only variable is also used in os_win32.cpp
 unsigned char failuretest_permissive = 0;
 
 // set to one if we catch a USR1 (check devices now)
 static volatile int caughtsigUSR1=0;
 
-#ifdef _WIN32
-// set to one if we catch a USR2 (toggle debug mode)
+// set to one if we catch a USR2 (toggle debug mode on Windows,
+// print command profile otherwise)
 static volatile int caughtsigUSR2=0;
-#endif
 
 // set to one if we catch a HUP (reload config file). In debug mode,
 // set to two, if we catch INT (also reload config file).
@@ -198,6 +252,91 @@ static volatile int caughtsigEXIT=0;
 static void PrintOut(int priority, const char *fmt, ...)
                      __attribute_format_printf(2, 3);
 
+// Output of a device check running in a worker thread.
+// Printed later in device order, see CheckDevicesParallel().
+struct captured_output
+{
+  enum item_type { PRINT_OUT, POUT, MAIL_WARNING, RESET_WARNING_MAIL };
+
+  struct item {
+    item_type type;
+    int arg; // PrintOut() priority or mail type
+    std::string text;
+  };
+
+  std::vector<item> items;
+
+  void add(item_type type, int arg, const char * fmt, va_list ap)
+    {
+      items.push_back(item());
+      item & it = items.back();
+      it.type = type; it.arg = arg;
+      it.text = vstrprintf(fmt, ap);
+    }
+};
+
+#ifdef HAVE_PTHREADS
+
+// Set in worker threads while a device is checked.
+static pthread_key_t capture_key;
+static bool capture_key_created = false;
+
+static inline captured_output * get_captured_output()
+{
+  if (!capture_key_created)
+    return 0;
+  return (captured_output *)pthread_getspecific(capture_key);
+}
+
+// Serializes calls of non-reentrant functions (localtime(), ...)
+// during parallel device checks and output of main thread and warning
+// dispatcher thread.  Recursive because PrintOut() is also called with
+// the lock held.
+static pthread_mutex_t nonreentrant_mutex;
+static pthread_once_t nonreentrant_once = PTHREAD_ONCE_INIT;
+
+extern "C" void init_nonreentrant_mutex()
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&nonreentrant_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+#else
+
+static inline captured_output * get_captured_output()
+{
+  return 0;
+}
+
+#endif // HAVE_PTHREADS
+
+// Scoped lock of nonreentrant_mutex, no-op without thread support.
+class nonreentrant_lock
+{
+public:
+  nonreentrant_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_once(&nonreentrant_once, init_nonreentrant_mutex);
+      pthread_mutex_lock(&nonreentrant_mutex);
+#endif
+    }
+
+  ~nonreentrant_lock()
+    {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_unlock(&nonreentrant_mutex);
+#endif
+    }
+
+private:
+  nonreentrant_lock(const nonreentrant_lock &);
+  void operator=(const nonreentrant_lock &);
+};
+
 // Attribute monitoring flags.
 // See monitor_attr_flags below.
 enum {
@@ -239,8 +378,11 @@ struct dev_config
   std::string dev_name;                   // Device name (plain, for SMARTD_DEVICE variable)
   std::string dev_type;                   // Device type argument from -d directive, empty if none
   std::string dev_idinfo;                 // Device identify info for warning emails
+  std::string lu_id;                      // Logical unit id (WWN) for multipath detection, empty if unknown
   std::string state_file;                 // Path of the persistent state file, empty if none
+  std::string state_key;                  // Key of device in state database, empty if none
   std::string attrlog_file;               // Path of the persistent attrlog file, empty if none
+  std::string directives;                 // DEFAULT and entry directives, compared on reload
   bool ignore;                            // Ignore this entry
   bool smartcheck;                        // Check SMART status
   bool usagefailed;                       // Check for failed Usage Attributes
@@ -260,6 +402,8 @@ struct dev_config
   bool ignorepresets;                     // Ignore database of -v options
   bool showpresets;                       // Show database entry for this device
   bool removable;                         // Device may disappear (not be present)
+  bool keep_open;                         // Keep device open between checks
+  int checktime;                          // Check interval in seconds, 0 for '-i' interval
   char powermode;                         // skip check, if disk in idle or standby mode
   bool powerquiet;                        // skip powermode 'skipping checks' message
   int powerskipmax;                       // how many times can be check skipped
@@ -316,6 +460,8 @@ dev_config::dev_config()
   ignorepresets(false),
   showpresets(false),
   removable(false),
+  keep_open(false),
+  checktime(0),
   powermode(0),
   powerquiet(false),
   powerskipmax(0),
@@ -415,6 +561,16 @@ persistent_dev_state::persistent_dev_state()
 {
 }
 
+// Phases of a device check, timed for '-P FILE' and SIGUSR2
+enum check_phase {
+  PHASE_OPEN, PHASE_POWER, PHASE_SMART, PHASE_LOGS, PHASE_SELFTEST, PHASE_CLOSE,
+  NUM_CHECK_PHASES
+};
+
+static const char * const check_phase_names[NUM_CHECK_PHASES] = {
+  "open", "power", "smart", "logs", "selftest", "close"
+};
+
 /// Non-persistent state data for a device.
 struct temp_dev_state
 {
@@ -432,6 +588,29 @@ struct temp_dev_state
   bool powermodefail;                     // true if power mode check failed
   int powerskipcnt;                       // Number of checks skipped due to idle or standby mode
 
+  int64_t open_usec;                      // Duration of last open() in microseconds
+  bool kept_open;                         // true if handle from last check was reused
+
+  std::vector<smart_device::device_info> alt_paths; // Other paths to same logical unit
+  bool path_opened;                       // true if select_device_path() already tried open()
+
+  attrlog_writer attrlog;                 // Appends to attribute history file
+
+  time_t next_check;                      // Time of next scheduled check, 0 if none
+  unsigned check_backoff;                 // Multiplier for check interval after failures
+  bool check_failed;                      // true if last check could not open device
+
+  time_t last_check;                      // Start time of last check, 0 if none
+  int64_t check_usec;                     // Duration of last check in microseconds
+  uint64_t num_checks;                    // Number of checks since registration
+  signed char smart_status;               // SMART health of last check: 0=passed, 1=failed, -1=unknown
+
+  command_stats cmd_stats;                // Latency histograms of all commands
+  int64_t phase_start_usec;               // Start time of current check phase
+  int64_t phase_usec[NUM_CHECK_PHASES];   // Duration of phases of last check
+  int64_t phase_total_usec[NUM_CHECK_PHASES]; // Sum of durations of phases of all checks
+  int64_t total_check_usec;               // Sum of durations of all checks
+
   // SCSI ONLY
   unsigned char SmartPageSupported;       // has log sense IE page (0x2f)
   unsigned char TempPageSupported;        // has log sense temperature page (0xd)
@@ -442,10 +621,12 @@ struct temp_dev_state
   unsigned char SuppressReport;           // minimize nuisance reports
   unsigned char modese_len;               // mode sense/select cmd len: 0 (don't
                                           // know yet) 6 or 10
+  scsi_log_batch log_pages;               // Log pages read on each check
   // ATA ONLY
   uint64_t num_sectors;                   // Number of sectors
   ata_smart_values smartval;              // SMART data
   ata_smart_thresholds_pvt smartthres;    // SMART thresholds
+  ata_data_cache ata_cache;               // Data of last checks for 'smartctl --smartd-cache'
   bool offline_started;                   // true if offline data collection was started
   bool selftest_started;                  // true if self-test was started
 
@@ -463,6 +644,18 @@ temp_dev_state::temp_dev_state()
   tempmin_delay(0),
   powermodefail(false),
   powerskipcnt(0),
+  open_usec(0),
+  kept_open(false),
+  path_opened(false),
+  next_check(0),
+  check_backoff(1),
+  check_failed(false),
+  last_check(0),
+  check_usec(0),
+  num_checks(0),
+  smart_status(-1),
+  phase_start_usec(0),
+  total_check_usec(0),
   SmartPageSupported(false),
   TempPageSupported(false),
   ReadECounterPageSupported(false),
@@ -477,6 +670,8 @@ temp_dev_state::temp_dev_state()
 {
   memset(&smartval, 0, sizeof(smartval));
   memset(&smartthres, 0, sizeof(smartthres));
+  for (int i = 0; i < NUM_CHECK_PHASES; i++)
+    phase_usec[i] = phase_total_usec[i] = 0;
 }
 
 /// Runtime state data for a device.
@@ -739,58 +934,409 @@ static bool write_dev_state(const char * path, const persistent_dev_state & stat
   return true;
 }
 
-// Write to the attrlog file
-static bool write_dev_attrlog(const char * path, const dev_state & state)
+/// Single file database for persistent states of all devices.
+/// Each device has two fixed size slots which are written alternately.
+/// A slot is only valid if its checksum is correct, the valid slot with
+/// the higher sequence number holds the current state.  An interrupted
+/// write therefore never destroys the last state which was synced.
+class state_db
 {
-  stdio_file f(path, "a");
-  if (!f) {
-    pout("Cannot create attribute log file \"%s\"\n", path);
+public:
+  state_db();
+  ~state_db();
+
+  /// Open or create database file, read keys of all devices.
+  bool open(const char * path);
+
+  void close();
+
+  bool is_open() const
+    { return !!m_file; }
+
+  /// Read state of device, return false if not found.
+  bool read(const std::string & key, persistent_dev_state & state);
+
+  /// Write state of device to inactive slot.
+  bool write(const std::string & key, const persistent_dev_state & state);
+
+  /// Flush all writes to disk.
+  bool sync();
+
+private:
+  enum {
+    slot_size = 4096, // Also size of file header
+    max_key_len = 128,
+    slot_header_size = 20 + max_key_len,
+    field_size = 10 // u16 tag, u64 value
+  };
+
+  struct entry {
+    unsigned index;  // Index of slot pair
+    int active;      // Active slot (0, 1)
+    uint64_t seq;    // Sequence number of active slot
+  };
+
+  FILE * m_file;
+  std::string m_path;
+  typedef std::map<std::string, entry> entry_map;
+  entry_map m_entries;
+  // Unused slot pairs, 'active' and 'seq' refer to the valid slot with
+  // the highest sequence number (if any) which may hold an outdated key
+  std::vector<entry> m_free;
+  std::set<std::string> m_bad_keys; // Keys already reported as too long
+  unsigned m_count;             // Number of slot pairs in file
+  bool m_dirty;
+
+  long slot_offset(unsigned index, int slot) const
+    { return (long)slot_size * (1 + 2 * index + slot); }
+
+  bool read_slot(unsigned index, int slot, unsigned char * buf,
+                 std::string & key, uint64_t & seq);
+
+  state_db(const state_db &);
+  void operator=(const state_db &);
+};
+
+// Field tags used in state database slots
+enum {
+  STATE_TAG_TEMPMIN = 1,
+  STATE_TAG_TEMPMAX,
+  STATE_TAG_SELFLOGCOUNT,
+  STATE_TAG_SELFLOGHOUR,
+  STATE_TAG_SCHEDULED_TEST_NEXT_CHECK,
+  STATE_TAG_SELECTIVE_TEST_LAST_START,
+  STATE_TAG_SELECTIVE_TEST_LAST_END,
+  STATE_TAG_ATAERRORCOUNT,
+  STATE_TAG_MAIL = 0x100,    // +i*4+{0,1,2}: count, first-sent-time, last-sent-time
+  STATE_TAG_ATTRIBUTE = 0x1000 // +i*8+{0,..,4}: id, val, worst, raw, resvd
+};
+
+static const char state_db_magic[8] = { 'S','M','A','R','T','D','S','D' };
+
+// FNV-1a hash used as slot checksum
+static unsigned fnv1a_hash(const unsigned char * buf, unsigned size)
+{
+  unsigned h = 2166136261U;
+  for (unsigned i = 0; i < size; i++)
+    h = (h ^ buf[i]) * 16777619U;
+  return h & 0xffffffffU;
+}
+
+state_db::state_db()
+: m_file(0), m_count(0), m_dirty(false)
+{
+}
+
+state_db::~state_db()
+{
+  close();
+}
+
+void state_db::close()
+{
+  if (m_file) {
+    sync();
+    fclose(m_file);
+    m_file = 0;
+  }
+  m_entries.clear();
+  m_free.clear();
+  m_bad_keys.clear();
+  m_count = 0;
+  m_dirty = false;
+}
+
+// Slot layout:
+// 0: "SDST", 4: u32 checksum of bytes 8..end of fields, 8: u64 seq,
+// 16: u16 key length, 18: u16 number of fields, 20: key,
+// slot_header_size: fields (u16 tag, u64 value)
+bool state_db::read_slot(unsigned index, int slot, unsigned char * buf,
+                         std::string & key, uint64_t & seq)
+{
+  if (   fseek(m_file, slot_offset(index, slot), SEEK_SET)
+      || fread(buf, 1, slot_size, m_file) != slot_size)
+    return false;
+  if (memcmp(buf, "SDST", 4))
+    return false;
+  unsigned keylen = (unsigned)get_le(buf + 16, 2);
+  unsigned nfields = (unsigned)get_le(buf + 18, 2);
+  if (!(0 < keylen && keylen <= max_key_len))
+    return false;
+  unsigned size = slot_header_size + nfields * field_size;
+  if (size > slot_size)
+    return false;
+  if (fnv1a_hash(buf + 8, size - 8) != get_le(buf + 4, 4))
+    return false;
+  seq = get_le(buf + 8, 8);
+  key.assign((const char *)buf + 20, keylen);
+  return true;
+}
+
+bool state_db::open(const char * path)
+{
+  close();
+  m_file = fopen(path, "r+b");
+  if (!m_file && errno == ENOENT) {
+    // Create new database
+    m_file = fopen(path, "w+b");
+    unsigned char hdr[slot_size];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, state_db_magic, sizeof(state_db_magic));
+    put_le(hdr + 8, 1, 2); // Version
+    put_le(hdr + 10, slot_size, 4);
+    if (m_file && !(fwrite(hdr, 1, sizeof(hdr), m_file) == sizeof(hdr) && !fflush(m_file))) {
+      fclose(m_file); m_file = 0;
+    }
+  }
+  if (!m_file) {
+    PrintOut(LOG_CRIT, "Cannot open state database \"%s\": %s\n", path, strerror(errno));
     return false;
   }
+  m_path = path;
 
-  
-  time_t now = time(0);
-  struct tm * tms = gmtime(&now);
-  fprintf(f, "%d-%02d-%02d %02d:%02d:%02d;",
-             1900+tms->tm_year, 1+tms->tm_mon, tms->tm_mday,
-             tms->tm_hour, tms->tm_min, tms->tm_sec);
+  unsigned char buf[slot_size];
+  if (   fseek(m_file, 0, SEEK_SET)
+      || fread(buf, 1, sizeof(buf), m_file) != sizeof(buf)
+      || memcmp(buf, state_db_magic, sizeof(state_db_magic))
+      || get_le(buf + 8, 2) != 1 || get_le(buf + 10, 4) != slot_size) {
+    PrintOut(LOG_CRIT, "%s: not a smartd state database\n", path);
+    fclose(m_file); m_file = 0;
+    return false;
+  }
+
+  // Read keys, partial slot pair at end of file is included
+  if (fseek(m_file, 0, SEEK_END))
+    return false;
+  long size = ftell(m_file);
+  m_count = (unsigned)((size - slot_size + 2*slot_size - 1) / (2*slot_size));
+  for (unsigned i = 0; i < m_count; i++) {
+    entry e = { i, -1, 0 };
+    std::string key;
+    for (int slot = 0; slot < 2; slot++) {
+      std::string k; uint64_t seq;
+      if (!read_slot(i, slot, buf, k, seq))
+        continue;
+      if (e.active >= 0 && seq <= e.seq)
+        continue;
+      e.active = slot; e.seq = seq; key = k;
+    }
+    if (e.active < 0) {
+      e.active = 1; e.seq = 0;
+      m_free.push_back(e);
+      continue;
+    }
+    // Keep the newest pair of duplicate keys, the other pair is reused
+    // with higher sequence numbers such that its old key never wins again
+    entry_map::iterator it = m_entries.find(key);
+    if (it == m_entries.end())
+      m_entries[key] = e;
+    else if (it->second.seq < e.seq) {
+      m_free.push_back(it->second);
+      it->second = e;
+    }
+    else
+      m_free.push_back(e);
+  }
+  return true;
+}
+
+bool state_db::read(const std::string & key, persistent_dev_state & state)
+{
+  entry_map::const_iterator it = m_entries.find(key);
+  if (it == m_entries.end())
+    return false;
+  const entry & e = it->second;
+  unsigned char buf[slot_size];
+  std::string k; uint64_t seq;
+  if (!read_slot(e.index, e.active, buf, k, seq) || k != key) {
+    PrintOut(LOG_INFO, "%s: cannot read state of %s\n", m_path.c_str(), key.c_str());
+    return false;
+  }
+
+  persistent_dev_state new_state;
+  unsigned nfields = (unsigned)get_le(buf + 18, 2);
+  for (unsigned i = 0; i < nfields; i++) {
+    const unsigned char * f = buf + slot_header_size + i * field_size;
+    unsigned tag = (unsigned)get_le(f, 2);
+    uint64_t val = get_le(f + 2, 8);
+    switch (tag) {
+      case STATE_TAG_TEMPMIN: new_state.tempmin = (unsigned char)val; break;
+      case STATE_TAG_TEMPMAX: new_state.tempmax = (unsigned char)val; break;
+      case STATE_TAG_SELFLOGCOUNT: new_state.selflogcount = (unsigned char)val; break;
+      case STATE_TAG_SELFLOGHOUR: new_state.selfloghour = (unsigned short)val; break;
+      case STATE_TAG_SCHEDULED_TEST_NEXT_CHECK: new_state.scheduled_test_next_check = (time_t)val; break;
+      case STATE_TAG_SELECTIVE_TEST_LAST_START: new_state.selective_test_last_start = val; break;
+      case STATE_TAG_SELECTIVE_TEST_LAST_END: new_state.selective_test_last_end = val; break;
+      case STATE_TAG_ATAERRORCOUNT: new_state.ataerrorcount = (int)val; break;
+      default:
+        if (STATE_TAG_MAIL <= tag && tag < STATE_TAG_MAIL + SMARTD_NMAIL * 4) {
+          int m = (tag - STATE_TAG_MAIL) >> 2;
+          if (m == MAILTYPE_TEST) // Don't suppress test mails
+            break;
+          mailinfo & mi = new_state.maillog[m];
+          switch (tag & 3) {
+            case 0: mi.logged = (int)val; break;
+            case 1: mi.firstsent = (time_t)val; break;
+            case 2: mi.lastsent = (time_t)val; break;
+          }
+        }
+        else if (STATE_TAG_ATTRIBUTE <= tag && tag < STATE_TAG_ATTRIBUTE + NUMBER_ATA_SMART_ATTRIBUTES * 8) {
+          persistent_dev_state::ata_attribute & pa
+            = new_state.ata_attributes[(tag - STATE_TAG_ATTRIBUTE) >> 3];
+          switch (tag & 7) {
+            case 0: pa.id = (unsigned char)val; break;
+            case 1: pa.val = (unsigned char)val; break;
+            case 2: pa.worst = (unsigned char)val; break;
+            case 3: pa.raw = val; break;
+            case 4: pa.resvd = (unsigned char)val; break;
+          }
+        }
+        // Ignore unknown tags
+    }
+  }
+
+  state = new_state;
+  return true;
+}
+
+static void add_state_field(unsigned char * buf, unsigned & nfields, unsigned tag, uint64_t val)
+{
+  if (!val)
+    return;
+  unsigned char * f = buf + nfields++ * 10;
+  put_le(f, tag, 2);
+  put_le(f + 2, val, 8);
+}
+
+bool state_db::write(const std::string & key, const persistent_dev_state & state)
+{
+  if (!(0 < key.size() && key.size() <= max_key_len)) {
+    if (m_bad_keys.insert(key).second)
+      PrintOut(LOG_CRIT, "%s: key \"%s\" too long (max %d chars), state not written\n",
+               m_path.c_str(), key.c_str(), (int)max_key_len);
+    return false;
+  }
+
+  unsigned char buf[slot_size];
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, "SDST", 4);
+  put_le(buf + 16, key.size(), 2);
+  memcpy(buf + 20, key.data(), key.size());
+
+  unsigned char * fields = buf + slot_header_size;
+  unsigned n = 0;
+  add_state_field(fields, n, STATE_TAG_TEMPMIN, state.tempmin);
+  add_state_field(fields, n, STATE_TAG_TEMPMAX, state.tempmax);
+  add_state_field(fields, n, STATE_TAG_SELFLOGCOUNT, state.selflogcount);
+  add_state_field(fields, n, STATE_TAG_SELFLOGHOUR, state.selfloghour);
+  add_state_field(fields, n, STATE_TAG_SCHEDULED_TEST_NEXT_CHECK, state.scheduled_test_next_check);
+  add_state_field(fields, n, STATE_TAG_SELECTIVE_TEST_LAST_START, state.selective_test_last_start);
+  add_state_field(fields, n, STATE_TAG_SELECTIVE_TEST_LAST_END, state.selective_test_last_end);
+  add_state_field(fields, n, STATE_TAG_ATAERRORCOUNT, state.ataerrorcount);
+  int i;
+  for (i = 0; i < SMARTD_NMAIL; i++) {
+    if (i == MAILTYPE_TEST) // Don't suppress test mails
+      continue;
+    const mailinfo & mi = state.maillog[i];
+    if (!mi.logged)
+      continue;
+    add_state_field(fields, n, STATE_TAG_MAIL + i*4 + 0, mi.logged);
+    add_state_field(fields, n, STATE_TAG_MAIL + i*4 + 1, mi.firstsent);
+    add_state_field(fields, n, STATE_TAG_MAIL + i*4 + 2, mi.lastsent);
+  }
+  for (i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
+    const persistent_dev_state::ata_attribute & pa = state.ata_attributes[i];
+    if (!pa.id)
+      continue;
+    add_state_field(fields, n, STATE_TAG_ATTRIBUTE + i*8 + 0, pa.id);
+    add_state_field(fields, n, STATE_TAG_ATTRIBUTE + i*8 + 1, pa.val);
+    add_state_field(fields, n, STATE_TAG_ATTRIBUTE + i*8 + 2, pa.worst);
+    add_state_field(fields, n, STATE_TAG_ATTRIBUTE + i*8 + 3, pa.raw);
+    add_state_field(fields, n, STATE_TAG_ATTRIBUTE + i*8 + 4, pa.resvd);
+  }
+  put_le(buf + 18, n, 2);
+
+  // Use inactive slot of existing entry, or free or new slot pair.
+  // A free slot pair continues with the sequence numbers of its old slots.
+  entry e;
+  entry_map::iterator it = m_entries.find(key);
+  if (it != m_entries.end())
+    e = it->second;
+  else if (!m_free.empty()) {
+    e = m_free.back(); m_free.pop_back();
+  }
+  else {
+    e.index = m_count++; e.active = 1; e.seq = 0;
+  }
+  int slot = !e.active;
+  e.seq++;
+  put_le(buf + 8, e.seq, 8);
+  put_le(buf + 4, fnv1a_hash(buf + 8, slot_header_size + n * field_size - 8), 4);
+
+  if (   fseek(m_file, slot_offset(e.index, slot), SEEK_SET)
+      || fwrite(buf, 1, sizeof(buf), m_file) != sizeof(buf)) {
+    PrintOut(LOG_CRIT, "%s: write error: %s\n", m_path.c_str(), strerror(errno));
+    if (it == m_entries.end())
+      m_free.push_back(e);
+    return false;
+  }
+  e.active = slot;
+  m_entries[key] = e;
+  m_dirty = true;
+  return true;
+}
+
+bool state_db::sync()
+{
+  if (!m_dirty)
+    return true;
+  m_dirty = false;
+  bool ok = !fflush(m_file);
+#ifndef _WIN32
+  if (ok && fsync(fileno(m_file)))
+    ok = false;
+#else
+  if (ok && _commit(_fileno(m_file)))
+    ok = false;
+#endif
+  if (!ok)
+    PrintOut(LOG_CRIT, "%s: write error: %s\n", m_path.c_str(), strerror(errno));
+  return ok;
+}
+
+// State database, open if '--statedb' is specified
+static state_db state_database;
+
+// Append to the attribute history file
+static bool write_dev_attrlog(const char * path, dev_state & state)
+{
+  attrlog_record rec;
+  rec.time = time(0);
   // ATA ONLY
   for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
     const persistent_dev_state::ata_attribute & pa = state.ata_attributes[i];
     if (!pa.id)
       continue;
-    fprintf(f, "\t%d;%d;%" PRIu64 ";", pa.id, pa.val, pa.raw);
+    rec.add_ata(pa.id, pa.val, pa.raw);
   }
   // SCSI ONLY
-  const struct scsiErrorCounter * ecp;
-  const char * pageNames[3] = {"read", "write", "verify"};
+  static const unsigned short pageTags[3] = {
+    ATTRLOG_TAG_SCSI_READ, ATTRLOG_TAG_SCSI_WRITE, ATTRLOG_TAG_SCSI_VERIFY
+  };
   for (int k = 0; k < 3; ++k) {
     if ( !state.scsi_error_counters[k].found ) continue;
-    ecp = &state.scsi_error_counters[k].errCounter;
-     fprintf(f, "\t%s-corr-by-ecc-fast;%" PRIu64 ";"
-       "\t%s-corr-by-ecc-delayed;%" PRIu64 ";"
-       "\t%s-corr-by-retry;%" PRIu64 ";"
-       "\t%s-total-err-corrected;%" PRIu64 ";"
-       "\t%s-corr-algorithm-invocations;%" PRIu64 ";"
-       "\t%s-gb-processed;%.3f;"
-       "\t%s-total-unc-errors;%" PRIu64 ";",
-       pageNames[k], ecp->counter[0],
-       pageNames[k], ecp->counter[1],
-       pageNames[k], ecp->counter[2],
-       pageNames[k], ecp->counter[3],
-       pageNames[k], ecp->counter[4],
-       pageNames[k], (ecp->counter[5] / 1000000000.0),
-       pageNames[k], ecp->counter[6]);
+    const struct scsiErrorCounter * ecp = &state.scsi_error_counters[k].errCounter;
+    for (int j = 0; j < 7; j++)
+      rec.add(pageTags[k] + j, ecp->counter[j]);
   }
   if(state.scsi_nonmedium_error.found && state.scsi_nonmedium_error.nme.gotPC0) {
-    fprintf(f, "\tnon-medium-errors;%" PRIu64 ";", state.scsi_nonmedium_error.nme.counterPC0);
+    rec.add(ATTRLOG_TAG_SCSI_NONMEDIUM, state.scsi_nonmedium_error.nme.counterPC0);
   }
   // write SCSI current temperature if it is monitored
   if(state.TempPageSupported && state.temperature)
-     fprintf(f, "\ttemperature;%d;", state.temperature);
-  // end of line
-  fprintf(f, "\n");
-  return true;
+    rec.add(ATTRLOG_TAG_TEMPERATURE, state.temperature);
+
+  return state.attrlog.append(path, rec);
 }
 
 // Write all state files. If write_always is false, don't write
@@ -801,25 +1347,57 @@ static void write_all_dev_states(const dev_config_vector & configs,
 {
   for (unsigned i = 0; i < states.size(); i++) {
     const dev_config & cfg = configs.at(i);
-    if (cfg.state_file.empty())
+    if (cfg.state_file.empty() && cfg.state_key.empty())
       continue;
     dev_state & state = states[i];
     if (!write_always && !state.must_write)
       continue;
-    if (!write_dev_state(cfg.state_file.c_str(), state))
+    if (!cfg.state_key.empty()) {
+      // Update only this device in state database
+      if (!state_database.write(cfg.state_key, state))
+        continue;
+    }
+    else if (!write_dev_state(cfg.state_file.c_str(), state))
       continue;
     state.must_write = false;
     if (write_always || debugmode)
-      PrintOut(LOG_INFO, "Device: %s, state written to %s\n",
-               cfg.name.c_str(), cfg.state_file.c_str());
+      PrintOut(LOG_INFO, "Device: %s, state written to %s\n", cfg.name.c_str(),
+               (!cfg.state_key.empty() ? state_db_path.c_str() : cfg.state_file.c_str()));
+  }
+
+  // Single sync for all updates
+  if (state_database.is_open())
+    state_database.sync();
+}
+
+// Read state of device from state database or state file.
+static bool read_dev_state(const dev_config & cfg, dev_state & state, const char * name)
+{
+  // Devices may be registered in parallel, see ProbeDevicesParallel()
+  nonreentrant_lock lock;
+  if (!cfg.state_key.empty()) {
+    if (state_database.read(cfg.state_key, state)) {
+      PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, state_db_path.c_str());
+      return true;
+    }
+    if (cfg.state_file.empty())
+      return false;
+    // Import state file from '-s PREFIX', written to database on first write
+  }
+  if (!cfg.state_file.empty() && read_dev_state(cfg.state_file.c_str(), state)) {
+    PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, cfg.state_file.c_str());
+    return true;
   }
+  return false;
 }
 
-// Write to all attrlog files
+// Write to attrlog files of checked devices
 static void write_all_dev_attrlogs(const dev_config_vector & configs,
-                                   dev_state_vector & states)
+                                   dev_state_vector & states,
+                                   const std::vector<unsigned> & checked)
 {
-  for (unsigned i = 0; i < states.size(); i++) {
+  for (unsigned j = 0; j < checked.size(); j++) {
+    unsigned i = checked[j];
     const dev_config & cfg = configs.at(i);
     if (cfg.attrlog_file.empty())
       continue;
@@ -828,6 +1406,100 @@ static void write_all_dev_attrlogs(const dev_config_vector & configs,
   }
 }
 
+static std::string format_phase_line(const char * title, const int64_t * phase_usec,
+                                     int64_t check_usec, uint64_t div)
+{
+  std::string line = strprintf("  %-14s", title);
+  int64_t sum = 0;
+  for (int i = 0; i < NUM_CHECK_PHASES; i++) {
+    int64_t usec = phase_usec[i] / (int64_t)div;
+    line += strprintf(" %5d.%03d", (int)(usec / 1000), (int)(usec % 1000));
+    sum += usec;
+  }
+  int64_t other = check_usec / (int64_t)div - sum;
+  if (other < 0)
+    other = 0;
+  int64_t total = check_usec / (int64_t)div;
+  line += strprintf(" %5d.%03d %5d.%03d\n", (int)(other / 1000), (int)(other % 1000),
+                    (int)(total / 1000), (int)(total % 1000));
+  return line;
+}
+
+// Format durations of check phases and command latencies of all devices
+static std::string format_command_profile(const dev_config_vector & configs,
+                                          const dev_state_vector & states,
+                                          const smart_device_list & devices)
+{
+  char datenow[DATEANDEPOCHLEN];
+  dateandtimezoneepoch(datenow, time(0));
+  std::string text = strprintf("# smartd command profile, %s\n", datenow);
+
+  for (unsigned i = 0; i < configs.size(); i++) {
+    const dev_config & cfg = configs.at(i);
+    const dev_state & state = states.at(i);
+    const smart_device * dev = devices.at(i);
+    if (!dev)
+      continue;
+
+    text += strprintf("\nDevice: %s, type %s, %" PRIu64 " check%s\n", cfg.name.c_str(),
+                      dev->get_dev_type(), state.num_checks, (state.num_checks == 1 ? "" : "s"));
+    if (state.num_checks) {
+      std::string head = strprintf("  %-14s", "Phase[ms]");
+      for (int j = 0; j < NUM_CHECK_PHASES; j++)
+        head += strprintf(" %9s", check_phase_names[j]);
+      text += head + strprintf(" %9s %9s\n", "other", "total");
+      text += format_phase_line("Last check", state.phase_usec, state.check_usec, 1);
+      text += format_phase_line("Average", state.phase_total_usec, state.total_check_usec,
+                                state.num_checks);
+    }
+    if (!state.cmd_stats.empty())
+      text += state.cmd_stats.format("  ");
+  }
+  return text;
+}
+
+// Write command profile to file, replace old file atomically
+static bool write_command_profile(const char * path, const dev_config_vector & configs,
+                                  const dev_state_vector & states,
+                                  const smart_device_list & devices)
+{
+  std::string pathtmp = path; pathtmp += '~';
+  {
+    stdio_file f(pathtmp.c_str(), "w");
+    if (!f) {
+      PrintOut(LOG_CRIT, "Cannot create profile file \"%s\"\n", pathtmp.c_str());
+      return false;
+    }
+    fputs(format_command_profile(configs, states, devices).c_str(), f);
+    if (!f.close()) {
+      PrintOut(LOG_CRIT, "Cannot write profile file \"%s\"\n", pathtmp.c_str());
+      return false;
+    }
+  }
+#ifdef _WIN32
+  unlink(path); // rename() does not replace
+#endif
+  if (rename(pathtmp.c_str(), path)) {
+    PrintOut(LOG_CRIT, "Cannot rename \"%s\" to \"%s\"\n", pathtmp.c_str(), path);
+    return false;
+  }
+  return true;
+}
+
+// Print command profile to log, called on SIGUSR2
+static void log_command_profile(const dev_config_vector & configs,
+                                const dev_state_vector & states,
+                                const smart_device_list & devices)
+{
+  std::string text = format_command_profile(configs, states, devices);
+  for (const char * line = text.c_str(); *line; ) {
+    size_t len = strcspn(line, "\n");
+    if (len)
+      PrintOut(LOG_INFO, "%.*s\n", (int)len, line);
+    line += len + (line[len] ? 1 : 0);
+  }
+}
+
 // remove the PID file
 static void RemovePidFile()
 {
@@ -850,7 +1522,6 @@ static void USR1handler(int sig)
   return;
 }
 
-#ifdef _WIN32
 //  Note if we catch a SIGUSR2
 static void USR2handler(int sig)
 {
@@ -858,7 +1529,6 @@ static void USR2handler(int sig)
     caughtsigUSR2=1;
   return;
 }
-#endif
 
 // Note if we catch a HUP (or INT in debug mode)
 static void HUPhandler(int sig)
@@ -937,25 +1607,626 @@ void env_buffer::set(const char * name, const char * value)
 
 #define EBUFLEN 1024
 
-static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
-                        __attribute_format_printf(4, 5);
+// Warning message to be delivered by the warning script.
+struct warning_job
+{
+  typedef std::pair<std::string, std::string> env_var;
 
-// If either address or executable path is non-null then send and log
-// a warning email, or execute executable
-static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
+  int which;                  // Mail type, index of whichfail[]
+  std::string executable;     // Mailer or "<mail>", for messages
+  std::string address;        // Addresses or "<nomailer>", for messages
+  std::vector<env_var> env;   // SMARTD_* environment variables
+  unsigned count;             // Number of coalesced warnings
+  int64_t queued_usec;        // Time added to dispatcher queue
+
+  warning_job()
+    : which(0), count(1), queued_usec(0) { }
+
+  const char * newwarn() const
+    { return (which ? "Warning via" : "Test of"); }
+
+  // Return value of environment variable NAME.
+  std::string & getenv(const char * name);
+  const std::string & getenv(const char * name) const
+    { return const_cast<warning_job *>(this)->getenv(name); }
+};
+
+std::string & warning_job::getenv(const char * name)
 {
-  static const char * const whichfail[] = {
-    "EmailTest",                  // 0
-    "Health",                     // 1
-    "Usage",                      // 2
-    "SelfTest",                   // 3
-    "ErrorCount",                 // 4
-    "FailedHealthCheck",          // 5
-    "FailedReadSmartData",        // 6
-    "FailedReadSmartErrorLog",    // 7
-    "FailedReadSmartSelfTestLog", // 8
-    "FailedOpenDevice",           // 9
-    "CurrentPendingSector",       // 10
+  for (unsigned i = 0; i < env.size(); i++) {
+    if (env[i].first == name)
+      return env[i].second;
+  }
+  throw std::logic_error("warning_job::getenv()");
+}
+
+#ifndef _WIN32
+
+// Print exit status of warning script
+static void print_warning_exit_status(const warning_job & job, int status)
+{
+  const char * newwarn = job.newwarn();
+  const char * executable = job.executable.c_str(), * newadd = job.address.c_str();
+
+  if (WIFEXITED(status)) {
+    // exited 'normally' (but perhaps with nonzero status)
+    int status8 = WEXITSTATUS(status);
+    if (status8>128)
+      PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d) perhaps caught signal %d [%s]\n",
+               newwarn, executable, newadd, status, status8, status8-128, strsignal(status8-128));
+    else if (status8)
+      PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d)\n",
+               newwarn, executable, newadd, status, status8);
+    else
+      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+  }
+
+  if (WIFSIGNALED(status))
+    PrintOut(LOG_INFO,"%s %s to %s: exited because of uncaught signal %d [%s]\n",
+             newwarn, executable, newadd, WTERMSIG(status), strsignal(WTERMSIG(status)));
+
+  // this branch is probably not possible. If subprocess is
+  // stopped then pclose() should not return.
+  if (WIFSTOPPED(status))
+    PrintOut(LOG_CRIT,"%s %s to %s: process STOPPED because it caught signal %d [%s]\n",
+             newwarn, executable, newadd, WSTOPSIG(status), strsignal(WSTOPSIG(status)));
+}
+
+#endif // _WIN32
+
+// Run warning script and wait for completion.
+static void run_warning_job(const warning_job & job)
+{
+  // Set environment variables, the names are always set in the same order
+  static env_buffer env[16];
+  if (job.env.size() > sizeof(env)/sizeof(env[0]))
+    throw std::logic_error("run_warning_job(): too many variables");
+  for (unsigned i = 0; i < job.env.size(); i++)
+    env[i].set(job.env[i].first.c_str(), job.env[i].second.c_str());
+
+  const char * newwarn = job.newwarn();
+  const char * executable = job.executable.c_str(), * newadd = job.address.c_str();
+
+#ifndef _WIN32
+  char command[2048];
+  snprintf(command, sizeof(command), "%s 2>&1", warning_script.c_str());
+  
+  // tell SYSLOG what we are about to do...
+  PrintOut(LOG_INFO,"%s %s to %s ...\n",
+           job.which?"Sending warning via":"Executing test of", executable, newadd);
+  
+  // issue the command to send mail or to run the user's executable
+  errno=0;
+  FILE * pfp;
+  if (!(pfp=popen(command, "r")))
+    // failed to popen() mail process
+    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n", 
+	     newwarn,  executable, newadd, errno?strerror(errno):"");
+  else {
+    // pipe suceeded!
+    int len, status;
+    char buffer[EBUFLEN];
+
+    // if unexpected output on stdout/stderr, null terminate, print, and flush
+    if ((len=fread(buffer, 1, EBUFLEN, pfp))) {
+      int count=0;
+      int newlen = len<EBUFLEN ? len : EBUFLEN-1;
+      buffer[newlen]='\0';
+      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%s%d bytes) to STDOUT/STDERR: \n%s\n", 
+	       newwarn, executable, newadd, len!=newlen?"here truncated to ":"", newlen, buffer);
+      
+      // flush pipe if needed
+      while (fread(buffer, 1, EBUFLEN, pfp) && count<EBUFLEN)
+	count++;
+
+      // tell user that pipe was flushed, or that something is really wrong
+      if (count && count<EBUFLEN)
+	PrintOut(LOG_CRIT,"%s %s to %s: flushed remaining STDOUT/STDERR\n", 
+		 newwarn, executable, newadd);
+      else if (count)
+	PrintOut(LOG_CRIT,"%s %s to %s: more than 1 MB STDOUT/STDERR flushed, breaking pipe\n", 
+		 newwarn, executable, newadd);
+    }
+    
+    // if something went wrong with mail process, print warning
+    errno=0;
+    if (-1==(status=pclose(pfp)))
+      PrintOut(LOG_CRIT,"%s %s to %s: pclose(3) failed %s\n", newwarn, executable, newadd,
+	       errno?strerror(errno):"");
+    else
+      // mail process apparently succeeded. Check and report exit status
+      print_warning_exit_status(job, status);
+  }
+  
+#else // _WIN32
+  {
+    char command[2048];
+    snprintf(command, sizeof(command), "cmd /c \"%s\"", warning_script.c_str());
+
+    char stdoutbuf[800]; // < buffer in syslog_win32::vsyslog()
+    int rc;
+    // run command
+    PrintOut(LOG_INFO,"%s %s to %s ...\n",
+             (job.which?"Sending warning via":"Executing test of"), executable, newadd);
+    rc = daemon_spawn(command, "", 0, stdoutbuf, sizeof(stdoutbuf));
+    if (rc >= 0 && stdoutbuf[0])
+      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%d bytes) to STDOUT/STDERR:\n%s\n",
+        newwarn, executable, newadd, (int)strlen(stdoutbuf), stdoutbuf);
+    if (rc != 0)
+      PrintOut(LOG_CRIT,"%s %s to %s: failed, exit status %d\n",
+        newwarn, executable, newadd, rc);
+    else
+      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+  }
+
+#endif // _WIN32
+}
+
+#if defined(HAVE_PTHREADS) && !defined(_WIN32)
+
+extern char ** environ;
+
+extern "C" void * warning_dispatcher_thread(void * arg);
+
+// Runs the warning script for queued warnings in a separate thread,
+// so device checks never wait for mail delivery.  Up to 'max_procs'
+// scripts run in parallel, each is killed after 'timeout' seconds.
+// If 'delay' is nonzero, a warning is started 'delay' seconds after
+// it was queued.  Until then, further warnings of the same type to the
+// same recipients are coalesced into one script run.
+class warning_dispatcher
+{
+public:
+  warning_dispatcher();
+  ~warning_dispatcher();
+
+  // Set limits, warnings are queued from now on.
+  void enable(unsigned max_procs, int timeout, int delay);
+
+  bool is_enabled() const
+    { return m_enabled; }
+
+  // Start thread.  Warnings queued before are delivered now.  Runs
+  // these in foreground and disables queue on error.
+  bool start();
+
+  // Start all pending warnings now, wait for completion, stop thread.
+  // Warnings queued but never started are discarded, so a parent
+  // process does not deliver warnings queued before fork().
+  void stop();
+
+  bool is_running() const
+    { return m_running; }
+
+  // Add warning to queue.
+  void push(const warning_job & job);
+
+private:
+  // Script run in progress
+  struct child_proc {
+    warning_job job;
+    pid_t pid;
+    int fd;                   // Read end of stdout/stderr pipe, -1 on EOF
+    int64_t deadline_usec;
+    std::string output;       // First EBUFLEN-1 bytes
+    unsigned long discarded;  // Bytes discarded after 'output'
+    bool killed;
+  };
+
+  bool m_enabled;
+  bool m_running;
+  bool m_stopping;            // protected by m_mutex
+  unsigned m_max_procs;
+  int m_timeout;
+  int m_delay;
+  std::vector<std::string> m_environ; // Environment without SMARTD_*
+  std::deque<warning_job> m_pending;  // protected by m_mutex
+  std::vector<child_proc> m_procs;    // used by thread only
+  int m_wakeup[2];
+  pthread_t m_thread;
+  pthread_mutex_t m_mutex;
+
+  friend void * warning_dispatcher_thread(void * arg);
+  void run();
+  bool start_proc(const warning_job & job, child_proc & proc);
+  void read_output(child_proc & proc);
+  bool finish_proc(child_proc & proc, int64_t now);
+
+  warning_dispatcher(const warning_dispatcher &);
+  void operator=(const warning_dispatcher &);
+};
+
+extern "C" void * warning_dispatcher_thread(void * arg)
+{
+  ((warning_dispatcher *)arg)->run();
+  return 0;
+}
+
+warning_dispatcher::warning_dispatcher()
+: m_enabled(false), m_running(false), m_stopping(false),
+  m_max_procs(1), m_timeout(0), m_delay(0)
+{
+  m_wakeup[0] = m_wakeup[1] = -1;
+  pthread_mutex_init(&m_mutex, 0);
+}
+
+warning_dispatcher::~warning_dispatcher()
+{
+  stop();
+  pthread_mutex_destroy(&m_mutex);
+}
+
+void warning_dispatcher::enable(unsigned max_procs, int timeout, int delay)
+{
+  m_max_procs = max_procs; m_timeout = timeout; m_delay = delay;
+  m_enabled = true;
+}
+
+bool warning_dispatcher::start()
+{
+  if (m_running || !m_enabled)
+    return m_running;
+  m_stopping = false;
+
+  // Child environment, SMARTD_* variables are added for each warning
+  m_environ.clear();
+  for (char ** e = environ; *e; e++) {
+    if (!str_starts_with(*e, "SMARTD_"))
+      m_environ.push_back(*e);
+  }
+
+  int err = 0;
+  if (!pipe(m_wakeup)) {
+    fcntl(m_wakeup[0], F_SETFD, FD_CLOEXEC);
+    fcntl(m_wakeup[1], F_SETFD, FD_CLOEXEC);
+    fcntl(m_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(m_wakeup[1], F_SETFL, O_NONBLOCK);
+
+    // Signals should be handled by the main thread only
+    sigset_t allsigs, oldsigs;
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+    err = pthread_create(&m_thread, 0, warning_dispatcher_thread, this);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, 0);
+    if (err) {
+      close(m_wakeup[0]); close(m_wakeup[1]);
+    }
+  }
+  else
+    err = errno;
+
+  if (err) {
+    PrintOut(LOG_CRIT, "Unable to start warning dispatcher: %s\n", strerror(err));
+    m_enabled = false;
+    while (!m_pending.empty()) {
+      run_warning_job(m_pending.front());
+      m_pending.pop_front();
+    }
+    return false;
+  }
+  m_running = true;
+  return true;
+}
+
+void warning_dispatcher::stop()
+{
+  if (!m_running) {
+    m_pending.clear();
+    return;
+  }
+  pthread_mutex_lock(&m_mutex);
+  m_stopping = true;
+  unsigned num_pending = m_pending.size();
+  pthread_mutex_unlock(&m_mutex);
+  if (num_pending)
+    PrintOut(LOG_INFO, "Waiting for delivery of %u pending warnings\n", num_pending);
+
+  if (write(m_wakeup[1], "x", 1) == 1 || errno == EAGAIN)
+    pthread_join(m_thread, 0);
+  close(m_wakeup[0]); close(m_wakeup[1]);
+  m_running = false;
+}
+
+// Append list item VALUE to VAR
+static void append_item(std::string & var, const char * sep, const std::string & value)
+{
+  if (!var.empty())
+    var += sep;
+  var += value;
+}
+
+void warning_dispatcher::push(const warning_job & job)
+{
+  pthread_mutex_lock(&m_mutex);
+  // Coalesce with a pending warning of same type to same recipients
+  warning_job * pj = 0;
+  for (unsigned i = 0; m_delay > 0 && i < m_pending.size() && !pj; i++) {
+    warning_job & p = m_pending[i];
+    if (   p.which == job.which && job.which != 0
+        && p.executable == job.executable && p.address == job.address)
+      pj = &p;
+  }
+  if (pj) {
+    append_item(pj->getenv("SMARTD_MESSAGE"), "\n", job.getenv("SMARTD_MESSAGE"));
+    append_item(pj->getenv("SMARTD_DEVICESTRING"), ", ", job.getenv("SMARTD_DEVICESTRING"));
+    append_item(pj->getenv("SMARTD_DEVICE"), " ", job.getenv("SMARTD_DEVICE"));
+    append_item(pj->getenv("SMARTD_DEVICETYPE"), " ", job.getenv("SMARTD_DEVICETYPE"));
+    append_item(pj->getenv("SMARTD_DEVICEINFO"), "\n", job.getenv("SMARTD_DEVICEINFO"));
+    pj->count++;
+    pj->getenv("SMARTD_DEVICECOUNT") = strprintf("%u", pj->count);
+  }
+  else {
+    m_pending.push_back(job);
+    m_pending.back().queued_usec = smi()->get_timer_usec();
+  }
+  pthread_mutex_unlock(&m_mutex);
+
+  if (m_running && write(m_wakeup[1], "x", 1) != 1) {
+    // Pipe full, thread is already awake
+  }
+}
+
+bool warning_dispatcher::start_proc(const warning_job & job, child_proc & proc)
+{
+  const char * newwarn = job.newwarn();
+  const char * executable = job.executable.c_str(), * newadd = job.address.c_str();
+
+  // tell SYSLOG what we are about to do...
+  if (job.count > 1)
+    PrintOut(LOG_INFO,"Sending %u warnings via %s to %s ...\n", job.count, executable, newadd);
+  else
+    PrintOut(LOG_INFO,"%s %s to %s ...\n",
+             job.which?"Sending warning via":"Executing test of", executable, newadd);
+
+  // Prepare arguments and environment before fork()
+  std::vector<std::string> envstr(m_environ);
+  for (unsigned i = 0; i < job.env.size(); i++)
+    envstr.push_back(job.env[i].first + '=' + job.env[i].second);
+  std::vector<char *> envp;
+  for (unsigned i = 0; i < envstr.size(); i++)
+    envp.push_back(const_cast<char *>(envstr[i].c_str()));
+  envp.push_back((char *)0);
+  char * argv[] = { (char *)"sh", (char *)"-c", const_cast<char *>(warning_script.c_str()), 0 };
+
+  // All forks are done by this thread, so FD_CLOEXEC is set before
+  // another child could inherit the pipe.
+  int fds[2];
+  if (pipe(fds)) {
+    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n",
+             newwarn, executable, newadd, strerror(errno));
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child: Only async-signal-safe functions from here on.
+    // Own process group, so a timeout also kills the mailer.
+    setpgid(0, 0);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    sigset_t nosigs;
+    sigemptyset(&nosigs);
+    sigprocmask(SIG_SETMASK, &nosigs, 0);
+    execve("/bin/sh", argv, &envp[0]);
+    _exit(127);
+  }
+
+  int err = errno;
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n",
+             newwarn, executable, newadd, strerror(err));
+    return false;
+  }
+  setpgid(pid, pid);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+  proc.job = job;
+  proc.pid = pid;
+  proc.fd = fds[0];
+  proc.deadline_usec = smi()->get_timer_usec() + m_timeout * 1000000LL;
+  proc.discarded = 0;
+  proc.killed = false;
+  return true;
+}
+
+void warning_dispatcher::read_output(child_proc & proc)
+{
+  for (;;) {
+    char buf[EBUFLEN];
+    ssize_t n = read(proc.fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+    }
+    if (n <= 0)
+      break;
+
+    // Keep first EBUFLEN-1 bytes, discard up to 1 MB
+    unsigned keep = 0;
+    if (proc.output.size() < EBUFLEN-1) {
+      keep = EBUFLEN-1 - proc.output.size();
+      if (keep > (unsigned)n)
+        keep = n;
+      proc.output.append(buf, keep);
+    }
+    proc.discarded += n - keep;
+    if (proc.discarded > EBUFLEN * EBUFLEN)
+      break; // breaking pipe
+  }
+  close(proc.fd);
+  proc.fd = -1;
+}
+
+// Check for termination or timeout of script, print results.
+// Returns true if process has finished.
+bool warning_dispatcher::finish_proc(child_proc & proc, int64_t now)
+{
+  const warning_job & job = proc.job;
+  const char * newwarn = job.newwarn();
+  const char * executable = job.executable.c_str(), * newadd = job.address.c_str();
+
+  if (!proc.killed && now >= proc.deadline_usec) {
+    PrintOut(LOG_CRIT,"%s %s to %s: timed out after %d seconds, killed\n",
+             newwarn, executable, newadd, m_timeout);
+    kill(-proc.pid, SIGKILL);
+    proc.killed = true;
+  }
+
+  int status = 0;
+  pid_t rc = waitpid(proc.pid, &status, WNOHANG);
+  if (rc == 0)
+    return false;
+  if (proc.fd >= 0) {
+    if (!proc.killed)
+      read_output(proc);
+    if (proc.fd >= 0)
+      close(proc.fd);
+  }
+
+  if (!proc.output.empty()) {
+    PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%s%d bytes) to STDOUT/STDERR: \n%s\n",
+             newwarn, executable, newadd, proc.discarded ? "here truncated to " : "",
+             (int)proc.output.size(), proc.output.c_str());
+    if (proc.discarded > EBUFLEN * EBUFLEN)
+      PrintOut(LOG_CRIT,"%s %s to %s: more than 1 MB STDOUT/STDERR flushed, breaking pipe\n",
+               newwarn, executable, newadd);
+    else if (proc.discarded)
+      PrintOut(LOG_CRIT,"%s %s to %s: flushed remaining STDOUT/STDERR\n",
+               newwarn, executable, newadd);
+  }
+
+  if (rc < 0)
+    PrintOut(LOG_CRIT,"%s %s to %s: waitpid(2) failed %s\n", newwarn, executable, newadd,
+             strerror(errno));
+  else if (!proc.killed)
+    print_warning_exit_status(job, status);
+  return true;
+}
+
+void warning_dispatcher::run()
+{
+  for (;;) {
+    int64_t now = smi()->get_timer_usec();
+
+    // Start due warnings, all if stopping
+    int64_t next_start = -1;
+    bool stopping;
+    std::vector<warning_job> jobs;
+    pthread_mutex_lock(&m_mutex);
+    stopping = m_stopping;
+    while (!m_pending.empty() && m_procs.size() + jobs.size() < m_max_procs) {
+      const warning_job & job = m_pending.front();
+      int64_t start = job.queued_usec + m_delay * 1000000LL;
+      if (!stopping && now < start) {
+        next_start = start;
+        break;
+      }
+      jobs.push_back(job);
+      m_pending.pop_front();
+    }
+    bool idle = m_pending.empty();
+    pthread_mutex_unlock(&m_mutex);
+
+    for (unsigned i = 0; i < jobs.size(); i++) {
+      child_proc proc;
+      if (start_proc(jobs[i], proc))
+        m_procs.push_back(proc);
+    }
+
+    if (stopping && idle && m_procs.empty())
+      break;
+
+    // Wait for output, termination, timeout, next start or new warnings
+    std::vector<pollfd> fds(1);
+    fds[0].fd = m_wakeup[0]; fds[0].events = POLLIN; fds[0].revents = 0;
+    int64_t next = next_start;
+    bool waiting = false; // Some process closed its output or was killed
+    for (unsigned i = 0; i < m_procs.size(); i++) {
+      const child_proc & proc = m_procs[i];
+      if (proc.fd >= 0) {
+        pollfd pfd; pfd.fd = proc.fd; pfd.events = POLLIN; pfd.revents = 0;
+        fds.push_back(pfd);
+      }
+      if (proc.fd < 0 || proc.killed)
+        waiting = true;
+      if (!proc.killed && (next < 0 || proc.deadline_usec < next))
+        next = proc.deadline_usec;
+    }
+    int timeout_ms = -1;
+    if (next >= 0)
+      timeout_ms = (next > now ? (int)((next - now + 999) / 1000) : 0);
+    if (waiting && !(0 <= timeout_ms && timeout_ms <= 100))
+      timeout_ms = 100;
+
+    if (poll(&fds[0], fds.size(), timeout_ms) < 0 && errno != EINTR)
+      break;
+
+    if (fds[0].revents) {
+      char buf[64];
+      while (read(m_wakeup[0], buf, sizeof(buf)) > 0) { }
+    }
+    for (unsigned i = 0, j = 1; i < m_procs.size(); i++) {
+      child_proc & proc = m_procs[i];
+      if (proc.fd < 0)
+        continue;
+      if (fds[j++].revents)
+        read_output(proc);
+    }
+
+    now = smi()->get_timer_usec();
+    for (unsigned i = 0; i < m_procs.size(); ) {
+      if (finish_proc(m_procs[i], now))
+        m_procs.erase(m_procs.begin() + i);
+      else
+        i++;
+    }
+  }
+}
+
+#else // HAVE_PTHREADS && !_WIN32
+
+// Warnings are always delivered synchronously.
+class warning_dispatcher
+{
+public:
+  bool is_enabled() const
+    { return false; }
+  void stop()
+    { }
+  void push(const warning_job & /*job*/)
+    { }
+};
+
+#endif // HAVE_PTHREADS && !_WIN32
+
+// Runs warning scripts asynchronously if started, see main_worker().
+static warning_dispatcher warning_queue;
+
+static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
+                        __attribute_format_printf(4, 5);
+
+// If either address or executable path is non-null then send and log
+// a warning email, or execute executable
+static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
+{
+  static const char * const whichfail[] = {
+    "EmailTest",                  // 0
+    "Health",                     // 1
+    "Usage",                      // 2
+    "SelfTest",                   // 3
+    "ErrorCount",                 // 4
+    "FailedHealthCheck",          // 5
+    "FailedReadSmartData",        // 6
+    "FailedReadSmartErrorLog",    // 7
+    "FailedReadSmartSelfTestLog", // 8
+    "FailedOpenDevice",           // 9
+    "CurrentPendingSector",       // 10
     "OfflineUncorrectableSector", // 11
     "Temperature"                 // 12
   };
@@ -964,6 +2235,16 @@ static void MailWarning(const dev_config & cfg, dev_state & state, int which, co
   if (cfg.emailaddress.empty() && cfg.emailcmdline.empty())
     return;
 
+  // Defer if called from a worker thread
+  captured_output * capture = get_captured_output();
+  if (capture) {
+    va_list ap;
+    va_start(ap, fmt);
+    capture->add(captured_output::MAIL_WARNING, which, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
   std::string address = cfg.emailaddress;
   const char * executable = cfg.emailcmdline.c_str();
 
@@ -1030,135 +2311,46 @@ static void MailWarning(const dev_config & cfg, dev_state & state, int which, co
 
   // Export information in environment variables that will be useful
   // for user scripts
-  static env_buffer env[12];
-  env[0].set("SMARTD_MAILER", executable);
-  env[1].set("SMARTD_MESSAGE", message);
+  warning_job job;
+  job.which = which;
+  std::vector<warning_job::env_var> & env = job.env;
+  env.push_back(warning_job::env_var("SMARTD_MAILER", executable));
+  env.push_back(warning_job::env_var("SMARTD_MESSAGE", message));
   char dates[DATEANDEPOCHLEN];
   snprintf(dates, sizeof(dates), "%d", mail->logged);
-  env[2].set("SMARTD_PREVCNT", dates);
+  env.push_back(warning_job::env_var("SMARTD_PREVCNT", dates));
   dateandtimezoneepoch(dates, mail->firstsent);
-  env[3].set("SMARTD_TFIRST", dates);
+  env.push_back(warning_job::env_var("SMARTD_TFIRST", dates));
   snprintf(dates, DATEANDEPOCHLEN,"%d", (int)mail->firstsent);
-  env[4].set("SMARTD_TFIRSTEPOCH", dates);
-  env[5].set("SMARTD_FAILTYPE", whichfail[which]);
-  env[6].set("SMARTD_ADDRESS", address.c_str());
-  env[7].set("SMARTD_DEVICESTRING", cfg.name.c_str());
+  env.push_back(warning_job::env_var("SMARTD_TFIRSTEPOCH", dates));
+  env.push_back(warning_job::env_var("SMARTD_FAILTYPE", whichfail[which]));
+  env.push_back(warning_job::env_var("SMARTD_ADDRESS", address));
+  env.push_back(warning_job::env_var("SMARTD_DEVICESTRING", cfg.name));
 
   // Allow 'smartctl ... -d $SMARTD_DEVICETYPE $SMARTD_DEVICE'
-  env[8].set("SMARTD_DEVICETYPE",
-             (!cfg.dev_type.empty() ? cfg.dev_type.c_str() : "auto"));
-  env[9].set("SMARTD_DEVICE", cfg.dev_name.c_str());
+  env.push_back(warning_job::env_var("SMARTD_DEVICETYPE",
+                (!cfg.dev_type.empty() ? cfg.dev_type : "auto")));
+  env.push_back(warning_job::env_var("SMARTD_DEVICE", cfg.dev_name));
 
-  env[10].set("SMARTD_DEVICEINFO", cfg.dev_idinfo.c_str());
-  dates[0] = 0;
-  if (which) switch (cfg.emailfreq) {
-    case 2: dates[0] = '1'; dates[1] = 0; break;
-    case 3: snprintf(dates, sizeof(dates), "%d", (0x01)<<mail->logged);
-  }
-  env[11].set("SMARTD_NEXTDAYS", dates);
-
-  // now construct a command to send this as EMAIL
-  if (!*executable)
-    executable = "<mail>";
-  const char * newadd = (!address.empty()? address.c_str() : "<nomailer>");
-  const char * newwarn = (which? "Warning via" : "Test of");
-
-#ifndef _WIN32
-  char command[2048];
-  snprintf(command, sizeof(command), "%s 2>&1", warning_script.c_str());
-  
-  // tell SYSLOG what we are about to do...
-  PrintOut(LOG_INFO,"%s %s to %s ...\n",
-           which?"Sending warning via":"Executing test of", executable, newadd);
-  
-  // issue the command to send mail or to run the user's executable
-  errno=0;
-  FILE * pfp;
-  if (!(pfp=popen(command, "r")))
-    // failed to popen() mail process
-    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n", 
-	     newwarn,  executable, newadd, errno?strerror(errno):"");
-  else {
-    // pipe suceeded!
-    int len, status;
-    char buffer[EBUFLEN];
-
-    // if unexpected output on stdout/stderr, null terminate, print, and flush
-    if ((len=fread(buffer, 1, EBUFLEN, pfp))) {
-      int count=0;
-      int newlen = len<EBUFLEN ? len : EBUFLEN-1;
-      buffer[newlen]='\0';
-      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%s%d bytes) to STDOUT/STDERR: \n%s\n", 
-	       newwarn, executable, newadd, len!=newlen?"here truncated to ":"", newlen, buffer);
-      
-      // flush pipe if needed
-      while (fread(buffer, 1, EBUFLEN, pfp) && count<EBUFLEN)
-	count++;
-
-      // tell user that pipe was flushed, or that something is really wrong
-      if (count && count<EBUFLEN)
-	PrintOut(LOG_CRIT,"%s %s to %s: flushed remaining STDOUT/STDERR\n", 
-		 newwarn, executable, newadd);
-      else if (count)
-	PrintOut(LOG_CRIT,"%s %s to %s: more than 1 MB STDOUT/STDERR flushed, breaking pipe\n", 
-		 newwarn, executable, newadd);
-    }
-    
-    // if something went wrong with mail process, print warning
-    errno=0;
-    if (-1==(status=pclose(pfp)))
-      PrintOut(LOG_CRIT,"%s %s to %s: pclose(3) failed %s\n", newwarn, executable, newadd,
-	       errno?strerror(errno):"");
-    else {
-      // mail process apparently succeeded. Check and report exit status
-      if (WIFEXITED(status)) {
-	// exited 'normally' (but perhaps with nonzero status)
-        int status8 = WEXITSTATUS(status);
-	if (status8>128)  
-	  PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d) perhaps caught signal %d [%s]\n", 
-		   newwarn, executable, newadd, status, status8, status8-128, strsignal(status8-128));
-	else if (status8)  
-	  PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d)\n", 
-		   newwarn, executable, newadd, status, status8);
-	else
-	  PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
-      }
-      
-      if (WIFSIGNALED(status))
-	PrintOut(LOG_INFO,"%s %s to %s: exited because of uncaught signal %d [%s]\n", 
-		 newwarn, executable, newadd, WTERMSIG(status), strsignal(WTERMSIG(status)));
-      
-      // this branch is probably not possible. If subprocess is
-      // stopped then pclose() should not return.
-      if (WIFSTOPPED(status)) 
-      	PrintOut(LOG_CRIT,"%s %s to %s: process STOPPED because it caught signal %d [%s]\n",
-		 newwarn, executable, newadd, WSTOPSIG(status), strsignal(WSTOPSIG(status)));
-      
-    }
-  }
-  
-#else // _WIN32
-  {
-    char command[2048];
-    snprintf(command, sizeof(command), "cmd /c \"%s\"", warning_script.c_str());
-
-    char stdoutbuf[800]; // < buffer in syslog_win32::vsyslog()
-    int rc;
-    // run command
-    PrintOut(LOG_INFO,"%s %s to %s ...\n",
-             (which?"Sending warning via":"Executing test of"), executable, newadd);
-    rc = daemon_spawn(command, "", 0, stdoutbuf, sizeof(stdoutbuf));
-    if (rc >= 0 && stdoutbuf[0])
-      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%d bytes) to STDOUT/STDERR:\n%s\n",
-        newwarn, executable, newadd, (int)strlen(stdoutbuf), stdoutbuf);
-    if (rc != 0)
-      PrintOut(LOG_CRIT,"%s %s to %s: failed, exit status %d\n",
-        newwarn, executable, newadd, rc);
-    else
-      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+  env.push_back(warning_job::env_var("SMARTD_DEVICEINFO", cfg.dev_idinfo));
+  dates[0] = 0;
+  if (which) switch (cfg.emailfreq) {
+    case 2: dates[0] = '1'; dates[1] = 0; break;
+    case 3: snprintf(dates, sizeof(dates), "%d", (0x01)<<mail->logged);
   }
+  env.push_back(warning_job::env_var("SMARTD_NEXTDAYS", dates));
+  // More than one if warnings were coalesced
+  env.push_back(warning_job::env_var("SMARTD_DEVICECOUNT", "1"));
 
-#endif // _WIN32
+  // now construct a command to send this as EMAIL
+  job.executable = (*executable ? executable : "<mail>");
+  job.address = (!address.empty()? address.c_str() : "<nomailer>");
+
+  // Deliver in background, queued until dispatcher is started after fork()
+  if (warning_queue.is_enabled())
+    warning_queue.push(job);
+  else
+    run_warning_job(job);
 
   // increment mail sent counter
   mail->logged++;
@@ -1177,6 +2369,16 @@ static void reset_warning_mail(const dev_config & cfg, dev_state & state, int wh
   if (!mi.logged)
     return;
 
+  // Defer if called from a worker thread
+  captured_output * capture = get_captured_output();
+  if (capture) {
+    va_list ap;
+    va_start(ap, fmt);
+    capture->add(captured_output::RESET_WARNING_MAIL, which, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
   // Format & print message
   char msg[256];
   va_list ap;
@@ -1223,6 +2425,17 @@ static void vsyslog_lines(int priority, const char * fmt, va_list ap)
 void pout(const char *fmt, ...){
   va_list ap;
 
+  // Defer if called from a worker thread
+  captured_output * capture = get_captured_output();
+  if (capture) {
+    va_start(ap, fmt);
+    capture->add(captured_output::POUT, 0, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  // Also serializes FixGlibcTimeZoneBug() with next_scheduled_test()
+  nonreentrant_lock lock;
   // get the correct time in syslog()
   FixGlibcTimeZoneBug();
   // initialize variable argument list 
@@ -1250,7 +2463,18 @@ void pout(const char *fmt, ...){
 // This function prints either to stdout or to the syslog as needed.
 static void PrintOut(int priority, const char *fmt, ...){
   va_list ap;
-  
+
+  // Defer if called from a worker thread
+  captured_output * capture = get_captured_output();
+  if (capture) {
+    va_start(ap, fmt);
+    capture->add(captured_output::PRINT_OUT, priority, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  // Also serializes FixGlibcTimeZoneBug() with next_scheduled_test()
+  nonreentrant_lock lock;
   // get the correct time in syslog()
   FixGlibcTimeZoneBug();
   // initialize variable argument list 
@@ -1422,6 +2646,8 @@ static void Directives()
            "  -o VAL  Enable/disable automatic offline tests (on/off)\n"
            "  -S VAL  Enable/disable attribute autosave (on/off)\n"
            "  -n MODE No check if: never, sleep[,N][,q], standby[,N][,q], idle[,N][,q]\n"
+           "  -k      Keep device open between checks\n"
+           "  -c N    Check device every N seconds instead of '-i' interval\n"
            "  -H      Monitor SMART Health Status, report if failed\n"
            "  -s REG  Do Self-Test at time(s) given by regular expression REG\n"
            "  -l TYPE Monitor SMART log or self-test status:\n"
@@ -1474,11 +2700,25 @@ static const char *GetValidArgList(char opt)
   case 'r':
     return "ioctl[,N], ataioctl[,N], scsiioctl[,N]";
   case 'B':
+  case 'K':
+  case 'M':
   case 'p':
+  case 'P':
+  case 'S':
   case 'w':
     return "<FILE_NAME>";
   case 'i':
     return "<INTEGER_SECONDS>";
+#ifdef HAVE_SHM_OPEN
+  case 'T':
+    return "</NAME>";
+#endif
+#ifdef HAVE_PTHREADS
+  case 'j':
+    return "<INTEGER_JOBS>";
+  case 'W':
+    return "<INTEGER_JOBS>[,<INTEGER_SECONDS>[,<INTEGER_SECONDS>]]";
+#endif
   default:
     return NULL;
   }
@@ -1489,9 +2729,9 @@ static void Usage()
 {
   PrintOut(LOG_INFO,"Usage: smartd [options]\n\n");
   PrintOut(LOG_INFO,"  -A PREFIX, --attributelog=PREFIX\n");
-  PrintOut(LOG_INFO,"        Log ATA attribute information to {PREFIX}MODEL-SERIAL.ata.csv\n");
+  PrintOut(LOG_INFO,"        Log ATA attribute history to {PREFIX}MODEL-SERIAL.ata.hist\n");
 #ifdef SMARTMONTOOLS_ATTRIBUTELOG
-  PrintOut(LOG_INFO,"        [default is " SMARTMONTOOLS_ATTRIBUTELOG "MODEL-SERIAL.ata.csv]\n");
+  PrintOut(LOG_INFO,"        [default is " SMARTMONTOOLS_ATTRIBUTELOG "MODEL-SERIAL.ata.hist]\n");
 #endif
   PrintOut(LOG_INFO,"\n");
   PrintOut(LOG_INFO,"  -B [+]FILE, --drivedb=[+]FILE\n");
@@ -1516,8 +2756,15 @@ static void Usage()
   PrintOut(LOG_INFO,"        Print the configuration file Directives and exit\n\n");
   PrintOut(LOG_INFO,"  -h, --help, --usage\n");
   PrintOut(LOG_INFO,"        Display this help and exit\n\n");
+  PrintOut(LOG_INFO,"  -H SOURCE, --hotplug=SOURCE\n");
+  PrintOut(LOG_INFO,"        Register and remove devices on events from SOURCE\n"
+                    "        ('kernel' or FIFO with simulated events)\n\n");
   PrintOut(LOG_INFO,"  -i N, --interval=N\n");
   PrintOut(LOG_INFO,"        Set interval between disk checks to N seconds, where N >= 10\n\n");
+#ifdef HAVE_PTHREADS
+  PrintOut(LOG_INFO,"  -j N, --jobs=N\n");
+  PrintOut(LOG_INFO,"        Check up to N devices in parallel [default is 1]\n\n");
+#endif
   PrintOut(LOG_INFO,"  -l local[0-7], --logfacility=local[0-7]\n");
 #ifndef _WIN32
   PrintOut(LOG_INFO,"        Use syslog facility local0 - local7 or daemon [default]\n\n");
@@ -1528,8 +2775,14 @@ static void Usage()
   PrintOut(LOG_INFO,"  -n, --no-fork\n");
   PrintOut(LOG_INFO,"        Do not fork into background\n\n");
 #endif  // _WIN32
+#ifdef HAVE_PTHREADS
+  PrintOut(LOG_INFO,"  -M SOCKET, --metrics=SOCKET\n");
+  PrintOut(LOG_INFO,"        Serve results of last checks as metrics on local SOCKET\n\n");
+#endif
   PrintOut(LOG_INFO,"  -p NAME, --pidfile=NAME\n");
   PrintOut(LOG_INFO,"        Write PID file NAME\n\n");
+  PrintOut(LOG_INFO,"  -P FILE, --profile=FILE\n");
+  PrintOut(LOG_INFO,"        Write durations of check phases and commands to FILE\n\n");
   PrintOut(LOG_INFO,"  -q WHEN, --quit=WHEN\n");
   PrintOut(LOG_INFO,"        Quit on one of: %s\n\n", GetValidArgList('q'));
   PrintOut(LOG_INFO,"  -r, --report=TYPE\n");
@@ -1540,6 +2793,14 @@ static void Usage()
   PrintOut(LOG_INFO,"        [default is " SMARTMONTOOLS_SAVESTATES "MODEL-SERIAL.TYPE.state]\n");
 #endif
   PrintOut(LOG_INFO,"\n");
+  PrintOut(LOG_INFO,"  -S FILE, --statedb=FILE\n");
+  PrintOut(LOG_INFO,"        Save states of all disks in single database FILE\n\n");
+  PrintOut(LOG_INFO,"  -K FILE, --capcache=FILE\n");
+  PrintOut(LOG_INFO,"        Read and update SCSI capability and ATA log limit cache FILE\n\n");
+#ifdef HAVE_SHM_OPEN
+  PrintOut(LOG_INFO,"  -T /NAME, --statetable=/NAME\n");
+  PrintOut(LOG_INFO,"        Publish device states in shared memory /NAME\n\n");
+#endif
   PrintOut(LOG_INFO,"  -w NAME, --warnexec=NAME\n");
   PrintOut(LOG_INFO,"        Run executable NAME on warnings\n");
 #ifndef _WIN32
@@ -1547,6 +2808,11 @@ static void Usage()
 #else
   PrintOut(LOG_INFO,"        [default is %s/smartd_warning.cmd]\n\n", get_exe_dir().c_str());
 #endif
+#ifdef HAVE_PTHREADS
+  PrintOut(LOG_INFO,"  -W N[,TIMEOUT[,DELAY]], --warnjobs=N[,TIMEOUT[,DELAY]]\n");
+  PrintOut(LOG_INFO,"        Run up to N warning scripts in background, 0 to wait for each\n");
+  PrintOut(LOG_INFO,"        [default is %d,%d,%d]\n\n", warn_jobs, warn_timeout, warn_delay);
+#endif
 #ifdef _WIN32
   PrintOut(LOG_INFO,"  --service\n");
   PrintOut(LOG_INFO,"        Running as windows service (see man page), install with:\n");
@@ -1568,6 +2834,78 @@ static int CloseDevice(smart_device * device, const char * name)
   return 0;
 }
 
+// Open device before check.  If '-k' is specified, reuse the handle
+// from the last check unless it is stale (device removed or reset).
+static bool OpenCheckDevice(const dev_config & cfg, dev_state & state, smart_device * device)
+{
+  state.kept_open = false;
+  if (state.path_opened) {
+    // Opened (or failed) by select_device_path()
+    state.path_opened = false;
+    return device->is_open();
+  }
+  if (cfg.keep_open && device->is_open()) {
+    // Issue a command which does not spin up the disk
+    device->clear_err();
+    if (device->is_ata())
+      ataCheckPowerMode(device->to_ata());
+    else if (device->is_scsi())
+      scsiTestUnitReady(device->to_scsi());
+
+    int err = device->get_errno();
+    if (!(err == ENODEV || err == ENXIO)) {
+      device->clear_err();
+      state.kept_open = true;
+      return true;
+    }
+
+    PrintOut(LOG_INFO, "Device: %s, stale device handle (%s), reopening\n",
+             cfg.name.c_str(), device->get_errmsg());
+    device->close();
+  }
+
+  int64_t start = smi()->get_timer_usec();
+  if (!device->open())
+    return false;
+  if (start >= 0)
+    state.open_usec = smi()->get_timer_usec() - start;
+  return true;
+}
+
+// Close device after check unless '-k' is specified.
+static void CloseCheckDevice(const dev_config & cfg, smart_device * device)
+{
+  if (cfg.keep_open)
+    return;
+  CloseDevice(device, cfg.name.c_str());
+}
+
+// Add time since end of previous phase to PHASE of current check.
+static void end_check_phase(dev_state & state, check_phase phase)
+{
+  int64_t now = smi()->get_timer_usec();
+  state.phase_usec[phase] += now - state.phase_start_usec;
+  state.phase_start_usec = now;
+}
+
+// Collect command latencies of device while in scope.
+class command_timing
+{
+public:
+  command_timing(smart_device * dev, command_stats & stats)
+    : m_dev(dev)
+    { m_dev->set_command_stats(&stats); }
+
+  ~command_timing()
+    { m_dev->set_command_stats(0); }
+
+private:
+  smart_device * m_dev;
+
+  command_timing(const command_timing &);
+  void operator=(const command_timing &);
+};
+
 // return true if a char is not allowed in a state file name
 static bool not_allowed_in_filename(char c)
 {
@@ -1712,7 +3050,7 @@ static void finish_device_scan(dev_config & cfg, dev_state & state)
   // Set cfg.emailfreq if user hasn't set it
   if ((!cfg.emailaddress.empty() || !cfg.emailcmdline.empty()) && !cfg.emailfreq) {
     // Avoid that emails are suppressed forever due to state persistence
-    if (cfg.state_file.empty())
+    if (cfg.state_file.empty() && cfg.state_key.empty())
       cfg.emailfreq = 1; // '-M once'
     else
       cfg.emailfreq = 2; // '-M daily'
@@ -1744,6 +3082,86 @@ static void format_set_result_msg(std::string & msg, const char * name, bool ok,
 // TODO: Add '-F swapid' directive
 const bool fix_swapped_id = false;
 
+// Return true if ATA data is recorded for 'smartctl --smartd-cache'.
+// The cache is served on the metrics socket.
+static inline bool ata_cache_enabled()
+{
+#ifdef HAVE_PTHREADS
+  return !metrics_socket_path.empty();
+#else
+  return false;
+#endif
+}
+
+// Records results of ATA commands to CACHE while in scope.  The
+// recorder is reset because device states may be moved later.
+class ata_cache_recording
+{
+public:
+  ata_cache_recording(ata_device * atadev, ata_data_cache & cache)
+    : m_atadev(ata_cache_enabled() ? atadev : 0)
+    {
+      if (m_atadev)
+        m_atadev->set_data_recorder(&cache);
+    }
+
+  ~ata_cache_recording()
+    {
+      if (m_atadev)
+        m_atadev->set_data_recorder(0);
+    }
+
+private:
+  ata_device * m_atadev;
+
+  ata_cache_recording(const ata_cache_recording &);
+  void operator=(const ata_cache_recording &);
+};
+
+// Read SMART logs printed by 'smartctl -a' which are not monitored,
+// so the cache is complete.  Called once at registration.
+static void read_ata_cache_logs(ata_device * atadev, const ata_identify_device & drive,
+                                const ata_smart_values & smartval)
+{
+  ata_data_cache * cache = atadev->get_data_recorder();
+  if (!cache)
+    return;
+
+  unsigned char logs[4]; int num_logs = 0;
+  if (isGeneralPurposeLoggingCapable(&drive))
+    logs[num_logs++] = 0x00; // SMART log directory
+  if (isSmartErrorLogCapable(&smartval, &drive))
+    logs[num_logs++] = 0x01;
+  if (isSmartTestLogCapable(&smartval, &drive))
+    logs[num_logs++] = 0x06;
+  if (isSupportSelectiveSelfTest(&smartval))
+    logs[num_logs++] = 0x09;
+
+  for (int i = 0; i < num_logs; i++) {
+    char data[512]; int retval;
+    if (!cache->lookup(READ_LOG, logs[i], data, retval))
+      smartcommandhandler(atadev, READ_LOG, logs[i], data);
+  }
+}
+
+// Read again the logs of the cache which were not read during this
+// check, so that 'smartctl --smartd-cache' does not get stale logs.
+static void refresh_ata_cache_logs(ata_device * atadev, time_t check_time)
+{
+  ata_data_cache * cache = atadev->get_data_recorder();
+  if (!cache)
+    return;
+
+  static const unsigned char logs[] = { 0x00, 0x01, 0x06, 0x09 };
+  for (unsigned i = 0; i < sizeof(logs); i++) {
+    time_t t = cache->get_time(READ_LOG, logs[i]);
+    if (!t || t >= check_time)
+      continue; // Not read at registration or read by this check
+    char data[512];
+    smartcommandhandler(atadev, READ_LOG, logs[i], data);
+  }
+}
+
 // scan to see what ata devices there are, and if they support SMART
 static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atadev)
 {
@@ -1772,6 +3190,13 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   ata_format_id_string(serial, drive.serial_no, sizeof(serial)-1);
   ata_format_id_string(firmware, drive.fw_rev, sizeof(firmware)-1);
 
+  // Apply log read limits learned before
+  if (!capcache_path.empty()) {
+    ata_log_limits limits;
+    if (caps_cache.lookup_ata(model, serial, firmware, limits))
+      atadev->set_log_limits(limits);
+  }
+
   ata_size_info sizes;
   ata_get_size_info(&drive, sizes);
   state.num_sectors = sizes.sectors;
@@ -1780,8 +3205,11 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   char wwn[30]; wwn[0] = 0;
   unsigned oui = 0; uint64_t unique_id = 0;
   int naa = ata_get_wwn(&drive, oui, unique_id);
-  if (naa >= 0)
+  if (naa >= 0) {
     snprintf(wwn, sizeof(wwn), "WWN:%x-%06x-%09" PRIx64 ", ", naa, oui, unique_id);
+    // Same format as NAA designator from SCSI VPD page 0x83
+    cfg.lu_id = strprintf("0x%x%06x%09" PRIx64, naa, oui, unique_id);
+  }
 
   // Format device id string for warning emails
   char cap[32];
@@ -1974,16 +3402,21 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
 
   if (   isGeneralPurposeLoggingCapable(&drive)
       && (cfg.errorlog || cfg.selftest)
-      && !cfg.firmwarebugs.is_set(BUG_NOLOGDIR)) {
+      && !cfg.firmwarebugs.is_set(BUG_NOLOGDIR)
+      && (atadev->get_log_limits().smart_logdir >= 0 || cfg.permissive)) {
       if (!ataReadLogDirectory(atadev, &smart_logdir, false))
         smart_logdir_ok = true;
   }
 
-  if (cfg.xerrorlog && !cfg.firmwarebugs.is_set(BUG_NOLOGDIR)) {
+  if (   cfg.xerrorlog && !cfg.firmwarebugs.is_set(BUG_NOLOGDIR)
+      && (atadev->get_log_limits().gp_logdir >= 0 || cfg.permissive)) {
     if (!ataReadLogDirectory(atadev, &gp_logdir, true))
       gp_logdir_ok = true;
   }
 
+  if (!capcache_path.empty())
+    caps_cache.update_ata(model, serial, firmware, atadev->get_log_limits());
+
   // capability check: self-test-log
   state.selflogcount = 0; state.selfloghour = 0;
   if (cfg.selftest) {
@@ -2045,6 +3478,9 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
       state.ataerrorcount = errcnt2;
   }
 
+  if (smart_val_ok)
+    read_ata_cache_logs(atadev, drive, state.smartval);
+
   // capability check: self-test and offline data collection status
   if (cfg.offlinests || cfg.selfteststs) {
     if (!(cfg.permissive || (smart_val_ok && state.smartval.offline_data_collection_capability))) {
@@ -2134,21 +3570,21 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   // close file descriptor
   CloseDevice(atadev, name);
 
-  if (!state_path_prefix.empty() || !attrlog_path_prefix.empty()) {
+  if (!state_path_prefix.empty() || !state_db_path.empty() || !attrlog_path_prefix.empty()) {
     // Build file name for state file
     std::replace_if(model, model+strlen(model), not_allowed_in_filename, '_');
     std::replace_if(serial, serial+strlen(serial), not_allowed_in_filename, '_');
-    if (!state_path_prefix.empty()) {
+    if (!state_path_prefix.empty())
       cfg.state_file = strprintf("%s%s-%s.ata.state", state_path_prefix.c_str(), model, serial);
-      // Read previous state
-      if (read_dev_state(cfg.state_file.c_str(), state)) {
-        PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, cfg.state_file.c_str());
-        // Copy ATA attribute values to temp state
-        state.update_temp_state();
-      }
+    if (!state_db_path.empty())
+      cfg.state_key = strprintf("%s-%s.ata", model, serial);
+    // Read previous state
+    if (read_dev_state(cfg, state, name)) {
+      // Copy ATA attribute values to temp state
+      state.update_temp_state();
     }
     if (!attrlog_path_prefix.empty())
-      cfg.attrlog_file = strprintf("%s%s-%s.ata.csv", attrlog_path_prefix.c_str(), model, serial);
+      cfg.attrlog_file = strprintf("%s%s-%s.ata.hist", attrlog_path_prefix.c_str(), model, serial);
   }
 
   finish_device_scan(cfg, state);
@@ -2158,12 +3594,76 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
 
 // on success, return 0. On failure, return >0.  Never return <0,
 // please.
+// Set flags of dev_state from list of supported log pages.
+static void set_scsi_log_pages_supported(dev_state & state,
+                                         const std::vector<unsigned char> & pages)
+{
+  for (unsigned k = 0; k < pages.size(); ++k) {
+    switch (pages[k]) {
+    case TEMPERATURE_LPAGE:
+      state.TempPageSupported = 1;
+      break;
+    case IE_LPAGE:
+      state.SmartPageSupported = 1;
+      break;
+    case READ_ERROR_COUNTER_LPAGE:
+      state.ReadECounterPageSupported = 1;
+      break;
+    case WRITE_ERROR_COUNTER_LPAGE:
+      state.WriteECounterPageSupported = 1;
+      break;
+    case VERIFY_ERROR_COUNTER_LPAGE:
+      state.VerifyECounterPageSupported = 1;
+      break;
+    case NON_MEDIUM_ERROR_LPAGE:
+      state.NonMediumErrorPageSupported = 1;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// Plan the log pages read by SCSICheckDevice(), the response lengths
+// are learned on first check.
+// Return true if the SCSI error counters are read during checks.  They
+// are used by the attribute log, the metrics socket and the state table.
+static bool scsi_error_counters_used(const dev_config & cfg)
+{
+  return (   !cfg.attrlog_file.empty() || !metrics_socket_path.empty()
+          || !state_table_name.empty());
+}
+
+static void plan_scsi_log_pages(const dev_config & cfg, dev_state & state)
+{
+  scsi_log_batch & lp = state.log_pages;
+  lp.clear();
+  if (!state.SuppressReport) {
+    if (state.SmartPageSupported)
+      lp.add_page(IE_LPAGE);
+    if (state.TempPageSupported)
+      lp.add_page(TEMPERATURE_LPAGE);
+  }
+  if (cfg.selftest)
+    lp.add_page(SELFTEST_RESULTS_LPAGE, LOG_RESP_SELF_TEST_LEN);
+  if (scsi_error_counters_used(cfg)) {
+    if (state.ReadECounterPageSupported)
+      lp.add_page(READ_ERROR_COUNTER_LPAGE);
+    if (state.WriteECounterPageSupported)
+      lp.add_page(WRITE_ERROR_COUNTER_LPAGE);
+    if (state.VerifyECounterPageSupported)
+      lp.add_page(VERIFY_ERROR_COUNTER_LPAGE);
+    if (state.NonMediumErrorPageSupported)
+      lp.add_page(NON_MEDIUM_ERROR_LPAGE);
+  }
+}
+
 static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scsidev)
 {
   int err, req_len, avail_len, version, len;
   const char *device = cfg.name.c_str();
   struct scsi_iec_mode_page iec;
-  UINT8  tBuf[64];
+  UINT8  tBuf[252];
   UINT8  inqBuf[96];
   UINT8  vpdBuf[252];
   char lu_id[64], serial[256], vendor[40], model[40];
@@ -2199,23 +3699,58 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
     return 2;
   }
 
-  if (supported_vpd_pages_p) {
-    delete supported_vpd_pages_p;
-    supported_vpd_pages_p = NULL;
+  // Supported VPD pages are kept local because devices may be scanned
+  // in parallel.  These are always read from the device because the
+  // serial number must not be requested if not supported.
+  supported_vpd_pages vpd_pages(scsidev);
+
+  // Look up supported log and mode pages in capability cache.
+  // The serial number is part of the id and is read first.  A cache
+  // entry with other VPD pages is stale.
+  scsi_device_caps caps;
+  std::string caps_id, caps_fw;
+  bool caps_cached = false, serial_read = false;
+  serial[0] = '\0';
+  if (!capcache_path.empty()) {
+    if (   vpd_pages.is_supported(SCSI_VPD_UNIT_SERIAL_NUMBER)
+        && 0 == scsiInquiryVpd(scsidev, SCSI_VPD_UNIT_SERIAL_NUMBER,
+                               vpdBuf, sizeof(vpdBuf))) {
+      len = vpdBuf[3];
+      if (len > (int)sizeof(vpdBuf) - 4)
+        len = sizeof(vpdBuf) - 4;
+      scsi_format_id_string(serial, (const unsigned char *)&vpdBuf[4], len);
+    }
+    serial_read = true;
+    caps_id = scsi_format_caps_id(inqBuf, serial);
+    caps_fw = scsi_format_caps_fw(inqBuf);
+    int num = vpd_pages.num_pages();
+    const unsigned char * pages = vpd_pages.get_pages();
+    caps_cached = (   caps_cache.lookup(caps_id, caps_fw, caps)
+                   && caps.vpd_pages == std::vector<unsigned char>(pages,
+                                          pages + (num > 0 ? num : 0)));
+  }
+
+  if (caps_cached) {
+    if (debugmode)
+      PrintOut(LOG_INFO, "Device: %s, using cached capabilities\n", device);
+    if (caps.modese_len)
+      state.modese_len = caps.modese_len;
   }
-  supported_vpd_pages_p = new supported_vpd_pages(scsidev);
 
   lu_id[0] = '\0';
   if ((version >= 0x3) && (version < 0x8)) {
     /* SPC to SPC-5 */
-    if (0 == scsiInquiryVpd(scsidev, SCSI_VPD_DEVICE_IDENTIFICATION,
+    if (   vpd_pages.is_supported(SCSI_VPD_DEVICE_IDENTIFICATION)
+        && 0 == scsiInquiryVpd(scsidev, SCSI_VPD_DEVICE_IDENTIFICATION,
 			    vpdBuf, sizeof(vpdBuf))) {
       len = vpdBuf[3];
       scsi_decode_lu_dev_id(vpdBuf + 4, len, lu_id, sizeof(lu_id), NULL);
     }
   }
-  serial[0] = '\0';
-  if (0 == scsiInquiryVpd(scsidev, SCSI_VPD_UNIT_SERIAL_NUMBER,
+  if (str_starts_with(lu_id, "0x"))
+    cfg.lu_id = lu_id;
+  if (   !serial_read && vpd_pages.is_supported(SCSI_VPD_UNIT_SERIAL_NUMBER)
+      && 0 == scsiInquiryVpd(scsidev, SCSI_VPD_UNIT_SERIAL_NUMBER,
 			  vpdBuf, sizeof(vpdBuf))) {
   	  len = vpdBuf[3];
   	  vpdBuf[4 + len] = '\0';
@@ -2288,31 +3823,28 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
   
   // Flag that certain log pages are supported (information may be
   // available from other sources).
-  if (0 == scsiLogSense(scsidev, SUPPORTED_LPAGES, 0, tBuf, sizeof(tBuf), 0)) {
-    for (int k = 4; k < tBuf[3] + LOGPAGEHDRSIZE; ++k) {
-      switch (tBuf[k]) { 
-      case TEMPERATURE_LPAGE:
-        state.TempPageSupported = 1;
-        break;
-      case IE_LPAGE:
-        state.SmartPageSupported = 1;
-        break;
-      case READ_ERROR_COUNTER_LPAGE:
-        state.ReadECounterPageSupported = 1;
-        break;
-      case WRITE_ERROR_COUNTER_LPAGE:
-        state.WriteECounterPageSupported = 1;
-        break;
-      case VERIFY_ERROR_COUNTER_LPAGE:
-        state.VerifyECounterPageSupported = 1;
-        break;
-      case NON_MEDIUM_ERROR_LPAGE:
-        state.NonMediumErrorPageSupported = 1;
-        break;
-      default:
-        break;
-      }
-    }   
+  bool log_pages_valid = caps_cached;
+  if (!caps_cached && 0 == scsiLogSense(scsidev, SUPPORTED_LPAGES, 0, tBuf,
+                                        sizeof(tBuf), 0)) {
+    len = tBuf[3];
+    if (len > (int)sizeof(tBuf) - LOGPAGEHDRSIZE)
+      len = sizeof(tBuf) - LOGPAGEHDRSIZE;
+    caps.log_pages.assign(tBuf + LOGPAGEHDRSIZE, tBuf + LOGPAGEHDRSIZE + len);
+    log_pages_valid = true;
+  }
+  if (log_pages_valid)
+    set_scsi_log_pages_supported(state, caps.log_pages);
+
+  // Add new device or changed mode sense length to cache
+  if (!caps_id.empty() && log_pages_valid) {
+    caps.modese_len = state.modese_len;
+    if (!caps_cached) {
+      int num = vpd_pages.num_pages();
+      if (num > 0)
+        caps.vpd_pages.assign(vpd_pages.get_pages(),
+                              vpd_pages.get_pages() + num);
+    }
+    caps_cache.update(caps_id, caps_fw, caps);
   }
   
   // Check if scsiCheckIE() is going to work
@@ -2376,23 +3908,25 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
   // close file descriptor
   CloseDevice(scsidev, device);
 
-  if (!state_path_prefix.empty() || !attrlog_path_prefix.empty()) {
+  if (!state_path_prefix.empty() || !state_db_path.empty() || !attrlog_path_prefix.empty()) {
     // Build file name for state file
     std::replace_if(model, model+strlen(model), not_allowed_in_filename, '_');
     std::replace_if(serial, serial+strlen(serial), not_allowed_in_filename, '_');
-    if (!state_path_prefix.empty()) {
+    if (!state_path_prefix.empty())
       cfg.state_file = strprintf("%s%s-%s-%s.scsi.state", state_path_prefix.c_str(), vendor, model, serial);
-      // Read previous state
-      if (read_dev_state(cfg.state_file.c_str(), state)) {
-        PrintOut(LOG_INFO, "Device: %s, state read from %s\n", device, cfg.state_file.c_str());
-        // Copy ATA attribute values to temp state
-        state.update_temp_state();
-      }
+    if (!state_db_path.empty())
+      cfg.state_key = strprintf("%s-%s-%s.scsi", vendor, model, serial);
+    // Read previous state
+    if (read_dev_state(cfg, state, device)) {
+      // Copy ATA attribute values to temp state
+      state.update_temp_state();
     }
     if (!attrlog_path_prefix.empty())
-      cfg.attrlog_file = strprintf("%s%s-%s-%s.scsi.csv", attrlog_path_prefix.c_str(), vendor, model, serial);
+      cfg.attrlog_file = strprintf("%s%s-%s-%s.scsi.hist", attrlog_path_prefix.c_str(), vendor, model, serial);
   }
 
+  plan_scsi_log_pages(cfg, state);
+
   finish_device_scan(cfg, state);
 
   return 0;
@@ -2458,9 +3992,19 @@ static void CheckSelfTestLogs(const dev_config & cfg, dev_state & state, int new
   return;
 }
 
-// Test types, ordered by priority.
-static const char test_type_chars[] = "LncrSCO";
-static const unsigned num_test_types = sizeof(test_type_chars)-1;
+// Compiled schedules, shared by devices with same regex.
+// Protected by nonreentrant_lock.
+typedef std::map<std::string, test_schedule> test_schedule_map;
+static test_schedule_map test_schedules;
+
+static test_schedule & get_test_schedule(const regular_expression & regex)
+{
+  test_schedule_map::iterator it = test_schedules.find(regex.get_pattern());
+  if (it == test_schedules.end())
+    it = test_schedules.insert(std::make_pair(std::string(regex.get_pattern()),
+                                              test_schedule(regex))).first;
+  return it->second;
+}
 
 // returns test type if time to do test of type testtype,
 // 0 if not time to do test.
@@ -2475,6 +4019,9 @@ static char next_scheduled_test(const dev_config & cfg, dev_state & state, bool
       (scsi || (state.not_cap_conveyance && state.not_cap_offline)))
     return 0;
 
+  // localtime() and FixGlibcTimeZoneBug() are not reentrant
+  nonreentrant_lock lock;
+
   // since we are about to call localtime(), be sure glibc is informed
   // of any timezone changes we make.
   if (!usetime)
@@ -2489,49 +4036,29 @@ static char next_scheduled_test(const dev_config & cfg, dev_state & state, bool
   if (state.scheduled_test_next_check + (3600L*24*90) < now)
     state.scheduled_test_next_check = now - (3600L*24*90);
 
-  // Check interval [state.scheduled_test_next_check, now] for scheduled tests
-  char testtype = 0;
-  time_t testtime = 0; int testhour = 0;
-  int maxtest = num_test_types-1;
-
-  for (time_t t = state.scheduled_test_next_check; ; ) {
-    struct tm * tms = localtime(&t);
-    // tm_wday is 0 (Sunday) to 6 (Saturday).  We use 1 (Monday) to 7 (Sunday).
-    int weekday = (tms->tm_wday ? tms->tm_wday : 7);
-    for (int i = 0; i <= maxtest; i++) {
-      // Skip if drive not capable of this test
-      switch (test_type_chars[i]) {
-        case 'L': if (state.not_cap_long)       continue; break;
-        case 'S': if (state.not_cap_short)      continue; break;
-        case 'C': if (scsi || state.not_cap_conveyance) continue; break;
-        case 'O': if (scsi || state.not_cap_offline)    continue; break;
-        case 'c': case 'n':
-        case 'r': if (scsi || state.not_cap_selective)  continue; break;
-        default: continue;
-      }
-      // Try match of "T/MM/DD/d/HH"
-      char pattern[16];
-      snprintf(pattern, sizeof(pattern), "%c/%02d/%02d/%1d/%02d",
-        test_type_chars[i], tms->tm_mon+1, tms->tm_mday, weekday, tms->tm_hour);
-      if (cfg.test_regex.full_match(pattern)) {
-        // Test found
-        testtype = pattern[0];
-        testtime = t; testhour = tms->tm_hour;
-        // Limit further matches to higher priority self-tests
-        maxtest = i-1;
-        break;
-      }
+  // Test types the drive is capable of
+  bool capable[num_test_types];
+  for (unsigned i = 0; i < num_test_types; i++) {
+    bool cap;
+    switch (test_type_chars[i]) {
+      case 'L': cap = !state.not_cap_long; break;
+      case 'S': cap = !state.not_cap_short; break;
+      case 'C': cap = !(scsi || state.not_cap_conveyance); break;
+      case 'O': cap = !(scsi || state.not_cap_offline); break;
+      case 'c': case 'n':
+      case 'r': cap = !(scsi || state.not_cap_selective); break;
+      default: cap = false;
     }
-    // Exit if no tests left or current time reached
-    if (maxtest < 0)
-      break;
-    if (t >= now)
-      break;
-    // Check next hour
-    if ((t += 3600) > now)
-      t = now;
+    capable[i] = cap;
   }
-  
+
+  test_schedule & sched = get_test_schedule(cfg.test_regex);
+
+  // Check interval [state.scheduled_test_next_check, now] for scheduled tests
+  time_t testtime = 0; int testhour = 0;
+  char testtype = find_scheduled_test(sched, capable, state.scheduled_test_next_check,
+                                      now, testtime, testhour);
+
   // Do next check not before next hour.
   struct tm * tmnow = localtime(&now);
   state.scheduled_test_next_check = now + (3600 - tmnow->tm_min*60 - tmnow->tm_sec);
@@ -2549,6 +4076,12 @@ static char next_scheduled_test(const dev_config & cfg, dev_state & state, bool
   return testtype;
 }
 
+// Return check interval of device.
+static inline int get_checktime(const dev_config & cfg)
+{
+  return (cfg.checktime ? cfg.checktime : checktime);
+}
+
 // Print a list of future tests.
 static void PrintTestSchedule(const dev_config_vector & configs, dev_state_vector & states, const smart_device_list & devices)
 {
@@ -2564,12 +4097,26 @@ static void PrintTestSchedule(const dev_config_vector & configs, dev_state_vecto
   char datenow[DATEANDEPOCHLEN], date[DATEANDEPOCHLEN];
   dateandtimezoneepoch(datenow, now);
 
+  // Step through time with greatest common divisor of check intervals
+  long step = 0;
+  for (unsigned i = 0; i < numdev; i++) {
+    long a = get_checktime(configs.at(i)), b = step;
+    while (b) {
+      long r = a % b; a = b; b = r;
+    }
+    step = a;
+  }
+  if (!step)
+    step = checktime;
+
   long seconds;
-  for (seconds=checktime; seconds<3600L*24*90; seconds+=checktime) {
+  for (seconds=step; seconds<3600L*24*90; seconds+=step) {
     // Check for each device whether a test will be run
     time_t testtime = now + seconds;
     for (unsigned i = 0; i < numdev; i++) {
       const dev_config & cfg = configs.at(i);
+      if (seconds % get_checktime(cfg))
+        continue;
       dev_state & state = states.at(i);
       const char * p;
       char testtype = next_scheduled_test(cfg, state, devices.at(i)->is_scsi(), testtime);
@@ -3007,13 +4554,16 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
   // perhaps the next time around we'll be able to open it.  ATAPI
   // cd/dvd devices will hang awaiting media if O_NONBLOCK is not
   // given (see linux cdrom driver).
-  if (!atadev->open()) {
+  bool opened = OpenCheckDevice(cfg, state, atadev);
+  end_check_phase(state, PHASE_OPEN);
+  if (!opened) {
     PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, atadev->get_errmsg());
     MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
     return 1;
   }
   if (debugmode)
-    PrintOut(LOG_INFO,"Device: %s, opened ATA device\n", name);
+    PrintOut(LOG_INFO,"Device: %s, %s ATA device\n", name,
+             (state.kept_open ? "reusing open" : "opened"));
   reset_warning_mail(cfg, state, 9, "open device worked again");
 
   // user may have requested (with the -n Directive) to leave the disk
@@ -3067,7 +4617,9 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     if (dontcheck){
       // skip at most powerskipmax checks
       if (!cfg.powerskipmax || state.powerskipcnt<cfg.powerskipmax) {
-        CloseDevice(atadev, name);
+        end_check_phase(state, PHASE_POWER);
+        CloseCheckDevice(cfg, atadev);
+        end_check_phase(state, PHASE_CLOSE);
         if (!state.powerskipcnt && !cfg.powerquiet) // report first only and avoid waking up system disk
           PrintOut(LOG_INFO, "Device: %s, is in %s mode, suspending checks\n", name, mode);
         state.powerskipcnt++;
@@ -3086,11 +4638,13 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
       state.powerskipcnt = 0;
       state.tempmin_delay = time(0) + CHECKTIME - 60; // Delay Min Temperature update
     }
+    end_check_phase(state, PHASE_POWER);
   }
 
   // check smart status
   if (cfg.smartcheck) {
     int status=ataSmartStatus2(atadev);
+    state.smart_status = (status == 1 ? 1 : status == 0 ? 0 : -1);
     if (status==-1){
       PrintOut(LOG_INFO,"Device: %s, not capable of SMART self-check\n",name);
       MailWarning(cfg, state, 5, "Device: %s, not capable of SMART self-check", name);
@@ -3166,6 +4720,7 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     }
   }
   state.offline_started = state.selftest_started = false;
+  end_check_phase(state, PHASE_SMART);
   
   // check if number of selftest errors has increased (note: may also DECREASE)
   if (cfg.selftest)
@@ -3202,6 +4757,9 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
       state.ataerrorcount=newc;
   }
 
+  refresh_ata_cache_logs(atadev, state.last_check);
+  end_check_phase(state, PHASE_LOGS);
+
   // if the user has asked, and device is capable (or we're not yet
   // sure) check whether a self test should be done now.
   if (allow_selftests && !cfg.test_regex.empty()) {
@@ -3209,10 +4767,12 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     if (testtype)
       DoATASelfTest(cfg, state, atadev, testtype);
   }
+  end_check_phase(state, PHASE_SELFTEST);
 
   // Don't leave device open -- the OS/user may want to access it
   // before the next smartd cycle!
-  CloseDevice(atadev, name);
+  CloseCheckDevice(cfg, atadev);
+  end_check_phase(state, PHASE_CLOSE);
 
   // Copy ATA attribute values to persistent state
   state.update_persistent_state();
@@ -3233,28 +4793,54 @@ static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_devic
 
     // if we can't open device, fail gracefully rather than hard --
     // perhaps the next time around we'll be able to open it
-    if (!scsidev->open()) {
+    bool opened = OpenCheckDevice(cfg, state, scsidev);
+    end_check_phase(state, PHASE_OPEN);
+    if (!opened) {
       PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, scsidev->get_errmsg());
       MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
       return 1;
     } else if (debugmode)
-        PrintOut(LOG_INFO,"Device: %s, opened SCSI device\n", name);
+        PrintOut(LOG_INFO,"Device: %s, %s SCSI device\n", name,
+                 (state.kept_open ? "reusing open" : "opened"));
     reset_warning_mail(cfg, state, 9, "open device worked again");
+
+    // Read all log pages needed below back to back
+    scsi_log_batch & lp = state.log_pages;
+    if (lp.num_planned() > 0) {
+      int num_ok = lp.fetch(scsidev);
+      if (debugmode)
+        PrintOut(LOG_INFO, "Device: %s, read %d of %d log pages, %u commands, "
+                 "%d.%03d ms (total: %u checks, %" PRIu64 " commands, "
+                 "%" PRId64 ".%03d ms)\n", name, num_ok, lp.num_planned(),
+                 lp.get_commands(), (int)(lp.get_usec() / 1000),
+                 (int)(lp.get_usec() % 1000), lp.get_total_fetches(),
+                 lp.get_total_commands(), lp.get_total_usec() / 1000,
+                 (int)(lp.get_total_usec() % 1000));
+    }
+    end_check_phase(state, PHASE_LOGS);
+
     currenttemp = 0;
     asc = 0;
     ascq = 0;
+    bool replan_log_pages = false;
     if (!state.SuppressReport) {
-        if (scsiCheckIE(scsidev, state.SmartPageSupported, state.TempPageSupported,
-                        &asc, &ascq, &currenttemp, &triptemp)) {
+        if (scsiCheckIE(scsidev, lp, &asc, &ascq, &currenttemp, &triptemp)) {
             PrintOut(LOG_INFO, "Device: %s, failed to read SMART values\n",
                       name);
             MailWarning(cfg, state, 6, "Device: %s, failed to read SMART values", name);
             state.SuppressReport = 1;
+            // Don't read IE and temperature pages again, pages read
+            // above are still used below
+            replan_log_pages = true;
         }
     }
+    if (!state.SuppressReport)
+        state.smart_status = 0;
     if (asc > 0) {
-        const char * cp = scsiGetIEString(asc, ascq);
+        char iebuf[128];
+        const char * cp = scsiGetIEString(asc, ascq, iebuf, sizeof(iebuf));
         if (cp) {
+            state.smart_status = 1;
             PrintOut(LOG_CRIT, "Device: %s, SMART Failure: %s\n", name, cp);
             MailWarning(cfg, state, 1,"Device: %s, SMART Failure: %s", name, cp);
         } else if (asc == 4 && ascq == 9) {
@@ -3264,45 +4850,48 @@ static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_devic
                      name, (int)asc, (int)ascq);  
     } else if (debugmode)
         PrintOut(LOG_INFO,"Device: %s, SMART health: passed\n", name);  
+    end_check_phase(state, PHASE_SMART);
 
     // check temperature limits
     if (cfg.tempdiff || cfg.tempinfo || cfg.tempcrit || !cfg.attrlog_file.empty())
       CheckTemperature(cfg, state, currenttemp, triptemp);
 
     // check if number of selftest errors has increased (note: may also DECREASE)
-    if (cfg.selftest)
-      CheckSelfTestLogs(cfg, state, scsiCountFailedSelfTests(scsidev, 0));
+    if (cfg.selftest) {
+      const unsigned char * resp = lp.get_page(SELFTEST_RESULTS_LPAGE);
+      CheckSelfTestLogs(cfg, state, (resp ? scsiCountFailedSelfTests(resp, 0) : -1));
+    }
     
     if (allow_selftests && !cfg.test_regex.empty()) {
       char testtype = next_scheduled_test(cfg, state, true/*scsi*/);
       if (testtype)
         DoSCSISelfTest(cfg, state, scsidev, testtype);
     }
-    if (!cfg.attrlog_file.empty()){
+    end_check_phase(state, PHASE_SELFTEST);
+    if (scsi_error_counters_used(cfg)) {
       // saving error counters to state
-      UINT8 tBuf[252];
-      if (state.ReadECounterPageSupported && (0 == scsiLogSense(scsidev,
-          READ_ERROR_COUNTER_LPAGE, 0, tBuf, sizeof(tBuf), 0))) {
+      UINT8 * tBuf;
+      if ((tBuf = lp.get_page(READ_ERROR_COUNTER_LPAGE))) {
           scsiDecodeErrCounterPage(tBuf, &state.scsi_error_counters[0].errCounter);
           state.scsi_error_counters[0].found=1;
       }
-      if (state.WriteECounterPageSupported && (0 == scsiLogSense(scsidev,
-          WRITE_ERROR_COUNTER_LPAGE, 0, tBuf, sizeof(tBuf), 0))) {
+      if ((tBuf = lp.get_page(WRITE_ERROR_COUNTER_LPAGE))) {
           scsiDecodeErrCounterPage(tBuf, &state.scsi_error_counters[1].errCounter);
           state.scsi_error_counters[1].found=1;
       }
-      if (state.VerifyECounterPageSupported && (0 == scsiLogSense(scsidev,
-          VERIFY_ERROR_COUNTER_LPAGE, 0, tBuf, sizeof(tBuf), 0))) {
+      if ((tBuf = lp.get_page(VERIFY_ERROR_COUNTER_LPAGE))) {
           scsiDecodeErrCounterPage(tBuf, &state.scsi_error_counters[2].errCounter);
           state.scsi_error_counters[2].found=1;
       }
-      if (state.NonMediumErrorPageSupported && (0 == scsiLogSense(scsidev,
-          NON_MEDIUM_ERROR_LPAGE, 0, tBuf, sizeof(tBuf), 0))) {
+      if ((tBuf = lp.get_page(NON_MEDIUM_ERROR_LPAGE))) {
           scsiDecodeNonMediumErrPage(tBuf, &state.scsi_nonmedium_error.nme);
           state.scsi_nonmedium_error.found=1;
       }
     }
-    CloseDevice(scsidev, name);
+    if (replan_log_pages)
+      plan_scsi_log_pages(cfg, state);
+    CloseCheckDevice(cfg, scsidev);
+    end_check_phase(state, PHASE_CLOSE);
     return 0;
 }
 
@@ -3384,18 +4973,380 @@ static void do_disable_standby_check(const dev_config_vector & configs, const de
   }
 }
 
-// Checks the SMART status of all ATA and SCSI devices
+// Return new device for alternate path K of multipath device DEV, 0 if
+// unavailable or of different type.  Check functions require the same
+// device type.
+static smart_device * get_alternate_path(const dev_state & state, const smart_device * dev,
+                                         unsigned k)
+{
+  const smart_device::device_info & alt = state.alt_paths.at(k);
+  smart_device_auto_ptr altdev( smi()->get_smart_device(alt.dev_name.c_str(), alt.dev_type.c_str()) );
+  if (!(altdev && altdev->is_ata() == dev->is_ata() && altdev->is_scsi() == dev->is_scsi()))
+    return 0;
+  return altdev.release();
+}
+
+// Open multipath device for the next check.  Switch to an alternate path
+// if the current path cannot be opened.  The failed path becomes the last
+// alternate.  OpenCheckDevice() then uses the result of this open().
+static void select_device_path(const dev_config & cfg, dev_state & state,
+                               smart_device_list & devices, unsigned i)
+{
+  if (state.alt_paths.empty())
+    return;
+  smart_device * dev = devices.at(i);
+  if (dev->is_open())
+    return; // '-k'
+
+  state.path_opened = true;
+  int64_t start = smi()->get_timer_usec();
+  if (dev->open()) {
+    if (start >= 0)
+      state.open_usec = smi()->get_timer_usec() - start;
+    return;
+  }
+
+  for (unsigned k = 0; k < state.alt_paths.size(); k++) {
+    smart_device_auto_ptr altdev( get_alternate_path(state, dev, k) );
+    if (!(altdev && altdev->open()))
+      continue;
+
+    PrintOut(LOG_INFO, "Device: %s, path %s failed: %s, switching to %s\n", cfg.name.c_str(),
+             dev->get_info_name(), dev->get_errmsg(), altdev->get_info_name());
+    state.alt_paths.push_back(dev->get_info());
+    state.alt_paths.erase(state.alt_paths.begin() + k);
+    devices.replace(i, altdev.release());
+    return;
+  }
+  // All paths failed, error of current path is reported by check
+}
+
+// Checks the SMART status of one ATA or SCSI device
+static void CheckDevice(const dev_config & cfg, dev_state & state, smart_device * dev,
+                        bool firstpass, bool allow_selftests)
+{
+  state.last_check = time(0);
+  int64_t start = smi()->get_timer_usec();
+  state.phase_start_usec = start;
+  for (int i = 0; i < NUM_CHECK_PHASES; i++)
+    state.phase_usec[i] = 0;
+
+  int status = 0;
+  {
+    command_timing timing(dev, state.cmd_stats);
+    if (dev->is_ata()) {
+      ata_cache_recording rec(dev->to_ata(), state.ata_cache);
+      status = ATACheckDevice(cfg, state, dev->to_ata(), firstpass, allow_selftests);
+    }
+    else if (dev->is_scsi())
+      status = SCSICheckDevice(cfg, state, dev->to_scsi(), allow_selftests);
+  }
+  state.check_failed = (status != 0);
+  state.check_usec = smi()->get_timer_usec() - start;
+  state.num_checks++;
+
+  state.total_check_usec += state.check_usec;
+  for (int i = 0; i < NUM_CHECK_PHASES; i++)
+    state.phase_total_usec[i] += state.phase_usec[i];
+}
+
+// Copy state of device to slot of shared memory state table
+static void fill_state_slot(const dev_config & cfg, const dev_state & state,
+                            const smart_device * dev, shm_state_slot & slot)
+{
+  memset(&slot, 0, sizeof(slot));
+  snprintf(slot.device, sizeof(slot.device), "%s", cfg.name.c_str());
+  snprintf(slot.type, sizeof(slot.type), "%s", dev->get_dev_type());
+  slot.last_check = state.last_check;
+  slot.check_usec = state.check_usec;
+  slot.num_checks = state.num_checks;
+  slot.smart_status = state.smart_status;
+  slot.temperature = state.temperature;
+  slot.temp_min = state.tempmin;
+  slot.temp_max = state.tempmax;
+  slot.power_skip_count = state.powerskipcnt;
+  if (state.check_failed)
+    slot.flags |= SHM_STATE_CHECK_FAILED;
+  if (cfg.selftest) {
+    slot.flags |= SHM_STATE_SELFTEST_LOG;
+    slot.self_test_errors = state.selflogcount;
+  }
+
+  if (dev->is_ata()) {
+    slot.flags |= SHM_STATE_ATA;
+    if (cfg.errorlog || cfg.xerrorlog) {
+      slot.flags |= SHM_STATE_ATA_ERROR_LOG;
+      slot.ata_errors = state.ataerrorcount;
+    }
+    // Attributes and self-test status are only valid if read on each check
+    if (   cfg.usagefailed || cfg.prefail || cfg.usage
+        || cfg.curr_pending_id || cfg.offl_pending_id
+        || cfg.tempdiff || cfg.tempinfo || cfg.tempcrit
+        || cfg.selftest || cfg.offlinests || cfg.selfteststs) {
+      slot.flags |= SHM_STATE_ATA_VALUES;
+      slot.self_test_exec_status = state.smartval.self_test_exec_status;
+      for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES && slot.num_attrs < SHM_STATE_MAX_ATTRS; i++) {
+        const ata_smart_attribute & attr = state.smartval.vendor_attributes[i];
+        if (!attr.id)
+          continue;
+        shm_state_attr & sa = slot.attrs[slot.num_attrs++];
+        sa.id = attr.id;
+        sa.value = attr.current;
+        sa.worst = attr.worst;
+        const ata_smart_threshold_entry & thr = state.smartthres.thres_entries[i];
+        if (thr.id == attr.id)
+          sa.threshold = thr.threshold;
+        sa.raw = ata_get_attr_raw_value(attr, cfg.attribute_defs);
+      }
+    }
+  }
+  else if (dev->is_scsi()) {
+    slot.flags |= SHM_STATE_SCSI;
+    for (int k = 0; k < 3; k++) {
+      if (!state.scsi_error_counters[k].found)
+        continue;
+      const scsiErrorCounter & ec = state.scsi_error_counters[k].errCounter;
+      slot.flags |= (SHM_STATE_SCSI_READ << k);
+      slot.scsi_corrected[k] = ec.counter[3];
+      slot.scsi_uncorrected[k] = ec.counter[6];
+      slot.scsi_bytes[k] = ec.counter[5];
+    }
+    if (state.scsi_nonmedium_error.found && state.scsi_nonmedium_error.nme.gotPC0) {
+      slot.flags |= SHM_STATE_SCSI_NONMEDIUM;
+      slot.scsi_nonmedium = state.scsi_nonmedium_error.nme.counterPC0;
+    }
+  }
+}
+
+// Publish state of device I in shared memory state table, if open
+static void update_state_table(unsigned i, const dev_config & cfg, const dev_state & state,
+                               const smart_device * dev)
+{
+  if (!state_table.is_open())
+    return;
+  shm_state_slot slot;
+  fill_state_slot(cfg, state, dev, slot);
+  state_table.update_slot(i, slot);
+}
+
+// Publish all devices in shared memory state table after device list
+// has changed.
+static void update_state_table(const dev_config_vector & configs, const dev_state_vector & states,
+                               const smart_device_list & devices)
+{
+  if (!state_table.is_open())
+    return;
+  if (!state_table.set_num_devices(configs.size())) {
+    PrintOut(LOG_CRIT, "State table no longer updated\n");
+    return;
+  }
+  for (unsigned i = 0; i < configs.size(); i++)
+    update_state_table(i, configs.at(i), states.at(i), devices.at(i));
+}
+
+// Print output captured in a worker thread, send mails
+static void replay_captured_output(const dev_config & cfg, dev_state & state,
+                                   const captured_output & output)
+{
+  const std::vector<captured_output::item> & items = output.items;
+  for (unsigned j = 0; j < items.size(); j++) {
+    const captured_output::item & it = items[j];
+    switch (it.type) {
+      case captured_output::PRINT_OUT:
+        PrintOut(it.arg, "%s", it.text.c_str()); break;
+      case captured_output::POUT:
+        pout("%s", it.text.c_str()); break;
+      case captured_output::MAIL_WARNING:
+        MailWarning(cfg, state, it.arg, "%s", it.text.c_str()); break;
+      case captured_output::RESET_WARNING_MAIL:
+        reset_warning_mail(cfg, state, it.arg, "%s", it.text.c_str()); break;
+    }
+  }
+}
+
+#ifdef HAVE_PTHREADS
+
+// Shared data of the worker threads of CheckDevicesParallel().
+struct parallel_check_info
+{
+  const dev_config_vector * configs;
+  dev_state_vector * states;
+  smart_device_list * devices;
+  const std::vector<unsigned> * due;
+  bool firstpass, allow_selftests;
+
+  // Device indices grouped by controller, each group is checked serially
+  std::vector< std::vector<unsigned> > groups;
+  unsigned next_group; // Next group to check, protected by mutex
+  pthread_mutex_t mutex;
+
+  std::vector<captured_output> outputs; // Per device
+
+  // Exception caught in a worker, rethrown after all threads finished
+  bool failed;
+  std::string errmsg;
+};
+
+extern "C" void * parallel_check_worker(void * arg)
+{
+  parallel_check_info & info = *(parallel_check_info *)arg;
+  for (;;) {
+    pthread_mutex_lock(&info.mutex);
+    bool stop = (info.failed || info.next_group >= info.groups.size());
+    unsigned g = info.next_group++;
+    pthread_mutex_unlock(&info.mutex);
+    if (stop)
+      break;
+
+    const std::vector<unsigned> & group = info.groups[g];
+    for (unsigned j = 0; j < group.size(); j++) {
+      unsigned i = group[j];
+      pthread_setspecific(capture_key, &info.outputs[i]);
+      try {
+        select_device_path(info.configs->at(i), info.states->at(i), *info.devices, i);
+        CheckDevice(info.configs->at(i), info.states->at(i), info.devices->at(i),
+                    info.firstpass, info.allow_selftests);
+        update_state_table(i, info.configs->at(i), info.states->at(i), info.devices->at(i));
+      }
+      catch (const std::exception & ex) {
+        pthread_mutex_lock(&info.mutex);
+        info.failed = true;
+        info.errmsg = ex.what();
+        pthread_mutex_unlock(&info.mutex);
+      }
+      catch (...) {
+        pthread_mutex_lock(&info.mutex);
+        info.failed = true;
+        info.errmsg = "unknown exception in device check";
+        pthread_mutex_unlock(&info.mutex);
+      }
+      pthread_setspecific(capture_key, 0);
+    }
+  }
+  return 0;
+}
+
+// Checks devices in up to max_jobs worker threads.  Devices sharing
+// the same device node (e.g. the ports of a RAID controller) are
+// checked serially in the same thread.  Output and warning mails
+// are captured and then replayed in device order.
+// Returns false if threads could not be created.
+static bool CheckDevicesParallel(const dev_config_vector & configs, dev_state_vector & states,
+                                 smart_device_list & devices, const std::vector<unsigned> & due,
+                                 bool firstpass, bool allow_selftests)
+{
+  if (!capture_key_created) {
+    if (pthread_key_create(&capture_key, 0))
+      return false;
+    capture_key_created = true;
+  }
+
+  parallel_check_info info;
+  info.configs = &configs; info.states = &states; info.devices = &devices;
+  info.due = &due;
+  info.firstpass = firstpass; info.allow_selftests = allow_selftests;
+  info.next_group = 0;
+  info.failed = false;
+
+  // Group devices by device node name, keep order of first device
+  std::vector<std::string> group_names;
+  for (unsigned j = 0; j < due.size(); j++) {
+    unsigned i = due[j];
+    std::string name = devices.at(i)->get_dev_name();
+    unsigned g;
+    for (g = 0; g < group_names.size() && group_names[g] != name; g++) ;
+    if (g >= group_names.size()) {
+      group_names.push_back(name);
+      info.groups.push_back(std::vector<unsigned>());
+    }
+    info.groups[g].push_back(i);
+  }
+
+  unsigned num_threads = info.groups.size();
+  if (num_threads > (unsigned)max_jobs)
+    num_threads = max_jobs;
+  if (num_threads < 2)
+    return false;
+
+  info.outputs.resize(devices.size());
+  pthread_mutex_init(&info.mutex, 0);
+
+  // Signals should be handled by the main thread only
+#ifndef _WIN32
+  sigset_t allsigs, oldsigs;
+  sigfillset(&allsigs);
+  pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+#endif
+
+  std::vector<pthread_t> threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, parallel_check_worker, &info))
+      break;
+    threads.push_back(thread);
+  }
+
+#ifndef _WIN32
+  pthread_sigmask(SIG_SETMASK, &oldsigs, 0);
+#endif
+
+  if (threads.empty()) {
+    pthread_mutex_destroy(&info.mutex);
+    return false;
+  }
+  if (debugmode)
+    PrintOut(LOG_INFO, "Checking %u devices (%u groups) in %u threads\n",
+             (unsigned)due.size(), (unsigned)info.groups.size(), (unsigned)threads.size());
+
+  for (unsigned t = 0; t < threads.size(); t++)
+    pthread_join(threads[t], 0);
+  pthread_mutex_destroy(&info.mutex);
+
+  // Print captured output, send mails
+  for (unsigned j = 0; j < due.size(); j++) {
+    unsigned i = due[j];
+    replay_captured_output(configs.at(i), states.at(i), info.outputs[i]);
+  }
+
+  if (info.failed)
+    throw std::runtime_error(info.errmsg);
+  return true;
+}
+
+#endif // HAVE_PTHREADS
+
+// Checks the SMART status of all due ATA and SCSI devices
 static void CheckDevicesOnce(const dev_config_vector & configs, dev_state_vector & states,
-                             smart_device_list & devices, bool firstpass, bool allow_selftests)
+                             smart_device_list & devices, const std::vector<unsigned> & due,
+                             bool firstpass, bool allow_selftests)
 {
-  for (unsigned i = 0; i < configs.size(); i++) {
-    const dev_config & cfg = configs.at(i);
-    dev_state & state = states.at(i);
-    smart_device * dev = devices.at(i);
-    if (dev->is_ata())
-      ATACheckDevice(cfg, state, dev->to_ata(), firstpass, allow_selftests);
-    else if (dev->is_scsi())
-      SCSICheckDevice(cfg, state, dev->to_scsi(), allow_selftests);
+  bool done = false;
+#ifdef HAVE_PTHREADS
+  if (max_jobs > 1)
+    done = CheckDevicesParallel(configs, states, devices, due, firstpass, allow_selftests);
+#endif
+
+  if (!done) {
+    for (unsigned j = 0; j < due.size(); j++) {
+      unsigned i = due[j];
+      select_device_path(configs.at(i), states.at(i), devices, i);
+      CheckDevice(configs.at(i), states.at(i), devices.at(i), firstpass, allow_selftests);
+      update_state_table(i, configs.at(i), states.at(i), devices.at(i));
+    }
+  }
+
+  if (debugmode) {
+    // Report time saved by '-k' directive
+    unsigned kept = 0; int64_t saved_usec = 0;
+    for (unsigned j = 0; j < due.size(); j++) {
+      unsigned i = due[j];
+      if (!states[i].kept_open)
+        continue;
+      kept++; saved_usec += states[i].open_usec;
+    }
+    if (kept)
+      PrintOut(LOG_INFO, "Reused %u open device handle%s, saved %d.%03d ms of open() time\n",
+               kept, (kept == 1 ? "" : "s"), (int)(saved_usec / 1000), (int)(saved_usec % 1000));
   }
 
   do_disable_standby_check(configs, states);
@@ -3405,7 +5356,7 @@ static void CheckDevicesOnce(const dev_config_vector & configs, dev_state_vector
 static bool is_initialized = false;
 
 // Does initialization right after fork to daemon mode
-static void Initialize(time_t *wakeuptime)
+static void Initialize()
 {
   // Call Goodbye() on exit
   is_initialized = true;
@@ -3428,19 +5379,14 @@ static void Initialize(time_t *wakeuptime)
   if (SIGNALFN(SIGINT, debugmode?HUPhandler:sighandler)==SIG_IGN)
     SIGNALFN(SIGINT, SIG_IGN);
   
-  // Catch HUP and USR1
+  // Catch HUP, USR1 and USR2
   if (SIGNALFN(SIGHUP, HUPhandler)==SIG_IGN)
     SIGNALFN(SIGHUP, SIG_IGN);
   if (SIGNALFN(SIGUSR1, USR1handler)==SIG_IGN)
     SIGNALFN(SIGUSR1, SIG_IGN);
-#ifdef _WIN32
   if (SIGNALFN(SIGUSR2, USR2handler)==SIG_IGN)
     SIGNALFN(SIGUSR2, SIG_IGN);
-#endif
 
-  // initialize wakeup time to CURRENT time
-  *wakeuptime=time(NULL);
-  
   return;
 }
 
@@ -3470,27 +5416,114 @@ static void ToggleDebugMode()
 }
 #endif
 
-static time_t dosleep(time_t wakeuptime, bool & sigwakeup)
+/// Schedules device checks by next due time (min-heap).
+class check_scheduler
+{
+public:
+  void clear()
+    { m_queue = queue_type(); }
+
+  bool empty() const
+    { return m_queue.empty(); }
+
+  void schedule(unsigned i, time_t t)
+    { m_queue.push(item(t, i)); }
+
+  /// Return time of earliest scheduled check.
+  time_t next_time() const
+    { return m_queue.top().first; }
+
+  /// Remove devices due at time t, append indices to 'due' in device order.
+  void pop_due(time_t t, std::vector<unsigned> & due)
+    {
+      unsigned n = due.size();
+      while (!m_queue.empty() && m_queue.top().first <= t) {
+        due.push_back(m_queue.top().second);
+        m_queue.pop();
+      }
+      std::sort(due.begin() + n, due.end());
+    }
+
+private:
+  typedef std::pair<time_t, unsigned> item;
+  typedef std::priority_queue<item, std::vector<item>, std::greater<item> > queue_type;
+  queue_type m_queue;
+};
+
+// Max multiplier for check interval if device open fails
+const unsigned max_check_backoff = 8;
+
+// Compute and schedule next check of device after check.
+static void schedule_next_check(const dev_config & cfg, dev_state & state, unsigned i,
+                                time_t now, check_scheduler & sched)
+{
+  int interval = get_checktime(cfg);
+  if (state.check_failed) {
+    // Device not accessible, increase interval up to max_check_backoff
+    if (state.check_backoff < max_check_backoff)
+      state.check_backoff *= 2;
+    state.next_check = now + (time_t)interval * state.check_backoff;
+    if (debugmode)
+      PrintOut(LOG_INFO, "Device: %s, next check in %d seconds\n", cfg.name.c_str(),
+               (int)(state.next_check - now));
+  }
+  else if (   state.check_backoff > 1 || !state.next_check
+           || state.next_check > now + interval) {
+    // First check, device accessible again, or system clock adjusted to the past
+    state.check_backoff = 1;
+    state.next_check = now + interval;
+  }
+  else if (state.next_check <= now) {
+    // Keep fixed interval, skip missed checks
+    state.next_check += ((now - state.next_check) / interval + 1) * interval;
+  }
+  sched.schedule(i, state.next_check);
+}
+
+// Schedule devices at state.next_check.  Devices which are not yet
+// checked or already due are added to 'due'.
+static void schedule_devices(const dev_state_vector & states, time_t now,
+                             check_scheduler & sched, std::vector<unsigned> & due)
 {
-  // If past wake-up-time, compute next wake-up-time
-  time_t timenow=time(NULL);
-  while (wakeuptime<=timenow){
-    int intervals=1+(timenow-wakeuptime)/checktime;
-    wakeuptime+=intervals*checktime;
+  sched.clear();
+  due.clear();
+  for (unsigned i = 0; i < states.size(); i++) {
+    if (states[i].next_check > now)
+      sched.schedule(i, states[i].next_check);
+    else
+      due.push_back(i);
   }
-  
+}
+
+// Sleep until next device check is due, a signal or hotplug events
+// arrive.  Returns indices of due devices in 'due' and hotplug events
+// in 'events'.  All devices are due on SIGUSR1.
+static void dosleep(check_scheduler & sched, unsigned numdev,
+                    std::vector<unsigned> & due, bool & sigwakeup,
+                    hotplug_monitor * & hotplug,
+                    std::vector<hotplug_monitor::event> & events)
+{
+  due.clear();
+  time_t timenow = time(NULL);
+  time_t wakeuptime = (!sched.empty() ? sched.next_time() : timenow + checktime);
+
   // sleep until we catch SIGUSR1 or have completed sleeping
   int addtime = 0;
-  while (timenow < wakeuptime+addtime && !caughtsigUSR1 && !caughtsigHUP && !caughtsigEXIT) {
-    
-    // protect user again system clock being adjusted backwards
-    if (wakeuptime>timenow+checktime){
-      PrintOut(LOG_CRIT, "System clock time adjusted to the past. Resetting next wakeup time.\n");
-      wakeuptime=timenow+checktime;
+  time_t lasttime = timenow;
+  while (   timenow < wakeuptime+addtime && !caughtsigUSR1 && !caughtsigHUP && !caughtsigEXIT
+#ifndef _WIN32
+         && !caughtsigUSR2
+#endif
+         && events.empty()) {
+
+    // Exit sleep when time interval has expired, a signal is received
+    // or hotplug events arrive
+    if (!hotplug)
+      sleep(wakeuptime+addtime-timenow);
+    else if (!hotplug->wait_events(wakeuptime+addtime-timenow, events)) {
+      PrintOut(LOG_CRIT, "Hotplug event monitor failed: %s, disabled\n", smi()->get_errmsg());
+      delete hotplug; hotplug = 0;
     }
-    
-    // Exit sleep when time interval has expired or a signal is received
-    sleep(wakeuptime+addtime-timenow);
 
 #ifdef _WIN32
     // toggle debug mode?
@@ -3502,6 +5535,16 @@ static time_t dosleep(time_t wakeuptime, bool & sigwakeup)
 
     timenow=time(NULL);
 
+    // protect user against system clock being adjusted backwards
+    if (timenow < lasttime) {
+      PrintOut(LOG_CRIT, "System clock time adjusted to the past. Resetting next wakeup time.\n");
+      sched.clear();
+      for (unsigned i = 0; i < numdev; i++)
+        due.push_back(i);
+      return;
+    }
+    lasttime = timenow;
+
     // Actual sleep time too long?
     if (!addtime && timenow > wakeuptime+60) {
       if (debugmode)
@@ -3509,23 +5552,24 @@ static time_t dosleep(time_t wakeuptime, bool & sigwakeup)
           (int)(timenow-wakeuptime));
       // Wait another 20 seconds to avoid I/O errors during disk spin-up
       addtime = timenow-wakeuptime+20;
-      // Use next wake-up-time if close
-      int nextcheck = checktime - addtime % checktime;
-      if (nextcheck <= 20)
-        addtime += nextcheck;
     }
   }
- 
+
   // if we caught a SIGUSR1 then print message and clear signal
   if (caughtsigUSR1){
     PrintOut(LOG_INFO,"Signal USR1 - checking devices now rather than in %d seconds.\n",
              wakeuptime-timenow>0?(int)(wakeuptime-timenow):0);
     caughtsigUSR1=0;
     sigwakeup = true;
+    sched.clear();
+    for (unsigned i = 0; i < numdev; i++)
+      due.push_back(i);
+    return;
   }
-  
-  // return adjusted wakeuptime
-  return wakeuptime;
+
+  // Devices due now, including those delayed by 'addtime'
+  if (!(caughtsigHUP || caughtsigEXIT))
+    sched.pop_due(timenow, due);
 }
 
 // Print out a list of valid arguments for the Directive d
@@ -3747,6 +5791,16 @@ static int ParseToken(char * token, dev_config & cfg)
     // check SMART status
     cfg.smartcheck = true;
     break;
+  case 'k':
+    // keep device open between checks
+    cfg.keep_open = true;
+    break;
+  case 'c':
+    // check interval of this device
+    if ((val = GetInteger(arg=strtok(NULL,delim), name, token, lineno, configfile, 10, INT_MAX)) < 0)
+      return -1;
+    cfg.checktime = val;
+    break;
   case 'f':
     // check for failure of usage attributes
     cfg.usagefailed = true;
@@ -4124,6 +6178,22 @@ static int ParseToken(char * token, dev_config & cfg)
 // Scan directive for configuration file
 #define SCANDIRECTIVE "DEVICESCAN"
 
+// Return tokens of configuration line separated by single spaces,
+// comment removed.
+static std::string get_config_directives(const char * line)
+{
+  const char *delim = " \n\t";
+  std::string dirs;
+  for (int i = strspn(line, delim); line[i] && line[i] != '#'; ) {
+    int n = strcspn(line + i, delim);
+    if (!dirs.empty())
+      dirs += ' ';
+    dirs.append(line + i, n);
+    i += n; i += strspn(line + i, delim);
+  }
+  return dirs;
+}
+
 // This is the routine that adds things to the conf_entries list.
 //
 // Return values are:
@@ -4137,6 +6207,9 @@ static int ParseConfigLine(dev_config_vector & conf_entries, dev_config & defaul
 {
   const char *delim = " \n\t";
 
+  // Save normalized line for comparison on reload, strtok() modifies it
+  std::string linedirs = get_config_directives(line);
+
   // get first token: device name. If a comment, skip line
   const char * name = strtok(line, delim);
   if (!name || *name == '#')
@@ -4156,6 +6229,10 @@ static int ParseConfigLine(dev_config_vector & conf_entries, dev_config & defaul
   }
   dev_config & cfg = (retval ? conf_entries.back() : default_conf);
 
+  if (!cfg.directives.empty())
+    cfg.directives += '\n';
+  cfg.directives += linedirs;
+
   cfg.name = name; // Later replaced by dev->get_info().info_name
   cfg.dev_name = name; // If DEVICESCAN later replaced by get->dev_info().dev_name
   cfg.lineno = lineno;
@@ -4408,11 +6485,17 @@ static void ParseOpts(int argc, char **argv)
 #endif
 
   // Please update GetValidArgList() if you edit shortopts
-  static const char shortopts[] = "c:l:q:dDni:p:r:s:A:B:w:Vh?"
+  static const char shortopts[] = "c:l:q:dDni:p:P:r:s:S:A:B:K:H:w:Vh?"
 #ifdef HAVE_LIBCAP_NG
-                                                          "C"
+                                                            "C"
 #endif
-                                                             ;
+#ifdef HAVE_PTHREADS
+                                                            "j:M:W:"
+#endif
+#ifdef HAVE_SHM_OPEN
+                                                            "T:"
+#endif
+                                                               ;
   // Please update GetValidArgList() if you edit longopts
   struct option longopts[] = {
     { "configfile",     required_argument, 0, 'c' },
@@ -4427,8 +6510,12 @@ static void ParseOpts(int argc, char **argv)
     { "service",        no_argument,       0, 'n' },
 #endif
     { "pidfile",        required_argument, 0, 'p' },
+    { "profile",        required_argument, 0, 'P' },
     { "report",         required_argument, 0, 'r' },
     { "savestates",     required_argument, 0, 's' },
+    { "statedb",        required_argument, 0, 'S' },
+    { "capcache",       required_argument, 0, 'K' },
+    { "hotplug",        required_argument, 0, 'H' },
     { "attributelog",   required_argument, 0, 'A' },
     { "drivedb",        required_argument, 0, 'B' },
     { "warnexec",       required_argument, 0, 'w' },
@@ -4439,6 +6526,14 @@ static void ParseOpts(int argc, char **argv)
     { "usage",          no_argument,       0, 'h' },
 #ifdef HAVE_LIBCAP_NG
     { "capabilities",   no_argument,       0, 'C' },
+#endif
+#ifdef HAVE_PTHREADS
+    { "jobs",           required_argument, 0, 'j' },
+    { "metrics",        required_argument, 0, 'M' },
+    { "warnjobs",       required_argument, 0, 'W' },
+#endif
+#ifdef HAVE_SHM_OPEN
+    { "statetable",     required_argument, 0, 'T' },
 #endif
     { 0,                0,                 0, 0   }
   };
@@ -4572,10 +6667,26 @@ static void ParseOpts(int argc, char **argv)
       // output file with PID number
       pid_file = optarg;
       break;
+    case 'P':
+      // path of command profile file
+      profile_path = optarg;
+      break;
     case 's':
       // path prefix of persistent state file
       state_path_prefix = optarg;
       break;
+    case 'S':
+      // path of state database file
+      state_db_path = optarg;
+      break;
+    case 'K':
+      // path of device capability cache
+      capcache_path = optarg;
+      break;
+    case 'H':
+      // source of hotplug events
+      hotplug_source = optarg;
+      break;
     case 'A':
       // path prefix of attribute log file
       attrlog_path_prefix = optarg;
@@ -4607,6 +6718,61 @@ static void ParseOpts(int argc, char **argv)
       // enable capabilities
       enable_capabilities = true;
       break;
+#endif
+#ifdef HAVE_PTHREADS
+    case 'j':
+      // max number of parallel device checks
+      {
+        errno = 0;
+        long jobs = strtol(optarg, &tailptr, 10);
+        if (*tailptr != '\0' || jobs < 1 || jobs > 256 || errno) {
+          debugmode=1;
+          PrintHead();
+          PrintOut(LOG_CRIT, "======> INVALID NUMBER OF JOBS: %s <=======\n", optarg);
+          PrintOut(LOG_CRIT, "======> JOBS MUST BE INTEGER BETWEEN %d AND %d <=======\n", 1, 256);
+          PrintOut(LOG_CRIT, "\nUse smartd -h to get a usage summary\n\n");
+          EXIT(EXIT_BADCMD);
+        }
+        max_jobs = (int)jobs;
+      }
+      break;
+    case 'M':
+      // path of metrics socket
+      metrics_socket_path = optarg;
+      break;
+    case 'W':
+      // max number of warning scripts run in background, timeout, delay
+      {
+        int jobs = -1, timeout = warn_timeout, delay = warn_delay;
+        int n1 = -1, n2 = -1, n3 = -1, len = strlen(optarg);
+        if (!(   sscanf(optarg, "%d%n,%d%n,%d%n", &jobs, &n1, &timeout, &n2, &delay, &n3) >= 1
+              && (n1 == len || n2 == len || n3 == len)
+              && 0 <= jobs && jobs <= 256 && 1 <= timeout && timeout <= 86400
+              && 0 <= delay && delay <= 3600)) {
+          debugmode=1;
+          PrintHead();
+          PrintOut(LOG_CRIT, "======> INVALID ARGUMENT OF -W: %s <=======\n", optarg);
+          PrintOut(LOG_CRIT, "======> MUST BE N[,TIMEOUT[,DELAY]] WITH N <= 256 AND TIMEOUT >= 1 <=======\n");
+          PrintOut(LOG_CRIT, "\nUse smartd -h to get a usage summary\n\n");
+          EXIT(EXIT_BADCMD);
+        }
+        warn_jobs = jobs; warn_timeout = timeout; warn_delay = delay;
+      }
+      break;
+#endif
+#ifdef HAVE_SHM_OPEN
+    case 'T':
+      // name of shared memory state table
+      if (optarg[0] != '/' || strchr(optarg + 1, '/')) {
+        debugmode=1;
+        PrintHead();
+        PrintOut(LOG_CRIT, "======> INVALID STATE TABLE NAME: %s <=======\n", optarg);
+        PrintOut(LOG_CRIT, "======> NAME MUST START WITH '/' AND CONTAIN NO OTHER '/' <=======\n");
+        PrintOut(LOG_CRIT, "\nUse smartd -h to get a usage summary\n\n");
+        EXIT(EXIT_BADCMD);
+      }
+      state_table_name = optarg;
+      break;
 #endif
     case 'h':
       // help: print summary of command-line options
@@ -4686,7 +6852,15 @@ static void ParseOpts(int argc, char **argv)
     // absolute path names are required due to chdir('/') after fork().
     check_abs_path('p', pid_file);
     check_abs_path('s', state_path_prefix);
+    check_abs_path('S', state_db_path);
+    check_abs_path('K', capcache_path);
+    if (hotplug_source != "kernel")
+      check_abs_path('H', hotplug_source);
     check_abs_path('A', attrlog_path_prefix);
+    check_abs_path('P', profile_path);
+#ifdef HAVE_PTHREADS
+    check_abs_path('M', metrics_socket_path);
+#endif
   }
 #endif
 
@@ -4752,9 +6926,21 @@ static void CanNotRegister(const char *name, const char *type, int line, bool sc
   return;
 }
 
+// Configuration entries used to register devices on hotplug events.
+struct hotplug_config
+{
+  dev_config_vector entries;              // Entries of explicitly listed devices
+  bool scan;                              // true if DEVICESCAN was found
+  dev_config scan_cfg;                    // DEVICESCAN entry used for other devices
+
+  hotplug_config()
+    : scan(false) { }
+};
+
 // Returns negative value (see ParseConfigFile()) if config file
 // had errors, else number of entries which may be zero or positive. 
-static int ReadOrMakeConfigEntries(dev_config_vector & conf_entries, smart_device_list & scanned_devs)
+static int ReadOrMakeConfigEntries(dev_config_vector & conf_entries, smart_device_list & scanned_devs,
+                                   hotplug_config & hpconf)
 {
   // parse configuration file configfile (normally /etc/smartd.conf)  
   int entries = ParseConfigFile(conf_entries);
@@ -4767,88 +6953,455 @@ static int ReadOrMakeConfigEntries(dev_config_vector & conf_entries, smart_devic
     return entries;
   }
 
-  // no error parsing config file.
-  if (entries) {
-    // we did not find a SCANDIRECTIVE and did find valid entries
-    PrintOut(LOG_INFO, "Configuration file %s parsed.\n", configfile);
+  // no error parsing config file.
+  hpconf = hotplug_config();
+  if (entries) {
+    hpconf.entries = conf_entries;
+    // we did not find a SCANDIRECTIVE and did find valid entries
+    PrintOut(LOG_INFO, "Configuration file %s parsed.\n", configfile);
+  }
+  else if (!conf_entries.empty()) {
+    // we found a SCANDIRECTIVE or there was no configuration file so
+    // scan.  Configuration file's last entry contains all options
+    // that were set
+    dev_config first = conf_entries.back();
+    conf_entries.pop_back();
+    hpconf.entries = conf_entries;
+    hpconf.scan = true;
+    hpconf.scan_cfg = first;
+
+    if (first.lineno)
+      PrintOut(LOG_INFO,"Configuration file %s was parsed, found %s, scanning devices\n", configfile, SCANDIRECTIVE);
+    else
+      PrintOut(LOG_INFO,"No configuration file %s found, scanning devices\n", configfile);
+    
+    // make config list of devices to search for
+    MakeConfigEntries(first, conf_entries, scanned_devs, first.dev_type.c_str());
+
+    // warn user if scan table found no devices
+    if (conf_entries.empty())
+      PrintOut(LOG_CRIT,"In the system's table of devices NO devices found to scan\n");
+  } 
+  else
+    PrintOut(LOG_CRIT, "Configuration file %s parsed but has no entries\n", configfile);
+  
+  return conf_entries.size();
+}
+
+// Return true if TYPE contains a RAID drive number
+static bool is_raid_type(const char * type)
+{
+  if (str_starts_with(type, "sat,"))
+    return false;
+  int i;
+  if (sscanf(type, "%*[^,],%d", &i) != 1)
+    return false;
+  return true;
+}
+
+// Return true if device INFO1 is already in DEVICES[0..NUMDEVS) or IGNORED[*]
+static bool is_duplicate_device(const smart_device::device_info & info1,
+                                const smart_device_list & devices, unsigned numdevs,
+                                const dev_config_vector & ignored)
+{
+  bool is_raid1 = is_raid_type(info1.dev_type.c_str());
+
+  for (unsigned i = 0; i < numdevs; i++) {
+    const smart_device::device_info & info2 = devices.at(i)->get_info();
+    // -d TYPE options must match if RAID drive number is specified
+    if (   info1.dev_name == info2.dev_name
+        && (   info1.dev_type == info2.dev_type
+            || !is_raid1 || !is_raid_type(info2.dev_type.c_str())))
+      return true;
+  }
+
+  for (unsigned i = 0; i < ignored.size(); i++) {
+    const dev_config & cfg2 = ignored.at(i);
+    if (   info1.dev_name == cfg2.dev_name
+        && (   info1.dev_type == cfg2.dev_type
+            || !is_raid1 || !is_raid_type(cfg2.dev_type.c_str())))
+      return true;
+  }
+  return false;
+}
+
+// Open device and check its capabilities.  Returns false if device
+// could not be opened.  Resets DEV if device cannot be monitored.
+static bool open_and_scan_device(dev_config & cfg, dev_state & state,
+                                 smart_device_auto_ptr & dev, bool scanning)
+{
+  // Save old info
+  smart_device::device_info oldinfo = dev->get_info();
+
+  // Open with autodetect support, may return 'better' device
+  dev.replace( dev->autodetect_open() );
+
+  // Report if type has changed
+  if (oldinfo.dev_type != dev->get_dev_type())
+    PrintOut(LOG_INFO,"Device: %s, type changed from '%s' to '%s'\n",
+      cfg.name.c_str(), oldinfo.dev_type.c_str(), dev->get_dev_type());
+
+  if (!dev->is_open()) {
+    // For linux+devfs, a nonexistent device gives a strange error
+    // message.  This makes the error message a bit more sensible.
+    // If no debug and scanning - don't print errors
+    if (debugmode || !scanning)
+      PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", dev->get_info_name(), dev->get_errmsg());
+    return false;
+  }
+
+  // Update informal name
+  cfg.name = dev->get_info().info_name;
+  PrintOut(LOG_INFO, "Device: %s, opened\n", cfg.name.c_str());
+
+  // Scan ATA or SCSI device, stop recording and timing before DEV is reset
+  int status = 0;
+  {
+    command_timing timing(dev.get(), state.cmd_stats);
+    if (dev->is_ata()) {
+      ata_cache_recording rec(dev->to_ata(), state.ata_cache);
+      status = ATADeviceScan(cfg, state, dev->to_ata());
+    }
+    else if (dev->is_scsi())
+      status = SCSIDeviceScan(cfg, state, dev->to_scsi());
+  }
+
+  // register ATA devices
+  if (dev->is_ata()){
+    if (status) {
+      CanNotRegister(cfg.name.c_str(), "ATA", cfg.lineno, scanning);
+      dev.reset();
+    }
+  }
+  // or register SCSI devices
+  else if (dev->is_scsi()){
+    if (status) {
+      CanNotRegister(cfg.name.c_str(), "SCSI", cfg.lineno, scanning);
+      dev.reset();
+    }
+  }
+  else {
+    PrintOut(LOG_INFO, "Device: %s, neither ATA nor SCSI device\n", cfg.name.c_str());
+    dev.reset();
+  }
+
+  return true;
+}
+
+// Return directives of CFG without the device name of its entry.
+static std::string get_directives_without_name(const dev_config & cfg)
+{
+  const std::string & dirs = cfg.directives;
+  std::string::size_type i = dirs.rfind('\n');
+  i = (i == std::string::npos ? 0 : i + 1);
+  std::string::size_type j = dirs.find(' ', i);
+  return dirs.substr(0, i) + (j != std::string::npos ? dirs.substr(j) : "");
+}
+
+// Return index of registered device with same name, type and directives
+// as CFG, -1 if none.  The name may also be the current path (PATHS) or
+// an alternate path of a multipath device, then ALT is set and only the
+// directives besides the device name are compared.
+static int find_unchanged_device(const dev_config & cfg, const dev_config_vector & configs,
+                                 const dev_state_vector & states,
+                                 const std::vector<std::string> & paths, bool & alt)
+{
+  std::string dirs = get_directives_without_name(cfg);
+  for (unsigned i = 0; i < configs.size(); i++) {
+    const dev_config & cfg2 = configs.at(i);
+    if (cfg.dev_type != cfg2.dev_type)
+      continue;
+    alt = false;
+    if (cfg.dev_name == cfg2.dev_name) {
+      if (cfg.directives == cfg2.directives)
+        return i;
+      continue;
+    }
+    if (dirs != get_directives_without_name(cfg2))
+      continue;
+    alt = true;
+    if (cfg.dev_name == paths.at(i))
+      return i;
+    const std::vector<smart_device::device_info> & alt_paths = states.at(i).alt_paths;
+    for (unsigned k = 0; k < alt_paths.size(); k++) {
+      if (cfg.dev_name == alt_paths[k].dev_name)
+        return i;
+    }
+  }
+  alt = false;
+  return -1;
+}
+
+// Index of registered devices by logical unit id.
+typedef std::map<std::string, unsigned> lu_id_map;
+
+// Return true if a device with the same logical unit id as CFG is
+// already registered.  Then DEV is added as alternate path of this
+// device.
+static bool add_alternate_path(const dev_config & cfg, const smart_device * dev,
+                               const lu_id_map & lu_ids, const dev_config_vector & configs,
+                               dev_state_vector & states, const smart_device_list & devices)
+{
+  if (cfg.lu_id.empty())
+    return false;
+  lu_id_map::const_iterator it = lu_ids.find(cfg.lu_id);
+  if (it == lu_ids.end())
+    return false;
+
+  unsigned i = it->second;
+  const smart_device::device_info & info = dev->get_info();
+  std::vector<smart_device::device_info> & alt = states.at(i).alt_paths;
+  unsigned k = 0;
+  while (k < alt.size() && alt[k].dev_name != info.dev_name)
+    k++;
+  if (k >= alt.size() && info.dev_name != devices.at(i)->get_info().dev_name)
+    alt.push_back(info);
+
+  PrintOut(LOG_INFO, "Device: %s, same logical unit %s as %s, used as alternate path\n",
+           cfg.name.c_str(), cfg.lu_id.c_str(), configs.at(i).name.c_str());
+  return true;
+}
+
+// Device entry opened and scanned in advance by ProbeDevicesParallel().
+struct probed_device
+{
+  unsigned index; // Index of config entry
+  bool scanning; // Found by DEVICESCAN
+  smart_device::device_info info; // Info before open
+  dev_config cfg;
+  dev_state state;
+  bool opened; // Result of open_and_scan_device()
+  captured_output output;
+};
+
+// Results of ProbeDevicesParallel(), committed by RegisterDevices()
+// in order of the config entries.
+struct probed_device_list
+{
+  std::vector<probed_device> items;
+  smart_device_list devices; // Per item, 0 if device cannot be monitored
+  std::vector<int> index; // Per config entry, -1 if not probed
+
+  int find(unsigned i) const
+    { return (i < index.size() ? index[i] : -1); }
+};
+
+#ifdef HAVE_PTHREADS
+
+// Shared data of the worker threads of ProbeDevicesParallel().
+struct parallel_probe_info
+{
+  probed_device_list * probes;
+
+  // Item indices grouped by device node, each group is probed serially
+  std::vector< std::vector<unsigned> > groups;
+  unsigned next_group; // Next group to probe, protected by mutex
+  pthread_mutex_t mutex;
+
+  // Exception caught in a worker, rethrown after all threads finished
+  bool failed;
+  std::string errmsg;
+};
+
+extern "C" void * parallel_probe_worker(void * arg)
+{
+  parallel_probe_info & info = *(parallel_probe_info *)arg;
+  for (;;) {
+    pthread_mutex_lock(&info.mutex);
+    bool stop = (info.failed || info.next_group >= info.groups.size());
+    unsigned g = info.next_group++;
+    pthread_mutex_unlock(&info.mutex);
+    if (stop)
+      break;
+
+    const std::vector<unsigned> & group = info.groups[g];
+    for (unsigned j = 0; j < group.size(); j++) {
+      unsigned k = group[j];
+      probed_device & pd = info.probes->items[k];
+      pthread_setspecific(capture_key, &pd.output);
+      try {
+        smart_device_auto_ptr dev(info.probes->devices.release(k));
+        pd.opened = open_and_scan_device(pd.cfg, pd.state, dev, pd.scanning);
+        info.probes->devices.replace(k, dev.release());
+      }
+      catch (const std::exception & ex) {
+        pthread_mutex_lock(&info.mutex);
+        info.failed = true;
+        info.errmsg = ex.what();
+        pthread_mutex_unlock(&info.mutex);
+      }
+      catch (...) {
+        pthread_mutex_lock(&info.mutex);
+        info.failed = true;
+        info.errmsg = "unknown exception in device probe";
+        pthread_mutex_unlock(&info.mutex);
+      }
+      pthread_setspecific(capture_key, 0);
+    }
+  }
+  return 0;
+}
+
+// Opens and scans devices of config entries in up to max_jobs worker
+// threads before registration.  Entries which may be ignored, kept
+// unchanged or found to be duplicates of preceding entries are left
+// to the serial registration.  Output is captured and printed later
+// by RegisterDevices() such that the log is the same as without
+// threads.  Returns false if nothing was probed.
+static bool ProbeDevicesParallel(const dev_config_vector & conf_entries,
+                                 smart_device_list & scanned_devs,
+                                 const dev_config_vector & old_configs,
+                                 const dev_state_vector & old_states,
+                                 const std::vector<std::string> & old_paths,
+                                 probed_device_list & probes)
+{
+  if (!capture_key_created) {
+    if (pthread_key_create(&capture_key, 0))
+      return false;
+    capture_key_created = true;
+  }
+
+  // Select entries, group devices by device node name
+  parallel_probe_info info;
+  info.probes = &probes;
+  info.next_group = 0;
+  info.failed = false;
+
+  probes.index.assign(conf_entries.size(), -1);
+  std::vector<std::string> group_names;
+  for (unsigned i = 0; i < conf_entries.size(); i++) {
+    const dev_config & cfg = conf_entries[i];
+    bool alt;
+    if (cfg.ignore || find_unchanged_device(cfg, old_configs, old_states, old_paths, alt) >= 0)
+      continue;
+
+    smart_device_auto_ptr dev;
+    bool scanning = (i < scanned_devs.size() && scanned_devs.at(i));
+    if (scanning) {
+      // Skip if a preceding explicit entry may refer to the same device
+      const std::string & name = scanned_devs.at(i)->get_info().dev_name;
+      unsigned j;
+      for (j = 0; j < i; j++) {
+        if (   !(j < scanned_devs.size() && scanned_devs.at(j))
+            && conf_entries[j].dev_name == name)
+          break;
+      }
+      if (j < i)
+        continue;
+      dev = scanned_devs.release(i);
+    }
+    else {
+      // Errors are reported by the serial registration
+      dev = smi()->get_smart_device(cfg.name.c_str(), cfg.dev_type.c_str());
+      if (!dev)
+        continue;
+    }
+
+    unsigned k = probes.items.size();
+    probes.index[i] = k;
+    probes.items.push_back(probed_device());
+    probed_device & pd = probes.items.back();
+    pd.index = i; pd.scanning = scanning;
+    pd.info = dev->get_info();
+    pd.cfg = cfg;
+    pd.opened = false;
+
+    std::string name = dev->get_dev_name();
+    unsigned g;
+    for (g = 0; g < group_names.size() && group_names[g] != name; g++) ;
+    if (g >= group_names.size()) {
+      group_names.push_back(name);
+      info.groups.push_back(std::vector<unsigned>());
+    }
+    info.groups[g].push_back(k);
+    probes.devices.push_back(dev);
   }
-  else if (!conf_entries.empty()) {
-    // we found a SCANDIRECTIVE or there was no configuration file so
-    // scan.  Configuration file's last entry contains all options
-    // that were set
-    dev_config first = conf_entries.back();
-    conf_entries.pop_back();
 
-    if (first.lineno)
-      PrintOut(LOG_INFO,"Configuration file %s was parsed, found %s, scanning devices\n", configfile, SCANDIRECTIVE);
-    else
-      PrintOut(LOG_INFO,"No configuration file %s found, scanning devices\n", configfile);
-    
-    // make config list of devices to search for
-    MakeConfigEntries(first, conf_entries, scanned_devs, first.dev_type.c_str());
+  unsigned num_threads = info.groups.size();
+  if (num_threads > (unsigned)max_jobs)
+    num_threads = max_jobs;
 
-    // warn user if scan table found no devices
-    if (conf_entries.empty())
-      PrintOut(LOG_CRIT,"In the system's table of devices NO devices found to scan\n");
-  } 
-  else
-    PrintOut(LOG_CRIT, "Configuration file %s parsed but has no entries\n", configfile);
-  
-  return conf_entries.size();
-}
+  std::vector<pthread_t> threads;
+  if (num_threads >= 2) {
+    pthread_mutex_init(&info.mutex, 0);
 
-// Return true if TYPE contains a RAID drive number
-static bool is_raid_type(const char * type)
-{
-  if (str_starts_with(type, "sat,"))
-    return false;
-  int i;
-  if (sscanf(type, "%*[^,],%d", &i) != 1)
-    return false;
-  return true;
-}
+    // Signals should be handled by the main thread only
+#ifndef _WIN32
+    sigset_t allsigs, oldsigs;
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+#endif
 
-// Return true if DEV is already in DEVICES[0..NUMDEVS) or IGNORED[*]
-static bool is_duplicate_device(const smart_device * dev,
-                                const smart_device_list & devices, unsigned numdevs,
-                                const dev_config_vector & ignored)
-{
-  const smart_device::device_info & info1 = dev->get_info();
-  bool is_raid1 = is_raid_type(info1.dev_type.c_str());
+    for (unsigned t = 0; t < num_threads; t++) {
+      pthread_t thread;
+      if (pthread_create(&thread, 0, parallel_probe_worker, &info))
+        break;
+      threads.push_back(thread);
+    }
 
-  for (unsigned i = 0; i < numdevs; i++) {
-    const smart_device::device_info & info2 = devices.at(i)->get_info();
-    // -d TYPE options must match if RAID drive number is specified
-    if (   info1.dev_name == info2.dev_name
-        && (   info1.dev_type == info2.dev_type
-            || !is_raid1 || !is_raid_type(info2.dev_type.c_str())))
-      return true;
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldsigs, 0);
+#endif
   }
 
-  for (unsigned i = 0; i < ignored.size(); i++) {
-    const dev_config & cfg2 = ignored.at(i);
-    if (   info1.dev_name == cfg2.dev_name
-        && (   info1.dev_type == cfg2.dev_type
-            || !is_raid1 || !is_raid_type(cfg2.dev_type.c_str())))
-      return true;
+  if (threads.empty()) {
+    if (num_threads >= 2)
+      pthread_mutex_destroy(&info.mutex);
+    // Return devices to the serial registration
+    for (unsigned k = 0; k < probes.items.size(); k++) {
+      const probed_device & pd = probes.items[k];
+      if (pd.scanning)
+        scanned_devs.replace(pd.index, probes.devices.release(k));
+    }
+    probes.items.clear(); probes.devices.clear(); probes.index.clear();
+    return false;
   }
-  return false;
+  if (debugmode)
+    PrintOut(LOG_INFO, "Probing %u devices (%u groups) in %u threads\n",
+             (unsigned)probes.items.size(), (unsigned)info.groups.size(),
+             (unsigned)threads.size());
+
+  for (unsigned t = 0; t < threads.size(); t++)
+    pthread_join(threads[t], 0);
+  pthread_mutex_destroy(&info.mutex);
+
+  if (info.failed)
+    throw std::runtime_error(info.errmsg);
+  return true;
 }
 
+#endif // HAVE_PTHREADS
+
 // This function tries devices from conf_entries.  Each one that can be
 // registered is moved onto the [ata|scsi]devices lists and removed
-// from the conf_entries list.
+// from the conf_entries list.  Devices already registered with an
+// unchanged entry are kept with their state and are not scanned again.
 static void RegisterDevices(const dev_config_vector & conf_entries, smart_device_list & scanned_devs,
                             dev_config_vector & configs, dev_state_vector & states, smart_device_list & devices)
 {
-  // start by clearing lists/memory of ALL existing devices
-  configs.clear();
+  // Move lists of ALL existing devices, unchanged ones are reused
+  dev_config_vector old_configs; old_configs.swap(configs);
+  dev_state_vector old_states; old_states.swap(states);
+  smart_device_list old_devices;
+  std::vector<std::string> old_paths; // Current paths of multipath devices
+  for (unsigned i = 0; i < devices.size(); i++) {
+    old_paths.push_back(devices.at(i)->get_info().dev_name);
+    old_devices.push_back(devices.release(i));
+  }
   devices.clear();
-  states.clear();
 
-  // Register entries
+  // Open and scan devices in parallel, results are committed below
+  probed_device_list probes;
+#ifdef HAVE_PTHREADS
+  if (max_jobs > 1)
+    ProbeDevicesParallel(conf_entries, scanned_devs, old_configs, old_states, old_paths, probes);
+#endif
+
+  // Register entries, each logical unit once
   dev_config_vector ignored_entries;
-  unsigned numnoscan = 0;
+  lu_id_map lu_ids;
+  std::vector<bool> kept(old_configs.size(), false);
+  unsigned numnoscan = 0, numkept = 0;
   for (unsigned i = 0; i < conf_entries.size(); i++){
 
     dev_config cfg = conf_entries[i];
@@ -4866,80 +7419,89 @@ static void RegisterDevices(const dev_config_vector & conf_entries, smart_device
     // get device of appropriate type
     smart_device_auto_ptr dev;
     bool scanning = false;
+    dev_state state;
 
-    // Device may already be detected during devicescan
-    if (i < scanned_devs.size()) {
-      dev = scanned_devs.release(i);
-      if (dev) {
-        // Check for a preceding non-DEVICESCAN entry for the same device
-        if (  (numnoscan || !ignored_entries.empty())
-            && is_duplicate_device(dev.get(), devices, numnoscan, ignored_entries)) {
-          PrintOut(LOG_INFO, "Device: %s, duplicate, ignored\n", dev->get_info_name());
-          continue;
-        }
-        scanning = true;
+    int pi = probes.find(i);
+    if (pi >= 0) {
+      // Device already opened and scanned by ProbeDevicesParallel()
+      probed_device & pd = probes.items[pi];
+      if (  pd.scanning && (numnoscan || !ignored_entries.empty())
+          && is_duplicate_device(pd.info, devices, numnoscan, ignored_entries)) {
+        PrintOut(LOG_INFO, "Device: %s, duplicate, ignored\n", pd.info.info_name.c_str());
+        continue;
       }
+      scanning = pd.scanning;
+      replay_captured_output(pd.cfg, pd.state, pd.output);
+      if (!pd.opened)
+        continue;
+      cfg = pd.cfg; state = pd.state;
+      dev = probes.devices.release(pi);
     }
+    else {
+      // Device may already be detected during devicescan
+      if (i < scanned_devs.size()) {
+        dev = scanned_devs.release(i);
+        if (dev) {
+          // Check for a preceding non-DEVICESCAN entry for the same device
+          if (  (numnoscan || !ignored_entries.empty())
+              && is_duplicate_device(dev->get_info(), devices, numnoscan, ignored_entries)) {
+            PrintOut(LOG_INFO, "Device: %s, duplicate, ignored\n", dev->get_info_name());
+            continue;
+          }
+          scanning = true;
+        }
+      }
 
-    if (!dev) {
-      dev = smi()->get_smart_device(cfg.name.c_str(), cfg.dev_type.c_str());
-      if (!dev) {
-        if (cfg.dev_type.empty())
-          PrintOut(LOG_INFO,"Device: %s, unable to autodetect device type\n", cfg.name.c_str());
-        else
-          PrintOut(LOG_INFO,"Device: %s, unsupported device type '%s'\n", cfg.name.c_str(), cfg.dev_type.c_str());
+      // Keep device if entry is unchanged.  Known alternate paths of
+      // multipath devices are kept without scanning them again.
+      bool alt;
+      int oldi = find_unchanged_device(cfg, old_configs, old_states, old_paths, alt);
+      if (oldi >= 0 && kept[oldi]) {
+        if (debugmode)
+          PrintOut(LOG_INFO, "Device: %s, unchanged, path of %s\n", cfg.name.c_str(),
+                   old_configs[oldi].name.c_str());
+        continue;
+      }
+      if (oldi >= 0) {
+        if (debugmode)
+          PrintOut(LOG_INFO, "Device: %s, unchanged%s\n", old_configs[oldi].name.c_str(),
+                   (alt ? " (alternate path)" : ""));
+        kept[oldi] = true;
+        if (!old_configs[oldi].lu_id.empty())
+          lu_ids[old_configs[oldi].lu_id] = configs.size();
+        configs.push_back(old_configs[oldi]);
+        states.push_back(old_states[oldi]);
+        devices.push_back(old_devices.release(oldi));
+        if (!scanning)
+          numnoscan = devices.size();
+        numkept++;
         continue;
       }
-    }
-
-    // Save old info
-    smart_device::device_info oldinfo = dev->get_info();
-
-    // Open with autodetect support, may return 'better' device
-    dev.replace( dev->autodetect_open() );
 
-    // Report if type has changed
-    if (oldinfo.dev_type != dev->get_dev_type())
-      PrintOut(LOG_INFO,"Device: %s, type changed from '%s' to '%s'\n",
-        cfg.name.c_str(), oldinfo.dev_type.c_str(), dev->get_dev_type());
+      if (!dev) {
+        dev = smi()->get_smart_device(cfg.name.c_str(), cfg.dev_type.c_str());
+        if (!dev) {
+          if (cfg.dev_type.empty())
+            PrintOut(LOG_INFO,"Device: %s, unable to autodetect device type\n", cfg.name.c_str());
+          else
+            PrintOut(LOG_INFO,"Device: %s, unsupported device type '%s'\n", cfg.name.c_str(), cfg.dev_type.c_str());
+          continue;
+        }
+      }
 
-    if (!dev->is_open()) {
-      // For linux+devfs, a nonexistent device gives a strange error
-      // message.  This makes the error message a bit more sensible.
-      // If no debug and scanning - don't print errors
-      if (debugmode || !scanning)
-        PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", dev->get_info_name(), dev->get_errmsg());
-      continue;
+      // Open and scan device, prepare initial state
+      if (!open_and_scan_device(cfg, state, dev, scanning))
+        continue;
     }
 
-    // Update informal name
-    cfg.name = dev->get_info().info_name;
-    PrintOut(LOG_INFO, "Device: %s, opened\n", cfg.name.c_str());
-
-    // Prepare initial state
-    dev_state state;
-
-    // register ATA devices
-    if (dev->is_ata()){
-      if (ATADeviceScan(cfg, state, dev->to_ata())) {
-        CanNotRegister(cfg.name.c_str(), "ATA", cfg.lineno, scanning);
-        dev.reset();
-      }
-    }
-    // or register SCSI devices
-    else if (dev->is_scsi()){
-      if (SCSIDeviceScan(cfg, state, dev->to_scsi())) {
-        CanNotRegister(cfg.name.c_str(), "SCSI", cfg.lineno, scanning);
-        dev.reset();
-      }
-    }
-    else {
-      PrintOut(LOG_INFO, "Device: %s, neither ATA nor SCSI device\n", cfg.name.c_str());
-      dev.reset();
-    }
+    // Monitor other paths of multipath devices only on failover
+    if (dev && add_alternate_path(cfg, dev.get(), lu_ids, configs, states, devices))
+      continue;
 
     if (dev) {
       // move onto the list of devices
+      if (!cfg.lu_id.empty())
+        lu_ids[cfg.lu_id] = configs.size();
       configs.push_back(cfg);
       states.push_back(state);
       devices.push_back(dev);
@@ -4958,11 +7520,375 @@ static void RegisterDevices(const dev_config_vector & conf_entries, smart_device
     }
   }
 
+  if (!old_configs.empty())
+    PrintOut(LOG_INFO, "Configuration reloaded: %u device%s unchanged, %u new or changed\n",
+             numkept, (numkept != 1 ? "s" : ""), (unsigned)configs.size() - numkept);
+
+  // Save capabilities of new or changed devices
+  if (!capcache_path.empty())
+    caps_cache.save(capcache_path.c_str());
+
   init_disable_standby_check(configs);
 }
 
+// Register added and remove disappeared devices.  Explicitly listed
+// devices use their entry, all others the DEVICESCAN entry, if any.
+// Returns true if the device list was changed.
+static bool HotplugDevices(const std::vector<hotplug_monitor::event> & events,
+                           const hotplug_config & hpconf, dev_config_vector & configs,
+                           dev_state_vector & states, smart_device_list & devices)
+{
+  bool changed = false;
+  for (unsigned e = 0; e < events.size(); e++) {
+    const hotplug_monitor::event & ev = events[e];
+    int mi = -1, ai = -1;
+    for (unsigned i = 0; i < configs.size() && mi < 0; i++) {
+      if (configs[i].dev_name == ev.dev_name)
+        mi = i;
+      const std::vector<smart_device::device_info> & alt = states[i].alt_paths;
+      for (unsigned k = 0; k < alt.size() && mi < 0; k++) {
+        if (alt[k].dev_name == ev.dev_name)
+          mi = i, ai = k;
+      }
+    }
+
+    if (!ev.add) {
+      if (mi < 0)
+        continue;
+      // Drop removed path of multipath device
+      std::vector<smart_device::device_info> & alt = states[mi].alt_paths;
+      if (ai >= 0 || !alt.empty()) {
+        if (ai < 0) {
+          // Current path removed, switch to first alternate path of same type
+          for (unsigned k = 0; k < alt.size() && ai < 0; k++) {
+            smart_device * dev = get_alternate_path(states[mi], devices.at(mi), k);
+            if (dev) {
+              devices.replace(mi, dev);
+              ai = k;
+            }
+          }
+          if (ai < 0) {
+            PrintOut(LOG_INFO, "Device: %s, path %s removed, no usable alternate path\n",
+                     configs[mi].name.c_str(), ev.dev_name.c_str());
+            continue;
+          }
+        }
+        PrintOut(LOG_INFO, "Device: %s, path %s removed, using %s\n", configs[mi].name.c_str(),
+                 ev.dev_name.c_str(), devices.at(mi)->get_info_name());
+        alt.erase(alt.begin() + ai);
+        continue;
+      }
+      // Keep explicitly listed devices unless removable, checks report the failure
+      const dev_config & cfg = configs[mi];
+      if (!(cfg.removable || (hpconf.scan && cfg.directives == hpconf.scan_cfg.directives))) {
+        PrintOut(LOG_INFO, "Device: %s, removed, still monitored (no Directive -d removable)\n",
+                 cfg.name.c_str());
+        continue;
+      }
+      // Save state
+      if (!cfg.state_file.empty() || !cfg.state_key.empty()) {
+        dev_config_vector c1(1, cfg); dev_state_vector s1(1, states[mi]);
+        write_all_dev_states(c1, s1);
+      }
+      PrintOut(LOG_INFO, "Device: %s, removed, no longer monitored\n", cfg.name.c_str());
+      configs.erase(configs.begin() + mi);
+      states.erase(states.begin() + mi);
+      devices.erase(mi);
+      changed = true;
+      continue;
+    }
+
+    // Ignore if already monitored
+    if (mi >= 0)
+      continue;
+
+    dev_config cfg;
+    bool scanning = true, found = false;
+    for (unsigned i = 0; i < hpconf.entries.size() && !found; i++) {
+      if (hpconf.entries[i].dev_name == ev.dev_name) {
+        cfg = hpconf.entries[i];
+        scanning = false; found = true;
+      }
+    }
+    if (found) {
+      if (cfg.ignore)
+        continue;
+    }
+    else if (hpconf.scan) {
+      cfg = hpconf.scan_cfg;
+      cfg.name = cfg.dev_name = ev.dev_name;
+    }
+    else
+      continue;
+
+    PrintOut(LOG_INFO, "Device: %s, added\n", cfg.name.c_str());
+    smart_device_auto_ptr dev( smi()->get_smart_device(cfg.dev_name.c_str(), cfg.dev_type.c_str()) );
+    if (!dev) {
+      PrintOut(LOG_INFO, "Device: %s, %s\n", cfg.name.c_str(), smi()->get_errmsg());
+      continue;
+    }
+
+    dev_state state;
+    if (!(open_and_scan_device(cfg, state, dev, scanning) && dev))
+      continue;
+
+    // New path of already monitored multipath device?
+    if (!cfg.lu_id.empty()) {
+      lu_id_map lu_ids;
+      for (unsigned i = 0; i < configs.size(); i++) {
+        if (configs[i].lu_id == cfg.lu_id)
+          lu_ids[cfg.lu_id] = i;
+      }
+      if (add_alternate_path(cfg, dev.get(), lu_ids, configs, states, devices))
+        continue;
+    }
+
+    configs.push_back(cfg);
+    states.push_back(state);
+    devices.push_back(dev);
+    changed = true;
+  }
+
+  if (changed) {
+    if (!capcache_path.empty())
+      caps_cache.save(capcache_path.c_str());
+    init_disable_standby_check(configs);
+  }
+  return changed;
+}
+
 
 // Main program without exception handling
+#ifdef HAVE_PTHREADS
+
+// Statistics of the device check cycles.
+struct check_cycle_stats
+{
+  uint64_t count;                         // Number of cycles
+  time_t start;                           // Start time of last cycle
+  int64_t usec;                           // Duration of last cycle in microseconds
+  unsigned devices;                       // Number of devices checked in last cycle
+
+  check_cycle_stats()
+    : count(0), start(0), usec(0), devices(0) { }
+};
+
+// Writes metrics in Prometheus text format.  Samples of the same
+// metric are grouped, metrics are written in order of first use.
+class metrics_writer
+{
+public:
+  void add(const char * name, const char * type, const char * help,
+           const std::string & labels, const std::string & value);
+
+  std::string str() const;
+
+private:
+  struct family {
+    const char * name, * type, * help;
+    std::string samples;
+  };
+  std::vector<family> m_families;
+};
+
+void metrics_writer::add(const char * name, const char * type, const char * help,
+                         const std::string & labels, const std::string & value)
+{
+  unsigned i;
+  for (i = 0; i < m_families.size() && strcmp(m_families[i].name, name); i++) ;
+  if (i >= m_families.size()) {
+    m_families.push_back(family());
+    family & f = m_families.back();
+    f.name = name; f.type = type; f.help = help;
+  }
+  std::string & samples = m_families[i].samples;
+  samples += name;
+  if (!labels.empty()) {
+    samples += '{'; samples += labels; samples += '}';
+  }
+  samples += ' '; samples += value; samples += '\n';
+}
+
+std::string metrics_writer::str() const
+{
+  std::string text;
+  for (unsigned i = 0; i < m_families.size(); i++) {
+    const family & f = m_families[i];
+    text += strprintf("# HELP %s %s\n# TYPE %s %s\n", f.name, f.help, f.name, f.type);
+    text += f.samples;
+  }
+  return text;
+}
+
+// Format label NAME="VALUE"
+static std::string metrics_label(const char * name, const std::string & value)
+{
+  std::string label = name;
+  label += "=\"";
+  for (unsigned i = 0; i < value.size(); i++) {
+    char c = value[i];
+    if (c == '\\' || c == '"')
+      label += '\\';
+    if (c == '\n')
+      label += "\\n";
+    else
+      label += c;
+  }
+  label += '"';
+  return label;
+}
+
+static std::string metrics_value(uint64_t value)
+{
+  return strprintf("%" PRIu64, value);
+}
+
+static std::string metrics_seconds(int64_t usec)
+{
+  return strprintf("%d.%06d", (int)(usec / 1000000), (int)(usec % 1000000));
+}
+
+// Format last results of all devices as metrics.  Uses only data
+// kept in the device states, devices are not accessed.
+static std::string format_metrics(const dev_config_vector & configs, const dev_state_vector & states,
+                                  const smart_device_list & devices, const check_cycle_stats & cycles)
+{
+  metrics_writer mw;
+  mw.add("smartd_devices", "gauge", "Number of monitored devices.",
+         "", metrics_value(devices.size()));
+  mw.add("smartd_check_cycles_total", "counter", "Number of device check cycles.",
+         "", metrics_value(cycles.count));
+  mw.add("smartd_check_cycle_start_timestamp_seconds", "gauge", "Start time of last check cycle.",
+         "", metrics_value(cycles.start));
+  mw.add("smartd_check_cycle_duration_seconds", "gauge", "Duration of last check cycle.",
+         "", metrics_seconds(cycles.usec));
+  mw.add("smartd_check_cycle_devices", "gauge", "Number of devices checked in last check cycle.",
+         "", metrics_value(cycles.devices));
+
+  static const char * const scsi_ops[3] = { "read", "write", "verify" };
+
+  for (unsigned i = 0; i < configs.size(); i++) {
+    const dev_config & cfg = configs.at(i);
+    const dev_state & state = states.at(i);
+    const smart_device * dev = devices.at(i);
+    std::string dl = metrics_label("device", cfg.name) + ','
+                   + metrics_label("type", dev->get_dev_type());
+
+    if (state.last_check) {
+      mw.add("smartd_device_last_check_timestamp_seconds", "gauge", "Start time of last check.",
+             dl, metrics_value(state.last_check));
+      mw.add("smartd_device_check_duration_seconds", "gauge", "Duration of last check.",
+             dl, metrics_seconds(state.check_usec));
+      mw.add("smartd_device_open_duration_seconds", "gauge", "Duration of last device open.",
+             dl, metrics_seconds(state.open_usec));
+      mw.add("smartd_device_check_failed", "gauge", "1 if last check failed.",
+             dl, metrics_value(state.check_failed));
+    }
+    mw.add("smartd_device_power_mode_skips", "gauge", "Number of checks skipped due to power mode.",
+           dl, metrics_value(state.powerskipcnt));
+    if (state.smart_status >= 0)
+      mw.add("smartd_device_smart_status_failed", "gauge", "1 if SMART health status is failed.",
+             dl, metrics_value(state.smart_status));
+
+    if (state.temperature)
+      mw.add("smartd_device_temperature_celsius", "gauge", "Last temperature.",
+             dl, metrics_value(state.temperature));
+    if (state.tempmin)
+      mw.add("smartd_device_temperature_min_celsius", "gauge", "Min temperature.",
+             dl, metrics_value(state.tempmin));
+    if (state.tempmax)
+      mw.add("smartd_device_temperature_max_celsius", "gauge", "Max temperature.",
+             dl, metrics_value(state.tempmax));
+
+    if (cfg.selftest)
+      mw.add("smartd_device_self_test_errors", "gauge", "Number of errors in self-test log.",
+             dl, metrics_value(state.selflogcount));
+
+    if (dev->is_ata()) {
+      if (cfg.errorlog || cfg.xerrorlog)
+        mw.add("smartd_device_ata_errors", "gauge", "Number of errors in ATA error log.",
+               dl, metrics_value(state.ataerrorcount));
+
+      // Attributes and self-test status are only valid if read on each check
+      if (!(   cfg.usagefailed || cfg.prefail || cfg.usage
+            || cfg.curr_pending_id || cfg.offl_pending_id
+            || cfg.tempdiff || cfg.tempinfo || cfg.tempcrit
+            || cfg.selftest || cfg.offlinests || cfg.selfteststs))
+        continue;
+
+      mw.add("smartd_device_self_test_exec_status", "gauge", "Self-test execution status byte.",
+             dl, metrics_value(state.smartval.self_test_exec_status));
+
+      for (int j = 0; j < NUMBER_ATA_SMART_ATTRIBUTES; j++) {
+        const ata_smart_attribute & attr = state.smartval.vendor_attributes[j];
+        if (!attr.id)
+          continue;
+        std::string al = dl + ',' + metrics_label("id", strprintf("%d", attr.id)) + ','
+          + metrics_label("name", ata_get_smart_attr_name(attr.id, cfg.attribute_defs, cfg.dev_rpm));
+        mw.add("smartd_ata_attribute_value", "gauge", "Normalized value of ATA SMART attribute.",
+               al, metrics_value(attr.current));
+        mw.add("smartd_ata_attribute_worst", "gauge", "Worst value of ATA SMART attribute.",
+               al, metrics_value(attr.worst));
+        const ata_smart_threshold_entry & thr = state.smartthres.thres_entries[j];
+        if (thr.id == attr.id)
+          mw.add("smartd_ata_attribute_threshold", "gauge", "Threshold of ATA SMART attribute.",
+                 al, metrics_value(thr.threshold));
+        mw.add("smartd_ata_attribute_raw", "gauge", "Raw value of ATA SMART attribute.",
+               al, metrics_value(ata_get_attr_raw_value(attr, cfg.attribute_defs)));
+      }
+    }
+    else if (dev->is_scsi()) {
+      for (int k = 0; k < 3; k++) {
+        if (!state.scsi_error_counters[k].found)
+          continue;
+        const scsiErrorCounter & ec = state.scsi_error_counters[k].errCounter;
+        std::string ol = dl + ',' + metrics_label("op", scsi_ops[k]);
+        mw.add("smartd_scsi_errors_corrected_total", "counter", "Total errors corrected.",
+               ol, metrics_value(ec.counter[3]));
+        mw.add("smartd_scsi_errors_uncorrected_total", "counter", "Total uncorrected errors.",
+               ol, metrics_value(ec.counter[6]));
+        mw.add("smartd_scsi_bytes_processed_total", "counter", "Total bytes processed.",
+               ol, metrics_value(ec.counter[5]));
+      }
+      if (state.scsi_nonmedium_error.found && state.scsi_nonmedium_error.nme.gotPC0)
+        mw.add("smartd_scsi_nonmedium_errors_total", "counter", "Non-medium error count.",
+               dl, metrics_value(state.scsi_nonmedium_error.nme.counterPC0));
+      mw.add("smartd_scsi_log_commands_total", "counter", "LOG SENSE commands issued by checks.",
+             dl, metrics_value(state.log_pages.get_total_commands()));
+      mw.add("smartd_scsi_log_duration_seconds_total", "counter", "Time spent in LOG SENSE commands.",
+             dl, metrics_seconds(state.log_pages.get_total_usec()));
+    }
+  }
+  return mw.str();
+}
+
+// Publish last results on metrics socket
+static void update_metrics(local_socket_server & server,
+                           const dev_config_vector & configs, const dev_state_vector & states,
+                           const smart_device_list & devices, const check_cycle_stats & cycles)
+{
+  local_socket_server::response_map responses;
+  responses["metrics"] = format_metrics(configs, states, devices, cycles);
+
+  // ATA data for 'smartctl --smartd-cache', by device name with and
+  // without type.  First device wins if names are ambiguous.
+  for (unsigned i = 0; i < configs.size(); i++) {
+    const smart_device * dev = devices.at(i);
+    if (!(dev->is_ata() && !states.at(i).ata_cache.empty()))
+      continue;
+    std::string text = states.at(i).ata_cache.format();
+    std::string key = strprintf("cache %s", dev->get_dev_name());
+    std::string typed_key = key + ' ' + dev->get_dev_type();
+    if (responses.find(key) == responses.end())
+      responses[key] = text;
+    if (responses.find(typed_key) == responses.end())
+      responses[typed_key] = text;
+  }
+  server.set_responses(responses);
+}
+
+#endif // HAVE_PTHREADS
+
 static int main_worker(int argc, char **argv)
 {
   // Initialize interface
@@ -4973,8 +7899,21 @@ static int main_worker(int argc, char **argv)
   // is it our first pass through?
   bool firstpass = true;
 
-  // next time to wake up
-  time_t wakeuptime = 0;
+  // next device checks
+  check_scheduler sched;
+  // devices to check in next pass, all if firstpass or config reread
+  std::vector<unsigned> due;
+
+  // hotplug event source, entries for new devices and pending events
+  hotplug_monitor * hotplug = 0;
+  hotplug_config hpconf;
+  std::vector<hotplug_monitor::event> hotplug_events;
+
+#ifdef HAVE_PTHREADS
+  // server of metrics socket, statistics of check cycles
+  local_socket_server metrics_server;
+  check_cycle_stats cycles;
+#endif
 
   // parse input and print header and usage info if needed
   ParseOpts(argc,argv);
@@ -4988,6 +7927,14 @@ static int main_worker(int argc, char **argv)
 
   bool write_states_always = true;
 
+  // Open state database, devices are added during registration
+  if (!state_db_path.empty() && !state_database.open(state_db_path.c_str()))
+    return EXIT_STARTUP;
+
+  // Read device capability cache, errors are not fatal
+  if (!capcache_path.empty())
+    caps_cache.load(capcache_path.c_str());
+
 #ifdef HAVE_LIBCAP_NG
   // Drop capabilities
   if (enable_capabilities) {
@@ -4998,6 +7945,16 @@ static int main_worker(int argc, char **argv)
   }
 #endif
 
+#if defined(HAVE_PTHREADS) && !defined(_WIN32)
+  // Queue warnings, dispatcher is started after DaemonInit() which
+  // would close its file descriptors
+  if (warn_jobs > 0) {
+    warning_queue.enable(warn_jobs, warn_timeout, warn_delay);
+    if (debugmode || quit == 3)
+      warning_queue.start();
+  }
+#endif
+
   // the main loop of the code
   for (;;) {
 
@@ -5015,7 +7972,7 @@ static int main_worker(int argc, char **argv)
         return EXIT_SIGNAL;
 
       // Write state files
-      if (!state_path_prefix.empty())
+      if (!state_path_prefix.empty() || !state_db_path.empty())
         write_all_dev_states(configs, states);
 
       return 0;
@@ -5025,7 +7982,7 @@ static int main_worker(int argc, char **argv)
     if (firstpass || caughtsigHUP){
       if (!firstpass) {
         // Write state files
-        if (!state_path_prefix.empty())
+        if (!state_path_prefix.empty() || !state_db_path.empty())
           write_all_dev_states(configs, states);
 
         PrintOut(LOG_INFO,
@@ -5039,13 +7996,16 @@ static int main_worker(int argc, char **argv)
         dev_config_vector conf_entries; // Entries read from smartd.conf
         smart_device_list scanned_devs; // Devices found during scan
         // (re)reads config file, makes >=0 entries
-        int entries = ReadOrMakeConfigEntries(conf_entries, scanned_devs);
+        int entries = ReadOrMakeConfigEntries(conf_entries, scanned_devs, hpconf);
 
         if (entries>=0) {
+          // Drop compiled test schedules of previous configuration
+          test_schedules.clear();
           // checks devices, then moves onto ata/scsi list or deallocates.
           RegisterDevices(conf_entries, scanned_devs, configs, states, devices);
           if (!(configs.size() == devices.size() && configs.size() == states.size()))
             throw std::logic_error("Invalid result from RegisterDevices");
+          update_state_table(configs, states, devices);
         }
         else if (quit==2 || ((quit==0 || quit==1) && !firstpass)) {
           // user has asked to continue on error in configuration file
@@ -5095,20 +8055,41 @@ static int main_worker(int argc, char **argv)
 
       // Always write state files after (re)configuration
       write_states_always = true;
+
+      // Check new devices now, keep schedule of unchanged devices
+      schedule_devices(states, time(0), sched, due);
     }
 
-    // check all devices once,
+    // check all due devices once,
     // self tests are not started in first pass unless '-q onecheck' is specified
-    CheckDevicesOnce(configs, states, devices, firstpass, (!firstpass || quit==3));
+#ifdef HAVE_PTHREADS
+    time_t cycle_start = time(0);
+    int64_t cycle_start_usec = smi()->get_timer_usec();
+#endif
+    CheckDevicesOnce(configs, states, devices, due, firstpass, (!firstpass || quit==3));
+#ifdef HAVE_PTHREADS
+    if (!due.empty()) {
+      cycles.count++;
+      cycles.start = cycle_start;
+      cycles.usec = smi()->get_timer_usec() - cycle_start_usec;
+      cycles.devices = due.size();
+    }
+#endif
+    if (!due.empty())
+      state_table.update_header(time(0));
 
      // Write state files
-    if (!state_path_prefix.empty())
+    if (!state_path_prefix.empty() || !state_db_path.empty())
       write_all_dev_states(configs, states, write_states_always);
     write_states_always = false;
 
     // Write attribute logs
     if (!attrlog_path_prefix.empty())
-      write_all_dev_attrlogs(configs, states);
+      write_all_dev_attrlogs(configs, states, due);
+
+    // Write command profile
+    if (!profile_path.empty() && !due.empty())
+      write_command_profile(profile_path.c_str(), configs, states, devices);
 
     // user has asked us to exit after first check
     if (quit==3) {
@@ -5119,17 +8100,93 @@ static int main_worker(int argc, char **argv)
     
     // fork into background if needed
     if (firstpass && !debugmode) {
+      // DaemonInit() closes all file descriptors
+      state_database.close();
       DaemonInit();
+      if (!state_db_path.empty() && !state_database.open(state_db_path.c_str()))
+        return EXIT_STARTUP;
     }
 
-    // set exit and signal handlers, write PID file, set wake-up time
+    // set exit and signal handlers, write PID file
     if (firstpass){
-      Initialize(&wakeuptime);
+      Initialize();
       firstpass = false;
+
+      // Start monitoring of hotplug events, file descriptors are closed on fork
+      if (!hotplug_source.empty()) {
+        hotplug = smi()->get_hotplug_monitor(hotplug_source.c_str());
+        if (!hotplug) {
+          PrintOut(LOG_CRIT, "Unable to monitor hotplug events from %s: %s\n",
+                   hotplug_source.c_str(), smi()->get_errmsg());
+          return EXIT_STARTUP;
+        }
+        PrintOut(LOG_INFO, "Monitoring hotplug events from %s\n", hotplug_source.c_str());
+      }
+
+#ifdef HAVE_SHM_OPEN
+      // Create state table, would be removed on exit of parent process
+      if (!state_table_name.empty()) {
+        if (!state_table.open(state_table_name.c_str(), configs.size())) {
+          PrintOut(LOG_CRIT, "Unable to create state table %s\n", state_table_name.c_str());
+          return EXIT_STARTUP;
+        }
+        update_state_table(configs, states, devices);
+        state_table.update_header(time(0));
+        PrintOut(LOG_INFO, "Publishing device states in shared memory %s\n", state_table_name.c_str());
+      }
+#endif
+
+#if defined(HAVE_PTHREADS) && !defined(_WIN32)
+      // Start warning dispatcher, threads do not survive fork
+      if (warning_queue.is_enabled())
+        warning_queue.start();
+#endif
+
+#ifdef HAVE_PTHREADS
+      // Start metrics server, threads do not survive fork
+      if (!metrics_socket_path.empty()) {
+        if (!metrics_server.start(metrics_socket_path.c_str(), "metrics")) {
+          PrintOut(LOG_CRIT, "Unable to serve metrics on %s\n", metrics_socket_path.c_str());
+          return EXIT_STARTUP;
+        }
+        PrintOut(LOG_INFO, "Serving metrics on %s\n", metrics_socket_path.c_str());
+      }
+#endif
+    }
+
+#ifdef HAVE_PTHREADS
+    // Publish results of this cycle
+    if (metrics_server.is_running())
+      update_metrics(metrics_server, configs, states, devices, cycles);
+#endif
+
+    // schedule next check of each checked device
+    time_t now = time(0);
+    for (unsigned j = 0; j < due.size(); j++) {
+      unsigned i = due[j];
+      schedule_next_check(configs.at(i), states.at(i), i, now, sched);
+    }
+
+    // sleep until next device is due, or a signal arrives
+    dosleep(sched, devices.size(), due, write_states_always, hotplug, hotplug_events);
+
+#ifndef _WIN32
+    // print command profile on SIGUSR2
+    if (caughtsigUSR2) {
+      caughtsigUSR2 = 0;
+      PrintOut(LOG_INFO, "Signal USR2 - printing command profile\n");
+      log_command_profile(configs, states, devices);
+    }
+#endif
+
+    // register or remove devices on hotplug events
+    if (!hotplug_events.empty()) {
+      if (HotplugDevices(hotplug_events, hpconf, configs, states, devices)) {
+        schedule_devices(states, time(0), sched, due);
+        update_state_table(configs, states, devices);
+      }
+      hotplug_events.clear();
     }
-    
-    // sleep until next check time, or a signal arrives
-    wakeuptime = dosleep(wakeuptime, write_states_always);
   }
 }
 
@@ -5162,6 +8219,9 @@ static int smartd_main(int argc, char **argv)
     status = EXIT_BADCODE;
   }
 
+  // Wait for warnings still in progress
+  warning_queue.stop();
+
   if (is_initialized)
     status = Goodbye(status);
 
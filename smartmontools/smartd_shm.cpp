@@ -0,0 +1,153 @@
+/*
+ * smartd_shm.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Print the device states published by smartd '-T NAME'.
+// Reads the shared memory segment only, never accesses devices and
+// needs no privileges.
+
+#include "config.h"
+#include "int64.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shmstate.h"
+#include "utility.h"
+
+const char * smartd_shm_cpp_cvsid = "$Id$"
+  SHMSTATE_H_CVSID;
+
+void pout(const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+static void usage(const char * prog)
+{
+  printf("Usage: %s [-a] [-n /NAME]\n\n"
+         "Print device states published by 'smartd -T /NAME'.\n\n"
+         "  -a        Print ATA SMART attributes and SCSI error counters\n"
+         "  -n /NAME  Name of shared memory segment [/smartd]\n"
+         "  -h        Print this help\n", prog);
+}
+
+static const char * fmt_time(int64_t t, char (& buf)[32])
+{
+  if (!t)
+    return "-";
+  time_t tt = (time_t)t;
+  struct tm * tmp = localtime(&tt);
+  if (!(tmp && strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tmp)))
+    snprintf(buf, sizeof(buf), "%" PRId64, t);
+  return buf;
+}
+
+static void print_slot(const shm_state_slot & slot, bool attrs)
+{
+  char tbuf[32];
+  printf("%-20s %-8s %-19s %9.3f  %-7s",
+         slot.device, slot.type, fmt_time(slot.last_check, tbuf),
+         slot.check_usec / 1000.0,
+         (slot.flags & SHM_STATE_CHECK_FAILED ? "OPEN" :
+          slot.smart_status < 0 ? "-" : slot.smart_status ? "FAILED" : "PASSED"));
+  if (slot.temperature)
+    printf(" %3dC", slot.temperature);
+  else
+    printf("    -");
+  if (slot.flags & SHM_STATE_SELFTEST_LOG)
+    printf(" %5u", slot.self_test_errors);
+  else
+    printf("     -");
+  if (slot.flags & SHM_STATE_ATA_ERROR_LOG)
+    printf(" %5u", slot.ata_errors);
+  else
+    printf("     -");
+  printf("\n");
+
+  if (!attrs)
+    return;
+  if (slot.flags & SHM_STATE_ATA_VALUES) {
+    for (unsigned i = 0; i < slot.num_attrs && i < SHM_STATE_MAX_ATTRS; i++) {
+      const shm_state_attr & a = slot.attrs[i];
+      printf("    ID %3d  value %3d  worst %3d  thresh %3d  raw %" PRIu64 "\n",
+             a.id, a.value, a.worst, a.threshold, a.raw);
+    }
+  }
+  static const char * const names[3] = { "read", "write", "verify" };
+  for (int k = 0; k < 3; k++) {
+    if (!(slot.flags & (SHM_STATE_SCSI_READ << k)))
+      continue;
+    printf("    %-6s  corrected %" PRIu64 "  uncorrected %" PRIu64 "  bytes %" PRIu64 "\n",
+           names[k], slot.scsi_corrected[k], slot.scsi_uncorrected[k], slot.scsi_bytes[k]);
+  }
+  if (slot.flags & SHM_STATE_SCSI_NONMEDIUM)
+    printf("    non-medium errors %" PRIu64 "\n", slot.scsi_nonmedium);
+}
+
+int main(int argc, char ** argv)
+{
+  const char * name = "/smartd";
+  bool attrs = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-a"))
+      attrs = true;
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      name = argv[++i];
+    else {
+      usage(argv[0]);
+      return (!strcmp(argv[i], "-h") ? 0 : 1);
+    }
+  }
+
+  shm_state_reader reader;
+  if (!reader.open(name)) {
+    fprintf(stderr, "%s: %s\n", name, (errno == EPROTO ? "not a smartd state table"
+                                       : strerror(errno)));
+    return 2;
+  }
+
+  shm_state_header hdr;
+  if (!reader.read_header(hdr)) {
+    fprintf(stderr, "%s: cannot read header: %s\n", name, strerror(errno));
+    return 2;
+  }
+  char tbuf[32];
+  printf("smartd pid %u, %u devices, generation %" PRIu64 ", updated %s%s\n\n",
+         hdr.pid, hdr.num_devices, hdr.generation, fmt_time(hdr.update_time, tbuf),
+         (hdr.closed ? " (closed)" : ""));
+  printf("%-20s %-8s %-19s %9s  %-7s %4s %5s %5s\n",
+         "Device", "Type", "Last check", "Time [ms]", "Health", "Temp", "STErr", "Err");
+
+  int status = 0;
+  for (unsigned i = 0; i < hdr.num_devices; i++) {
+    shm_state_slot slot;
+    if (!reader.read_slot(i, slot)) {
+      fprintf(stderr, "%s: cannot read slot %u: %s\n", name, i, strerror(errno));
+      status = 2;
+      continue;
+    }
+    slot.device[sizeof(slot.device)-1] = 0;
+    slot.type[sizeof(slot.type)-1] = 0;
+    print_slot(slot, attrs);
+  }
+  return status;
+}
@@ -0,0 +1,88 @@
+/*
+ * testsched.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include <stdio.h>
+#include <time.h>
+
+#include "testsched.h"
+
+const char * testsched_cpp_cvsid = "$Id$"
+                                   TESTSCHED_H_CVSID;
+
+unsigned test_schedule::get_hours(unsigned i, int mon, int mday, int wday)
+{
+  if (m_hours.empty())
+    m_hours.resize(12 * 31 * 7 * num_test_types, 0);
+  unsigned & hours = m_hours[(((mon-1)*31 + mday-1)*7 + wday-1)*num_test_types + i];
+  if (!(hours & 0x80000000U)) {
+    hours = 0x80000000U;
+    for (int hour = 0; hour < 24; hour++) {
+      char pattern[16];
+      snprintf(pattern, sizeof(pattern), "%c/%02d/%02d/%1d/%02d",
+        test_type_chars[i], mon, mday, wday, hour);
+      if (m_regex.full_match(pattern))
+        hours |= 1U << hour;
+    }
+  }
+  return (hours & 0xffffff);
+}
+
+char find_scheduled_test(test_schedule & sched, const bool * capable,
+                         time_t from, time_t now, time_t & testtime, int & testhour)
+{
+  // The hours of each day are looked up at once, steps within the same
+  // day without a match are skipped.
+  char testtype = 0;
+  int maxtest = num_test_types-1;
+
+  for (time_t t = from; ; ) {
+    struct tm * tms = localtime(&t);
+    // tm_wday is 0 (Sunday) to 6 (Saturday).  We use 1 (Monday) to 7 (Sunday).
+    int weekday = (tms->tm_wday ? tms->tm_wday : 7);
+    unsigned later_hours = 0; // Matches of remaining tests after this hour
+    for (int i = 0; i <= maxtest; i++) {
+      // Skip if drive not capable of this test
+      if (!capable[i])
+        continue;
+      unsigned hours = sched.get_hours(i, tms->tm_mon+1, tms->tm_mday, weekday);
+      if (hours & (1U << tms->tm_hour)) {
+        // Test found
+        testtype = test_type_chars[i];
+        testtime = t; testhour = tms->tm_hour;
+        // Limit further matches to higher priority self-tests
+        maxtest = i-1;
+        break;
+      }
+      later_hours |= hours & ~((2U << tms->tm_hour) - 1);
+    }
+    // Exit if no tests left or current time reached
+    if (maxtest < 0)
+      break;
+    if (t >= now)
+      break;
+    // Check next hour.  If no test matches later this day, skip to the
+    // last step which is surely on the same day, even if a DST change
+    // removes one hour.
+    int steps = 1;
+    if (!later_hours && tms->tm_hour < 21)
+      steps = 22 - tms->tm_hour;
+    if ((t += 3600L * steps) > now)
+      t = now;
+  }
+
+  return testtype;
+}
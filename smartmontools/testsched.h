@@ -0,0 +1,60 @@
+/*
+ * testsched.h
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TESTSCHED_H_
+#define TESTSCHED_H_
+
+#define TESTSCHED_H_CVSID "$Id$\n"
+
+// Self-test schedules of smartd '-s REGEXP'.  Used by smartd and by
+// testsched_bench which checks the results against plain regex matching.
+
+#include "utility.h" // regular_expression
+
+#include <vector>
+
+// Test types, ordered by priority.
+const char test_type_chars[] = "LncrSCO";
+const unsigned num_test_types = sizeof(test_type_chars)-1;
+
+/// Compiled '-s REGEXP' test schedule.  The regex is evaluated at most
+/// once for each test type and hour of a (month, day, weekday) triple.
+/// The results are kept as bitmasks of matching hours.
+class test_schedule
+{
+public:
+  explicit test_schedule(const regular_expression & regex)
+    : m_regex(regex) { }
+
+  /// Return bitmask of hours 0-23 where "T/MM/DD/d/HH" matches for test
+  /// type test_type_chars[i].  mon is 1-12, mday 1-31, wday 1-7.
+  unsigned get_hours(unsigned i, int mon, int mday, int wday);
+
+private:
+  regular_expression m_regex;
+  // Index (((mon-1)*31 + mday-1)*7 + wday-1)*num_test_types + i,
+  // bit 31 set if valid
+  std::vector<unsigned> m_hours;
+};
+
+/// Check interval [FROM, NOW] for tests scheduled in SCHED in hourly
+/// steps.  Only test types with CAPABLE[i] set are considered.  Returns
+/// the highest priority test type found, 0 if none.  Sets TESTTIME and
+/// TESTHOUR to the time of the last match of this test type.
+/// Calls localtime(), not thread safe.
+char find_scheduled_test(test_schedule & sched, const bool * capable,
+                         time_t from, time_t now, time_t & testtime, int & testhour);
+
+#endif // TESTSCHED_H_
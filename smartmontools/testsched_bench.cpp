@@ -0,0 +1,237 @@
+/*
+ * testsched_bench.cpp
+ *
+ * Home page of code is: http://www.smartmontools.org
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Micro-benchmark for smartd '-s REGEXP' test schedules.
+// Compares find_scheduled_test() which uses the hour tables of
+// test_schedule with an hourly search which matches the regex for each
+// hour and test type (the old implementation).
+// With '-c', only checks that both return the same results for random
+// intervals in several time zones.
+// Not installed, run 'make testsched-bench' or 'make check'.
+
+#include "config.h"
+#include "int64.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dev_interface.h" // smart_interface::s_instance
+#include "testsched.h"
+#include "utility.h"
+
+#include <stdexcept>
+#include <vector>
+
+const char * testsched_bench_cpp_cvsid = "$Id$"
+  TESTSCHED_H_CVSID;
+
+// Referenced by format_version_info() in utility.cpp, not used here
+smart_interface * smart_interface::s_instance;
+
+void pout(const char * fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  fflush(stdout);
+}
+
+// Hourly search, matches regex for each hour and test type.
+static char find_scheduled_test_linear(const regular_expression & regex, const bool * capable,
+                                       time_t from, time_t now, time_t & testtime, int & testhour)
+{
+  char testtype = 0;
+  int maxtest = num_test_types-1;
+
+  for (time_t t = from; ; ) {
+    struct tm * tms = localtime(&t);
+    int weekday = (tms->tm_wday ? tms->tm_wday : 7);
+    for (int i = 0; i <= maxtest; i++) {
+      if (!capable[i])
+        continue;
+      char pattern[64]; // Large enough for any int values
+      snprintf(pattern, sizeof(pattern), "%c/%02d/%02d/%1d/%02d",
+        test_type_chars[i], tms->tm_mon+1, tms->tm_mday, weekday, tms->tm_hour);
+      if (regex.full_match(pattern)) {
+        testtype = pattern[0];
+        testtime = t; testhour = tms->tm_hour;
+        maxtest = i-1;
+        break;
+      }
+    }
+    if (maxtest < 0)
+      break;
+    if (t >= now)
+      break;
+    if ((t += 3600) > now)
+      t = now;
+  }
+  return testtype;
+}
+
+// Schedules from smartd.conf(5) and some which skip days or hit the
+// hours of DST changes.
+static const char * const schedules[] = {
+  "L/../../7/02",
+  "S/../.././02|L/../../6/03",
+  "(S/../.././(00|06|12|18)|L/../../6/03)",
+  "(L/../../6/0[1-4]|S/../.././(0[4-9]|1[0-9]))",
+  "n/../../[1-5]/1[0-3]|r/01/01/./0[0-5]|C/../.././23|O/../(0[1-9]|1[0-5])/./22",
+  "S/../.././(01|02|03)",
+  "L/../0[1-7]/7/02",
+  "S/03/(2[5-9]|3[01])/7/0[1-4]|L/10/(2[5-9]|3[01])/7/0[1-4]",
+  "c/../.././..|L/02/29/./12",
+  "O/12/31/./23",
+  0
+};
+
+// Time zones without DST and with DST changes at 02:00 or 03:00.
+static const char * const time_zones[] = {
+  "TZ=UTC0",
+  "TZ=CET-1CEST,M3.5.0,M10.5.0/3",
+  "TZ=EST5EDT,M3.2.0,M11.1.0",
+  0
+};
+
+// Test type masks: all, no selective, SCSI (L, S only)
+static const bool capable_masks[][num_test_types] = {
+  { true, true,  true,  true,  true, true,  true  },
+  { true, false, false, false, true, true,  true  },
+  { true, false, false, false, true, false, false }
+};
+
+static const unsigned num_capable_masks = sizeof(capable_masks) / sizeof(capable_masks[0]);
+
+// Simple deterministic pseudo random numbers
+static unsigned random_seed = 1;
+
+static unsigned next_random(unsigned range)
+{
+  random_seed = random_seed * 1103515245U + 12345U;
+  return (random_seed >> 8) % range;
+}
+
+static void set_time_zone(const char * tz)
+{
+  putenv(const_cast<char *>(tz));
+  tzset();
+}
+
+// Compare both searches for random intervals within 2015-2017,
+// return number of mismatches.
+static int check_schedules(unsigned num_intervals, unsigned & checked)
+{
+  const time_t start = 1420070400; // 2015-01-01 00:00:00 UTC
+  int errcnt = 0;
+  checked = 0;
+  for (unsigned z = 0; time_zones[z]; z++) {
+    set_time_zone(time_zones[z]);
+    for (unsigned s = 0; schedules[s]; s++) {
+      regular_expression regex(schedules[s], REG_EXTENDED);
+      test_schedule sched(regex);
+      for (unsigned n = 0; n < num_intervals; n++) {
+        const bool * capable = capable_masks[n % num_capable_masks];
+        // Mostly short intervals, some up to the 90 day limit of smartd
+        time_t from = start + (time_t)next_random(3 * 365 * 24) * 3600 + next_random(3600);
+        unsigned days = (next_random(10) ? next_random(8) : next_random(91));
+        time_t now = from + (time_t)days * 24 * 3600 + next_random(24 * 3600);
+
+        time_t tt1 = 0, tt2 = 0; int th1 = 0, th2 = 0;
+        char t1 = find_scheduled_test_linear(regex, capable, from, now, tt1, th1);
+        char t2 = find_scheduled_test(sched, capable, from, now, tt2, th2);
+        checked++;
+        if (t1 != t2 || (t1 && (tt1 != tt2 || th1 != th2))) {
+          if (errcnt < 10)
+            printf("Mismatch for \"%s\", %s, [%lu, %lu]: %c at %lu (%d) != %c at %lu (%d)\n",
+                   schedules[s], time_zones[z] + 3, (unsigned long)from, (unsigned long)now,
+                   (t1 ? t1 : '-'), (unsigned long)tt1, th1,
+                   (t2 ? t2 : '-'), (unsigned long)tt2, th2);
+          errcnt++;
+        }
+      }
+    }
+  }
+  return errcnt;
+}
+
+// Search 90 day intervals for at least 1s, return microseconds per search.
+static double time_searches(bool linear, unsigned & rounds)
+{
+  set_time_zone(time_zones[1]);
+  const time_t from = 1451606400; // 2016-01-01 00:00:00 UTC
+  const time_t now = from + 90L * 24 * 3600;
+  // Schedules are kept between rounds as in smartd, so the tables are
+  // filled in the first round only
+  std::vector<regular_expression> regexes;
+  std::vector<test_schedule> scheds;
+  for (unsigned s = 0; schedules[s]; s++) {
+    regexes.push_back(regular_expression(schedules[s], REG_EXTENDED));
+    scheds.push_back(test_schedule(regexes.back()));
+  }
+  unsigned num_schedules = regexes.size();
+
+  clock_t start = clock(), elapsed;
+  rounds = 0;
+  do {
+    for (unsigned s = 0; s < num_schedules; s++) {
+      time_t tt = 0; int th = 0;
+      if (linear)
+        find_scheduled_test_linear(regexes[s], capable_masks[0], from, now, tt, th);
+      else
+        find_scheduled_test(scheds[s], capable_masks[0], from, now, tt, th);
+    }
+    rounds++;
+    elapsed = clock() - start;
+  } while (elapsed < CLOCKS_PER_SEC);
+
+  return (1000000.0 * elapsed / CLOCKS_PER_SEC) / ((double)rounds * num_schedules);
+}
+
+int main(int argc, char ** argv)
+{
+  if (!(argc == 1 || (argc == 2 && !strcmp(argv[1], "-c")))) {
+    printf("Usage: %s [-c]\n\n"
+           "-c checks the results of both searches only.\n", argv[0]);
+    return 1;
+  }
+
+  try {
+    // Both searches must return the same test and time
+    unsigned checked;
+    int errcnt = check_schedules(argc == 2 ? 200 : 50, checked);
+    printf("Test schedules: %u intervals, %d mismatches\n", checked, errcnt);
+    if (errcnt)
+      return 1;
+    if (argc == 2)
+      return 0;
+
+    unsigned rounds1, rounds2;
+    double t1 = time_searches(true, rounds1);
+    double t2 = time_searches(false, rounds2);
+    printf("Hourly regex search: %10.3f us/search (%u rounds)\n", t1, rounds1);
+    printf("Hour tables:         %10.3f us/search (%u rounds)\n", t2, rounds2);
+    if (t2 > 0)
+      printf("Speedup: %.1fx\n", t1 / t2);
+  }
+  catch (const std::exception & ex) {
+    printf("Exception: %s\n", ex.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -42,6 +42,9 @@
 #ifdef _WIN32
 #include <mbstring.h> // _mbsinc()
 #endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include <stdexcept>
 
@@ -283,6 +286,11 @@ static void check_endianness()
     throw std::logic_error("CPU endianness does not match compile time test");
 }
 
+#ifdef HAVE_PTHREADS
+// FixGlibcTimeZoneBug(), localtime() and asctime() are not reentrant.
+static pthread_mutex_t dateandtimezone_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 // Utility function prints date and time and timezone into a character
 // buffer of length>=64.  All the fuss is needed to get the right
 // timezone info (sigh).
@@ -292,6 +300,9 @@ void dateandtimezoneepoch(char *buffer, time_t tval){
   char datebuffer[DATEANDEPOCHLEN];
   int lenm1;
 
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&dateandtimezone_mutex);
+#endif
   FixGlibcTimeZoneBug();
   
   // Get the time structure.  We need this to determine if we are in
@@ -328,10 +339,37 @@ void dateandtimezoneepoch(char *buffer, time_t tval){
   
   // Finally put the information into the buffer as needed.
   snprintf(buffer, DATEANDEPOCHLEN, "%s %s", datebuffer, timezonename);
-  
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&dateandtimezone_mutex);
+#endif
   return;
 }
 
+struct tm * time_to_tm_local(struct tm * tp, time_t t)
+{
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&dateandtimezone_mutex);
+#endif
+  *tp = *localtime(&t);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&dateandtimezone_mutex);
+#endif
+  return tp;
+}
+
+char * time_to_ctime(char * buffer, time_t t)
+{
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&dateandtimezone_mutex);
+#endif
+  snprintf(buffer, CTIMELEN, "%s", ctime(&t));
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&dateandtimezone_mutex);
+#endif
+  return buffer;
+}
+
 // Date and timezone gets printed into string pointed to by buffer
 void dateandtimezone(char *buffer){
   
@@ -699,6 +737,20 @@ bool nonempty(const void * data, int size)
   return false;
 }
 
+void put_le(unsigned char * buf, uint64_t val, int n)
+{
+  for (int i = 0; i < n; i++)
+    buf[i] = (unsigned char)(val >> (8 * i));
+}
+
+uint64_t get_le(const unsigned char * buf, int n)
+{
+  uint64_t val = 0;
+  for (int i = n - 1; i >= 0; i--)
+    val = (val << 8) | buf[i];
+  return val;
+}
+
 // Format integer with thousands separator
 const char * format_with_thousands_sep(char * str, int strsize, uint64_t val,
                                        const char * thousands_sep /* = 0 */)
@@ -82,6 +82,13 @@ void dateandtimezone(char *buffer);
 // Same, but for time defined by epoch tval
 void dateandtimezoneepoch(char *buffer, time_t tval);
 
+// Thread safe replacements of localtime() and ctime().  Use the same
+// lock as the above functions.  The ctime() buffer must hold at least
+// 26 characters, the result includes the trailing newline.
+struct tm * time_to_tm_local(struct tm * tp, time_t t);
+#define CTIMELEN 32
+char * time_to_ctime(char * buffer, time_t t);
+
 // like printf() except that we can control it better. Note --
 // although the prototype is given here in utility.h, the function
 // itself is defined differently in smartctl and smartd.  So the
@@ -137,6 +144,12 @@ const char *packetdevicetype(int type);
 // returns true if any of the n bytes are nonzero, else zero.
 bool nonempty(const void * data, int size);
 
+// Store VAL as N byte little endian integer at BUF.
+void put_le(unsigned char * buf, uint64_t val, int n);
+
+// Return N byte little endian integer at BUF.
+uint64_t get_le(const unsigned char * buf, int n);
+
 // needed to fix glibc bug
 void FixGlibcTimeZoneBug();
 